@@ -1,185 +1,430 @@
 /*
 Explanation
 Define the Query Structure: We define a simple structure to represent the SQL query.
-Parse the Query: We implement a basic SQL parser to convert the SQL string into our Query structure. This involves tokenizing the SQL string and extracting the SELECT columns, FROM tables, and WHERE conditions.
+Table Statistics: ANALYZE streams CSV or binary column files once into per-column min/max, null fraction, equi-depth histograms, most common values and HyperLogLog distinct counts.
+Binary Catalog: Statistics, constraints and indexes can be compiled by catalog_builder.cpp into a versioned file that is mmapped and read in place, with a hash index on table names.
+Arena Allocation: The AST and the DP memos live in a per-thread bump arena released in bulk, and table qualifiers are interned so they compare by pointer.
+Parse the Query: A zero-copy lexer and recursive-descent parser turn the SQL string into an AST of views into the statement, which is then bound to our Query structure (SELECT columns, FROM tables, join conditions and filters).
+Query Rewrite: Join columns are grouped into equivalence classes to add implied join conditions, and joins that declared key/foreign-key constraints prove redundant are removed.
+Filter Pushdown: Comparison, IN, BETWEEN, LIKE and IS NULL filters on a single table are applied by its scan, and their estimated selectivity shrinks the table's input to join ordering.
+Access Paths: Each table is read by a full scan, an index scan over the key range its filters select, or an index-only scan when an index covers the query, and an index nested loop join can probe the inner table's index instead of scanning it.
 Cost-based Optimization: We implement a dynamic programming approach to find the optimal join order based on estimated join costs.
+Bitmask Enumeration: Relation sets are 64-bit masks and the DP memo is a dense array indexed by subset, with back-pointers to each best split.
+Join Graph: Join conditions are turned into an explicit graph, and the DPccp enumerator only visits connected subgraph/complement pairs of it; the components of a disconnected graph are planned apart and only joined whole, by cross products.
+Top-down Optimization: A Cascades-style optimizer explores groups of logical join expressions with commutativity and associativity rules, and prunes them against cost bounds starting from the greedy plan's cost.
+Bushy Join Trees: Plans are binary join trees, so composite inputs can be joined with each other and are emitted as nested JOIN ... ON clauses.
+Cost Model: Each subplan carries an estimated cardinality and a CPU/memory/IO cost in doubles, folded into one number by configurable weights.
+Parallel Enumeration: The bitmask enumerator can split each subset-size level across a work-stealing thread pool and still return the serial plan.
+Planning Budget: Under a time or memo budget the optimizer starts from a greedy plan, runs exact DP if it fits, and otherwise improves the greedy plan by simulated annealing.
+Join Operators: Every join picks the cheapest of hash (with build side), sort-merge and nested-loop join, paying spill I/O beyond the work-memory budget.
+Physical Properties: Each relation set keeps a small Pareto set of plans by cost and the sort order or partitioning they deliver, and sorts and repartitions for merge joins, grace hash joins and ORDER BY ... LIMIT are costed as explicit enforcers.
+Prepared Statements: A statement with ? parameters is optimized over a grid of selectivities of its parameterized filters into a few plans that stay near-optimal across it, and binding values recosts those plans to run the cheapest without enumerating again.
+Multi-Query Optimization: --share plans a batch of queries together, computing the joins they have in common (same tables, filters and join conditions) once as a temporary result when the cost model says reading it back beats each query joining the tables itself.
+Distributed Plans: --nodes=N costs plans for a simulated cluster, with network transfer in the cost model; each join is placed co-located on the tables' declared hash, range or replicated partitioning, or with one input broadcast or both shuffled on a join key, and the exchanges appear in the plan.
+Plan Cache: Plans are cached under a fingerprint of the query with literals parameterized and tables in canonical order, in a sharded, size-bounded cache with CLOCK eviction.
 Generate the Optimized Query: We generate the SQL string from the optimized query plan.
+Benchmark: optimizer_benchmark.cpp links the optimizer and reports per-phase latency percentiles, memo size and peak memory on synthetic join graphs as JSON.
+EXPLAIN: --explain prints the join tree with per-node rows and cost; builds with QUERY_OPTIMIZER_INSTRUMENTATION also report per-phase timings and search-space counters.
+Execution: --execute runs the optimized plan over tables given as binary column files with --data, in batches of columns filtered through selection vectors, with radix-partitioned hash joins, merge and nested-loop joins and hash aggregation, and EXPLAIN then shows actual rows and time per operator.
+Cardinality Feedback: Executions record each operator's observed rows against its estimate, keyed by a signature of its tables, filters and join conditions, and later estimates of the same relation sets are corrected by a bounded, decaying store of those ratios that --feedback keeps in a file.
+Batch Mode: --batch streams a file of statements (one per line or ;-delimited) through a bounded worker pipeline and writes the optimized SQL in input order.
+Source Layout: The optimizer's interface is declared in optimizer.h and implemented in optimizer.cpp, which this program, optimizer_benchmark.cpp, catalog_builder.cpp and optimizer_test.cpp are each linked with.
 Main Function: We put everything together and demonstrate the optimization process.
 */
 
+#include "optimizer.h"
 
-#include <iostream>
-#include <vector>
-#include <string>
-#include <algorithm>
-#include <unordered_map>
-#include <limits>
-#include <sstream>
-
-// Define the Query Structure
-struct Table {
-    std::string name;
-    int rows; // Number of rows in the table
-};
-
-struct Query {
-    std::vector<std::string> selectColumns;
-    std::vector<Table> fromTables;
-    std::vector<std::pair<std::string, std::string>> joinConditions; // (table1.column, table2.column)
-};
-
-// Helper function to trim whitespace
-std::string trim(const std::string& str) {
-    size_t first = str.find_first_not_of(' ');
-    if (std::string::npos == first) {
-        return str;
-    }
-    size_t last = str.find_last_not_of(' ');
-    return str.substr(first, (last - first + 1));
-}
-
-// Parse the Query
-Query parseQuery(const std::string& queryStr) {
-    Query query;
-    std::istringstream stream(queryStr);
-    std::string token;
-
-    // Parse SELECT columns
-    stream >> token; // Skip "SELECT"
-    std::getline(stream, token, 'F'); // Read until "FROM"
-    std::istringstream selectStream(token);
-    while (std::getline(selectStream, token, ',')) {
-        query.selectColumns.push_back(trim(token));
+// Main Function
+int main(int argc, char* argv[]) {
+    OptimizerOptions options;
+    StatisticsCatalog statistics;
+    ColumnStore store;
+    FeedbackStore feedback;
+    std::string feedbackPath;
+    std::string feedbackRowsPath;
+    std::vector<std::vector<std::string>> bindings; // Values of each --bind, for statements with parameters
+    std::vector<std::string> queries;
+    size_t cacheCapacity = 4096;
+    bool explain = false;
+    bool execute = false;
+    bool share = false;
+    std::string batchPath;
+    std::string outputPath;
+    bool semicolons = false;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    // The number after a flag's '=', reported like a parse error when it is not one
+    auto number = [](const std::string& arg, auto& value) {
+        if (!parseFlagValue(std::string_view(arg).substr(arg.find('=') + 1), value)) {
+            std::cerr << "Invalid option: " << arg << " expects a number" << std::endl;
+            return false;
+        }
+        return true;
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--enumerator=string") {
+            options.enumerator = EnumeratorMode::StringKeyed;
+        } else if (arg == "--enumerator=bitmask") {
+            options.enumerator = EnumeratorMode::Bitmask;
+        } else if (arg == "--enumerator=dpccp") {
+            options.enumerator = EnumeratorMode::ConnectedSubgraph;
+        } else if (arg == "--enumerator=cascades") {
+            options.enumerator = EnumeratorMode::TopDown;
+        } else if (arg == "--left-deep") {
+            options.bushy = false;
+        } else if (arg.rfind("--catalog=", 0) == 0) {
+            try {
+                statistics.attach(std::make_shared<MappedCatalog>(arg.substr(10)));
+            } catch (const std::exception& e) {
+                std::cerr << "Catalog: " << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--cost-weights=", 0) == 0) {
+            // --cost-weights=CPU,MEMORY,IO[,ROWS_PER_PAGE[,NETWORK]]
+            double* fields[] = {&options.costWeights.cpu, &options.costWeights.memory, &options.costWeights.io, &options.costWeights.rowsPerPage,
+                                &options.costWeights.network};
+            std::istringstream weightList(arg.substr(15));
+            size_t count = 0;
+            for (std::string weight; count < 5 && std::getline(weightList, weight, ',');) {
+                if (!parseFlagValue(weight, *fields[count++])) {
+                    std::cerr << "Invalid option: " << arg << " expects numbers separated by commas" << std::endl;
+                    return 1;
+                }
+            }
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!number(arg, options.threads)) {
+                return 1;
+            }
+        } else if (arg.rfind("--work-memory=", 0) == 0) {
+            if (!number(arg, options.costWeights.workMemoryRows)) {
+                return 1;
+            }
+        } else if (arg.rfind("--nodes=", 0) == 0) {
+            if (!number(arg, options.costWeights.nodes)) {
+                return 1;
+            }
+            options.costWeights.nodes = std::max<size_t>(1, options.costWeights.nodes);
+        } else if (arg.rfind("--budget-ms=", 0) == 0) {
+            double milliseconds = 0;
+            if (!number(arg, milliseconds)) {
+                return 1;
+            }
+            options.budget.seconds = milliseconds / 1000;
+        } else if (arg.rfind("--memo-budget-mb=", 0) == 0) {
+            double megabytes = 0;
+            if (!number(arg, megabytes)) {
+                return 1;
+            }
+            options.budget.memoBytes = static_cast<size_t>(megabytes * 1024 * 1024);
+        } else if (arg.rfind("--exact-tables=", 0) == 0) {
+            if (!number(arg, options.budget.exactTables)) {
+                return 1;
+            }
+        } else if (arg == "--no-rewrite") {
+            options.rewrite = false;
+        } else if (arg.rfind("--batch=", 0) == 0) {
+            batchPath = arg.substr(8);
+        } else if (arg.rfind("--output=", 0) == 0) {
+            outputPath = arg.substr(9);
+        } else if (arg == "--delimiter=line") {
+            semicolons = false;
+        } else if (arg == "--delimiter=semicolon") {
+            semicolons = true;
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            if (!number(arg, workers)) {
+                return 1;
+            }
+        } else if (arg == "--explain") {
+            explain = true;
+        } else if (arg.rfind("--data=", 0) == 0) {
+            // --data=TABLE:COLUMN.bin[,COLUMN.bin...]
+            std::string spec = arg.substr(7);
+            size_t colon = spec.find(':');
+            if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size()) {
+                std::cerr << "--data expects TABLE:COLUMN.bin[,COLUMN.bin...]" << std::endl;
+                return 1;
+            }
+            std::vector<std::string> paths;
+            std::istringstream pathList(spec.substr(colon + 1));
+            for (std::string path; std::getline(pathList, path, ',');) {
+                paths.push_back(path);
+            }
+            try {
+                store.add(spec.substr(0, colon), paths);
+            } catch (const std::exception& e) {
+                std::cerr << "Data: " << e.what() << std::endl;
+                return 1;
+            }
+        } else if (arg == "--execute") {
+            execute = true;
+        } else if (arg == "--share") {
+            share = true;
+        } else if (arg.rfind("--bind=", 0) == 0) {
+            // --bind=VALUE[,VALUE...], split at commas outside quoted strings
+            std::vector<std::string> values(1);
+            bool quoted = false;
+            for (char c : arg.substr(7)) {
+                if (c == ',' && !quoted) {
+                    values.emplace_back();
+                    continue;
+                }
+                quoted ^= c == '\'';
+                values.back() += c;
+            }
+            bindings.push_back(std::move(values));
+        } else if (arg.rfind("--feedback=", 0) == 0) {
+            feedbackPath = arg.substr(11);
+        } else if (arg.rfind("--feedback-rows=", 0) == 0) {
+            feedbackRowsPath = arg.substr(16);
+        } else if (arg.rfind("--plan-cache=", 0) == 0) {
+            if (!number(arg, cacheCapacity)) {
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) != 0) {
+            queries.push_back(arg);
+        } else {
+            try {
+                if (applyCatalogOption(arg, statistics)) {
+                    continue;
+                }
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            std::cerr << "Usage: " << argv[0] << " [--enumerator=string|bitmask|dpccp|cascades] [--left-deep]"
+                      << " [--catalog=FILE] [--analyze=TABLE:FILE.csv|TABLE:COLUMN.bin,...]... [--cost-weights=CPU,MEMORY,IO[,ROWS_PER_PAGE[,NETWORK]]] [--work-memory=ROWS] [--threads=N]"
+                      << " [--budget-ms=MS] [--memo-budget-mb=MB] [--exact-tables=N] [--plan-cache=ENTRIES] [--explain]"
+                      << " [--data=TABLE:COLUMN.bin,...]... [--execute] [--share] [--feedback=FILE] [--feedback-rows=FILE] [--bind=VALUE,...]..."
+                      << " [--primary-key=TABLE.COLUMN]... [--foreign-key=TABLE.COLUMN:TABLE.COLUMN]..."
+                      << " [--index=TABLE:COLUMN,...[:clustered][:pages=N]]... [--unique-index=...]..."
+                      << " [--partition=TABLE:hash:COLUMN[:nodes=N]|TABLE:range:COLUMN:BOUND,...|TABLE:replicated]... [--nodes=N] [--no-rewrite]"
+                      << " [--batch=FILE|- [--delimiter=line|semicolon] [--workers=N] [--output=FILE]] [SQL]..." << std::endl;
+            return 1;
+        }
     }
+    options.statistics = &statistics;
 
-    // Parse FROM tables
-    stream >> token; // Skip "FROM"
-    std::getline(stream, token, 'W'); // Read until "WHERE"
-    std::istringstream fromStream(token);
-    while (std::getline(fromStream, token, ',')) {
-        query.fromTables.push_back({trim(token), 1000}); // Default row count for simplicity
+    // Cardinality feedback: corrections learned by earlier runs, then any row counts observed
+    // elsewhere; executions add to them, and the file is rewritten with what was learned
+    if (!feedbackPath.empty() || !feedbackRowsPath.empty()) {
+        try {
+            if (!feedbackPath.empty()) {
+                feedback.load(feedbackPath);
+            }
+            if (!feedbackRowsPath.empty()) {
+                std::ifstream rows(feedbackRowsPath);
+                if (!rows) {
+                    throw std::runtime_error("cannot open " + feedbackRowsPath);
+                }
+                ingestObservedRows(feedback, rows, options);
+                if (!feedbackPath.empty()) {
+                    feedback.save(feedbackPath);
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Feedback: " << e.what() << std::endl;
+            return 1;
+        }
+        options.feedback = &feedback;
     }
 
-    // Parse WHERE conditions
-    stream >> token; // Skip "WHERE"
-    std::getline(stream, token);
-    std::istringstream whereStream(token);
-    while (std::getline(whereStream, token, 'A')) { // Split by "AND"
-        size_t eqPos = token.find('=');
-        if (eqPos != std::string::npos) {
-            std::string left = trim(token.substr(0, eqPos));
-            std::string right = trim(token.substr(eqPos + 1));
-            query.joinConditions.push_back({left, right});
+    // Batch mode: optimize every statement of a file (or stdin), writing them back in input order
+    if (!batchPath.empty()) {
+        if (execute || share) {
+            std::cerr << (execute ? "--execute" : "--share") << " cannot be combined with --batch" << std::endl;
+            return 1;
+        }
+        std::ifstream file;
+        if (batchPath != "-") {
+            file.open(batchPath, std::ios::binary);
+            if (!file) {
+                std::cerr << "Cannot open " << batchPath << std::endl;
+                return 1;
+            }
+        }
+        std::ofstream output;
+        if (!outputPath.empty()) {
+            output.open(outputPath, std::ios::binary);
+            if (!output) {
+                std::cerr << "Cannot write " << outputPath << std::endl;
+                return 1;
+            }
         }
+        PlanCache cache(cacheCapacity);
+        BatchReport report = optimizeStream(batchPath == "-" ? std::cin : file, outputPath.empty() ? std::cout : output,
+                                            options, cache, semicolons, workers, explain);
+        PlanCache::Counters counters = cache.counters();
+        std::cerr << "Batch: " << report.statements << " statements (" << report.errors << " errors) in " << report.seconds << " s, "
+                  << (report.seconds > 0 ? static_cast<double>(report.statements) / report.seconds : 0) << " statements/s; plan cache "
+                  << counters.hits << " hits, " << counters.misses << " misses" << std::endl;
+        return report.errors == 0 ? 0 : 1;
     }
 
-    return query;
-}
-
-// Cost-based optimization using dynamic programming
-struct Plan {
-    std::vector<Table> tables;
-    std::vector<std::pair<std::string, std::string>> joins;
-    int cost;
-};
-
-int estimateJoinCost(const Table& t1, const Table& t2) {
-    // Simplified cost estimation: product of row counts
-    return t1.rows * t2.rows;
-}
-
-Plan optimizeQuery(const Query& query) {
-    std::unordered_map<std::string, Table> tableMap;
-    for (const auto& table : query.fromTables) {
-        tableMap[table.name] = table;
+    if (queries.empty()) {
+        queries.push_back("SELECT column1, column2 FROM table1, table2, table3 WHERE table1.column1 = table2.column1 AND table2.column2 = table3.column2");
     }
 
-    std::unordered_map<std::string, Plan> dp;
-    for (const auto& table : query.fromTables) {
-        dp[table.name] = {{table}, {}, table.rows};
+    // With --share the statements are planned together, reading the joins they have in common
+    // from results computed once
+    std::vector<Query> sharedQueries;
+    std::vector<RewriteSummary> sharedRewrites;
+    SharedPlan sharedPlan;
+    if (share) {
+        try {
+            for (const auto& queryStr : queries) {
+                if (!parameterMarkers(queryStr).empty()) {
+                    throw std::runtime_error("--share cannot plan statements with parameters");
+                }
+                sharedQueries.push_back(parseQuery(queryStr, &statistics));
+                sharedRewrites.emplace_back();
+                if (options.rewrite) {
+                    sharedRewrites.back() = rewriteQuery(sharedQueries.back(), &statistics);
+                }
+            }
+            sharedPlan = optimizeShared(sharedQueries, options);
+        } catch (const ParseError& e) {
+            std::cerr << "Parse error: " << e.what() << std::endl;
+            return 1;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
     }
 
-    for (size_t i = 1; i < query.fromTables.size(); ++i) {
-        std::unordered_map<std::string, Plan> newDp;
-        for (const auto& entry : dp) {
-            const auto& plan = entry.second;
-            for (const auto& table : query.fromTables) {
-                if (std::find_if(plan.tables.begin(), plan.tables.end(), [&](const Table& t) { return t.name == table.name; }) != plan.tables.end()) {
-                    continue;
+    // Every other statement without parameters goes through the plan cache, so repeated shapes are
+    // only optimized once
+    PlanCache cache(cacheCapacity);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        const std::string& queryStr = queries[q];
+        OptimizerMetrics metrics;
+        OPTIMIZER_METRICS_SCOPE(&metrics);
+        options.metrics = &metrics;
+        // A statement with ? markers is prepared once, then run with the values of every --bind
+        struct Run {
+            Query query;
+            RewriteSummary rewrite;
+            Plan plan;
+            std::string bound; // The statement with the values bound, for a prepared one
+        };
+        std::vector<Run> runs;
+        std::string prepared;
+        try {
+            if (share) {
+                runs.push_back({sharedQueries[q], sharedRewrites[q], sharedPlan.plans[q], std::string()});
+            } else if (parameterMarkers(queryStr).empty()) {
+                runs.emplace_back();
+                runs.back().query = parseQuery(queryStr, &statistics);
+                if (options.rewrite) {
+                    runs.back().rewrite = rewriteQuery(runs.back().query, &statistics);
+                }
+                runs.back().plan = optimizeQueryCached(runs.back().query, options, cache);
+            } else {
+                PreparedStatement statement(queryStr, options);
+                prepared = "Prepared: " + std::to_string(statement.plans().size()) + " plans over " +
+                           std::to_string(statement.dimensions().size()) + " parameterized filters (" +
+                           std::to_string(statement.gridPoints()) + " grid points)\n";
+                if (explain) {
+                    prepared += explainPrepared(statement);
                 }
+                for (const auto& values : bindings) {
+                    PreparedStatement::Binding binding = statement.bind(values);
+                    runs.push_back({std::move(binding.query), std::move(binding.rewrite), std::move(binding.plan),
+                                    binding.sql + " (prepared plan " + std::to_string(binding.choice + 1) + ")"});
+                }
+            }
+        } catch (const ParseError& e) {
+            std::cerr << "Parse error: " << e.what() << std::endl;
+            return 1;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl; // Such as a corrupt catalog file
+            return 1;
+        }
+
+        std::cout << "Original Query: " << queryStr << std::endl << prepared;
+        for (Run& run : runs) {
+            const Query& query = run.query;
+            const RewriteSummary& rewrite = run.rewrite;
+            const Plan& optimizedPlan = run.plan;
+            if (!run.bound.empty()) {
+                std::cout << "Bound Query: " << run.bound << std::endl;
+            }
 
-                std::vector<Table> newTables = plan.tables;
-                newTables.push_back(table);
-                std::vector<std::pair<std::string, std::string>> newJoins = plan.joins;
-                for (const auto& join : query.joinConditions) {
-                    if ((join.first.find(table.name) != std::string::npos && join.second.find(plan.tables[0].name) != std::string::npos) ||
-                        (join.second.find(table.name) != std::string::npos && join.first.find(plan.tables[0].name) != std::string::npos)) {
-                        newJoins.push_back(join);
+            std::string optimizedQuery = generateOptimizedQuery(query, optimizedPlan);
+            std::cout << "Optimized Query: " << optimizedQuery << std::endl;
+            if (!optimizedPlan.nodes.empty()) {
+                const PlanNode& root = optimizedPlan.nodes.back();
+                Cost components = root.components + root.enforcerComponents + root.exchangeComponents;
+                std::cout << "Estimated Cost: " << optimizedPlan.cost << " (cpu " << components.cpu << ", memory " << components.memory
+                          << ", io " << components.io;
+                if (components.network > 0) {
+                    std::cout << ", network " << components.network;
+                }
+                std::cout << "), rows " << std::min(limitRows(query), root.rows) << std::endl;
+            }
+            ExecutionResult result;
+            if (execute) {
+                try {
+                    result = executePlan(query, optimizedPlan, store);
+                } catch (const std::exception& e) {
+                    std::cerr << "Execution: " << e.what() << std::endl;
+                    return 1;
+                }
+            }
+            if (explain) {
+                std::cout << "Plan:\n" << explainRewrite(rewrite) << explainPlan(query, optimizedPlan, execute ? &result.nodes : nullptr);
+#if QUERY_OPTIMIZER_INSTRUMENTATION
+                std::cout << explainMetrics(metrics, optimizedPlan);
+#endif
+            }
+            if (execute) {
+                std::cout << "Result:\n";
+                for (size_t i = 0; i < result.columns.size(); ++i) {
+                    std::cout << (i == 0 ? "" : "\t") << result.columns[i];
+                }
+                std::cout << '\n';
+                for (const auto& row : result.rows) {
+                    for (size_t i = 0; i < row.size(); ++i) {
+                        std::cout << (i == 0 ? "" : "\t") << row[i];
                     }
+                    std::cout << '\n';
                 }
-
-                int newCost = plan.cost + estimateJoinCost(plan.tables[0], table);
-                std::string newKey;
-                for (const auto& t : newTables) {
-                    newKey += t.name + ",";
+                if (result.rowCount > result.rows.size()) {
+                    std::cout << "...\n";
                 }
-
-                if (newDp.find(newKey) == newDp.end() || newDp[newKey].cost > newCost) {
-                    newDp[newKey] = {newTables, newJoins, newCost};
+                std::cout << "Executed: " << result.rowCount << " rows in " << result.seconds * 1000 << " ms" << std::endl;
+            }
+            if (execute && options.feedback != nullptr) {
+                size_t observations = recordFeedback(feedback, query, optimizedPlan, result.nodes, &statistics);
+                if (observations > 0) {
+                    cache.clear(); // Plans cached so far were costed without what was just learned
                 }
+                try {
+                    if (!feedbackPath.empty()) {
+                        feedback.save(feedbackPath);
+                    }
+                } catch (const std::exception& e) {
+                    std::cerr << "Feedback: " << e.what() << std::endl;
+                    return 1;
+                }
+                std::cout << "Feedback: " << observations << " observations recorded, " << feedback.size() << " corrections kept" << std::endl;
             }
         }
-        dp = newDp;
     }
-
-    Plan bestPlan = { {}, {}, std::numeric_limits<int>::max() };
-    for (const auto& entry : dp) {
-        if (entry.second.cost < bestPlan.cost) {
-            bestPlan = entry.second;
+    if (share) {
+        size_t reads = 0;
+        for (const auto& shared : sharedPlan.shared) {
+            reads += shared.readers.size();
         }
-    }
-
-    return bestPlan;
-}
-
-// Generate the Optimized Query
-std::string generateOptimizedQuery(const Plan& plan) {
-    std::string optimizedQuery = "SELECT ";
-    for (const auto& column : plan.tables[0].name) {
-        optimizedQuery += column + ", ";
-    }
-    optimizedQuery.pop_back();
-    optimizedQuery.pop_back();
-
-    optimizedQuery += " FROM ";
-    for (const auto& table : plan.tables) {
-        optimizedQuery += table.name + ", ";
-    }
-    optimizedQuery.pop_back();
-    optimizedQuery.pop_back();
-
-    if (!plan.joins.empty()) {
-        optimizedQuery += " WHERE ";
-        for (const auto& join : plan.joins) {
-            optimizedQuery += join.first + " = " + join.second + " AND ";
+        if (explain) {
+            std::cout << explainShared(sharedQueries, sharedPlan);
         }
-        optimizedQuery.erase(optimizedQuery.size() - 5); // Remove the last " AND "
+        std::cout << "Shared: " << sharedPlan.shared.size() << " results computed once for " << reads << " reads; batch cost "
+                  << sharedPlan.cost << ", " << sharedPlan.separateCost << " planned separately" << std::endl;
+    } else if (queries.size() > 1) {
+        PlanCache::Counters counters = cache.counters();
+        std::cout << "Plan Cache: " << counters.hits << " hits, " << counters.misses << " misses, "
+                  << counters.entries << " entries" << std::endl;
     }
 
-    return optimizedQuery;
-}
-
-// Main Function
-int main() {
-    std::string queryStr = "SELECT column1, column2 FROM table1, table2, table3 WHERE table1.column1 = table2.column1 AND table2.column2 = table3.column2";
-    Query query = parseQuery(queryStr);
-
-    std::cout << "Original Query: " << queryStr << std::endl;
-
-    Plan optimizedPlan = optimizeQuery(query);
-
-    std::string optimizedQuery = generateOptimizedQuery(optimizedPlan);
-    std::cout << "Optimized Query: " << optimizedQuery << std::endl;
-
     return 0;
 }
@@ -0,0 +1,8351 @@
+/*
+Query Optimizer
+Implementation of optimizer.h: the parser and rewrites, statistics and the catalog, the join
+enumerators and cost model, plan generation and the executor.
+*/
+
+#include "optimizer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string trim(const std::string& str) {
+    size_t first = str.find_first_not_of(' ');
+    if (std::string::npos == first) {
+        return str;
+    }
+    size_t last = str.find_last_not_of(' ');
+    return str.substr(first, (last - first + 1));
+}
+
+const char* const kOptimizerPhaseNames[] = {"parse", "enumeration", "costing", "emission"};
+
+// SQL Lexer
+// Tokens are views into the statement text, so lexing allocates nothing. Identifiers are matched
+// case-insensitively against the keyword list once, here, so the parser compares enums.
+enum class Keyword : uint8_t {
+    None, Select, From, Where, Join, Inner, Cross, On, And, As, Not, In, Between, Like, Is, Null, Order, By, Asc, Desc, Limit, Group
+};
+
+enum class TokenKind {
+    Identifier,
+    QuotedIdentifier, // "name" or `name`; text excludes the quotes
+    Number,
+    String,           // 'text'; text excludes the quotes, doubled '' are left as-is
+    Symbol,
+    End
+};
+
+struct Token {
+    TokenKind kind = TokenKind::End;
+    Keyword keyword = Keyword::None; // Set for identifiers that spell a keyword
+    std::string_view text;
+    size_t offset = 0; // Start of the token in the statement, quotes included
+    size_t length = 0; // Length of the token in the statement, quotes included
+};
+
+// ASCII letters only: folding other bytes with | 0x20 would equate '@' with '`', '[' with '{' and so on
+inline char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c | 0x20) : c;
+}
+
+inline bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (lowerAscii(a[i]) != lowerAscii(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class Lexer {
+public:
+    explicit Lexer(std::string_view sql) : sql_(sql) {}
+
+    Token next() {
+        skipWhitespaceAndComments();
+        Token token;
+        token.offset = pos_;
+        if (pos_ >= sql_.size()) {
+            return token;
+        }
+
+        char c = sql_[pos_];
+        if (isIdentifierStart(c)) {
+            size_t end = pos_ + 1;
+            while (end < sql_.size() && isIdentifierChar(sql_[end])) {
+                ++end;
+            }
+            finish(token, TokenKind::Identifier, pos_, end, end);
+            token.keyword = classifyKeyword(token.text);
+            return token;
+        }
+        if (isDigit(c) || (c == '.' && pos_ + 1 < sql_.size() && isDigit(sql_[pos_ + 1]))) {
+            size_t end = pos_;
+            while (end < sql_.size() && isDigit(sql_[end])) {
+                ++end;
+            }
+            if (end < sql_.size() && sql_[end] == '.') { // One decimal point at most: 1.2.3 is 1.2 then .3
+                ++end;
+                while (end < sql_.size() && isDigit(sql_[end])) {
+                    ++end;
+                }
+            }
+            if (end < sql_.size() && (sql_[end] == 'e' || sql_[end] == 'E')) {
+                size_t exponent = end + 1;
+                if (exponent < sql_.size() && (sql_[exponent] == '+' || sql_[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < sql_.size() && isDigit(sql_[exponent])) {
+                    end = exponent;
+                    while (end < sql_.size() && isDigit(sql_[end])) {
+                        ++end;
+                    }
+                }
+            }
+            return finish(token, TokenKind::Number, pos_, end, end);
+        }
+        if (c == '\'' || c == '"' || c == '`') {
+            size_t end = pos_ + 1;
+            for (;;) {
+                if (end >= sql_.size()) {
+                    throw ParseError(c == '\'' ? "unterminated string literal" : "unterminated quoted identifier", pos_);
+                }
+                if (sql_[end] == c) {
+                    if (end + 1 < sql_.size() && sql_[end + 1] == c) {
+                        end += 2; // Doubled quote
+                        continue;
+                    }
+                    break;
+                }
+                ++end;
+            }
+            TokenKind kind = c == '\'' ? TokenKind::String : TokenKind::QuotedIdentifier;
+            return finish(token, kind, pos_ + 1, end, end + 1);
+        }
+
+        char following = pos_ + 1 < sql_.size() ? sql_[pos_ + 1] : '\0';
+        switch (c) {
+        case '<':
+            if (following == '=' || following == '>') {
+                return finish(token, TokenKind::Symbol, pos_, pos_ + 2, pos_ + 2);
+            }
+            return finish(token, TokenKind::Symbol, pos_, pos_ + 1, pos_ + 1);
+        case '>':
+        case '!':
+            if (following == '=') {
+                return finish(token, TokenKind::Symbol, pos_, pos_ + 2, pos_ + 2);
+            }
+            if (c == '!') {
+                break;
+            }
+            return finish(token, TokenKind::Symbol, pos_, pos_ + 1, pos_ + 1);
+        case '|':
+            if (following == '|') {
+                return finish(token, TokenKind::Symbol, pos_, pos_ + 2, pos_ + 2);
+            }
+            break;
+        case ',': case '.': case '(': case ')': case '*': case '=': case '+': case '-': case '/': case ';': case '?':
+            return finish(token, TokenKind::Symbol, pos_, pos_ + 1, pos_ + 1);
+        default:
+            break;
+        }
+        throw ParseError(std::string("unexpected character '") + c + "'", pos_);
+    }
+
+private:
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static bool isIdentifierStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    static bool isIdentifierChar(char c) { return isIdentifierStart(c) || isDigit(c) || c == '$'; }
+
+    static Keyword classifyKeyword(std::string_view text) {
+        switch (text.size()) {
+        case 2:
+            return equalsIgnoreCase(text, "ON") ? Keyword::On
+                 : equalsIgnoreCase(text, "AS") ? Keyword::As
+                 : equalsIgnoreCase(text, "IN") ? Keyword::In
+                 : equalsIgnoreCase(text, "IS") ? Keyword::Is
+                 : equalsIgnoreCase(text, "BY") ? Keyword::By : Keyword::None;
+        case 3:
+            return equalsIgnoreCase(text, "AND") ? Keyword::And
+                 : equalsIgnoreCase(text, "NOT") ? Keyword::Not
+                 : equalsIgnoreCase(text, "ASC") ? Keyword::Asc : Keyword::None;
+        case 4:
+            return equalsIgnoreCase(text, "FROM") ? Keyword::From
+                 : equalsIgnoreCase(text, "JOIN") ? Keyword::Join
+                 : equalsIgnoreCase(text, "LIKE") ? Keyword::Like
+                 : equalsIgnoreCase(text, "NULL") ? Keyword::Null
+                 : equalsIgnoreCase(text, "DESC") ? Keyword::Desc : Keyword::None;
+        case 5:
+            return equalsIgnoreCase(text, "WHERE") ? Keyword::Where
+                 : equalsIgnoreCase(text, "INNER") ? Keyword::Inner
+                 : equalsIgnoreCase(text, "CROSS") ? Keyword::Cross
+                 : equalsIgnoreCase(text, "ORDER") ? Keyword::Order
+                 : equalsIgnoreCase(text, "GROUP") ? Keyword::Group
+                 : equalsIgnoreCase(text, "LIMIT") ? Keyword::Limit : Keyword::None;
+        case 6:
+            return equalsIgnoreCase(text, "SELECT") ? Keyword::Select : Keyword::None;
+        case 7:
+            return equalsIgnoreCase(text, "BETWEEN") ? Keyword::Between : Keyword::None;
+        default:
+            return Keyword::None;
+        }
+    }
+
+    void skipWhitespaceAndComments() {
+        while (pos_ < sql_.size()) {
+            char c = sql_[pos_];
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                ++pos_;
+            } else if (c == '-' && pos_ + 1 < sql_.size() && sql_[pos_ + 1] == '-') {
+                size_t end = sql_.find('\n', pos_);
+                pos_ = end == std::string_view::npos ? sql_.size() : end;
+            } else if (c == '/' && pos_ + 1 < sql_.size() && sql_[pos_ + 1] == '*') {
+                size_t end = sql_.find("*/", pos_ + 2);
+                if (end == std::string_view::npos) {
+                    throw ParseError("unterminated comment", pos_);
+                }
+                pos_ = end + 2; // Block comments include the optimizer's own operator hints
+            } else {
+                break;
+            }
+        }
+    }
+
+    Token finish(Token& token, TokenKind kind, size_t textBegin, size_t textEnd, size_t tokenEnd) {
+        token.kind = kind;
+        token.text = sql_.substr(textBegin, textEnd - textBegin);
+        token.length = tokenEnd - pos_;
+        pos_ = tokenEnd;
+        return token;
+    }
+
+    std::string_view sql_;
+    size_t pos_ = 0;
+};
+
+// Arena allocation
+// A monotonic bump allocator for memory that dies all at once: the AST of one statement, the memo
+// of one enumeration. Deallocation is a no-op; an ArenaFrame releases everything allocated since
+// it was opened in one step, so frames must nest like scopes. Released blocks are kept for the
+// next frame, so a thread that plans query after query stops calling the heap once its arena has
+// grown to its working size.
+class Arena : public std::pmr::memory_resource {
+public:
+    struct Mark {
+        size_t block = 0;
+        size_t offset = 0;
+    };
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    Mark mark() const {
+        return {current_, offset_};
+    }
+
+    // Free everything allocated after mark; once the arena is empty again, blocks beyond
+    // kRetainedBytes go back to the heap
+    void release(Mark mark) {
+        current_ = mark.block;
+        offset_ = mark.offset;
+        if (current_ == 0 && offset_ == 0) {
+            size_t retained = 0;
+            size_t keep = 0;
+            while (keep < blocks_.size() && (keep == 0 || retained + blocks_[keep].size <= kRetainedBytes)) {
+                retained += blocks_[keep++].size;
+            }
+            blocks_.resize(keep);
+        }
+    }
+
+    // Return every block to the heap; does nothing while a frame holds memory
+    void trim() {
+        if (current_ == 0 && offset_ == 0) {
+            blocks_.clear();
+        }
+    }
+
+    size_t reservedBytes() const {
+        size_t total = 0;
+        for (const auto& block : blocks_) {
+            total += block.size;
+        }
+        return total;
+    }
+
+private:
+    static constexpr size_t kFirstBlockBytes = 16 * 1024;
+    static constexpr size_t kRetainedBytes = 16 * 1024 * 1024;
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        if (blocks_.empty()) {
+            blocks_.push_back({std::make_unique<char[]>(std::max(kFirstBlockBytes, bytes + alignment)), std::max(kFirstBlockBytes, bytes + alignment)});
+        }
+        for (;;) {
+            Block& block = blocks_[current_];
+            uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+            size_t start = ((base + offset_ + alignment - 1) & ~uintptr_t(alignment - 1)) - base;
+            if (start + bytes <= block.size) {
+                offset_ = start + bytes;
+                return block.data.get() + start;
+            }
+            // Continue in the next kept block if it is big enough, otherwise insert a larger one
+            if (current_ + 1 >= blocks_.size() || blocks_[current_ + 1].size < bytes + alignment) {
+                size_t size = std::max(block.size * 2, bytes + alignment);
+                blocks_.insert(blocks_.begin() + current_ + 1, Block{std::make_unique<char[]>(size), size});
+            }
+            ++current_;
+            offset_ = 0;
+        }
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::vector<Block> blocks_;
+    size_t current_ = 0; // Block being allocated from
+    size_t offset_ = 0;  // First free byte in it
+};
+
+// The calling thread's arena, reused by every frame opened on that thread
+inline Arena& threadArena() {
+    thread_local Arena arena;
+    return arena;
+}
+
+void releaseThreadArena() {
+    threadArena().trim();
+}
+
+class ArenaFrame {
+public:
+    explicit ArenaFrame(Arena& arena) : arena_(arena), mark_(arena.mark()) {}
+    ~ArenaFrame() { arena_.release(mark_); }
+    ArenaFrame(const ArenaFrame&) = delete;
+    ArenaFrame& operator=(const ArenaFrame&) = delete;
+
+    Arena& arena() { return arena_; }
+
+private:
+    Arena& arena_;
+    Arena::Mark mark_;
+};
+
+// Names copied into an arena once each: interning equal names yields views with the same data
+// pointer, so interned names compare by pointer
+class NameInterner {
+public:
+    explicit NameInterner(std::pmr::memory_resource* arena) : arena_(arena), names_(arena) {}
+
+    std::string_view intern(std::string_view name) {
+        auto found = names_.find(name);
+        if (found != names_.end()) {
+            return *found;
+        }
+        char* copy = static_cast<char*>(arena_->allocate(std::max<size_t>(name.size(), 1), 1));
+        std::memcpy(copy, name.data(), name.size());
+        return *names_.insert(std::string_view(copy, name.size())).first;
+    }
+
+    // The interned copy of name, or a null view if it was never interned
+    std::string_view find(std::string_view name) const {
+        auto found = names_.find(name);
+        return found == names_.end() ? std::string_view() : *found;
+    }
+
+private:
+    std::pmr::memory_resource* arena_;
+    std::pmr::unordered_set<std::string_view> names_;
+};
+
+const char* const kKeywordNames[] = {"", "SELECT", "FROM", "WHERE", "JOIN", "INNER", "CROSS", "ON", "AND", "AS", "NOT",
+                                     "IN", "BETWEEN", "LIKE", "IS", "NULL", "ORDER", "BY", "ASC", "DESC", "LIMIT", "GROUP"};
+
+inline bool parseNumber(std::string_view text, double& value) {
+    const char* end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, value);
+    return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+double ColumnStats::fractionBetween(double low, double high) const {
+    if (!numeric || low > high || high < min || low > max) {
+        return 0;
+    }
+    if (histogram.size() < 2) {
+        return max > min ? (std::min(high, max) - std::max(low, min)) / (max - min) : 1;
+    }
+    size_t buckets = histogram.size() - 1;
+    double fraction = 0;
+    for (size_t i = 0; i < buckets; ++i) {
+        double bucketLow = histogram[i];
+        double bucketHigh = histogram[i + 1];
+        if (high < bucketLow || low > bucketHigh) {
+            continue;
+        }
+        if (bucketHigh == bucketLow) {
+            fraction += 1.0 / buckets;
+        } else {
+            fraction += (std::min(high, bucketHigh) - std::max(low, bucketLow)) / (bucketHigh - bucketLow) / buckets;
+        }
+    }
+    return std::min(fraction, 1.0);
+}
+
+const ColumnStats* TableStats::column(const std::string& columnName) const {
+    for (const auto& stats : columns) {
+        if (stats.name == columnName) {
+            return &stats;
+        }
+    }
+    return nullptr;
+}
+
+// HyperLogLog distinct-value sketch with 2^12 one-byte registers (about 1.6% standard error)
+class HyperLogLog {
+public:
+    static constexpr int kPrecision = 12;
+
+    HyperLogLog() : registers_(size_t(1) << kPrecision, 0) {}
+
+    void add(uint64_t hash) {
+        size_t index = hash >> (64 - kPrecision);
+        uint64_t rest = hash << kPrecision;
+        uint8_t rank = rest == 0 ? 64 - kPrecision + 1 : static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        registers_[index] = std::max(registers_[index], rank);
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(registers_.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t rank : registers_) {
+            sum += std::ldexp(1.0, -rank);
+            zeros += rank == 0;
+        }
+        double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (estimate <= 2.5 * m && zeros != 0) {
+            estimate = m * std::log(m / zeros); // Linear counting for small cardinalities
+        }
+        return estimate;
+    }
+
+private:
+    std::vector<uint8_t> registers_;
+};
+
+// Space-Saving heavy-hitter counter: tracks at most kCapacity values, each with an overestimated
+// count and the maximum error of that count
+class FrequentValues {
+public:
+    static constexpr size_t kCapacity = 64;
+
+    struct Counter {
+        std::string value;
+        long long count;
+        long long error;
+    };
+
+    void add(std::string_view value) {
+        for (auto& counter : counters_) {
+            if (counter.value == value) {
+                ++counter.count;
+                return;
+            }
+        }
+        if (counters_.size() < kCapacity) {
+            counters_.push_back({std::string(value), 1, 0});
+            return;
+        }
+        evicted_ = true;
+        auto smallest = std::min_element(counters_.begin(), counters_.end(), [](const Counter& a, const Counter& b) {
+            return a.count < b.count;
+        });
+        smallest->value.assign(value.data(), value.size());
+        smallest->error = smallest->count;
+        ++smallest->count;
+    }
+
+    const std::vector<Counter>& counters() const { return counters_; }
+    bool evicted() const { return evicted_; } // False when every distinct value was counted exactly
+
+private:
+    std::vector<Counter> counters_;
+    bool evicted_ = false;
+};
+
+// Single-pass, bounded-memory statistics builder for one column
+class ColumnAnalyzer {
+public:
+    static constexpr size_t kSampleSize = 30000;     // Reservoir sample backing the histogram
+    static constexpr size_t kHistogramBuckets = 100;
+    static constexpr size_t kMostCommonValues = 16;
+
+    explicit ColumnAnalyzer(std::string name) : name_(std::move(name)), random_(0x5eed) {}
+
+    void addNull() {
+        ++rows_;
+        ++nulls_;
+    }
+
+    void add(std::string_view text) {
+        double value = 0;
+        const char* end = text.data() + text.size();
+        auto result = std::from_chars(text.data(), end, value);
+        if (numeric_ && (result.ec != std::errc() || result.ptr != end)) {
+            numeric_ = false;
+            sample_.clear();
+        }
+        addValue(text, value);
+    }
+
+    void add(double value) {
+        char buffer[32];
+        auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        addValue(std::string_view(buffer, result.ptr - buffer), value);
+    }
+
+    long long rows() const { return rows_; }
+
+    ColumnStats finish() const {
+        ColumnStats stats;
+        stats.name = name_;
+        long long nonNull = rows_ - nulls_;
+        stats.numeric = numeric_ && nonNull > 0;
+        stats.min = min_;
+        stats.max = max_;
+        stats.nullFraction = rows_ == 0 ? 0 : static_cast<double>(nulls_) / rows_;
+
+        const auto& counters = frequent_.counters();
+        stats.distinct = frequent_.evicted() ? distinct_.estimate() : static_cast<double>(counters.size());
+        stats.distinct = std::max(1.0, std::min(stats.distinct, static_cast<double>(nonNull)));
+
+        // Keep values that are clearly more common than average
+        std::vector<FrequentValues::Counter> sorted = counters;
+        std::sort(sorted.begin(), sorted.end(), [](const FrequentValues::Counter& a, const FrequentValues::Counter& b) {
+            return a.count > b.count;
+        });
+        double averageCount = nonNull / stats.distinct;
+        for (const auto& counter : sorted) {
+            if (stats.mostCommon.size() == kMostCommonValues || counter.count - counter.error < 2) {
+                break;
+            }
+            if (frequent_.evicted() && counter.count - counter.error < 1.25 * averageCount) {
+                break;
+            }
+            stats.mostCommon.push_back({counter.value, static_cast<double>(counter.count) / rows_});
+        }
+
+        if (stats.numeric && !sample_.empty()) {
+            std::vector<double> sample = sample_;
+            std::sort(sample.begin(), sample.end());
+            size_t buckets = std::min(kHistogramBuckets, sample.size());
+            for (size_t i = 0; i <= buckets; ++i) {
+                stats.histogram.push_back(sample[i * (sample.size() - 1) / buckets]);
+            }
+            stats.histogram.front() = min_;
+            stats.histogram.back() = max_;
+        }
+        return stats;
+    }
+
+private:
+    void addValue(std::string_view text, double value) {
+        long long seen = rows_ - nulls_;
+        ++rows_;
+        distinct_.add(hashValue(text));
+        frequent_.add(text);
+        if (!numeric_) {
+            return;
+        }
+        min_ = seen == 0 ? value : std::min(min_, value);
+        max_ = seen == 0 ? value : std::max(max_, value);
+        if (sample_.size() < kSampleSize) {
+            sample_.push_back(value);
+        } else {
+            std::uniform_int_distribution<long long> slot(0, seen);
+            long long index = slot(random_);
+            if (index < static_cast<long long>(kSampleSize)) {
+                sample_[index] = value;
+            }
+        }
+    }
+
+    std::string name_;
+    long long rows_ = 0;
+    long long nulls_ = 0;
+    bool numeric_ = true;
+    double min_ = 0;
+    double max_ = 0;
+    HyperLogLog distinct_;
+    FrequentValues frequent_;
+    std::vector<double> sample_;
+    std::mt19937_64 random_;
+};
+
+// ANALYZE a CSV file: the first line names the columns, empty fields and NULL are nulls, and
+// fields may be double-quoted with "" escapes. The file is streamed one line at a time.
+TableStats analyzeCsv(const std::string& table, const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+
+    auto splitRecord = [](const std::string& line, std::vector<std::string>& fields) {
+        fields.clear();
+        std::string field;
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            char c = line[i];
+            if (quoted) {
+                if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                    field += '"';
+                    ++i;
+                } else if (c == '"') {
+                    quoted = false;
+                } else {
+                    field += c;
+                }
+            } else if (c == '"') {
+                quoted = true;
+            } else if (c == ',') {
+                fields.push_back(field);
+                field.clear();
+            } else if (c != '\r') {
+                field += c;
+            }
+        }
+        fields.push_back(field);
+    };
+
+    std::string line;
+    std::vector<std::string> fields;
+    if (!std::getline(in, line)) {
+        throw std::runtime_error(path + " has no header line");
+    }
+    splitRecord(line, fields);
+    std::vector<ColumnAnalyzer> columns;
+    for (const auto& name : fields) {
+        columns.emplace_back(trim(name));
+    }
+
+    long long rows = 0;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        splitRecord(line, fields);
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (i >= fields.size() || fields[i].empty() || equalsIgnoreCase(fields[i], "NULL")) {
+                columns[i].addNull();
+            } else {
+                columns[i].add(fields[i]);
+            }
+        }
+        ++rows;
+    }
+
+    TableStats stats;
+    stats.name = table;
+    stats.rows = rows;
+    for (const auto& column : columns) {
+        stats.columns.push_back(column.finish());
+    }
+    return stats;
+}
+
+ColumnFileHeader readColumnFileHeader(std::istream& in, const std::string& path) {
+    ColumnFileHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kColumnFileMagic, sizeof(kColumnFileMagic)) != 0 ||
+        (header.type != ColumnType::Int64 && header.type != ColumnType::Double)) {
+        throw std::runtime_error(path + " is not a column file");
+    }
+    return header;
+}
+
+std::string columnNameFromPath(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    return name.substr(0, name.find('.'));
+}
+
+// ANALYZE a table stored as binary column files, reading each file in fixed-size chunks
+TableStats analyzeColumnFiles(const std::string& table, const std::vector<std::string>& paths) {
+    const size_t kChunkValues = 4096;
+    TableStats stats;
+    stats.name = table;
+    for (size_t f = 0; f < paths.size(); ++f) {
+        std::ifstream in(paths[f], std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("cannot open " + paths[f]);
+        }
+        ColumnFileHeader header = readColumnFileHeader(in, paths[f]);
+        if (f > 0 && static_cast<long long>(header.count) != stats.rows) {
+            throw std::runtime_error(paths[f] + " has a different row count than " + paths[0]);
+        }
+        stats.rows = static_cast<long long>(header.count);
+
+        ColumnAnalyzer column(columnNameFromPath(paths[f]));
+        std::vector<char> chunk(kChunkValues * 8);
+        for (uint64_t done = 0; done < header.count;) {
+            size_t values = static_cast<size_t>(std::min<uint64_t>(kChunkValues, header.count - done));
+            if (!in.read(chunk.data(), values * 8)) {
+                throw std::runtime_error(paths[f] + " is truncated");
+            }
+            for (size_t i = 0; i < values; ++i) {
+                if (header.type == ColumnType::Int64) {
+                    int64_t value;
+                    std::memcpy(&value, chunk.data() + i * 8, 8);
+                    if (value == std::numeric_limits<int64_t>::min()) {
+                        column.addNull();
+                    } else {
+                        column.add(static_cast<double>(value));
+                    }
+                } else {
+                    double value;
+                    std::memcpy(&value, chunk.data() + i * 8, 8);
+                    if (std::isnan(value)) {
+                        column.addNull();
+                    } else {
+                        column.add(value);
+                    }
+                }
+            }
+            done += values;
+        }
+        stats.columns.push_back(column.finish());
+    }
+    return stats;
+}
+
+MappedCatalog::MappedCatalog(const std::string& path) : path_(path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CatalogHeader)) {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a catalog file");
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    void* data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path);
+    }
+    data_ = static_cast<const char*>(data);
+
+    const CatalogHeader& header = this->header();
+    if (std::memcmp(header.magic, kCatalogMagic, sizeof(kCatalogMagic)) != 0 || header.byteOrder != kCatalogByteOrder) {
+        unmap();
+        throw std::runtime_error(path + " is not a catalog file");
+    }
+    if (header.version != kCatalogVersion) {
+        uint32_t version = header.version;
+        unmap();
+        throw std::runtime_error(path + " has catalog version " + std::to_string(version) + ", expected " +
+                                 std::to_string(kCatalogVersion));
+    }
+    static const size_t recordBytes[kCatalogSectionCount] = {
+        sizeof(uint32_t), sizeof(CatalogTable), sizeof(CatalogColumn), sizeof(CatalogValue), sizeof(CatalogForeignKey),
+        sizeof(CatalogIndex), sizeof(uint32_t), sizeof(double), sizeof(char)};
+    for (int i = 0; i < kCatalogSectionCount; ++i) {
+        const CatalogSectionEntry& section = header.sections[i];
+        if (header.fileBytes != size_ || section.offset % 8 != 0 || section.offset > size_ ||
+            section.count > (size_ - section.offset) / recordBytes[i]) {
+            unmap();
+            throw std::runtime_error(path + " is truncated or corrupt");
+        }
+    }
+    size_t buckets = header.sections[kCatalogBuckets].count;
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0) {
+        unmap();
+        throw std::runtime_error(path + " is truncated or corrupt");
+    }
+}
+
+const CatalogTable* MappedCatalog::findTable(std::string_view name) const {
+    uint64_t hash = hashValue(name);
+    const uint32_t* buckets = section<uint32_t>(kCatalogBuckets);
+    size_t mask = count(kCatalogBuckets) - 1;
+    for (size_t probe = 0, bucket = hash & mask; probe <= mask; ++probe, bucket = (bucket + 1) & mask) {
+        uint32_t entry = buckets[bucket];
+        if (entry == 0) {
+            return nullptr;
+        }
+        const CatalogTable& table = record<CatalogTable>(kCatalogTables, entry - 1);
+        if (table.nameHash == hash && string(table.name) == name) {
+            return &table;
+        }
+    }
+    return nullptr;
+}
+
+const CatalogColumn* MappedCatalog::findColumn(const CatalogTable& table, std::string_view name) const {
+    for (uint32_t i = 0; i < table.columnCount; ++i) {
+        const CatalogColumn& column = record<CatalogColumn>(kCatalogColumns, uint64_t(table.firstColumn) + i);
+        if (string(column.name) == name) {
+            return &column;
+        }
+    }
+    return nullptr;
+}
+
+std::string_view MappedCatalog::string(CatalogString text) const {
+    if (uint64_t(text.offset) + text.length > count(kCatalogStrings)) {
+        throw std::runtime_error(path_ + " is corrupt");
+    }
+    return std::string_view(section<char>(kCatalogStrings) + text.offset, text.length);
+}
+
+ColumnStats MappedCatalog::columnStats(const CatalogColumn& column) const {
+    ColumnStats stats;
+    stats.name = std::string(string(column.name));
+    stats.numeric = (column.flags & CatalogColumn::kNumeric) != 0;
+    stats.min = column.min;
+    stats.max = column.max;
+    stats.nullFraction = column.nullFraction;
+    stats.distinct = column.distinct;
+    stats.histogram.reserve(column.numberCount);
+    for (uint32_t i = 0; i < column.numberCount; ++i) {
+        stats.histogram.push_back(record<double>(kCatalogNumbers, uint64_t(column.firstNumber) + i));
+    }
+    stats.mostCommon.reserve(column.valueCount);
+    for (uint32_t i = 0; i < column.valueCount; ++i) {
+        const CatalogValue& value = record<CatalogValue>(kCatalogValues, uint64_t(column.firstValue) + i);
+        stats.mostCommon.push_back({std::string(string(value.value)), value.fraction});
+    }
+    return stats;
+}
+
+bool MappedCatalog::isForeignKey(const CatalogTable& table, std::string_view column, std::string_view referencedTable,
+                                 std::string_view referencedColumn) const {
+    for (uint32_t i = 0; i < table.foreignKeyCount; ++i) {
+        const CatalogForeignKey& key = record<CatalogForeignKey>(kCatalogForeignKeys, uint64_t(table.firstForeignKey) + i);
+        const CatalogTable& referenced = record<CatalogTable>(kCatalogTables, key.referencedTable);
+        if (string(columnAt(table, key.column).name) == column && string(referenced.name) == referencedTable &&
+            string(columnAt(referenced, key.referencedColumn).name) == referencedColumn) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<IndexDefinition> MappedCatalog::indexes(const CatalogTable& table) const {
+    std::vector<IndexDefinition> result;
+    for (uint32_t i = 0; i < table.indexCount; ++i) {
+        const CatalogIndex& index = record<CatalogIndex>(kCatalogIndexes, uint64_t(table.firstIndex) + i);
+        IndexDefinition definition;
+        definition.name = std::string(string(index.name));
+        definition.unique = (index.flags & CatalogIndex::kUnique) != 0;
+        definition.clustered = (index.flags & CatalogIndex::kClustered) != 0;
+        definition.pages = index.pages;
+        for (uint32_t c = 0; c < index.columnCount; ++c) {
+            uint32_t column = record<uint32_t>(kCatalogIndexColumns, uint64_t(index.firstColumn) + c);
+            definition.columns.push_back(std::string(string(columnAt(table, column).name)));
+        }
+        result.push_back(std::move(definition));
+    }
+    return result;
+}
+
+TablePartitioning MappedCatalog::partitioning(const CatalogTable& table) const {
+    TablePartitioning result;
+    if (table.partitionScheme > static_cast<uint32_t>(PartitionScheme::Replicated)) {
+        throw std::runtime_error(path_ + " is corrupt");
+    }
+    result.scheme = static_cast<PartitionScheme>(table.partitionScheme);
+    if (result.scheme == PartitionScheme::Hash || result.scheme == PartitionScheme::Range) {
+        result.column = std::string(string(columnAt(table, table.partitionColumn).name));
+    }
+    std::string_view bounds = string(table.partitionBounds);
+    for (size_t start = 0; !bounds.empty() && start <= bounds.size();) {
+        size_t comma = std::min(bounds.find(',', start), bounds.size());
+        result.bounds.emplace_back(bounds.substr(start, comma - start));
+        start = comma + 1;
+    }
+    result.nodes = table.partitionNodes;
+    return result;
+}
+
+const CatalogColumn& MappedCatalog::columnAt(const CatalogTable& table, uint32_t column) const {
+    if (column >= table.columnCount) {
+        throw std::runtime_error(path_ + " is corrupt");
+    }
+    return record<CatalogColumn>(kCatalogColumns, uint64_t(table.firstColumn) + column);
+}
+
+void MappedCatalog::unmap() {
+    if (data_ != nullptr) {
+        ::munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+    }
+}
+
+void StatisticsCatalog::add(TableStats stats) {
+    std::string name = stats.name;
+    tables_[name] = std::move(stats);
+}
+
+void StatisticsCatalog::attach(std::shared_ptr<const MappedCatalog> mapped) {
+    mapped_ = std::move(mapped);
+    std::unique_lock<std::shared_mutex> lock(decodedMutex_);
+    decoded_.clear();
+}
+
+const TableStats* StatisticsCatalog::find(const std::string& table) const {
+    auto it = tables_.find(table);
+    return it == tables_.end() ? nullptr : &it->second;
+}
+
+bool StatisticsCatalog::hasStatistics(const std::string& table) const {
+    if (find(table) != nullptr) {
+        return true;
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    return mapped != nullptr && mapped->rows >= 0;
+}
+
+long long StatisticsCatalog::rowCount(const std::string& table, long long fallback) const {
+    if (const TableStats* stats = find(table)) {
+        return stats->rows;
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    return mapped != nullptr && mapped->rows >= 0 ? mapped->rows : fallback;
+}
+
+bool StatisticsCatalog::hasColumn(const std::string& table, const std::string& column) const {
+    if (const TableStats* stats = find(table)) {
+        return stats->column(column) != nullptr;
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    return mapped != nullptr && mapped->rows >= 0 && mapped_->findColumn(*mapped, column) != nullptr;
+}
+
+const ColumnStats* StatisticsCatalog::findColumn(const std::string& table, const std::string& column) const {
+    if (const TableStats* stats = find(table)) {
+        return stats->column(column);
+    }
+    if (!mapped_) {
+        return nullptr;
+    }
+    std::string key = table + '\0' + column;
+    {
+        std::shared_lock<std::shared_mutex> lock(decodedMutex_);
+        auto found = decoded_.find(key);
+        if (found != decoded_.end()) {
+            return found->second.get();
+        }
+    }
+    const CatalogTable* mapped = mapped_->findTable(table);
+    const CatalogColumn* mappedColumn = mapped == nullptr ? nullptr : mapped_->findColumn(*mapped, column);
+    std::unique_ptr<ColumnStats> stats;
+    if (mappedColumn != nullptr && (mappedColumn->flags & CatalogColumn::kStatistics)) {
+        stats = std::make_unique<ColumnStats>(mapped_->columnStats(*mappedColumn));
+    }
+    std::unique_lock<std::shared_mutex> lock(decodedMutex_);
+    return decoded_.emplace(std::move(key), std::move(stats)).first->second.get(); // Keeps a racing thread's copy
+}
+
+void StatisticsCatalog::addKey(const std::string& table, const std::string& column) {
+    constraints_[table].keys.insert(column);
+}
+
+void StatisticsCatalog::addForeignKey(const std::string& table, const std::string& column, const std::string& referencedTable,
+                                      const std::string& referencedColumn) {
+    addKey(referencedTable, referencedColumn);
+    constraints_[table].foreignKeys.push_back({column, referencedTable, referencedColumn});
+}
+
+void StatisticsCatalog::addIndex(const std::string& table, IndexDefinition index) {
+    constraints_[table].indexes.push_back(std::move(index));
+}
+
+void StatisticsCatalog::setPartitioning(const std::string& table, TablePartitioning partitioning) {
+    constraints_[table].partitioning = std::move(partitioning);
+}
+
+bool StatisticsCatalog::isKey(const std::string& table, const std::string& column) const {
+    auto found = constraints_.find(table);
+    if (found != constraints_.end() && found->second.keys.count(column) != 0) {
+        return true;
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    const CatalogColumn* mappedColumn = mapped == nullptr ? nullptr : mapped_->findColumn(*mapped, column);
+    return mappedColumn != nullptr && (mappedColumn->flags & CatalogColumn::kKey);
+}
+
+bool StatisticsCatalog::isForeignKey(const std::string& table, const std::string& column, const std::string& referencedTable,
+                                     const std::string& referencedColumn) const {
+    auto found = constraints_.find(table);
+    if (found != constraints_.end()) {
+        for (const auto& key : found->second.foreignKeys) {
+            if (key.column == column && key.referencedTable == referencedTable && key.referencedColumn == referencedColumn) {
+                return true;
+            }
+        }
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    return mapped != nullptr && mapped_->isForeignKey(*mapped, column, referencedTable, referencedColumn);
+}
+
+std::vector<IndexDefinition> StatisticsCatalog::indexes(const std::string& table) const {
+    std::vector<IndexDefinition> result;
+    auto found = constraints_.find(table);
+    if (found != constraints_.end()) {
+        result = found->second.indexes;
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    if (mapped != nullptr) {
+        for (auto& index : mapped_->indexes(*mapped)) {
+            result.push_back(std::move(index));
+        }
+    }
+    return result;
+}
+
+TablePartitioning StatisticsCatalog::partitioning(const std::string& table) const {
+    auto found = constraints_.find(table);
+    if (found != constraints_.end() && found->second.partitioning.scheme != PartitionScheme::Spread) {
+        return found->second.partitioning;
+    }
+    const CatalogTable* mapped = mapped_ ? mapped_->findTable(table) : nullptr;
+    return mapped != nullptr ? mapped_->partitioning(*mapped) : TablePartitioning();
+}
+
+void writeCatalog(const StatisticsCatalog& catalog, const std::string& path) {
+    std::vector<std::string> names;
+    for (const auto& entry : catalog.tables()) {
+        names.push_back(entry.first);
+    }
+    for (const auto& entry : catalog.constraints()) {
+        if (catalog.tables().count(entry.first) == 0) {
+            names.push_back(entry.first);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    if (names.size() >= std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("too many tables for a catalog file");
+    }
+
+    // Each table's columns: its analyzed columns, then any other column a constraint names
+    std::unordered_map<std::string, uint32_t> tableIndex;
+    std::vector<std::vector<std::string>> columnNames(names.size());
+    auto columnIndex = [&](size_t table, const std::string& column) {
+        auto& columns = columnNames[table];
+        auto found = std::find(columns.begin(), columns.end(), column);
+        if (found == columns.end()) {
+            columns.push_back(column);
+            return static_cast<uint32_t>(columns.size() - 1);
+        }
+        return static_cast<uint32_t>(found - columns.begin());
+    };
+    for (size_t t = 0; t < names.size(); ++t) {
+        tableIndex[names[t]] = static_cast<uint32_t>(t);
+        const TableStats* stats = catalog.find(names[t]);
+        for (size_t c = 0; stats != nullptr && c < stats->columns.size(); ++c) {
+            columnIndex(t, stats->columns[c].name);
+        }
+    }
+    for (size_t t = 0; t < names.size(); ++t) {
+        auto found = catalog.constraints().find(names[t]);
+        if (found == catalog.constraints().end()) {
+            continue;
+        }
+        for (const auto& key : found->second.keys) {
+            columnIndex(t, key);
+        }
+        for (const auto& key : found->second.foreignKeys) {
+            columnIndex(t, key.column);
+            columnIndex(tableIndex.at(key.referencedTable), key.referencedColumn);
+        }
+        for (const auto& index : found->second.indexes) {
+            for (const auto& column : index.columns) {
+                columnIndex(t, column);
+            }
+        }
+        if (!found->second.partitioning.column.empty()) {
+            columnIndex(t, found->second.partitioning.column);
+        }
+    }
+
+    std::vector<uint32_t> buckets(16);
+    while (buckets.size() < 2 * names.size()) {
+        buckets.resize(buckets.size() * 2);
+    }
+    std::vector<CatalogTable> tables;
+    std::vector<CatalogColumn> columns;
+    std::vector<CatalogValue> values;
+    std::vector<CatalogForeignKey> foreignKeys;
+    std::vector<CatalogIndex> indexes;
+    std::vector<uint32_t> indexColumns;
+    std::vector<double> numbers;
+    std::string strings;
+    auto addString = [&](const std::string& text) {
+        if (strings.size() + text.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::length_error("catalog strings exceed 4 GB");
+        }
+        CatalogString result = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(text.size())};
+        strings += text;
+        return result;
+    };
+
+    for (size_t t = 0; t < names.size(); ++t) {
+        const TableStats* stats = catalog.find(names[t]);
+        auto constraints = catalog.constraints().find(names[t]);
+        bool constrained = constraints != catalog.constraints().end();
+
+        CatalogTable table = {};
+        table.nameHash = hashValue(names[t]);
+        table.name = addString(names[t]);
+        table.rows = stats == nullptr ? -1 : stats->rows;
+        table.firstColumn = static_cast<uint32_t>(columns.size());
+        table.columnCount = static_cast<uint32_t>(columnNames[t].size());
+        for (const auto& name : columnNames[t]) {
+            CatalogColumn column = {};
+            column.name = addString(name);
+            const ColumnStats* columnStats = stats == nullptr ? nullptr : stats->column(name);
+            if (columnStats != nullptr) {
+                column.flags |= CatalogColumn::kStatistics | (columnStats->numeric ? CatalogColumn::kNumeric : 0);
+                column.min = columnStats->min;
+                column.max = columnStats->max;
+                column.nullFraction = columnStats->nullFraction;
+                column.distinct = columnStats->distinct;
+                column.firstNumber = static_cast<uint32_t>(numbers.size());
+                column.numberCount = static_cast<uint32_t>(columnStats->histogram.size());
+                numbers.insert(numbers.end(), columnStats->histogram.begin(), columnStats->histogram.end());
+                column.firstValue = static_cast<uint32_t>(values.size());
+                column.valueCount = static_cast<uint32_t>(columnStats->mostCommon.size());
+                for (const auto& value : columnStats->mostCommon) {
+                    values.push_back({addString(value.first), value.second});
+                }
+            }
+            if (constrained && constraints->second.keys.count(name) != 0) {
+                column.flags |= CatalogColumn::kKey;
+            }
+            columns.push_back(column);
+        }
+        table.firstForeignKey = static_cast<uint32_t>(foreignKeys.size());
+        table.firstIndex = static_cast<uint32_t>(indexes.size());
+        if (constrained) {
+            for (const auto& key : constraints->second.foreignKeys) {
+                uint32_t referenced = tableIndex.at(key.referencedTable);
+                foreignKeys.push_back({columnIndex(t, key.column), referenced, columnIndex(referenced, key.referencedColumn), 0});
+            }
+            for (const auto& definition : constraints->second.indexes) {
+                CatalogIndex index = {};
+                index.name = addString(definition.name);
+                index.firstColumn = static_cast<uint32_t>(indexColumns.size());
+                index.columnCount = static_cast<uint32_t>(definition.columns.size());
+                index.flags = (definition.unique ? CatalogIndex::kUnique : 0) | (definition.clustered ? CatalogIndex::kClustered : 0);
+                index.pages = definition.pages;
+                for (const auto& column : definition.columns) {
+                    indexColumns.push_back(columnIndex(t, column));
+                }
+                indexes.push_back(index);
+            }
+            table.foreignKeyCount = static_cast<uint32_t>(constraints->second.foreignKeys.size());
+            table.indexCount = static_cast<uint32_t>(constraints->second.indexes.size());
+            const TablePartitioning& partitioning = constraints->second.partitioning;
+            table.partitionScheme = static_cast<uint32_t>(partitioning.scheme);
+            if (!partitioning.column.empty()) {
+                table.partitionColumn = columnIndex(t, partitioning.column);
+            }
+            table.partitionNodes = static_cast<uint32_t>(partitioning.nodes);
+            std::string bounds;
+            for (const auto& bound : partitioning.bounds) {
+                bounds += (bounds.empty() ? "" : ",") + bound;
+            }
+            table.partitionBounds = addString(bounds);
+        }
+        tables.push_back(table);
+
+        size_t mask = buckets.size() - 1;
+        size_t bucket = table.nameHash & mask;
+        while (buckets[bucket] != 0) {
+            bucket = (bucket + 1) & mask;
+        }
+        buckets[bucket] = static_cast<uint32_t>(t + 1);
+    }
+
+    CatalogHeader header = {};
+    std::memcpy(header.magic, kCatalogMagic, sizeof(kCatalogMagic));
+    header.version = kCatalogVersion;
+    header.byteOrder = kCatalogByteOrder;
+    const std::pair<const void*, size_t> sections[kCatalogSectionCount] = {
+        {buckets.data(), buckets.size() * sizeof(uint32_t)},
+        {tables.data(), tables.size() * sizeof(CatalogTable)},
+        {columns.data(), columns.size() * sizeof(CatalogColumn)},
+        {values.data(), values.size() * sizeof(CatalogValue)},
+        {foreignKeys.data(), foreignKeys.size() * sizeof(CatalogForeignKey)},
+        {indexes.data(), indexes.size() * sizeof(CatalogIndex)},
+        {indexColumns.data(), indexColumns.size() * sizeof(uint32_t)},
+        {numbers.data(), numbers.size() * sizeof(double)},
+        {strings.data(), strings.size()}};
+    const size_t counts[kCatalogSectionCount] = {buckets.size(), tables.size(), columns.size(), values.size(), foreignKeys.size(),
+                                                 indexes.size(), indexColumns.size(), numbers.size(), strings.size()};
+    uint64_t offset = sizeof(CatalogHeader);
+    for (int i = 0; i < kCatalogSectionCount; ++i) {
+        offset = (offset + 7) & ~uint64_t(7);
+        header.sections[i] = {offset, counts[i]};
+        offset += sections[i].second;
+    }
+    header.fileBytes = offset;
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        static const char padding[8] = {};
+        uint64_t written = sizeof(CatalogHeader);
+        for (int i = 0; i < kCatalogSectionCount; ++i) {
+            out.write(padding, static_cast<std::streamsize>(header.sections[i].offset - written));
+            out.write(static_cast<const char*>(sections[i].first), static_cast<std::streamsize>(sections[i].second));
+            written = header.sections[i].offset + sections[i].second;
+        }
+        if (!out.flush()) {
+            throw std::runtime_error("cannot write " + temporary);
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("cannot replace " + path);
+    }
+}
+
+bool applyCatalogOption(const std::string& arg, StatisticsCatalog& catalog) {
+    auto split = [](const std::string& list, char separator) {
+        std::vector<std::string> parts;
+        std::istringstream stream(list);
+        for (std::string part; std::getline(stream, part, separator);) {
+            parts.push_back(part);
+        }
+        return parts;
+    };
+    auto splitColumn = [&](const std::string& option, const std::string& columnRef) {
+        size_t dot = columnRef.find('.');
+        if (dot == std::string::npos || dot == 0 || dot + 1 == columnRef.size()) {
+            throw std::runtime_error(option + " expects TABLE.COLUMN, got '" + columnRef + "'");
+        }
+        return std::make_pair(columnRef.substr(0, dot), columnRef.substr(dot + 1));
+    };
+
+    if (arg.rfind("--analyze=", 0) == 0) {
+        size_t colon = arg.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("--analyze expects TABLE:FILE");
+        }
+        std::string table = arg.substr(10, colon - 10);
+        std::vector<std::string> files = split(arg.substr(colon + 1), ',');
+        try {
+            bool csv = files.size() == 1 && files[0].size() > 4 && files[0].compare(files[0].size() - 4, 4, ".csv") == 0;
+            catalog.add(csv ? analyzeCsv(table, files[0]) : analyzeColumnFiles(table, files));
+        } catch (const std::exception& e) {
+            throw std::runtime_error("ANALYZE " + table + ": " + e.what());
+        }
+    } else if (arg.rfind("--primary-key=", 0) == 0) {
+        auto key = splitColumn("--primary-key", arg.substr(14));
+        catalog.addKey(key.first, key.second);
+    } else if (arg.rfind("--foreign-key=", 0) == 0) {
+        size_t colon = arg.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("--foreign-key expects TABLE.COLUMN:TABLE.COLUMN");
+        }
+        auto column = splitColumn("--foreign-key", arg.substr(14, colon - 14));
+        auto referenced = splitColumn("--foreign-key", arg.substr(colon + 1));
+        catalog.addForeignKey(column.first, column.second, referenced.first, referenced.second);
+    } else if (arg.rfind("--index=", 0) == 0 || arg.rfind("--unique-index=", 0) == 0) {
+        bool unique = arg[2] == 'u';
+        std::string definition = arg.substr(unique ? 15 : 8);
+        std::vector<std::string> parts = split(definition, ':');
+        if (parts.size() < 2 || parts[0].empty() || parts[1].empty()) {
+            throw std::runtime_error(arg.substr(0, arg.find('=')) + " expects TABLE:COLUMN[,COLUMN...][:clustered][:pages=N]");
+        }
+        IndexDefinition index;
+        std::string table = parts[0];
+        index.columns = split(parts[1], ',');
+        index.unique = unique;
+        for (size_t i = 2; i < parts.size(); ++i) {
+            if (parts[i] == "clustered") {
+                index.clustered = true;
+            } else if (parts[i].rfind("pages=", 0) == 0 && parseNumber(std::string_view(parts[i]).substr(6), index.pages) && index.pages >= 0) {
+                continue;
+            } else {
+                throw std::runtime_error(arg.substr(0, arg.find('=')) + ": unknown index attribute '" + parts[i] + "'");
+            }
+        }
+        index.name = table;
+        for (const auto& column : index.columns) {
+            index.name += '_' + column;
+        }
+        index.name += unique ? "_key" : "_idx";
+        catalog.addIndex(table, std::move(index));
+    } else if (arg.rfind("--partition=", 0) == 0) {
+        std::vector<std::string> parts = split(arg.substr(12), ':');
+        const char* usage = "--partition expects TABLE:hash:COLUMN[:nodes=N], TABLE:range:COLUMN:BOUND[,BOUND...] or TABLE:replicated";
+        if (parts.size() < 2 || parts[0].empty()) {
+            throw std::runtime_error(usage);
+        }
+        TablePartitioning partitioning;
+        if (parts[1] == "replicated" && parts.size() == 2) {
+            partitioning.scheme = PartitionScheme::Replicated;
+        } else if (parts[1] == "hash" && (parts.size() == 3 || parts.size() == 4) && !parts[2].empty()) {
+            partitioning.scheme = PartitionScheme::Hash;
+            partitioning.column = parts[2];
+            double nodes = 0;
+            if (parts.size() == 4 && !(parts[3].rfind("nodes=", 0) == 0 && parseNumber(std::string_view(parts[3]).substr(6), nodes) &&
+                                       nodes >= 1 && nodes == std::floor(nodes))) {
+                throw std::runtime_error(usage);
+            }
+            partitioning.nodes = static_cast<size_t>(nodes);
+        } else if (parts[1] == "range" && parts.size() == 4 && !parts[2].empty() && !parts[3].empty()) {
+            // One node per range: below the first bound, between consecutive bounds, from the last up
+            partitioning.scheme = PartitionScheme::Range;
+            partitioning.column = parts[2];
+            partitioning.bounds = split(parts[3], ',');
+            partitioning.nodes = partitioning.bounds.size() + 1;
+        } else {
+            throw std::runtime_error(usage);
+        }
+        catalog.setPartitioning(parts[0], std::move(partitioning));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Selectivity of the equi-join a = b. With most-common-value lists on both sides, matching MCVs
+// are counted exactly and the remaining values are assumed uniform; otherwise it is the classic
+// 1 / max(distinct), restricted to the value range both columns share.
+double estimateJoinSelectivity(const ColumnStats* a, const ColumnStats* b, double rowsA, double rowsB) {
+    double floor = 1.0 / std::max(1.0, rowsA * rowsB);
+    if (a == nullptr || b == nullptr) {
+        return 1.0 / std::max(1.0, std::max(rowsA, rowsB)); // Assume key/foreign-key
+    }
+    double nonNullA = 1 - a->nullFraction;
+    double nonNullB = 1 - b->nullFraction;
+
+    double selectivity;
+    if (!a->mostCommon.empty() && !b->mostCommon.empty()) {
+        double matched = 0;
+        double matchedA = 0;
+        double matchedB = 0;
+        double mcvA = 0;
+        double mcvB = 0;
+        for (const auto& entry : b->mostCommon) {
+            mcvB += entry.second;
+        }
+        for (const auto& entryA : a->mostCommon) {
+            mcvA += entryA.second;
+            for (const auto& entryB : b->mostCommon) {
+                if (entryA.first == entryB.first) {
+                    matched += entryA.second * entryB.second;
+                    matchedA += entryA.second;
+                    matchedB += entryB.second;
+                }
+            }
+        }
+        double restA = std::max(0.0, nonNullA - mcvA);
+        double restB = std::max(0.0, nonNullB - mcvB);
+        double distinctRestA = std::max(1.0, a->distinct - a->mostCommon.size());
+        double distinctRestB = std::max(1.0, b->distinct - b->mostCommon.size());
+        selectivity = matched
+            + (mcvA - matchedA) * restB / distinctRestB
+            + (mcvB - matchedB) * restA / distinctRestA
+            + restA * restB / std::max(distinctRestA, distinctRestB);
+    } else {
+        double overlapA = 1;
+        double overlapB = 1;
+        if (a->numeric && b->numeric) {
+            double low = std::max(a->min, b->min);
+            double high = std::min(a->max, b->max);
+            overlapA = a->fractionBetween(low, high);
+            overlapB = b->fractionBetween(low, high);
+        }
+        double distinct = std::max(a->distinct * overlapA, b->distinct * overlapB);
+        selectivity = nonNullA * overlapA * nonNullB * overlapB / std::max(1.0, distinct);
+    }
+    return std::max(floor, std::min(1.0, selectivity));
+}
+
+// Filter selectivity
+// Fraction of all rows of a table, nulls included, whose column passes a predicate against a
+// literal. Equalities look the value up in the most common values and otherwise spread the
+// remaining rows evenly over the remaining distinct values; ranges read the histogram. Without
+// statistics (or for ranges over text) the estimates fall back to System R's fixed guesses.
+constexpr double kDefaultEqualitySelectivity = 0.1;
+constexpr double kDefaultRangeSelectivity = 1.0 / 3;
+constexpr double kDefaultBetweenSelectivity = 0.25;
+constexpr double kDefaultLikeSelectivity = 0.1;
+constexpr double kDefaultNullSelectivity = 0.005;
+
+double estimateEqualitySelectivity(const ColumnStats* column, std::string_view value) {
+    if (column == nullptr) {
+        return kDefaultEqualitySelectivity;
+    }
+    double number = 0;
+    bool numeric = column->numeric && parseNumber(value, number);
+    if (numeric && (number < column->min || number > column->max)) {
+        return 0;
+    }
+    double common = 0;
+    for (const auto& entry : column->mostCommon) {
+        double entryNumber = 0;
+        if (numeric ? parseNumber(entry.first, entryNumber) && entryNumber == number : entry.first == value) {
+            return entry.second;
+        }
+        common += entry.second;
+    }
+    double rest = std::max(0.0, 1 - column->nullFraction - common);
+    return rest / std::max(1.0, column->distinct - column->mostCommon.size());
+}
+
+// column op value for op one of <, <=, >, >=
+double estimateRangeSelectivity(const ColumnStats* column, std::string_view op, std::string_view value) {
+    double number = 0;
+    if (column == nullptr || !column->numeric || !parseNumber(value, number)) {
+        return kDefaultRangeSelectivity;
+    }
+    double low = op[0] == '<' ? column->min : number;
+    double high = op[0] == '<' ? number : column->max;
+    return column->fractionBetween(low, high) * (1 - column->nullFraction);
+}
+
+double estimateBetweenSelectivity(const ColumnStats* column, std::string_view low, std::string_view high) {
+    double lowNumber = 0;
+    double highNumber = 0;
+    if (column == nullptr || !column->numeric || !parseNumber(low, lowNumber) || !parseNumber(high, highNumber)) {
+        return kDefaultBetweenSelectivity;
+    }
+    return column->fractionBetween(lowNumber, highNumber) * (1 - column->nullFraction);
+}
+
+// A pattern without wildcards is an equality. For a prefix pattern the most common values are
+// matched exactly and the guess only covers the remaining rows.
+double estimateLikeSelectivity(const ColumnStats* column, std::string_view pattern) {
+    size_t wildcard = pattern.find_first_of("%_");
+    if (wildcard == std::string_view::npos) {
+        return estimateEqualitySelectivity(column, pattern);
+    }
+    if (column == nullptr || column->numeric || wildcard == 0) {
+        return kDefaultLikeSelectivity;
+    }
+    std::string_view prefix = pattern.substr(0, wildcard);
+    double matched = 0;
+    double common = 0;
+    for (const auto& entry : column->mostCommon) {
+        if (entry.first.compare(0, prefix.size(), prefix) == 0) {
+            matched += entry.second;
+        }
+        common += entry.second;
+    }
+    return matched + std::max(0.0, 1 - column->nullFraction - common) * kDefaultLikeSelectivity;
+}
+
+double estimateNullSelectivity(const ColumnStats* column) {
+    return column == nullptr ? kDefaultNullSelectivity : column->nullFraction;
+}
+
+// Abstract Syntax Tree
+// Every name and literal is a view into the statement, so the source string must outlive the AST.
+// Node lists are allocated from the memory resource the nodes are constructed with, which the
+// parser points at an arena.
+struct AstExpr {
+    enum class Kind { Column, Star, Number, String, Null, Function, Parameter }; // Parameter: a ? marker of a prepared statement
+
+    AstExpr() = default;
+    explicit AstExpr(std::pmr::memory_resource* arena) : args(arena) {}
+
+    Kind kind = Kind::Column;
+    std::string_view qualifier;     // Table name or alias of a column or qualified star
+    std::string_view name;          // Column, function name, or literal text
+    std::pmr::vector<AstExpr> args; // Function arguments
+    std::string_view source;        // Full source text of the expression
+};
+
+struct AstSelectItem {
+    explicit AstSelectItem(std::pmr::memory_resource* arena) : expr(arena) {}
+
+    AstExpr expr;
+    std::string_view alias;
+};
+
+struct AstTableRef {
+    std::string_view name;
+    std::string_view alias;
+};
+
+// One conjunct of an ON or WHERE clause
+struct AstPredicate {
+    enum class Kind { Compare, In, Between, Like, IsNull };
+
+    explicit AstPredicate(std::pmr::memory_resource* arena) : left(arena), right(arena), values(arena) {}
+
+    Kind kind = Kind::Compare;
+    bool negated = false;          // NOT IN, NOT BETWEEN, NOT LIKE, IS NOT NULL
+    AstExpr left;
+    std::string_view op;           // Comparison operator
+    AstExpr right;                 // Right side of a comparison, or the LIKE pattern
+    std::pmr::vector<AstExpr> values; // IN list, or the two BETWEEN bounds
+    std::string_view source;
+};
+
+struct AstOrderItem {
+    explicit AstOrderItem(std::pmr::memory_resource* arena) : expr(arena) {}
+
+    AstExpr expr;
+    bool descending = false;
+};
+
+struct AstSelect {
+    explicit AstSelect(std::pmr::memory_resource* arena) : items(arena), tables(arena), conditions(arena), groupBy(arena), orderBy(arena) {}
+
+    std::string_view source; // The whole statement
+    std::pmr::vector<AstSelectItem> items;
+    std::pmr::vector<AstTableRef> tables;
+    std::pmr::vector<AstPredicate> conditions; // ON and WHERE conjuncts, in source order
+    std::pmr::vector<AstExpr> groupBy;
+    std::pmr::vector<AstOrderItem> orderBy;
+    std::string_view limit;                    // Row count of the LIMIT clause, empty if none
+};
+
+// Recursive-descent SQL parser
+// statement  := SELECT item {, item} FROM chain [WHERE conj] [GROUP BY expr {, expr}] [ORDER BY key {, key}]
+//               [LIMIT number] [;]
+// item       := * | expr [[AS] alias]
+// key        := expr [ASC | DESC]
+// chain      := from {(, | [INNER] JOIN | CROSS JOIN) from [ON conj]}
+// from       := name [[AS] alias] | ( chain )
+// conj       := pred {AND pred}
+// pred       := expr op expr | expr [NOT] IN (expr {, expr}) | expr [NOT] BETWEEN expr AND expr
+//             | expr [NOT] LIKE expr | expr IS [NOT] NULL
+// expr       := literal | NULL | name[.name | .*] | name([* | expr {, expr}])
+class Parser {
+public:
+    explicit Parser(std::string_view sql, std::pmr::memory_resource* arena = std::pmr::get_default_resource())
+        : sql_(sql), lexer_(sql), arena_(arena) {
+        advance();
+    }
+
+    AstSelect parseSelect() {
+        AstSelect select(arena_);
+        select.source = sql_;
+        select.items.reserve(8);
+        select.tables.reserve(8);
+        select.conditions.reserve(8);
+        expectKeyword(Keyword::Select);
+        do {
+            select.items.push_back(parseSelectItem());
+        } while (acceptSymbol(","));
+
+        expectKeyword(Keyword::From);
+        parseJoinChain(select);
+
+        if (acceptKeyword(Keyword::Where)) {
+            parseConjunction(select.conditions);
+        }
+        if (acceptKeyword(Keyword::Group)) {
+            expectKeyword(Keyword::By);
+            do {
+                select.groupBy.push_back(parseExpr());
+            } while (acceptSymbol(","));
+        }
+        if (acceptKeyword(Keyword::Order)) {
+            expectKeyword(Keyword::By);
+            do {
+                AstOrderItem key(arena_);
+                key.expr = parseExpr();
+                key.descending = acceptKeyword(Keyword::Desc);
+                if (!key.descending) {
+                    acceptKeyword(Keyword::Asc);
+                }
+                select.orderBy.push_back(std::move(key));
+            } while (acceptSymbol(","));
+        }
+        if (acceptKeyword(Keyword::Limit)) {
+            if (current_.kind != TokenKind::Number || current_.text.find_first_not_of("0123456789") != std::string_view::npos) {
+                throw ParseError("expected row count", current_.offset);
+            }
+            select.limit = current_.text;
+            advance();
+        }
+        acceptSymbol(";");
+        expectEnd();
+        return select;
+    }
+
+    // A select item or a condition on its own, as the Query keeps them
+    AstSelectItem parseItem() {
+        AstSelectItem item = parseSelectItem();
+        expectEnd();
+        return item;
+    }
+
+    AstPredicate parseCondition() {
+        AstPredicate predicate = parsePredicate();
+        expectEnd();
+        return predicate;
+    }
+
+private:
+    void expectEnd() {
+        if (current_.kind != TokenKind::End) {
+            throw ParseError("unexpected '" + std::string(current_.text) + "'", current_.offset);
+        }
+    }
+
+    void advance() {
+        previousEnd_ = current_.offset + current_.length;
+        current_ = lexer_.next();
+    }
+
+    bool isKeyword(Keyword keyword) const {
+        return current_.keyword == keyword;
+    }
+
+    bool acceptKeyword(Keyword keyword) {
+        if (!isKeyword(keyword)) {
+            return false;
+        }
+        advance();
+        return true;
+    }
+
+    void expectKeyword(Keyword keyword) {
+        if (!acceptKeyword(keyword)) {
+            throw ParseError(std::string("expected ") + kKeywordNames[static_cast<int>(keyword)], current_.offset);
+        }
+    }
+
+    bool isSymbol(std::string_view symbol) const {
+        return current_.kind == TokenKind::Symbol && current_.text == symbol;
+    }
+
+    bool acceptSymbol(std::string_view symbol) {
+        if (!isSymbol(symbol)) {
+            return false;
+        }
+        advance();
+        return true;
+    }
+
+    void expectSymbol(std::string_view symbol) {
+        if (!acceptSymbol(symbol)) {
+            throw ParseError("expected '" + std::string(symbol) + "'", current_.offset);
+        }
+    }
+
+    bool isName() const {
+        return (current_.kind == TokenKind::Identifier && current_.keyword == Keyword::None) || current_.kind == TokenKind::QuotedIdentifier;
+    }
+
+    std::string_view expectName(const char* what) {
+        if (!isName()) {
+            throw ParseError(std::string("expected ") + what, current_.offset);
+        }
+        std::string_view name = current_.text;
+        advance();
+        return name;
+    }
+
+    std::string_view sourceFrom(size_t begin) const {
+        return sql_.substr(begin, previousEnd_ - begin);
+    }
+
+    std::string_view parseOptionalAlias() {
+        if (acceptKeyword(Keyword::As)) {
+            return expectName("alias");
+        }
+        if (isName()) {
+            return expectName("alias");
+        }
+        return {};
+    }
+
+    AstSelectItem parseSelectItem() {
+        AstSelectItem item(arena_);
+        if (isSymbol("*")) {
+            item.expr.kind = AstExpr::Kind::Star;
+            item.expr.source = current_.text;
+            advance();
+            return item;
+        }
+        item.expr = parseExpr();
+        item.alias = parseOptionalAlias();
+        return item;
+    }
+
+    // Inner joins are flattened: tables and ON conditions are appended to the statement's lists
+    void parseJoinChain(AstSelect& select) {
+        parseFromItem(select);
+        for (;;) {
+            if (acceptSymbol(",")) {
+                parseFromItem(select);
+            } else if (acceptKeyword(Keyword::Cross)) {
+                expectKeyword(Keyword::Join);
+                parseFromItem(select);
+            } else if (isKeyword(Keyword::Join) || isKeyword(Keyword::Inner)) {
+                acceptKeyword(Keyword::Inner);
+                expectKeyword(Keyword::Join);
+                parseFromItem(select);
+                expectKeyword(Keyword::On);
+                parseConjunction(select.conditions);
+            } else {
+                break;
+            }
+        }
+    }
+
+    void parseFromItem(AstSelect& select) {
+        if (acceptSymbol("(")) {
+            parseJoinChain(select);
+            expectSymbol(")");
+            return;
+        }
+        AstTableRef table;
+        table.name = expectName("table name");
+        table.alias = parseOptionalAlias();
+        select.tables.push_back(table);
+    }
+
+    AstExpr parseExpr() {
+        AstExpr expr(arena_);
+        size_t begin = current_.offset;
+        if (current_.kind == TokenKind::Number || isSymbol("-")) {
+            acceptSymbol("-");
+            if (current_.kind != TokenKind::Number) {
+                throw ParseError("expected number", current_.offset);
+            }
+            advance();
+            expr.kind = AstExpr::Kind::Number;
+            expr.name = sourceFrom(begin);
+        } else if (current_.kind == TokenKind::String) {
+            expr.kind = AstExpr::Kind::String;
+            expr.name = current_.text;
+            advance();
+        } else if (acceptKeyword(Keyword::Null)) {
+            expr.kind = AstExpr::Kind::Null;
+            expr.name = sourceFrom(begin);
+        } else if (acceptSymbol("?")) {
+            expr.kind = AstExpr::Kind::Parameter;
+            expr.name = sourceFrom(begin);
+        } else {
+            std::string_view name = expectName("expression");
+            if (acceptSymbol("(")) {
+                expr.kind = AstExpr::Kind::Function;
+                expr.name = name;
+                if (isSymbol("*")) {
+                    AstExpr star(arena_);
+                    star.kind = AstExpr::Kind::Star;
+                    star.source = current_.text;
+                    expr.args.push_back(std::move(star));
+                    advance();
+                } else if (!isSymbol(")")) {
+                    do {
+                        expr.args.push_back(parseExpr());
+                    } while (acceptSymbol(","));
+                }
+                expectSymbol(")");
+            } else if (acceptSymbol(".")) {
+                expr.qualifier = name;
+                if (acceptSymbol("*")) {
+                    expr.kind = AstExpr::Kind::Star;
+                } else {
+                    expr.name = expectName("column name");
+                }
+            } else {
+                expr.name = name;
+            }
+        }
+        expr.source = sourceFrom(begin);
+        return expr;
+    }
+
+    void parseConjunction(std::pmr::vector<AstPredicate>& conditions) {
+        do {
+            conditions.push_back(parsePredicate());
+        } while (acceptKeyword(Keyword::And));
+    }
+
+    AstPredicate parsePredicate() {
+        AstPredicate predicate(arena_);
+        size_t begin = current_.offset;
+        predicate.left = parseExpr();
+        if (acceptKeyword(Keyword::Is)) {
+            predicate.kind = AstPredicate::Kind::IsNull;
+            predicate.negated = acceptKeyword(Keyword::Not);
+            expectKeyword(Keyword::Null);
+        } else if (isKeyword(Keyword::Not) || isKeyword(Keyword::In) || isKeyword(Keyword::Between) || isKeyword(Keyword::Like)) {
+            predicate.negated = acceptKeyword(Keyword::Not);
+            if (acceptKeyword(Keyword::In)) {
+                predicate.kind = AstPredicate::Kind::In;
+                expectSymbol("(");
+                do {
+                    predicate.values.push_back(parseExpr());
+                } while (acceptSymbol(","));
+                expectSymbol(")");
+            } else if (acceptKeyword(Keyword::Between)) {
+                predicate.kind = AstPredicate::Kind::Between;
+                predicate.values.push_back(parseExpr());
+                expectKeyword(Keyword::And); // Binds to BETWEEN, not to the conjunction
+                predicate.values.push_back(parseExpr());
+            } else if (acceptKeyword(Keyword::Like)) {
+                predicate.kind = AstPredicate::Kind::Like;
+                predicate.right = parseExpr();
+            } else {
+                throw ParseError("expected IN, BETWEEN or LIKE", current_.offset);
+            }
+        } else {
+            static const char* const operators[] = {"=", "<>", "!=", "<", "<=", ">", ">="};
+            for (const char* op : operators) {
+                if (isSymbol(op)) {
+                    predicate.op = current_.text;
+                    break;
+                }
+            }
+            if (predicate.op.empty()) {
+                throw ParseError("expected comparison operator", current_.offset);
+            }
+            advance();
+            predicate.right = parseExpr();
+        }
+        predicate.source = sourceFrom(begin);
+        return predicate;
+    }
+
+    std::string_view sql_;
+    Lexer lexer_;
+    Token current_;
+    size_t previousEnd_ = 0;
+    std::pmr::memory_resource* arena_;
+};
+
+// Spell a table or column name for the Query, quoting it when it is not a plain identifier
+std::string sqlName(std::string_view name) {
+    bool plain = !name.empty() && !(name[0] >= '0' && name[0] <= '9');
+    for (char c : name) {
+        plain = plain && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$');
+    }
+    return plain ? std::string(name) : "\"" + std::string(name) + "\"";
+}
+
+bool isLiteral(const AstExpr& expr) {
+    return expr.kind == AstExpr::Kind::Number || expr.kind == AstExpr::Kind::String;
+}
+
+// A literal, or a parameter that will be bound to one before the statement runs
+bool isConstant(const AstExpr& expr) {
+    return isLiteral(expr) || expr.kind == AstExpr::Kind::Parameter;
+}
+
+// The column a single-table predicate restricts: the left side, unless a comparison has the
+// constant on the left (5 < t.x)
+const AstExpr& predicateSubject(const AstPredicate& predicate) {
+    bool mirrored = predicate.kind == AstPredicate::Kind::Compare && isConstant(predicate.left) && !isConstant(predicate.right);
+    return mirrored ? predicate.right : predicate.left;
+}
+
+// Whether an index on the predicate's subject column can evaluate it: a comparison (other than
+// <>) or BETWEEN against constants, an IN list of constants, a LIKE with a fixed prefix, or IS NULL
+bool isSargable(const AstPredicate& predicate) {
+    if (predicate.negated) {
+        return false;
+    }
+    switch (predicate.kind) {
+    case AstPredicate::Kind::Compare: {
+        const AstExpr& value = &predicateSubject(predicate) == &predicate.left ? predicate.right : predicate.left;
+        return isConstant(value) && predicate.op != "<>" && predicate.op != "!=";
+    }
+    case AstPredicate::Kind::In:
+    case AstPredicate::Kind::Between:
+        return std::all_of(predicate.values.begin(), predicate.values.end(), isConstant);
+    case AstPredicate::Kind::Like:
+        return predicate.right.kind == AstExpr::Kind::String && !predicate.right.name.empty() &&
+               predicate.right.name[0] != '%' && predicate.right.name[0] != '_';
+    case AstPredicate::Kind::IsNull:
+        return true;
+    }
+    return false;
+}
+
+// Estimated fraction of a table's rows that pass a predicate over that table alone; column is
+// the statistics of the predicate's subject column, if any
+double estimatePredicateSelectivity(const AstPredicate& predicate, const ColumnStats* column) {
+    double nonNull = column == nullptr ? 1 : 1 - column->nullFraction;
+    double selectivity = 1;
+    switch (predicate.kind) {
+    case AstPredicate::Kind::Compare: {
+        bool mirrored = &predicateSubject(predicate) == &predicate.right;
+        const AstExpr& value = mirrored ? predicate.left : predicate.right;
+        std::string_view op = predicate.op;
+        if (mirrored && (op[0] == '<' || op[0] == '>') && op != "<>") {
+            static const std::string_view flipped[] = {">", ">=", "<", "<="};
+            op = flipped[(op[0] == '<' ? 0 : 2) + (op.size() == 2 ? 1 : 0)];
+        }
+        bool equality = op == "=";
+        bool inequality = op == "<>" || op == "!=";
+        if (value.kind == AstExpr::Kind::Null) {
+            selectivity = 0; // Never true
+        } else if (!isLiteral(value)) {
+            selectivity = equality ? kDefaultEqualitySelectivity : inequality ? 1 - kDefaultEqualitySelectivity : kDefaultRangeSelectivity;
+        } else if (equality || inequality) {
+            double equal = estimateEqualitySelectivity(column, value.name);
+            selectivity = equality ? equal : nonNull - equal;
+        } else {
+            selectivity = estimateRangeSelectivity(column, op, value.name);
+        }
+        break;
+    }
+    case AstPredicate::Kind::In:
+        selectivity = 0;
+        for (const auto& value : predicate.values) {
+            selectivity += isLiteral(value) ? estimateEqualitySelectivity(column, value.name) : kDefaultEqualitySelectivity;
+        }
+        selectivity = std::min(selectivity, nonNull);
+        break;
+    case AstPredicate::Kind::Between:
+        selectivity = isLiteral(predicate.values[0]) && isLiteral(predicate.values[1])
+            ? estimateBetweenSelectivity(column, predicate.values[0].name, predicate.values[1].name)
+            : kDefaultBetweenSelectivity;
+        break;
+    case AstPredicate::Kind::Like:
+        selectivity = predicate.right.kind == AstExpr::Kind::String ? estimateLikeSelectivity(column, predicate.right.name)
+                                                                    : kDefaultLikeSelectivity;
+        break;
+    case AstPredicate::Kind::IsNull:
+        selectivity = estimateNullSelectivity(column);
+        nonNull = 1; // IS NOT NULL is the complement over all rows
+        break;
+    }
+    if (predicate.negated) {
+        selectivity = nonNull - selectivity;
+    }
+    return std::max(0.0, std::min(1.0, selectivity));
+}
+
+// Bind the AST to a Query
+// Equalities between columns of two different tables become join conditions; every other
+// condition is kept verbatim as a filter. Filters whose columns all belong to one table are also
+// recorded as table filters, with their selectivity estimated from the statistics catalog.
+// Names are copied out of the statement here, and row counts and indexes come from the statistics
+// catalog when it has the table; each table also records the columns the query uses, which tells
+// whether an index covers it. Column qualifiers are resolved by interning the table names and
+// aliases, so each lookup is a pointer comparison.
+Query bindQuery(const AstSelect& select, const StatisticsCatalog* statistics = nullptr) {
+    ArenaFrame frame(threadArena());
+    NameInterner names(&frame.arena());
+    std::pmr::vector<const char*> qualifiers(&frame.arena());
+    qualifiers.reserve(select.tables.size());
+    for (const auto& ref : select.tables) {
+        qualifiers.push_back(names.intern(ref.alias.empty() ? ref.name : ref.alias).data());
+    }
+
+    Query query;
+    query.selectColumns.reserve(select.items.size());
+    query.fromTables.reserve(select.tables.size());
+    for (const auto& item : select.items) {
+        std::string column(item.expr.source);
+        if (!item.alias.empty()) {
+            column += " AS " + std::string(item.alias);
+        }
+        query.selectColumns.push_back(column);
+    }
+
+    for (const auto& ref : select.tables) {
+        Table table = {sqlName(ref.name), 1000, ref.alias.empty() ? std::string() : sqlName(ref.alias), {}, {}, false, {}}; // Default row count without statistics
+        if (statistics != nullptr) {
+            table.rows = statistics->rowCount(table.name, table.rows);
+            table.indexes = statistics->indexes(table.name);
+            table.partitioning = statistics->partitioning(table.name);
+        }
+        query.fromTables.push_back(std::move(table));
+    }
+
+    auto findQualifier = [&](std::string_view name) -> int {
+        const char* qualifier = names.find(name).data();
+        auto found = std::find(qualifiers.begin(), qualifiers.end(), qualifier);
+        return qualifier == nullptr || found == qualifiers.end() ? -1 : static_cast<int>(found - qualifiers.begin());
+    };
+
+    auto resolve = [&](const AstExpr& expr) -> int {
+        if (expr.kind != AstExpr::Kind::Column || expr.qualifier.empty()) {
+            return -1;
+        }
+        int found = findQualifier(expr.qualifier);
+        if (found >= 0) {
+            return found;
+        }
+        throw ParseError("unknown table '" + std::string(expr.qualifier) + "'", static_cast<size_t>(expr.qualifier.data() - select.source.data()));
+    };
+
+    // An unqualified column belongs to the only table, or to the one table whose statistics
+    // know the column; -1 if that is ambiguous
+    auto resolveUnqualified = [&](const AstExpr& expr) -> int {
+        if (query.fromTables.size() == 1) {
+            return 0;
+        }
+        int found = -1;
+        for (size_t i = 0; statistics != nullptr && i < query.fromTables.size(); ++i) {
+            if (statistics->hasColumn(query.fromTables[i].name, std::string(expr.name))) {
+                if (found >= 0) {
+                    return -1;
+                }
+                found = static_cast<int>(i);
+            }
+        }
+        return found;
+    };
+
+    // The one table every column of expr belongs to: -1 if none, -2 if several or unknown
+    std::function<void(const AstExpr&, int&)> collectTable = [&](const AstExpr& expr, int& table) {
+        int found = -1;
+        if (expr.kind == AstExpr::Kind::Column) {
+            found = expr.qualifier.empty() ? resolveUnqualified(expr) : resolve(expr);
+            found = found < 0 ? -2 : found;
+        } else if (expr.kind == AstExpr::Kind::Star) {
+            found = -2;
+        }
+        for (const auto& arg : expr.args) {
+            collectTable(arg, table);
+        }
+        if (found != -1 && table != -2) {
+            table = table == -1 || table == found ? found : -2;
+        }
+    };
+
+    // Record the columns expr uses on their tables; a column whose table is unknown may belong
+    // to any of them
+    std::function<void(const AstExpr&)> collectColumns = [&](const AstExpr& expr) {
+        if (expr.kind == AstExpr::Kind::Column) {
+            int table = expr.qualifier.empty() ? resolveUnqualified(expr) : findQualifier(expr.qualifier);
+            for (size_t i = 0; i < query.fromTables.size(); ++i) {
+                auto& columns = query.fromTables[i].columns;
+                if ((table < 0 || table == static_cast<int>(i)) && std::find(columns.begin(), columns.end(), expr.name) == columns.end()) {
+                    columns.emplace_back(expr.name);
+                }
+            }
+        }
+        for (const auto& arg : expr.args) {
+            collectColumns(arg);
+        }
+    };
+    for (const auto& item : select.items) {
+        if (item.expr.kind == AstExpr::Kind::Star) {
+            int table = item.expr.qualifier.empty() ? -1 : findQualifier(item.expr.qualifier);
+            for (size_t i = 0; i < query.fromTables.size(); ++i) {
+                query.fromTables[i].allColumns |= table < 0 || table == static_cast<int>(i);
+            }
+        }
+        collectColumns(item.expr);
+    }
+    for (const auto& condition : select.conditions) {
+        collectColumns(condition.left);
+        collectColumns(condition.right);
+        for (const auto& value : condition.values) {
+            collectColumns(value);
+        }
+    }
+    for (const auto& key : select.groupBy) {
+        collectColumns(key);
+    }
+    for (const auto& key : select.orderBy) {
+        collectColumns(key.expr);
+    }
+
+    for (const auto& condition : select.conditions) {
+        int left = resolve(condition.left);
+        int right = resolve(condition.right);
+        if (condition.kind == AstPredicate::Kind::Compare && condition.op == "=" && left >= 0 && right >= 0 && left != right) {
+            query.joinConditions.push_back({sqlName(condition.left.qualifier) + "." + sqlName(condition.left.name),
+                                            sqlName(condition.right.qualifier) + "." + sqlName(condition.right.name)});
+            continue;
+        }
+        query.filterConditions.push_back(std::string(condition.source));
+
+        int table = -1;
+        collectTable(condition.left, table);
+        if (condition.kind == AstPredicate::Kind::Compare || condition.kind == AstPredicate::Kind::Like) {
+            collectTable(condition.right, table);
+        }
+        for (const auto& value : condition.values) {
+            collectTable(value, table);
+        }
+        if (table >= 0) {
+            const AstExpr& subject = predicateSubject(condition);
+            const ColumnStats* column = statistics == nullptr || subject.kind != AstExpr::Kind::Column
+                ? nullptr : statistics->findColumn(query.fromTables[table].name, std::string(subject.name));
+            TableFilter filter = {table, static_cast<int>(query.filterConditions.size()) - 1,
+                                  estimatePredicateSelectivity(condition, column), std::string(), false};
+            if (subject.kind == AstExpr::Kind::Column && isSargable(condition)) {
+                filter.column = std::string(subject.name);
+                filter.equality = condition.kind == AstPredicate::Kind::In || condition.kind == AstPredicate::Kind::IsNull ||
+                                  (condition.kind == AstPredicate::Kind::Compare && condition.op == "=");
+            }
+            query.tableFilters.push_back(std::move(filter));
+        }
+    }
+
+    // GROUP BY and ORDER BY columns are qualified the way join conditions are, so they can be
+    // matched with join keys and indexes; an unqualified name that is a select item's alias stays
+    // as written. Returns whether expr is a column of a FROM table.
+    auto qualify = [&](const AstExpr& expr, std::string& expression) {
+        int table = -1;
+        if (expr.kind == AstExpr::Kind::Column) {
+            bool alias = expr.qualifier.empty() && std::any_of(select.items.begin(), select.items.end(),
+                                                               [&](const AstSelectItem& item) { return item.alias == expr.name; });
+            table = alias ? -1 : expr.qualifier.empty() ? resolveUnqualified(expr) : resolve(expr);
+        }
+        if (table < 0) {
+            expression = std::string(expr.source);
+            return false;
+        }
+        const Table& owner = query.fromTables[table];
+        expression = (owner.alias.empty() ? owner.name : owner.alias) + "." + sqlName(expr.name);
+        return true;
+    };
+    for (const auto& key : select.groupBy) {
+        query.groupBy.emplace_back();
+        qualify(key, query.groupBy.back());
+    }
+    for (const auto& key : select.orderBy) {
+        OrderKey order;
+        order.descending = key.descending;
+        order.column = qualify(key.expr, order.expression);
+        query.orderBy.push_back(std::move(order));
+    }
+    if (!select.limit.empty()) {
+        auto parsed = std::from_chars(select.limit.data(), select.limit.data() + select.limit.size(), query.limit);
+        if (parsed.ec != std::errc()) {
+            throw ParseError("row count out of range", static_cast<size_t>(select.limit.data() - select.source.data()));
+        }
+    }
+    return query;
+}
+
+Query parseQuery(std::string_view queryStr, const StatisticsCatalog* statistics) {
+    OPTIMIZER_PHASE(Parse);
+    ArenaFrame frame(threadArena());
+    return bindQuery(Parser(queryStr, &frame.arena()).parseSelect(), statistics);
+}
+
+double CostModel::total(const Cost& cost) const {
+    return weights_.cpu * cost.cpu + weights_.memory * cost.memory + weights_.io * cost.io + weights_.network * cost.network;
+}
+
+double CostModel::pages(double rows) const {
+    return std::ceil(rows / weights_.rowsPerPage);
+}
+
+Cost CostModel::scan(double rows) const {
+    Cost cost;
+    cost.cpu = rows;
+    cost.io = pages(rows);
+    return cost;
+}
+
+Cost CostModel::indexScan(const IndexAccess& index, double matchedRows) const {
+    Cost cost = indexRange(index, matchedRows);
+    cost.cpu += std::log2(std::max(index.tableRows, 2.0));
+    cost.io += indexHeight(index);
+    return cost;
+}
+
+Cost CostModel::materialize(double rows) const {
+    Cost cost;
+    cost.cpu = rows;
+    cost.io = pages(rows);
+    return cost;
+}
+
+Cost CostModel::sort(double rows, double limit) const {
+    Cost cost;
+    double kept = std::min(rows, limit);
+    cost.cpu = rows * std::log2(std::max(kept, 2.0));
+    cost.memory = std::min(kept, weights_.workMemoryRows);
+    if (kept > weights_.workMemoryRows) {
+        cost.io = 2 * pages(rows); // External sort: write runs, read them back to merge
+    }
+    return cost;
+}
+
+Cost CostModel::repartition(double rows) const {
+    Cost cost;
+    cost.io = 2 * pages(rows);
+    return cost;
+}
+
+bool CostModel::fitsInMemory(double rows) const {
+    return rows <= weights_.workMemoryRows;
+}
+
+bool CostModel::distributed() const {
+    return weights_.nodes > 1;
+}
+
+Cost CostModel::shuffle(double rows) const {
+    return transfer(rows * (weights_.nodes - 1) / weights_.nodes);
+}
+
+Cost CostModel::broadcast(double rows) const {
+    return transfer(rows * (weights_.nodes - 1));
+}
+
+Cost CostModel::gather(double rows) const {
+    return transfer(rows * (weights_.nodes - 1) / weights_.nodes);
+}
+
+JoinChoice CostModel::nestedLoopJoin(double leftRows, double rightRows, double outputRows) const {
+    JoinChoice choice;
+    choice.algorithm = JoinAlgorithm::NestedLoop;
+    choice.cost.cpu = leftRows * rightRows + outputRows;
+    if (rightRows <= weights_.workMemoryRows) {
+        choice.memory = rightRows;
+    } else {
+        // Block nested loop: the right input is rescanned once per memory-sized block of the left
+        choice.memory = weights_.workMemoryRows;
+        choice.cost.io = pages(rightRows) * std::ceil(leftRows / weights_.workMemoryRows);
+    }
+    return finish(choice);
+}
+
+JoinChoice CostModel::hashJoin(double buildRows, double probeRows, double outputRows, bool buildLeft, bool buildPartitioned,
+                               bool probePartitioned) const {
+    JoinChoice choice;
+    choice.algorithm = JoinAlgorithm::Hash;
+    choice.buildLeft = buildLeft;
+    choice.cost.cpu = 2 * buildRows + probeRows + outputRows;
+    Cost enforcers;
+    if (fitsInMemory(buildRows)) {
+        choice.memory = buildRows;
+    } else {
+        choice.memory = weights_.workMemoryRows;
+        if (!buildPartitioned) {
+            enforcers += repartition(buildRows);
+            choice.enforcers |= buildLeft ? JoinChoice::kPartitionLeft : JoinChoice::kPartitionRight;
+        }
+        if (!probePartitioned) {
+            enforcers += repartition(probeRows);
+            choice.enforcers |= buildLeft ? JoinChoice::kPartitionRight : JoinChoice::kPartitionLeft;
+        }
+    }
+    return finish(choice, enforcers);
+}
+
+JoinChoice CostModel::sortMergeJoin(double leftRows, double rightRows, double outputRows, bool leftSorted, bool rightSorted) const {
+    JoinChoice choice;
+    choice.algorithm = JoinAlgorithm::SortMerge;
+    choice.cost.cpu = leftRows + rightRows + outputRows;
+    Cost enforcers;
+    if (!leftSorted) {
+        enforcers += sort(leftRows);
+        choice.enforcers |= JoinChoice::kSortLeft;
+    }
+    if (!rightSorted) {
+        enforcers += sort(rightRows);
+        choice.enforcers |= JoinChoice::kSortRight;
+    }
+    return finish(choice, enforcers);
+}
+
+JoinChoice CostModel::indexNestedLoopJoin(double leftRows, const IndexAccess& index, double matchesPerProbe, double outputRows) const {
+    JoinChoice choice;
+    choice.algorithm = JoinAlgorithm::IndexNestedLoop;
+    Cost probe = indexRange(index, matchesPerProbe);
+    choice.cost.cpu = leftRows * (std::log2(std::max(index.tableRows, 2.0)) + probe.cpu) + outputRows;
+    choice.cost.io = indexHeight(index) + leftRows * probe.io;
+    return finish(choice);
+}
+
+JoinChoice CostModel::chooseJoin(double leftRows, double rightRows, double outputRows, bool hasCondition) const {
+    JoinChoice best = nestedLoopJoin(leftRows, rightRows, outputRows);
+    if (!hasCondition) {
+        return best;
+    }
+    for (const JoinChoice& candidate : {hashJoin(rightRows, leftRows, outputRows, false),
+                                        hashJoin(leftRows, rightRows, outputRows, true),
+                                        sortMergeJoin(leftRows, rightRows, outputRows)}) {
+        if (candidate.total < best.total) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+double CostModel::indexPages(const IndexAccess& index) const {
+    return index.pages > 0 ? index.pages : std::max(1.0, std::ceil(index.tableRows / weights_.indexEntriesPerPage));
+}
+
+double CostModel::indexHeight(const IndexAccess& index) const {
+    return std::ceil(std::log(indexPages(index)) / std::log(weights_.indexEntriesPerPage));
+}
+
+Cost CostModel::indexRange(const IndexAccess& index, double matchedRows) const {
+    Cost cost;
+    cost.cpu = matchedRows;
+    cost.io = std::ceil(indexPages(index) * std::min(1.0, matchedRows / std::max(index.tableRows, 1.0)));
+    if (!index.covering) {
+        cost.io += index.clustered ? pages(matchedRows) : std::min(matchedRows, pages(index.tableRows));
+    }
+    return cost;
+}
+
+Cost CostModel::transfer(double sentRows) const {
+    Cost cost;
+    cost.cpu = 2 * sentRows;
+    cost.network = sentRows > 0 ? pages(sentRows) : 0;
+    return cost;
+}
+
+JoinChoice CostModel::finish(JoinChoice& choice, const Cost& enforcers) const {
+    choice.cost.memory = choice.memory;
+    choice.cost += enforcers;
+    choice.total = total(choice.cost);
+    return choice;
+}
+
+const char* joinAlgorithmName(JoinAlgorithm algorithm) {
+    switch (algorithm) {
+    case JoinAlgorithm::NestedLoop:
+        return "NESTED_LOOP";
+    case JoinAlgorithm::Hash:
+        return "HASH_JOIN";
+    case JoinAlgorithm::SortMerge:
+        return "MERGE_JOIN";
+    case JoinAlgorithm::IndexNestedLoop:
+        return "INDEX_NESTED_LOOP";
+    }
+    return "";
+}
+
+double estimateJoinCost(const Table& t1, const Table& t2) {
+    // Simplified cost estimation: product of row counts
+    return static_cast<double>(t1.rows) * t2.rows;
+}
+
+double estimateJoinRows(double leftRows, double rightRows, double selectivity) {
+    return std::max(1.0, leftRows * rightRows * selectivity);
+}
+
+double filteredRows(const Query& query, size_t table) {
+    double rows = static_cast<double>(query.fromTables[table].rows);
+    double selectivity = 1;
+    bool filtered = false;
+    for (const auto& filter : query.tableFilters) {
+        if (filter.table == static_cast<int>(table)) {
+            selectivity *= filter.selectivity;
+            filtered = true;
+        }
+    }
+    return filtered ? std::max(1.0, rows * selectivity) : rows;
+}
+
+Plan optimizeQueryStringKeyed(const Query& query) {
+    std::unordered_map<std::string, Table> tableMap;
+    for (const auto& table : query.fromTables) {
+        tableMap[table.name] = table;
+    }
+
+    std::unordered_map<std::string, Plan> dp;
+    for (const auto& table : query.fromTables) {
+        dp[table.name] = {{table}, {}, static_cast<double>(table.rows), {}};
+    }
+
+    for (size_t i = 1; i < query.fromTables.size(); ++i) {
+        std::unordered_map<std::string, Plan> newDp;
+        for (const auto& entry : dp) {
+            const auto& plan = entry.second;
+            for (const auto& table : query.fromTables) {
+                if (std::find_if(plan.tables.begin(), plan.tables.end(), [&](const Table& t) { return t.name == table.name; }) != plan.tables.end()) {
+                    continue;
+                }
+
+                std::vector<Table> newTables;
+                newTables.reserve(plan.tables.size() + 1);
+                newTables = plan.tables;
+                newTables.push_back(table);
+                std::vector<std::pair<std::string, std::string>> newJoins = plan.joins;
+                for (const auto& join : query.joinConditions) {
+                    if ((join.first.find(table.name) != std::string::npos && join.second.find(plan.tables[0].name) != std::string::npos) ||
+                        (join.second.find(table.name) != std::string::npos && join.first.find(plan.tables[0].name) != std::string::npos)) {
+                        newJoins.push_back(join);
+                    }
+                }
+
+                double newCost = plan.cost + estimateJoinCost(plan.tables[0], table);
+                std::string newKey;
+                newKey.reserve(plan.tables.size() * 16);
+                for (const auto& t : newTables) {
+                    newKey += t.name;
+                    newKey += ',';
+                }
+
+                auto existing = newDp.find(newKey);
+                if (existing == newDp.end()) {
+                    newDp.emplace(std::move(newKey), Plan{std::move(newTables), std::move(newJoins), newCost, {}});
+                } else if (existing->second.cost > newCost) {
+                    existing->second = {std::move(newTables), std::move(newJoins), newCost, {}};
+                }
+            }
+        }
+        dp = std::move(newDp);
+    }
+
+    Plan bestPlan = { {}, {}, std::numeric_limits<double>::infinity(), {} };
+    for (const auto& entry : dp) {
+        if (entry.second.cost < bestPlan.cost) {
+            bestPlan = entry.second;
+        }
+    }
+
+    return bestPlan;
+}
+
+// Largest query the bitmask enumerators take: the 2^n memo is allocated up front and the 3^n
+// splits of an 18-table query already take minutes, so larger queries need DPccp or a budget
+const size_t kMaxDenseMemoTables = 18;
+
+// Physical properties
+const int16_t kReplicated = -2; // Distribution of rows every node of the cluster holds all of
+
+// One plan of a relation set, by how it splits the set and which plans of the two inputs it joins
+struct MemoPlan {
+    double cost = std::numeric_limits<double>::infinity(); // Weighted total of components
+    Cost components;
+    RelSet left = 0;  // Relations of the left input (0 for a base table or a shared result)
+    RelSet right = 0; // Relations of the right input
+    JoinAlgorithm algorithm = JoinAlgorithm::NestedLoop;
+    bool buildLeft = false;
+    int16_t index = -1; // Base table: the index it is read through; index nested loop: the one probed; shared result: its number
+    PhysicalProperties properties;
+    uint8_t leftPlan = 0;  // Plan of the left input it joins: 0 for the input's best, i for its alternatives[i - 1]
+    uint8_t rightPlan = 0;
+    uint8_t enforcers = 0; // JoinChoice enforcers on the inputs
+    int16_t key = -1;      // Key class the enforcers sort or partition on
+    int16_t shuffle = -1;  // Distribution the shuffles among them move the inputs into
+    double memory = 0;
+};
+
+const size_t kMaxPlanAlternatives = 3;
+
+// The Pareto set of a relation set: its cheapest plan, and costlier plans kept for properties the
+// cheapest lacks. Most sets never keep one, so the alternatives are allocated with the first,
+// keeping the dense memos small. They come from the memo's memory resource and are released
+// with it, so entries stay trivially destructible.
+struct MemoEntry : MemoPlan {
+    double rows = 0;
+    uint8_t alternativeCount = 0;
+    MemoPlan* alternatives = nullptr; // kMaxPlanAlternatives slots once any is kept
+};
+static_assert(std::is_trivially_destructible<MemoEntry>::value, "memos are released with their arena");
+
+// Memo keyed by relation set: a dense array while 2^n entries are affordable, a hash map beyond
+class SubsetMemo {
+public:
+    static constexpr size_t kMaxDenseTables = 16;
+
+    explicit SubsetMemo(size_t tables, std::pmr::memory_resource* arena = std::pmr::get_default_resource())
+        : dense_(arena), sparse_(arena) {
+        if (tables <= kMaxDenseTables) {
+            dense_.resize(size_t(1) << tables);
+        }
+    }
+
+    MemoEntry& operator[](RelSet set) {
+        return dense_.empty() ? sparse_[set] : dense_[set];
+    }
+
+    const MemoEntry& at(RelSet set) const {
+        return dense_.empty() ? sparse_.at(set) : dense_[set];
+    }
+
+    size_t entries() const {
+        if (dense_.empty()) {
+            return sparse_.size();
+        }
+        return std::count_if(dense_.begin(), dense_.end(), [](const MemoEntry& entry) { return !std::isinf(entry.cost); });
+    }
+
+    // Approximate footprint, counting a hash node as its key/value pair plus two pointers
+    size_t bytes() const {
+        return dense_.size() * sizeof(MemoEntry) + sparse_.size() * (sizeof(std::pair<RelSet, MemoEntry>) + 2 * sizeof(void*));
+    }
+
+    std::pmr::memory_resource* resource() const {
+        return dense_.get_allocator().resource();
+    }
+
+private:
+    std::pmr::vector<MemoEntry> dense_;
+    std::pmr::unordered_map<RelSet, MemoEntry> sparse_;
+};
+
+// The memory resource a memo's entries allocate their alternatives from
+inline std::pmr::memory_resource* memoResource(const std::pmr::vector<MemoEntry>& memo) {
+    return memo.get_allocator().resource();
+}
+
+inline std::pmr::memory_resource* memoResource(const SubsetMemo& memo) {
+    return memo.resource();
+}
+
+inline std::pmr::memory_resource* memoResource(const std::pmr::unordered_map<RelSet, MemoEntry>& memo) {
+    return memo.get_allocator().resource();
+}
+
+// Qualifier of a column reference ("table.column" -> "table"), as a view into it
+std::string_view qualifierOf(std::string_view columnRef) {
+    std::string_view qualifier = columnRef.substr(0, columnRef.find('.'));
+    size_t first = qualifier.find_first_not_of(' ');
+    if (first == std::string_view::npos) {
+        return qualifier;
+    }
+    return qualifier.substr(first, qualifier.find_last_not_of(' ') - first + 1);
+}
+
+// Map a qualified column reference ("table.column") to the index of its table, or -1
+int tableIndexOf(const Query& query, const std::string& columnRef) {
+    std::string_view qualifier = qualifierOf(columnRef);
+    for (size_t i = 0; i < query.fromTables.size(); ++i) {
+        const Table& table = query.fromTables[i];
+        if ((table.alias.empty() ? table.name : table.alias) == qualifier) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+// Column equivalence classes
+// Union-find over the column references the join conditions equate: a.x = b.x AND b.x = c.x
+// puts a.x, b.x and c.x in one class. Columns are numbered in order of first appearance; the
+// views must outlive the classes.
+class ColumnEquivalence {
+public:
+    explicit ColumnEquivalence(std::pmr::memory_resource* arena = std::pmr::get_default_resource())
+        : ids_(arena), columns_(arena), parent_(arena) {}
+
+    int add(std::string_view column) {
+        auto found = ids_.find(column);
+        if (found != ids_.end()) {
+            return found->second;
+        }
+        int id = static_cast<int>(columns_.size());
+        ids_.emplace(column, id);
+        columns_.push_back(column);
+        parent_.push_back(id);
+        return id;
+    }
+
+    void merge(std::string_view first, std::string_view second) {
+        int a = find(add(first));
+        int b = find(add(second));
+        parent_[std::max(a, b)] = std::min(a, b);
+    }
+
+    // Representative of a column's class: its first-numbered member
+    int find(int id) {
+        while (parent_[id] != id) {
+            parent_[id] = parent_[parent_[id]];
+            id = parent_[id];
+        }
+        return id;
+    }
+
+    // Number of a column, -1 if it was never added
+    int idOf(std::string_view column) const {
+        auto found = ids_.find(column);
+        return found == ids_.end() ? -1 : found->second;
+    }
+
+    size_t size() const { return columns_.size(); }
+    std::string_view column(int id) const { return columns_[id]; }
+
+private:
+    std::pmr::unordered_map<std::string_view, int> ids_;
+    std::pmr::vector<std::string_view> columns_;
+    std::pmr::vector<int> parent_;
+};
+
+// Column name of a qualified column reference ("table.column")
+std::string columnNameOf(const std::string& columnRef) {
+    size_t dotPos = columnRef.find('.');
+    return trim(dotPos == std::string::npos ? columnRef : columnRef.substr(dotPos + 1));
+}
+
+// What each index of query.fromTables[table] offers its scan. Filters narrow an index scan when
+// they restrict a prefix of its key: equalities on the leading columns, then ranges on at most
+// one more.
+std::vector<IndexAccess> indexAccesses(const Query& query, size_t table) {
+    const Table& base = query.fromTables[table];
+    std::vector<IndexAccess> result;
+    result.reserve(base.indexes.size());
+    for (const auto& index : base.indexes) {
+        IndexAccess access;
+        access.tableRows = static_cast<double>(base.rows);
+        access.pages = index.pages;
+        access.clustered = index.clustered;
+        access.covering = !base.allColumns && std::all_of(base.columns.begin(), base.columns.end(), [&](const std::string& column) {
+            return std::find(index.columns.begin(), index.columns.end(), column) != index.columns.end();
+        });
+        for (const auto& column : index.columns) {
+            bool equality = false;
+            for (const auto& filter : query.tableFilters) {
+                if (filter.table == static_cast<int>(table) && filter.column == column) {
+                    access.selectivity *= filter.selectivity;
+                    access.narrowed = true;
+                    equality |= filter.equality;
+                }
+            }
+            if (!equality) {
+                break;
+            }
+        }
+        result.push_back(access);
+    }
+    return result;
+}
+
+// Index of the table whose leading key column is column, preferring unique ones; -1 if none
+int leadingIndex(const Table& table, const std::string& column) {
+    int found = -1;
+    for (size_t i = 0; i < table.indexes.size(); ++i) {
+        const IndexDefinition& index = table.indexes[i];
+        if (index.columns[0] == column && (found < 0 || (index.unique && !table.indexes[found].unique))) {
+            found = static_cast<int>(i);
+        }
+    }
+    return found;
+}
+
+int JoinGraph::descendingOrder(int keyClass) const {
+    return requiredOrder >= 0 && orders[requiredOrder].descending && orders[requiredOrder].keyClass == keyClass ? requiredOrder : -1;
+}
+
+PhysicalProperties JoinGraph::interesting(RelSet set, PhysicalProperties properties) const {
+    if (properties.order >= 0 && properties.order != requiredOrder &&
+        (orders[properties.order].descending || !(keyClasses[orders[properties.order].keyClass] & ~set))) {
+        properties.order = -1;
+    }
+    if (properties.partition >= 0 && !(keyClasses[properties.partition] & ~set)) {
+        properties.partition = -1;
+    }
+    if (properties.distribution >= 0 && !(keyClasses[distributions[properties.distribution].keyClass] & ~set)) {
+        properties.distribution = -1;
+    }
+    return properties;
+}
+
+bool JoinGraph::hasInterestingProperties(RelSet set) const {
+    if (requiredOrder >= 0 && (keyClasses[orders[requiredOrder].keyClass] & set)) {
+        return true;
+    }
+    for (RelSet relations : keyClasses) {
+        if ((relations & set) && (relations & ~set)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void JoinGraph::addEdge(int first, int second, int condition, double selectivity, int equivalence) {
+    edges.push_back({first, second, condition, selectivity, equivalence});
+    conditionNeighbors[first] |= relBit(second);
+    conditionNeighbors[second] |= relBit(first);
+    conditionEdges[first].push_back(static_cast<int>(edges.size()) - 1);
+    conditionEdges[second].push_back(static_cast<int>(edges.size()) - 1);
+}
+
+RelSet JoinGraph::neighborhood(RelSet set, RelSet excluded) const {
+    RelSet result = 0;
+    for (RelSet rest = set; rest != 0; rest &= rest - 1) {
+        result |= conditionNeighbors[lowestRel(rest)];
+    }
+    return result & ~set & ~excluded;
+}
+
+bool JoinGraph::wholeComponents(RelSet set) const {
+    for (RelSet component : components) {
+        if ((component & set) && (component & ~set)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JoinGraph::joinable(RelSet left, RelSet right, bool bushy) const {
+    return hasCondition(left, right) || (wholeComponents(left) && (wholeComponents(right) || (!bushy && isSingleRel(right))));
+}
+
+bool JoinGraph::hasCondition(RelSet left, RelSet right) const {
+    for (RelSet rest = left; rest != 0; rest &= rest - 1) {
+        if (conditionNeighbors[lowestRel(rest)] & right) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double JoinGraph::selectivityBetween(RelSet left, RelSet right) const {
+    // Like the key classes, the edges are looked up from the smaller side
+    RelSet from = __builtin_popcountll(left) <= __builtin_popcountll(right) ? left : right;
+    RelSet to = from == left ? right : left;
+    double selectivity = 1;
+    uint64_t classes = 0; // Equivalence classes below 64 met so far
+    double classSelectivity[64];
+    for (RelSet rest = from; rest != 0; rest &= rest - 1) {
+        int rel = lowestRel(rest);
+        if (!(conditionNeighbors[rel] & to)) {
+            continue;
+        }
+        for (int index : conditionEdges[rel]) {
+            const JoinEdge& edge = edges[index];
+            if (!(relBit(edge.first == rel ? edge.second : edge.first) & to)) {
+                continue;
+            }
+            if (edge.equivalence < 0 || edge.equivalence >= 64) {
+                selectivity *= edge.selectivity;
+            } else if (!(classes & relBit(edge.equivalence))) {
+                classes |= relBit(edge.equivalence);
+                classSelectivity[edge.equivalence] = edge.selectivity;
+            } else {
+                classSelectivity[edge.equivalence] = std::min(classSelectivity[edge.equivalence], edge.selectivity);
+            }
+        }
+    }
+    for (; classes != 0; classes &= classes - 1) {
+        selectivity *= classSelectivity[lowestRel(classes)];
+    }
+    return selectivity;
+}
+
+size_t JoinGraph::keyClassesBetween(RelSet left, RelSet right, int* keys, size_t max) const {
+    // The pairs are symmetric, so they are looked up from the smaller side
+    RelSet from = __builtin_popcountll(left) <= __builtin_popcountll(right) ? left : right;
+    RelSet to = from == left ? right : left;
+    uint64_t classes = 0;
+    for (RelSet rest = from; rest != 0; rest &= rest - 1) {
+        int rel = lowestRel(rest);
+        for (RelSet others = conditionNeighbors[rel] & to; others != 0; others &= others - 1) {
+            classes |= pairKeyClasses[rel * size + lowestRel(others)];
+        }
+    }
+    size_t count = 0;
+    for (; classes != 0 && count < max; classes &= classes - 1) {
+        keys[count++] = lowestRel(classes);
+    }
+    if (keyClasses.size() <= 64) {
+        return count;
+    }
+    // Key classes from 64 up are looked for edge by edge
+    for (RelSet rest = left; rest != 0; rest &= rest - 1) {
+        int rel = lowestRel(rest);
+        if (!(conditionNeighbors[rel] & right)) {
+            continue;
+        }
+        for (int index : conditionEdges[rel]) {
+            const JoinEdge& edge = edges[index];
+            if (edge.keyClass >= 64 && (relBit(edge.first == rel ? edge.second : edge.first) & right) && count < max &&
+                std::find(keys, keys + count, edge.keyClass) == keys + count) {
+                keys[count++] = edge.keyClass;
+            }
+        }
+    }
+    return count;
+}
+
+uint64_t JoinGraph::feedbackSignature(RelSet set) const {
+    uint64_t signature = 0;
+    for (RelSet rest = set; rest != 0; rest &= rest - 1) {
+        int rel = lowestRel(rest);
+        signature += relationSignatures[rel];
+        for (int index : conditionEdges[rel]) {
+            const JoinEdge& edge = edges[index];
+            int other = edge.first == rel ? edge.second : edge.first;
+            if (other > rel && (relBit(other) & set)) {
+                signature += edgeSignatures[index];
+            }
+        }
+    }
+    return signature;
+}
+
+double JoinGraph::feedbackCorrection(RelSet set) const {
+    if (!feedback) {
+        return 1;
+    }
+    auto found = feedback->find(feedbackSignature(set));
+    return found == feedback->end() ? 1 : found->second;
+}
+
+std::vector<int> JoinGraph::conditionsBetween(RelSet left, RelSet right) const {
+    std::vector<int> result;
+    for (const auto& edge : edges) {
+        if ((relBit(edge.first) & left && relBit(edge.second) & right) ||
+            (relBit(edge.second) & left && relBit(edge.first) & right)) {
+            result.push_back(edge.condition);
+        }
+    }
+    return result;
+}
+
+JoinGraph buildJoinGraph(const Query& query, const StatisticsCatalog* statistics = nullptr) {
+    JoinGraph graph;
+    graph.size = query.fromTables.size();
+    if (graph.size > 64) {
+        throw std::length_error("join graph supports at most 64 tables");
+    }
+    graph.conditionNeighbors.assign(graph.size, 0);
+    graph.conditionEdges.assign(graph.size, {});
+    graph.edges.reserve(query.joinConditions.size());
+    graph.indexes.reserve(graph.size);
+    for (size_t i = 0; i < graph.size; ++i) {
+        graph.indexes.push_back(indexAccesses(query, i));
+    }
+
+    // Both sides of every condition are resolved against interned table qualifiers
+    ArenaFrame frame(threadArena());
+    NameInterner names(&frame.arena());
+    std::pmr::vector<const char*> qualifiers(&frame.arena());
+    qualifiers.reserve(graph.size);
+    for (const auto& table : query.fromTables) {
+        qualifiers.push_back(names.intern(table.alias.empty() ? table.name : table.alias).data());
+    }
+    auto indexOf = [&](const std::string& columnRef) {
+        const char* qualifier = names.find(qualifierOf(columnRef)).data();
+        auto found = std::find(qualifiers.begin(), qualifiers.end(), qualifier);
+        return qualifier == nullptr || found == qualifiers.end() ? -1 : static_cast<int>(found - qualifiers.begin());
+    };
+
+    // Number the equivalence classes that more than one condition falls into
+    ColumnEquivalence equivalence(&frame.arena());
+    for (const auto& join : query.joinConditions) {
+        equivalence.merge(join.first, join.second);
+    }
+    std::pmr::vector<int> classConditions(equivalence.size(), 0, &frame.arena());
+    for (const auto& join : query.joinConditions) {
+        ++classConditions[equivalence.find(equivalence.add(join.first))];
+    }
+    std::pmr::vector<int> classIds(equivalence.size(), -1, &frame.arena());
+    int classCount = 0;
+    for (size_t i = 0; i < classConditions.size(); ++i) {
+        if (classConditions[i] > 1) {
+            classIds[i] = classCount++;
+        }
+    }
+
+    // Key classes are numbered in order of first appearance, the ORDER BY column's last unless a
+    // join condition equates it with others. Grouping does not keep the order of its input, so
+    // under a GROUP BY no join order serves the ORDER BY.
+    const OrderKey* orderKey = query.orderBy.size() == 1 && query.orderBy[0].column && query.groupBy.empty() ? &query.orderBy[0] : nullptr;
+    if (orderKey != nullptr) {
+        equivalence.add(orderKey->expression);
+    }
+    std::pmr::vector<int> keyIds(equivalence.size(), -1, &frame.arena());
+    for (size_t id = 0; id < equivalence.size(); ++id) {
+        int root = equivalence.find(static_cast<int>(id));
+        if (keyIds[root] < 0) {
+            keyIds[root] = static_cast<int>(graph.keyClasses.size());
+            graph.keyClasses.push_back(0);
+            graph.orders.push_back({keyIds[root], false});
+        }
+        int table = indexOf(std::string(equivalence.column(static_cast<int>(id))));
+        if (table >= 0) {
+            graph.keyClasses[keyIds[root]] |= relBit(table);
+        }
+    }
+    // Past a join on a key class its order or partitioning is only of use to the ORDER BY or to
+    // joins with a third relation of the class
+    for (RelSet relations : graph.keyClasses) {
+        if (__builtin_popcountll(relations) > 2) {
+            graph.keyedRelations |= relations;
+        }
+    }
+    if (orderKey != nullptr) {
+        int keyClass = keyIds[equivalence.find(equivalence.idOf(orderKey->expression))];
+        graph.keyedRelations |= graph.keyClasses[keyClass];
+        graph.requiredOrder = keyClass;
+        if (orderKey->descending) {
+            graph.requiredOrder = static_cast<int>(graph.orders.size());
+            graph.orders.push_back({keyClass, true});
+        }
+    }
+    graph.indexKeyClasses.resize(graph.size);
+    for (size_t i = 0; i < graph.size; ++i) {
+        const Table& table = query.fromTables[i];
+        for (const auto& index : table.indexes) {
+            int id = equivalence.idOf((table.alias.empty() ? table.name : table.alias) + "." + sqlName(index.columns[0]));
+            graph.indexKeyClasses[i].push_back(id < 0 ? -1 : keyIds[equivalence.find(id)]);
+        }
+    }
+
+    // A table partitioned on a column of no key class is as good as spread: nothing joins it in place
+    graph.distributions.reserve(graph.keyClasses.size());
+    for (size_t k = 0; k < graph.keyClasses.size(); ++k) {
+        graph.distributions.push_back({static_cast<int>(k), PartitionScheme::Hash, 0, {}});
+    }
+    graph.relationDistributions.assign(graph.size, -1);
+    for (size_t i = 0; i < graph.size; ++i) {
+        const Table& table = query.fromTables[i];
+        const TablePartitioning& partitioning = table.partitioning;
+        if (partitioning.scheme == PartitionScheme::Replicated) {
+            graph.relationDistributions[i] = kReplicated;
+        }
+        if (partitioning.scheme != PartitionScheme::Hash && partitioning.scheme != PartitionScheme::Range) {
+            continue;
+        }
+        int id = equivalence.idOf((table.alias.empty() ? table.name : table.alias) + "." + sqlName(partitioning.column));
+        if (id < 0) {
+            continue;
+        }
+        Distribution distribution = {keyIds[equivalence.find(id)], partitioning.scheme, partitioning.nodes, partitioning.bounds};
+        auto found = std::find_if(graph.distributions.begin(), graph.distributions.end(), [&](const Distribution& other) {
+            return other.keyClass == distribution.keyClass && other.scheme == distribution.scheme && other.nodes == distribution.nodes &&
+                   other.bounds == distribution.bounds;
+        });
+        if (found == graph.distributions.end()) {
+            found = graph.distributions.insert(found, std::move(distribution));
+        }
+        graph.relationDistributions[i] = static_cast<int16_t>(found - graph.distributions.begin());
+    }
+
+    graph.pairKeyClasses.assign(graph.size * graph.size, 0);
+    for (size_t i = 0; i < query.joinConditions.size(); ++i) {
+        const auto& join = query.joinConditions[i];
+        int first = indexOf(join.first);
+        int second = indexOf(join.second);
+        if (first < 0 || second < 0 || first == second) {
+            continue; // Not a join between two tables of this query
+        }
+        const Table& firstTable = query.fromTables[first];
+        const Table& secondTable = query.fromTables[second];
+        const ColumnStats* firstStats = statistics == nullptr ? nullptr : statistics->findColumn(firstTable.name, columnNameOf(join.first));
+        const ColumnStats* secondStats = statistics == nullptr ? nullptr : statistics->findColumn(secondTable.name, columnNameOf(join.second));
+        double selectivity = estimateJoinSelectivity(firstStats, secondStats, firstTable.rows, secondTable.rows);
+        graph.addEdge(first, second, static_cast<int>(i), selectivity, classIds[equivalence.find(equivalence.add(join.first))]);
+        graph.edges.back().firstIndex = leadingIndex(firstTable, columnNameOf(join.first));
+        graph.edges.back().secondIndex = leadingIndex(secondTable, columnNameOf(join.second));
+        int keyClass = keyIds[equivalence.find(equivalence.add(join.first))];
+        graph.edges.back().keyClass = keyClass;
+        if (keyClass < 64) {
+            graph.pairKeyClasses[first * graph.size + second] |= relBit(keyClass);
+            graph.pairKeyClasses[second * graph.size + first] |= relBit(keyClass);
+        }
+    }
+
+    // Label connected components
+    RelSet seen = 0;
+    for (size_t i = 0; i < graph.size; ++i) {
+        if (seen & relBit(i)) {
+            continue;
+        }
+        RelSet component = relBit(i);
+        RelSet frontier = component;
+        while (frontier != 0) {
+            frontier = graph.neighborhood(frontier, component);
+            component |= frontier;
+        }
+        seen |= component;
+        graph.components.push_back(component);
+    }
+    return graph;
+}
+
+// A table filter as it enters a feedback signature: re-lexed with keywords upper-cased and
+// column qualifiers dropped, since every column of a table filter belongs to its one table
+std::string feedbackFilterText(std::string_view text) {
+    std::string normalized;
+    try {
+        Lexer lexer(text);
+        Token token = lexer.next();
+        while (token.kind != TokenKind::End) {
+            Token following = lexer.next();
+            bool qualifier = (token.kind == TokenKind::Identifier || token.kind == TokenKind::QuotedIdentifier) &&
+                             token.keyword == Keyword::None && following.kind == TokenKind::Symbol && following.text == ".";
+            if (qualifier) {
+                token = lexer.next();
+                continue;
+            }
+            if (token.keyword != Keyword::None) {
+                normalized += kKeywordNames[static_cast<int>(token.keyword)];
+            } else {
+                normalized.append(text.substr(token.offset, token.length));
+            }
+            normalized += ' ';
+            token = following;
+        }
+    } catch (const ParseError&) {
+        normalized.assign(text);
+    }
+    return normalized;
+}
+
+// What a relation of the query reads, whatever it is called: its table's name and its sorted,
+// normalized table filters
+std::string relationDescriptor(const Query& query, size_t table) {
+    std::vector<std::string> filters;
+    for (const auto& filter : query.tableFilters) {
+        if (filter.table == static_cast<int>(table)) {
+            filters.push_back(feedbackFilterText(query.filterConditions[filter.condition]));
+        }
+    }
+    std::sort(filters.begin(), filters.end());
+    std::string descriptor = "T " + query.fromTables[table].name;
+    for (const auto& filter : filters) {
+        descriptor += '|' + filter;
+    }
+    return descriptor;
+}
+
+// Give the graph the feedback signatures of its relations and condition edges, and the
+// corrections to look them up in. A relation's signature hashes its descriptor; a condition's
+// hashes its two sides as table.column, in sorted order. A relation set's signature is the sum of
+// those of its relations and the conditions among them, so it is computed incrementally and does
+// not depend on aliases or the order of anything in the query.
+void attachFeedback(JoinGraph& graph, const Query& query, std::shared_ptr<const FeedbackCorrections> corrections) {
+    graph.relationSignatures.assign(graph.size, 0);
+    for (size_t i = 0; i < graph.size; ++i) {
+        graph.relationSignatures[i] = hashValue(relationDescriptor(query, i));
+    }
+    graph.edgeSignatures.assign(graph.edges.size(), 0);
+    for (size_t i = 0; i < graph.edges.size(); ++i) {
+        const JoinEdge& edge = graph.edges[i];
+        const auto& join = query.joinConditions[edge.condition];
+        std::string first = query.fromTables[edge.first].name + '.' + columnNameOf(join.first);
+        std::string second = query.fromTables[edge.second].name + '.' + columnNameOf(join.second);
+        graph.edgeSignatures[i] = hashValue("J " + std::min(first, second) + '=' + std::max(first, second));
+    }
+    graph.feedback = std::move(corrections);
+}
+
+// Rows of a base table after its filters, and of the join of left and right, each corrected by
+// the feedback for the resulting relation set
+double correctedBaseRows(const Query& query, const JoinGraph& graph, size_t table) {
+    return filteredRows(query, table) * graph.feedbackCorrection(relBit(table));
+}
+
+double correctedJoinRows(const JoinGraph& graph, RelSet left, RelSet right, double leftRows, double rightRows) {
+    double rows = estimateJoinRows(leftRows, rightRows, graph.selectivityBetween(left, right));
+    return graph.feedback ? std::max(1.0, rows * graph.feedbackCorrection(left | right)) : rows;
+}
+
+// Query rewrite
+// Rule-based rewrites of a bound query, run before enumeration:
+// - Joins the declared constraints prove redundant are removed. A table joined only on one key
+//   column, whose equivalence class also holds a foreign key to that key (or the same key of
+//   another instance of the table), matches exactly one row per row of that other side whose
+//   foreign key is not NULL. When none of its columns is referenced anywhere else, dropping it
+//   changes nothing but that the foreign key's NULLs are no longer rejected, so the rewrite
+//   filters them out itself.
+// - Every pair of columns of different tables in one equivalence class gets a join condition,
+//   so the enumerator can join a and c directly on the a.x = c.x implied by a.x = b.x AND
+//   b.x = c.x. Classes of more than kMaxInferredClassColumns columns are left alone: their
+//   implied conditions would turn a chain into a clique the exact enumerators cannot afford.
+constexpr size_t kMaxInferredClassColumns = 10;
+
+// Whether text may reference a column of query.fromTables[table]: through the table's
+// qualifier, a bare *, or an unqualified name the table's statistics do not rule out
+bool mayReferenceTable(const Query& query, size_t table, std::string_view text, const StatisticsCatalog* catalog) {
+    const Table& candidate = query.fromTables[table];
+    const std::string& qualifier = candidate.alias.empty() ? candidate.name : candidate.alias;
+    std::vector<Token> tokens;
+    try {
+        Lexer lexer(text);
+        for (Token token = lexer.next(); token.kind != TokenKind::End; token = lexer.next()) {
+            tokens.push_back(token);
+        }
+    } catch (const ParseError&) {
+        return true;
+    }
+    auto isSymbolAt = [&](size_t i, std::string_view symbol) {
+        return i < tokens.size() && tokens[i].kind == TokenKind::Symbol && tokens[i].text == symbol;
+    };
+    bool known = catalog != nullptr && catalog->hasStatistics(candidate.name);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const Token& token = tokens[i];
+        if (tokens.size() == 1 && isSymbolAt(i, "*")) {
+            return true;
+        }
+        bool name = (token.kind == TokenKind::Identifier && token.keyword == Keyword::None) || token.kind == TokenKind::QuotedIdentifier;
+        if (!name || (i > 0 && isSymbolAt(i - 1, ".")) || isSymbolAt(i + 1, "(") || (i > 0 && tokens[i - 1].keyword == Keyword::As)) {
+            continue; // Not a name, a qualified column, a function or an alias
+        }
+        if (isSymbolAt(i + 1, ".")) {
+            if (sqlName(token.text) == qualifier) {
+                return true;
+            }
+        } else if (!known || catalog->hasColumn(candidate.name, std::string(token.text))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remove one redundant table from the query; false if there is none
+bool eliminateRedundantJoin(Query& query, const StatisticsCatalog& catalog, RewriteSummary& summary) {
+    ColumnEquivalence equivalence;
+    for (const auto& join : query.joinConditions) {
+        equivalence.merge(join.first, join.second);
+    }
+
+    for (size_t parent = 0; parent < query.fromTables.size() && query.fromTables.size() > 1; ++parent) {
+        const Table& table = query.fromTables[parent];
+
+        // Every join condition of the table must be on the same key column
+        std::string keyRef;
+        std::vector<size_t> conditions;
+        bool keyed = true;
+        for (size_t i = 0; i < query.joinConditions.size() && keyed; ++i) {
+            const auto& join = query.joinConditions[i];
+            bool firstSide = tableIndexOf(query, join.first) == static_cast<int>(parent);
+            bool secondSide = tableIndexOf(query, join.second) == static_cast<int>(parent);
+            if (firstSide || secondSide) {
+                const std::string& own = firstSide ? join.first : join.second;
+                keyed = !(firstSide && secondSide) && (keyRef.empty() || columnNameOf(own) == columnNameOf(keyRef));
+                keyRef = own;
+                conditions.push_back(i);
+            }
+        }
+        if (!keyed || conditions.empty() || !catalog.isKey(table.name, columnNameOf(keyRef))) {
+            continue;
+        }
+
+        // A column equated with the key that guarantees exactly one match
+        std::string childRef;
+        int keyClass = equivalence.find(equivalence.add(keyRef));
+        for (size_t id = 0; id < equivalence.size() && childRef.empty(); ++id) {
+            std::string column(equivalence.column(static_cast<int>(id)));
+            int child = tableIndexOf(query, column);
+            if (equivalence.find(static_cast<int>(id)) != keyClass || child < 0 || child == static_cast<int>(parent)) {
+                continue;
+            }
+            const std::string& childName = query.fromTables[child].name;
+            if (catalog.isForeignKey(childName, columnNameOf(column), table.name, columnNameOf(keyRef)) ||
+                (childName == table.name && columnNameOf(column) == columnNameOf(keyRef))) {
+                childRef = column;
+            }
+        }
+        if (childRef.empty()) {
+            continue;
+        }
+
+        bool referenced = std::any_of(query.tableFilters.begin(), query.tableFilters.end(),
+                                      [&](const TableFilter& filter) { return filter.table == static_cast<int>(parent); });
+        for (const auto& column : query.selectColumns) {
+            referenced = referenced || mayReferenceTable(query, parent, column, &catalog);
+        }
+        for (const auto& filter : query.filterConditions) {
+            referenced = referenced || mayReferenceTable(query, parent, filter, &catalog);
+        }
+        for (const auto& key : query.groupBy) {
+            referenced = referenced || mayReferenceTable(query, parent, key, &catalog);
+        }
+        for (const auto& key : query.orderBy) {
+            referenced = referenced || mayReferenceTable(query, parent, key.expression, &catalog);
+        }
+        if (referenced) {
+            continue;
+        }
+
+        // The table's other partners in the class join the child instead
+        std::vector<std::pair<std::string, std::string>> joins;
+        joins.reserve(query.joinConditions.size());
+        for (size_t i = 0; i < query.joinConditions.size(); ++i) {
+            const auto& join = query.joinConditions[i];
+            if (std::find(conditions.begin(), conditions.end(), i) == conditions.end()) {
+                joins.push_back(join);
+                continue;
+            }
+            const std::string& other = tableIndexOf(query, join.first) == static_cast<int>(parent) ? join.second : join.first;
+            if (other != childRef) {
+                joins.push_back({childRef, other});
+            }
+        }
+        query.joinConditions = std::move(joins);
+
+        // The join rejected rows whose child column is NULL; unless a join condition left on the
+        // column still does, or the column is a key or ANALYZE found no NULLs in it, a filter must
+        int child = tableIndexOf(query, childRef);
+        const std::string& childName = query.fromTables[child].name;
+        const ColumnStats* childStats = catalog.findColumn(childName, columnNameOf(childRef));
+        bool nullable = !catalog.isKey(childName, columnNameOf(childRef)) && (childStats == nullptr || childStats->nullFraction > 0) &&
+                        std::none_of(query.joinConditions.begin(), query.joinConditions.end(),
+                                     [&](const auto& join) { return join.first == childRef || join.second == childRef; });
+
+        summary.eliminatedTables.push_back(table.alias.empty() ? table.name : table.alias);
+        query.fromTables.erase(query.fromTables.begin() + parent);
+        for (auto& filter : query.tableFilters) {
+            filter.table -= filter.table > static_cast<int>(parent) ? 1 : 0;
+        }
+        if (nullable) {
+            query.filterConditions.push_back(childRef + " IS NOT NULL");
+            query.tableFilters.push_back({child - (child > static_cast<int>(parent) ? 1 : 0), static_cast<int>(query.filterConditions.size()) - 1,
+                                          1 - estimateNullSelectivity(childStats), std::string(), false});
+        }
+        return true;
+    }
+    return false;
+}
+
+// Add the join conditions implied by each equivalence class
+void inferJoinConditions(Query& query, RewriteSummary& summary) {
+    std::vector<std::pair<std::string, std::string>> conditions = query.joinConditions;
+    ColumnEquivalence equivalence;
+    std::unordered_set<std::string> existing;
+    for (const auto& join : conditions) {
+        equivalence.merge(join.first, join.second);
+        existing.insert(join.first + '=' + join.second);
+        existing.insert(join.second + '=' + join.first);
+    }
+
+    std::vector<std::vector<int>> classes(equivalence.size());
+    for (size_t id = 0; id < equivalence.size(); ++id) {
+        classes[equivalence.find(static_cast<int>(id))].push_back(static_cast<int>(id));
+    }
+    for (const auto& members : classes) {
+        if (members.size() < 3 || members.size() > kMaxInferredClassColumns) {
+            continue;
+        }
+        for (size_t i = 0; i < members.size(); ++i) {
+            for (size_t j = i + 1; j < members.size(); ++j) {
+                std::string first(equivalence.column(members[i]));
+                std::string second(equivalence.column(members[j]));
+                if (tableIndexOf(query, first) == tableIndexOf(query, second) || existing.count(first + '=' + second)) {
+                    continue;
+                }
+                query.joinConditions.push_back({first, second});
+                ++summary.inferredConditions;
+            }
+        }
+    }
+}
+
+RewriteSummary rewriteQuery(Query& query, const StatisticsCatalog* catalog) {
+    RewriteSummary summary;
+    while (catalog != nullptr && eliminateRedundantJoin(query, *catalog, summary)) {
+    }
+    inferJoinConditions(query, summary);
+    return summary;
+}
+
+// Access paths
+// Cheapest way to read base table `table`: a full scan, or a scan of one of its indexes that the
+// table's filters narrow or that covers the query. Returns the index, -1 for the full scan.
+int chooseAccess(const Query& query, const JoinGraph& graph, const CostModel& model, size_t table, Cost& cost) {
+    cost = model.scan(static_cast<double>(query.fromTables[table].rows));
+    int best = -1;
+    const auto& indexes = graph.indexes[table];
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        if (!indexes[i].narrowed && !indexes[i].covering) {
+            continue;
+        }
+        Cost candidate = model.indexScan(indexes[i], indexes[i].tableRows * indexes[i].selectivity);
+        if (model.total(candidate) < model.total(cost)) {
+            cost = candidate;
+            best = static_cast<int>(i);
+        }
+    }
+    return best;
+}
+
+// Cheapest index nested loop join of left with base table inner, through the index on inner's
+// column of one of their join conditions; its total is infinite when no condition has one
+JoinChoice chooseIndexJoin(const JoinGraph& graph, const CostModel& model, RelSet left, int inner, double leftRows, double outputRows) {
+    JoinChoice best;
+    for (int edgeIndex : graph.conditionEdges[inner]) {
+        const JoinEdge& edge = graph.edges[edgeIndex];
+        bool innerFirst = edge.first == inner;
+        int index = innerFirst ? edge.firstIndex : edge.secondIndex;
+        if (index < 0 || !(relBit(innerFirst ? edge.second : edge.first) & left)) {
+            continue;
+        }
+        const IndexAccess& access = graph.indexes[inner][index];
+        JoinChoice candidate = model.indexNestedLoopJoin(leftRows, access, access.tableRows * edge.selectivity, outputRows);
+        if (candidate.total < best.total) {
+            best = candidate;
+            best.index = index;
+        }
+    }
+    return best;
+}
+
+AccessMethod accessMethod(const JoinGraph& graph, int table, int index) {
+    if (index < 0) {
+        return AccessMethod::FullScan;
+    }
+    return graph.indexes[table][index].covering ? AccessMethod::IndexOnlyScan : AccessMethod::IndexScan;
+}
+
+// Pareto sets
+// Each relation set keeps its cheapest plan and up to kMaxPlanAlternatives costlier plans with
+// interesting properties the cheapest lacks. A plan is only worth keeping while it is cheaper
+// than the cheapest plan with enforcers giving it the same properties, and while no kept plan
+// with at least its properties costs as little; when the set is full the costliest one goes.
+
+// Plan i of entry: 0 is its cheapest plan, i its alternatives[i - 1]
+inline const MemoPlan& memoPlan(const MemoEntry& entry, int i) {
+    return i == 0 ? static_cast<const MemoPlan&>(entry) : entry.alternatives[i - 1];
+}
+
+// Cheapest plan of entry with the required properties, numbered as for memoPlan; -1 if none
+int cheapestPlanWith(const MemoEntry& entry, PhysicalProperties required) {
+    if (entry.properties.satisfies(required)) {
+        return 0;
+    }
+    int found = -1;
+    for (int i = 0; i < entry.alternativeCount; ++i) {
+        if (entry.alternatives[i].properties.satisfies(required) && (found < 0 || entry.alternatives[i].cost < entry.alternatives[found].cost)) {
+            found = i;
+        }
+    }
+    return found < 0 ? -1 : found + 1;
+}
+
+// Weighted cost of the enforcers giving rows rows the properties
+double enforcerCost(const CostModel& model, double rows, PhysicalProperties properties) {
+    double cost = 0;
+    if (properties.order >= 0) {
+        cost += model.total(model.sort(rows));
+    }
+    if (properties.partition >= 0) {
+        cost += model.total(model.repartition(rows));
+    }
+    if (properties.distribution >= 0) {
+        cost += model.total(model.shuffle(rows));
+    } else if (properties.distribution == kReplicated) {
+        cost += model.total(model.broadcast(rows));
+    }
+    return cost;
+}
+
+// Keep plan among entry's alternatives if it is worth keeping; their slots come from resource
+bool addAlternative(const CostModel& model, MemoEntry& entry, const MemoPlan& plan, std::pmr::memory_resource* resource) {
+    if (!plan.properties.any() || entry.properties.satisfies(plan.properties) ||
+        plan.cost >= entry.cost + enforcerCost(model, entry.rows, plan.properties)) {
+        return false;
+    }
+    int costliest = -1;
+    for (int i = 0; i < entry.alternativeCount;) {
+        MemoPlan& other = entry.alternatives[i];
+        if (other.properties.satisfies(plan.properties) && other.cost <= plan.cost) {
+            return false;
+        }
+        if (plan.properties.satisfies(other.properties)) {
+            other = entry.alternatives[--entry.alternativeCount]; // Dominated by plan
+            continue;
+        }
+        if (costliest < 0 || other.cost > entry.alternatives[costliest].cost) {
+            costliest = i;
+        }
+        ++i;
+    }
+    if (entry.alternativeCount < kMaxPlanAlternatives) {
+        if (entry.alternatives == nullptr) {
+            entry.alternatives = std::pmr::polymorphic_allocator<MemoPlan>(resource).allocate(kMaxPlanAlternatives);
+            std::uninitialized_fill_n(entry.alternatives, kMaxPlanAlternatives, MemoPlan());
+        }
+        entry.alternatives[entry.alternativeCount++] = plan;
+        return true;
+    }
+    if (plan.cost >= entry.alternatives[costliest].cost) {
+        return false;
+    }
+    entry.alternatives[costliest] = plan;
+    return true;
+}
+
+// Offer plan, producing rows rows, to entry's Pareto set; returns whether it was kept
+bool offerPlan(const CostModel& model, MemoEntry& entry, const MemoPlan& plan, double rows, std::pmr::memory_resource* resource) {
+    if (!(plan.cost < entry.cost)) {
+        return addAlternative(model, entry, plan, resource);
+    }
+    // The plan it replaces stays on as an alternative if it has properties the new one lacks
+    bool keepPrevious = entry.properties.any() && !plan.properties.satisfies(entry.properties);
+    MemoPlan previous;
+    if (keepPrevious) {
+        previous = entry;
+    }
+    static_cast<MemoPlan&>(entry) = plan;
+    entry.rows = rows;
+    for (int i = 0; i < entry.alternativeCount;) {
+        const MemoPlan& other = entry.alternatives[i];
+        if (entry.properties.satisfies(other.properties) || other.cost >= entry.cost + enforcerCost(model, rows, other.properties)) {
+            entry.alternatives[i] = entry.alternatives[--entry.alternativeCount];
+        } else {
+            ++i;
+        }
+    }
+    if (keepPrevious) {
+        addAlternative(model, entry, previous, resource);
+    }
+    return true;
+}
+
+// Seed the memo with one entry per base table, passing up the rows that survive its filters: its
+// cheapest access path, and scans of its indexes for the interesting orders they read it in. An
+// index scan reads rows in key order, forwards or backwards, and so does a full scan of a table
+// stored in the order of its clustered index. On a cluster, each node reads the rows it stores, so
+// the table comes distributed as its partitioning declares.
+template <typename Memo>
+void seedBaseTables(const Query& query, const JoinGraph& graph, const CostModel& model, Memo& memo) {
+    for (size_t i = 0; i < query.fromTables.size(); ++i) {
+        MemoEntry& entry = memo[relBit(i)];
+        double rows = correctedBaseRows(query, graph, i);
+        int16_t distribution = model.distributed() ? graph.relationDistributions[i] : -1;
+        if (distribution >= 0 && graph.distributions[distribution].scheme == PartitionScheme::Hash &&
+            graph.distributions[distribution].nodes == model.weights().nodes) {
+            distribution = static_cast<int16_t>(graph.distributions[distribution].keyClass); // Hashed over every node after all
+        }
+        auto offer = [&](int index, const Cost& components, int order) {
+            MemoPlan plan;
+            plan.cost = model.total(components);
+            plan.components = components;
+            plan.index = static_cast<int16_t>(index);
+            plan.properties = graph.interesting(relBit(i), {static_cast<int16_t>(order), -1, distribution});
+            offerPlan(model, entry, plan, rows, memoResource(memo));
+        };
+        const auto& indexes = graph.indexes[i];
+        Cost fullScan = model.scan(static_cast<double>(query.fromTables[i].rows));
+        int clusteredOrder = -1;
+        for (size_t x = 0; x < indexes.size(); ++x) {
+            if (indexes[x].clustered && clusteredOrder < 0) {
+                clusteredOrder = graph.indexKeyClasses[i][x];
+            }
+        }
+        Cost components;
+        int best = chooseAccess(query, graph, model, i, components);
+        offer(best, components, best < 0 ? clusteredOrder : graph.indexKeyClasses[i][best]);
+        for (size_t x = 0; x < indexes.size(); ++x) {
+            int keyClass = graph.indexKeyClasses[i][x];
+            if (keyClass < 0) {
+                continue;
+            }
+            int index = static_cast<int>(x);
+            Cost ordered = model.indexScan(indexes[x], indexes[x].tableRows * indexes[x].selectivity);
+            if (indexes[x].clustered && !indexes[x].narrowed && model.total(fullScan) < model.total(ordered)) {
+                index = -1;
+                ordered = fullScan;
+            }
+            offer(index, ordered, keyClass);
+            int descending = graph.descendingOrder(keyClass);
+            if (descending >= 0) {
+                offer(index, ordered, descending);
+            }
+        }
+    }
+}
+
+const size_t kMaxJoinKeys = 8; // Key classes between two inputs tried for merge and partitioned hash joins
+
+// The joins of left and right that keep or prepare interesting properties, each passed to offer
+// as (outer plan, inner plan, join, properties). Operators streaming an input keep its order and
+// partitioning: nested loops, index nested loops and hash joins built on the right keep the left
+// input's, hash joins built on the left the right input's; a spilling hash join partitions both
+// inputs anew. Merge joins and grace hash joins are tried on each key between the inputs, over
+// inputs already sorted or partitioned on it and for keys whose order or partitioning is of
+// interest above the join; over the inputs' best plans they cost the same whatever the key, so
+// those are costed once.
+template <typename Offer>
+void considerPropertyJoins(const JoinGraph& graph, const CostModel& model, const MemoEntry& outer, const MemoEntry& inner, RelSet left,
+                           RelSet right, double rows, bool condition, bool preparedInputs, const JoinChoice& probe, Offer& offer) {
+    RelSet set = left | right;
+    for (int i = 0; preparedInputs && i <= outer.alternativeCount; ++i) {
+        PhysicalProperties properties = graph.interesting(set, memoPlan(outer, i).properties);
+        if (!properties.any()) {
+            continue;
+        }
+        offer(i, 0, model.nestedLoopJoin(outer.rows, inner.rows, rows), properties);
+        if (condition && model.fitsInMemory(inner.rows)) {
+            offer(i, 0, model.hashJoin(inner.rows, outer.rows, rows, false), properties);
+        }
+        if (!std::isinf(probe.total)) {
+            offer(i, 0, probe, properties);
+        }
+    }
+    for (int i = 0; preparedInputs && i <= inner.alternativeCount && condition && model.fitsInMemory(outer.rows); ++i) {
+        PhysicalProperties properties = graph.interesting(set, memoPlan(inner, i).properties);
+        if (properties.any()) {
+            offer(0, i, model.hashJoin(outer.rows, inner.rows, rows, true), properties);
+        }
+    }
+
+    int keys[kMaxJoinKeys];
+    size_t keyCount = condition ? graph.keyClassesBetween(left, right, keys, kMaxJoinKeys) : 0;
+    if (keyCount > 0) {
+        // Joins of the best plans are only costed once some key needs them, which for most
+        // joins of most queries none does
+        JoinChoice merge;
+        bool graceLeft = !model.fitsInMemory(outer.rows);
+        bool graceRight = !model.fitsInMemory(inner.rows);
+        JoinChoice graceBuildLeft;
+        JoinChoice graceBuildRight;
+        // Plan of input with the required properties when it beats enforcing them on its best plan, else -1
+        auto prepared = [&](const MemoEntry& input, PhysicalProperties required) {
+            if (!preparedInputs) {
+                return -1;
+            }
+            int i = cheapestPlanWith(input, required);
+            return i > 0 && memoPlan(input, i).cost >= input.cost + enforcerCost(model, input.rows, required) ? -1 : i;
+        };
+        for (size_t k = 0; k < keyCount; ++k) {
+            int16_t key = static_cast<int16_t>(keys[k]);
+            PhysicalProperties sorted = {key, -1};
+            int l = prepared(outer, sorted);
+            int r = prepared(inner, sorted);
+            if (l >= 0 || r >= 0) {
+                JoinChoice join = model.sortMergeJoin(outer.rows, inner.rows, rows, l >= 0, r >= 0);
+                join.key = key;
+                offer(std::max(l, 0), std::max(r, 0), join, sorted);
+            } else if (graph.interesting(set, sorted).any()) {
+                if (std::isinf(merge.total)) {
+                    merge = model.sortMergeJoin(outer.rows, inner.rows, rows);
+                }
+                merge.key = key;
+                offer(0, 0, merge, sorted);
+            }
+            if (!graceLeft && !graceRight) {
+                continue;
+            }
+            PhysicalProperties partitioned = {-1, key};
+            l = prepared(outer, partitioned);
+            r = prepared(inner, partitioned);
+            if (l < 0 && r < 0 && !graph.interesting(set, partitioned).any()) {
+                continue;
+            }
+            if (l < 0 && r < 0 && graceLeft && std::isinf(graceBuildLeft.total)) {
+                graceBuildLeft = model.hashJoin(outer.rows, inner.rows, rows, true);
+            }
+            if (l < 0 && r < 0 && graceRight && std::isinf(graceBuildRight.total)) {
+                graceBuildRight = model.hashJoin(inner.rows, outer.rows, rows, false);
+            }
+            for (bool buildLeft : {true, false}) {
+                if (buildLeft ? !graceLeft : !graceRight) {
+                    continue;
+                }
+                JoinChoice join = l < 0 && r < 0 ? (buildLeft ? graceBuildLeft : graceBuildRight)
+                                : buildLeft      ? model.hashJoin(outer.rows, inner.rows, rows, true, l >= 0, r >= 0)
+                                                 : model.hashJoin(inner.rows, outer.rows, rows, false, r >= 0, l >= 0);
+                join.key = key;
+                offer(std::max(l, 0), std::max(r, 0), join, partitioned);
+            }
+        }
+    }
+}
+
+// Distributed joins
+// On a cluster each node joins the rows it holds, so a join's inputs must be placed so that every
+// two rows that match meet on some node. Inputs distributed alike on a key of the join are
+// co-located, and so is any input with a replicated one: they join where they are. Otherwise one
+// input is broadcast to every node, or the inputs are shuffled on a key of the join, into the hash
+// on it over every node or into the distribution the other input already has; a replicated input
+// needs no shuffle, since every node holds its share of it already. Another plan of an input that
+// comes distributed as a shuffle would leave it stands in for the shuffle when cheaper. An input
+// the join relies on as it is, sorted or partitioned for it or probed through its index, cannot
+// move, and the join keeps the order and partitioning of its streamed input only if that input
+// stays. Each placement is passed to keep as (outer plan, inner plan, join with its exchanges,
+// components, properties, shuffle target).
+template <typename Keep>
+void considerPlacements(const JoinGraph& graph, const CostModel& model, const MemoEntry& outer, const MemoEntry& inner, const int* keys,
+                        size_t keyCount, int outerPlan, int innerPlan, const JoinChoice& join, PhysicalProperties properties, Keep& keep) {
+    bool merge = join.algorithm == JoinAlgorithm::SortMerge;
+    bool fixedLeft = join.key >= 0 && !(join.enforcers & (merge ? JoinChoice::kSortLeft : JoinChoice::kPartitionLeft));
+    bool fixedRight = join.algorithm == JoinAlgorithm::IndexNestedLoop ||
+                      (join.key >= 0 && !(join.enforcers & (merge ? JoinChoice::kSortRight : JoinChoice::kPartitionRight)));
+    bool streamedLeft = !(join.algorithm == JoinAlgorithm::Hash && join.buildLeft);
+    int16_t leftDistribution = memoPlan(outer, outerPlan).properties.distribution;
+    int16_t rightDistribution = memoPlan(inner, innerPlan).properties.distribution;
+
+    auto place = [&](uint8_t exchanges, int16_t shuffle, int16_t distribution, int l, int r) {
+        JoinChoice placed = join;
+        placed.enforcers |= exchanges;
+        Cost components = memoPlan(outer, l).components + join.cost;
+        if (join.algorithm != JoinAlgorithm::IndexNestedLoop) {
+            components += memoPlan(inner, r).components;
+        }
+        if (exchanges & JoinChoice::kShuffleLeft) {
+            components += model.shuffle(outer.rows);
+        } else if (exchanges & JoinChoice::kBroadcastLeft) {
+            components += model.broadcast(outer.rows);
+        }
+        if (exchanges & JoinChoice::kShuffleRight) {
+            components += model.shuffle(inner.rows);
+        } else if (exchanges & JoinChoice::kBroadcastRight) {
+            components += model.broadcast(inner.rows);
+        }
+        PhysicalProperties placedProperties = properties;
+        placedProperties.distribution = distribution;
+        bool streamedMoved = streamedLeft ? (exchanges & (JoinChoice::kShuffleLeft | JoinChoice::kBroadcastLeft)) || l != outerPlan
+                                          : (exchanges & (JoinChoice::kShuffleRight | JoinChoice::kBroadcastRight)) || r != innerPlan;
+        if (join.key < 0 && streamedMoved) {
+            placedProperties.order = -1;
+            placedProperties.partition = -1;
+        }
+        keep(l, r, placed, components, placedProperties, shuffle);
+    };
+    // Bring input, read through its plan chosen, into target: false if it would have to move and cannot
+    auto arrive = [&](const MemoEntry& input, int16_t distribution, bool fixed, int16_t target, uint8_t shuffle, uint8_t& exchanges,
+                      int& chosen) {
+        if (distribution == target || distribution == kReplicated) {
+            return true;
+        }
+        if (fixed) {
+            return false;
+        }
+        int other = cheapestPlanWith(input, {-1, -1, target});
+        if (other >= 0 && memoPlan(input, other).cost < memoPlan(input, chosen).cost + model.total(model.shuffle(input.rows))) {
+            chosen = other;
+        } else {
+            exchanges |= shuffle;
+        }
+        return true;
+    };
+
+    if (leftDistribution == kReplicated) {
+        place(0, -1, rightDistribution, outerPlan, innerPlan);
+    } else if (rightDistribution == kReplicated || (leftDistribution >= 0 && leftDistribution == rightDistribution &&
+                                                    std::find(keys, keys + keyCount, graph.distributions[leftDistribution].keyClass) != keys + keyCount)) {
+        place(0, -1, leftDistribution, outerPlan, innerPlan);
+    }
+    if (!fixedRight && rightDistribution != kReplicated) {
+        place(JoinChoice::kBroadcastRight, -1, leftDistribution, outerPlan, innerPlan);
+    }
+    if (!fixedLeft && leftDistribution != kReplicated) {
+        place(JoinChoice::kBroadcastLeft, -1, rightDistribution, outerPlan, innerPlan);
+    }
+    for (size_t k = 0; k < keyCount; ++k) {
+        int16_t targets[3] = {static_cast<int16_t>(keys[k]), -1, -1};
+        for (int16_t distribution : {leftDistribution, rightDistribution}) {
+            if (distribution >= 0 && graph.distributions[distribution].keyClass == keys[k] && distribution != targets[0] &&
+                distribution != targets[1]) {
+                targets[distribution == leftDistribution ? 1 : 2] = distribution;
+            }
+        }
+        for (int16_t target : targets) {
+            uint8_t exchanges = 0;
+            int l = outerPlan;
+            int r = innerPlan;
+            if (target < 0 || !arrive(outer, leftDistribution, fixedLeft, target, JoinChoice::kShuffleLeft, exchanges, l) ||
+                !arrive(inner, rightDistribution, fixedRight, target, JoinChoice::kShuffleRight, exchanges, r)) {
+                continue;
+            }
+            place(exchanges, exchanges != 0 ? target : -1, target, l, r);
+        }
+    }
+}
+
+// Cost joining left and right every way that can enter the Pareto set of their union: the
+// cheapest operator on the inputs' best plans and, when the inputs have properties or the union
+// has keys of interest, the joins of considerPropertyJoins. On a cluster each join is placed every
+// way considerPlacements finds. Returns the cheapest join's cost, infinite when an input has no
+// plan. The entries of the inputs and their union, and the join's rows, come looked up.
+double considerJoin(const JoinGraph& graph, const CostModel& model, const MemoEntry& outer, const MemoEntry& inner, MemoEntry& best,
+                    RelSet left, RelSet right, double rows, std::pmr::memory_resource* resource) {
+    OPTIMIZER_COUNT(enumerated);
+    RelSet set = left | right;
+    double cheapest = std::numeric_limits<double>::infinity();
+    bool kept = false;
+    {
+        OPTIMIZER_PHASE(Costing);
+        auto keep = [&](int outerPlan, int innerPlan, const JoinChoice& join, const Cost& components, PhysicalProperties properties,
+                        int16_t shuffle) {
+            double cost = model.total(components);
+            cheapest = std::min(cheapest, cost);
+            if (!(cost < best.cost) && !properties.any()) {
+                return;
+            }
+            MemoPlan plan;
+            plan.cost = cost;
+            plan.components = components;
+            plan.properties = graph.interesting(set, properties);
+            plan.left = left;
+            plan.right = right;
+            plan.algorithm = join.algorithm;
+            plan.buildLeft = join.buildLeft;
+            plan.index = static_cast<int16_t>(join.index);
+            plan.leftPlan = static_cast<uint8_t>(outerPlan);
+            plan.rightPlan = static_cast<uint8_t>(innerPlan);
+            plan.enforcers = join.enforcers;
+            plan.key = static_cast<int16_t>(join.key);
+            plan.shuffle = shuffle;
+            plan.memory = join.memory;
+            kept |= offerPlan(model, best, plan, rows, resource);
+        };
+        bool condition = graph.hasCondition(left, right);
+        int keys[kMaxJoinKeys];
+        size_t keyCount = condition && model.distributed() ? graph.keyClassesBetween(left, right, keys, kMaxJoinKeys) : 0;
+        auto offer = [&](int outerPlan, int innerPlan, const JoinChoice& join, PhysicalProperties properties) {
+            if (model.distributed()) {
+                considerPlacements(graph, model, outer, inner, keys, keyCount, outerPlan, innerPlan, join, properties, keep);
+                return;
+            }
+            Cost components = memoPlan(outer, outerPlan).components + join.cost;
+            if (join.algorithm != JoinAlgorithm::IndexNestedLoop) {
+                components += memoPlan(inner, innerPlan).components; // Probes replace the right table's scan
+            }
+            keep(outerPlan, innerPlan, join, components, properties, -1);
+        };
+
+        JoinChoice probe = isSingleRel(right) ? chooseIndexJoin(graph, model, left, lowestRel(right), outer.rows, rows) : JoinChoice();
+        bool preparedInputs = outer.properties.any() || outer.alternativeCount > 0 || inner.properties.any() || inner.alternativeCount > 0;
+        if (preparedInputs || (condition && (graph.keyedRelations & set))) {
+            considerPropertyJoins(graph, model, outer, inner, left, right, rows, condition, preparedInputs, probe, offer);
+        }
+
+        // Last, the cheapest join of the inputs' best plans regardless of properties, which only
+        // enters the Pareto set when it is the cheapest plan so far
+        JoinChoice join = model.chooseJoin(outer.rows, inner.rows, rows, condition);
+        if (model.distributed() && !std::isinf(probe.total)) {
+            offer(0, 0, probe, PhysicalProperties()); // Its right table cannot move, so it may place worse than the operator
+        } else if (outer.cost + probe.total < outer.cost + inner.cost + join.total) {
+            join = probe; // Probing an index of the right table replaces its scan
+        }
+        offer(0, 0, join, PhysicalProperties());
+    }
+    if (kept) {
+        OPTIMIZER_COUNT(memoized);
+    } else {
+        OPTIMIZER_COUNT(pruned);
+    }
+    return cheapest;
+}
+
+// The same, looking the entries up in memo and estimating the rows
+template <typename Memo>
+double considerJoin(const JoinGraph& graph, const CostModel& model, Memo& memo, RelSet left, RelSet right) {
+    const MemoEntry& outer = memo.at(left);
+    const MemoEntry& inner = memo.at(right);
+    if (std::isinf(outer.cost) || std::isinf(inner.cost)) {
+        OPTIMIZER_COUNT(enumerated);
+        OPTIMIZER_COUNT(pruned);
+        return std::numeric_limits<double>::infinity();
+    }
+    double rows = correctedJoinRows(graph, left, right, outer.rows, inner.rows);
+    return considerJoin(graph, model, outer, inner, memo[left | right], left, right, rows, memoResource(memo));
+}
+
+// Consider first joined to second as the outer input when firstOuter, and as the inner input
+// when secondOuter, looking the three entries up and estimating the join's rows once for both
+template <typename Memo>
+void considerJoinPair(const JoinGraph& graph, const CostModel& model, Memo& memo, RelSet first, RelSet second, bool firstOuter,
+                      bool secondOuter) {
+    if (!firstOuter || !secondOuter) {
+        if (firstOuter || secondOuter) {
+            considerJoin(graph, model, memo, firstOuter ? first : second, firstOuter ? second : first);
+        }
+        return;
+    }
+    const MemoEntry& a = memo.at(first);
+    const MemoEntry& b = memo.at(second);
+    if (std::isinf(a.cost) || std::isinf(b.cost)) {
+        OPTIMIZER_COUNT(enumerated);
+        OPTIMIZER_COUNT(enumerated);
+        OPTIMIZER_COUNT(pruned);
+        OPTIMIZER_COUNT(pruned);
+        return;
+    }
+    double rows = correctedJoinRows(graph, first, second, a.rows, b.rows);
+    MemoEntry& best = memo[first | second];
+    considerJoin(graph, model, a, b, best, first, second, rows, memoResource(memo));
+    considerJoin(graph, model, b, a, best, second, first, rows, memoResource(memo));
+}
+
+// Column of side's join condition with other on keyClass (on any key class if -1), as the key
+// of an enforcer on side
+std::string enforcerKeyOf(const Query& query, const JoinGraph& graph, RelSet side, RelSet other, int keyClass) {
+    for (const auto& edge : graph.edges) {
+        if (keyClass >= 0 && edge.keyClass != keyClass) {
+            continue;
+        }
+        if (relBit(edge.first) & side && relBit(edge.second) & other) {
+            return query.joinConditions[edge.condition].first;
+        }
+        if (relBit(edge.second) & side && relBit(edge.first) & other) {
+            return query.joinConditions[edge.condition].second;
+        }
+    }
+    return std::string();
+}
+
+void setEnforcer(const CostModel& model, PlanNode& node, Enforcer enforcer, std::string key, const Cost& cost) {
+    node.enforcer = enforcer;
+    node.enforcerKey = std::move(key);
+    node.enforcerComponents = cost;
+    node.enforcerCost = model.total(cost);
+}
+
+void setExchange(const CostModel& model, PlanNode& node, Exchange exchange, std::string key, const Cost& cost) {
+    node.exchange = exchange;
+    node.exchangeKey = std::move(key);
+    node.exchangeComponents = cost;
+    node.exchangeCost = model.total(cost);
+}
+
+// Key of a shuffle of side into distribution: its column of the join condition with other on the
+// key class, and how a table's own partitioning spreads it if that is not a hash over every node
+std::string shuffleKeyOf(const Query& query, const JoinGraph& graph, RelSet side, RelSet other, int distribution) {
+    const Distribution& target = graph.distributions[distribution];
+    std::string key = enforcerKeyOf(query, graph, side, other, target.keyClass);
+    if (target.scheme == PartitionScheme::Range) {
+        for (size_t i = 0; i < target.bounds.size(); ++i) {
+            key += (i == 0 ? " RANGES " : ",") + target.bounds[i];
+        }
+    } else if (target.nodes > 0) {
+        key += " OVER " + std::to_string(target.nodes) + " NODES";
+    }
+    return key;
+}
+
+// Put the enforcers a join applies to its inputs (JoinChoice flags) on the input nodes, and the
+// exchanges that move them, shuffling into distribution shuffle
+void placeJoinEnforcers(const Query& query, const JoinGraph& graph, const CostModel& model, uint8_t enforcers, int keyClass, int shuffle,
+                        RelSet left, RelSet right, PlanNode& leftNode, PlanNode& rightNode) {
+    if (enforcers & JoinChoice::kShuffleLeft) {
+        setExchange(model, leftNode, Exchange::Shuffle, shuffleKeyOf(query, graph, left, right, shuffle), model.shuffle(leftNode.rows));
+    } else if (enforcers & JoinChoice::kBroadcastLeft) {
+        setExchange(model, leftNode, Exchange::Broadcast, std::string(), model.broadcast(leftNode.rows));
+    }
+    if (enforcers & JoinChoice::kShuffleRight) {
+        setExchange(model, rightNode, Exchange::Shuffle, shuffleKeyOf(query, graph, right, left, shuffle), model.shuffle(rightNode.rows));
+    } else if (enforcers & JoinChoice::kBroadcastRight) {
+        setExchange(model, rightNode, Exchange::Broadcast, std::string(), model.broadcast(rightNode.rows));
+    }
+    if (enforcers & JoinChoice::kSortLeft) {
+        setEnforcer(model, leftNode, Enforcer::Sort, enforcerKeyOf(query, graph, left, right, keyClass), model.sort(leftNode.rows));
+    } else if (enforcers & JoinChoice::kPartitionLeft) {
+        setEnforcer(model, leftNode, Enforcer::Repartition, enforcerKeyOf(query, graph, left, right, keyClass),
+                    model.repartition(leftNode.rows));
+    }
+    if (enforcers & JoinChoice::kSortRight) {
+        setEnforcer(model, rightNode, Enforcer::Sort, enforcerKeyOf(query, graph, right, left, keyClass), model.sort(rightNode.rows));
+    } else if (enforcers & JoinChoice::kPartitionRight) {
+        setEnforcer(model, rightNode, Enforcer::Repartition, enforcerKeyOf(query, graph, right, left, keyClass),
+                    model.repartition(rightNode.rows));
+    }
+}
+
+double limitRows(const Query& query) {
+    return query.limit < 0 ? std::numeric_limits<double>::infinity() : static_cast<double>(query.limit);
+}
+
+// Sort the plan's result for the ORDER BY, unless its root already delivers that order
+void enforceOrderBy(const Query& query, const CostModel& model, Plan& plan, bool ordered) {
+    if (query.orderBy.empty() || ordered || plan.nodes.empty()) {
+        return;
+    }
+    std::string keys;
+    for (const auto& key : query.orderBy) {
+        keys += (keys.empty() ? "" : ", ") + key.expression + (key.descending ? " DESC" : "");
+    }
+    PlanNode& root = plan.nodes.back();
+    setEnforcer(model, root, Enforcer::Sort, keys, model.sort(root.rows, limitRows(query)));
+    plan.cost = root.cost + root.enforcerCost + root.exchangeCost;
+}
+
+// Gathering a result of rows rows at one node; under a LIMIT no node sends more than the limit
+Cost gatherCost(const Query& query, const CostModel& model, double rows) {
+    return model.gather(std::min(rows, limitRows(query) * model.weights().nodes));
+}
+
+// On a cluster, gather the plan's result at one node unless every node holds all of it
+void gatherResult(const Query& query, const CostModel& model, Plan& plan, bool replicated) {
+    if (!model.distributed() || replicated || plan.nodes.empty()) {
+        return;
+    }
+    PlanNode& root = plan.nodes.back();
+    setExchange(model, root, Exchange::Gather, std::string(), gatherCost(query, model, root.rows));
+    plan.cost += root.exchangeCost;
+}
+
+// Rebuild the join tree by following the memo's back-pointers from plan choice of set (numbered
+// as for memoPlan); returns the new node's index
+template <typename Memo>
+int appendPlanFromMemo(const Query& query, const JoinGraph& graph, const CostModel& model, const Memo& memo, RelSet set, int choice,
+                       Plan& plan) {
+    const MemoEntry& entry = memo.at(set);
+    const MemoPlan& chosen = memoPlan(entry, choice);
+    PlanNode node;
+    node.rows = entry.rows;
+    node.cost = chosen.cost;
+    node.components = chosen.components;
+    if (chosen.left == 0 && !isSingleRel(set)) {
+        node.shared = chosen.index; // A shared result offered to the enumerator; optimizeShared puts its subtree below
+    } else if (chosen.left == 0) {
+        node.table = lowestRel(set);
+        node.index = chosen.index;
+        node.access = accessMethod(graph, node.table, node.index);
+        node.backward = chosen.properties.order >= 0 && graph.orders[chosen.properties.order].descending;
+        plan.tables.push_back(query.fromTables[node.table]);
+    } else {
+        node.left = appendPlanFromMemo(query, graph, model, memo, chosen.left, chosen.leftPlan, plan);
+        node.right = appendPlanFromMemo(query, graph, model, memo, chosen.right, chosen.rightPlan, plan);
+        if (chosen.algorithm == JoinAlgorithm::IndexNestedLoop) {
+            // The right table is read by the join's probes, whose cost the join carries
+            PlanNode& lookup = plan.nodes[node.right];
+            lookup.access = AccessMethod::IndexLookup;
+            lookup.index = chosen.index;
+            lookup.cost = 0;
+            lookup.components = Cost();
+        }
+        placeJoinEnforcers(query, graph, model, chosen.enforcers, chosen.key, chosen.shuffle, chosen.left, chosen.right,
+                           plan.nodes[node.left], plan.nodes[node.right]);
+        node.algorithm = chosen.algorithm;
+        node.buildLeft = chosen.buildLeft;
+        node.memory = chosen.memory;
+        node.conditions = graph.conditionsBetween(chosen.left, chosen.right);
+        for (int condition : node.conditions) {
+            plan.joins.push_back(query.joinConditions[condition]);
+        }
+    }
+    plan.nodes.push_back(node);
+    return static_cast<int>(plan.nodes.size()) - 1;
+}
+
+inline size_t memoEntryCount(const std::pmr::vector<MemoEntry>& memo) {
+    return std::count_if(memo.begin(), memo.end(), [](const MemoEntry& entry) { return !std::isinf(entry.cost); });
+}
+
+inline size_t memoEntryCount(const SubsetMemo& memo) {
+    return memo.entries();
+}
+
+inline size_t memoEntryCount(const std::pmr::unordered_map<RelSet, MemoEntry>& memo) {
+    return memo.size();
+}
+
+inline size_t memoBytes(const std::pmr::vector<MemoEntry>& memo) {
+    return memo.size() * sizeof(MemoEntry);
+}
+
+inline size_t memoBytes(const SubsetMemo& memo) {
+    return memo.bytes();
+}
+
+inline size_t memoBytes(const std::pmr::unordered_map<RelSet, MemoEntry>& memo) {
+    return memo.size() * (sizeof(std::pair<RelSet, MemoEntry>) + 2 * sizeof(void*));
+}
+
+template <typename Memo>
+Plan planFromMemo(const Query& query, const JoinGraph& graph, const CostModel& model, const Memo& memo, RelSet full) {
+    // The root plan is the cheapest once finished: with an ORDER BY, sorted unless it comes in the
+    // order asked for; on a cluster, gathered unless it is replicated
+    const MemoEntry& root = memo.at(full);
+    double sort = model.total(model.sort(root.rows, limitRows(query)));
+    double gather = model.total(gatherCost(query, model, root.rows));
+    auto finished = [&](int i) {
+        const MemoPlan& candidate = memoPlan(root, i);
+        double cost = candidate.cost;
+        if (!query.orderBy.empty() && (graph.requiredOrder < 0 || candidate.properties.order != graph.requiredOrder)) {
+            cost += sort;
+        }
+        if (model.distributed() && candidate.properties.distribution != kReplicated) {
+            cost += gather;
+        }
+        return cost;
+    };
+    int choice = 0;
+    for (int i = 1; i <= root.alternativeCount; ++i) {
+        if (finished(i) < finished(choice)) {
+            choice = i;
+        }
+    }
+    Plan plan = { {}, {}, memoPlan(root, choice).cost, {} };
+    size_t tables = static_cast<size_t>(__builtin_popcountll(full));
+    plan.nodes.reserve(2 * tables - 1);
+    plan.tables.reserve(tables);
+    plan.joins.reserve(query.joinConditions.size());
+    appendPlanFromMemo(query, graph, model, memo, full, choice, plan);
+    enforceOrderBy(query, model, plan, graph.requiredOrder >= 0 && memoPlan(root, choice).properties.order == graph.requiredOrder);
+    gatherResult(query, model, plan, memoPlan(root, choice).properties.distribution == kReplicated);
+    plan.memoEntries = memoEntryCount(memo);
+    OPTIMIZER_RECORD_MEMO(memoBytes(memo));
+    return plan;
+}
+
+// Give a flat left-deep plan (as produced by optimizeQueryStringKeyed) its join tree, costed with
+// the current cost model. On a cluster every table after the first is broadcast to the nodes of
+// the first unless it is replicated; the order is not chosen for it.
+void buildLeftDeepTree(const Query& query, const JoinGraph& graph, const CostModel& model, Plan& plan) {
+    plan.nodes.clear();
+    plan.joins.clear();
+    RelSet joined = 0;
+    for (const auto& table : plan.tables) {
+        int index = tableIndexOf(query, table.alias.empty() ? table.name : table.alias);
+        PlanNode leaf;
+        leaf.table = index;
+        leaf.rows = correctedBaseRows(query, graph, index);
+        leaf.index = chooseAccess(query, graph, model, index, leaf.components);
+        leaf.access = accessMethod(graph, index, leaf.index);
+        leaf.cost = model.total(leaf.components);
+        plan.nodes.push_back(leaf);
+        if (joined != 0) {
+            const PlanNode& outer = plan.nodes[plan.nodes.size() - 2];
+            PlanNode join;
+            join.left = static_cast<int>(plan.nodes.size()) - 2;
+            join.right = static_cast<int>(plan.nodes.size()) - 1;
+            join.conditions = graph.conditionsBetween(joined, relBit(index));
+            join.rows = correctedJoinRows(graph, joined, relBit(index), outer.rows, leaf.rows);
+            JoinChoice choice = model.chooseJoin(outer.rows, leaf.rows, join.rows, !join.conditions.empty());
+            join.components = outer.components + leaf.components + choice.cost;
+            bool broadcast = model.distributed() && graph.relationDistributions[index] != kReplicated;
+            JoinChoice probe = broadcast ? JoinChoice() : chooseIndexJoin(graph, model, joined, index, outer.rows, join.rows);
+            if (outer.cost + probe.total < model.total(join.components)) {
+                choice = probe;
+                join.components = outer.components + probe.cost;
+                PlanNode& lookup = plan.nodes.back();
+                lookup.access = AccessMethod::IndexLookup;
+                lookup.index = probe.index;
+                lookup.cost = 0;
+                lookup.components = Cost();
+            }
+            if (broadcast) {
+                choice.enforcers |= JoinChoice::kBroadcastRight;
+                join.components += model.broadcast(leaf.rows);
+            }
+            placeJoinEnforcers(query, graph, model, choice.enforcers, choice.key, -1, joined, relBit(index), plan.nodes[join.left],
+                               plan.nodes[join.right]);
+            join.algorithm = choice.algorithm;
+            join.buildLeft = choice.buildLeft;
+            join.memory = choice.memory;
+            join.cost = model.total(join.components);
+            for (int condition : join.conditions) {
+                plan.joins.push_back(query.joinConditions[condition]);
+            }
+            plan.nodes.push_back(join);
+        }
+        joined |= relBit(index);
+    }
+    if (!plan.nodes.empty()) {
+        plan.cost = plan.nodes.back().cost;
+    }
+    enforceOrderBy(query, model, plan, false);
+    gatherResult(query, model, plan, std::all_of(graph.relationDistributions.begin(), graph.relationDistributions.end(), [](int16_t distribution) {
+        return distribution == kReplicated;
+    }));
+}
+
+void recostPlan(const Query& query, const JoinGraph& graph, const CostModel& model, Plan& plan) {
+    std::vector<RelSet> sets(plan.nodes.size());
+    std::vector<double> plannedRows(plan.nodes.size());
+    for (size_t i = 0; i < plan.nodes.size(); ++i) {
+        plannedRows[i] = plan.nodes[i].rows;
+    }
+    // Give input the enforcer its parent now wants, keeping the key of one it already had
+    auto enforce = [&](PlanNode& input, RelSet side, RelSet other, uint8_t enforcers, uint8_t sort, uint8_t partition) {
+        Enforcer wanted = enforcers & sort ? Enforcer::Sort : enforcers & partition ? Enforcer::Repartition : Enforcer::None;
+        if (wanted == Enforcer::None) {
+            setEnforcer(model, input, Enforcer::None, std::string(), Cost());
+            return;
+        }
+        std::string key = wanted == input.enforcer ? input.enforcerKey : enforcerKeyOf(query, graph, side, other, -1);
+        setEnforcer(model, input, wanted, std::move(key), wanted == Enforcer::Sort ? model.sort(input.rows) : model.repartition(input.rows));
+    };
+    auto move = [&](PlanNode& input) {
+        if (input.exchange == Exchange::Shuffle) {
+            setExchange(model, input, Exchange::Shuffle, input.exchangeKey, model.shuffle(input.rows));
+        } else if (input.exchange == Exchange::Broadcast) {
+            setExchange(model, input, Exchange::Broadcast, std::string(), model.broadcast(input.rows));
+        }
+        return input.exchangeComponents;
+    };
+    for (size_t i = 0; i < plan.nodes.size(); ++i) {
+        PlanNode& node = plan.nodes[i];
+        if (node.table >= 0) {
+            sets[i] = relBit(node.table);
+            node.rows = correctedBaseRows(query, graph, node.table);
+            if (node.access == AccessMethod::IndexLookup) {
+                node.components = Cost();
+            } else if (node.index < 0) {
+                node.components = model.scan(static_cast<double>(query.fromTables[node.table].rows));
+            } else {
+                const IndexAccess& index = graph.indexes[node.table][node.index];
+                node.components = model.indexScan(index, index.tableRows * index.selectivity);
+            }
+            node.cost = model.total(node.components);
+            continue;
+        }
+        PlanNode& left = plan.nodes[node.left];
+        PlanNode& right = plan.nodes[node.right];
+        sets[i] = sets[node.left] | sets[node.right];
+        node.rows = correctedJoinRows(graph, sets[node.left], sets[node.right], left.rows, right.rows);
+        JoinChoice choice;
+        switch (node.algorithm) {
+        case JoinAlgorithm::NestedLoop:
+            choice = model.nestedLoopJoin(left.rows, right.rows, node.rows);
+            break;
+        case JoinAlgorithm::Hash: {
+            bool grace = !model.fitsInMemory(plannedRows[node.buildLeft ? node.left : node.right]);
+            bool leftPartitioned = grace && left.enforcer != Enforcer::Repartition;
+            bool rightPartitioned = grace && right.enforcer != Enforcer::Repartition;
+            choice = node.buildLeft ? model.hashJoin(left.rows, right.rows, node.rows, true, leftPartitioned, rightPartitioned)
+                                    : model.hashJoin(right.rows, left.rows, node.rows, false, rightPartitioned, leftPartitioned);
+            break;
+        }
+        case JoinAlgorithm::SortMerge:
+            choice = model.sortMergeJoin(left.rows, right.rows, node.rows, left.enforcer != Enforcer::Sort, right.enforcer != Enforcer::Sort);
+            break;
+        case JoinAlgorithm::IndexNestedLoop:
+            choice = chooseIndexJoin(graph, model, sets[node.left], right.table, left.rows, node.rows);
+            right.index = choice.index;
+            break;
+        }
+        enforce(left, sets[node.left], sets[node.right], choice.enforcers, JoinChoice::kSortLeft, JoinChoice::kPartitionLeft);
+        enforce(right, sets[node.right], sets[node.left], choice.enforcers, JoinChoice::kSortRight, JoinChoice::kPartitionRight);
+        node.memory = choice.memory;
+        node.components = left.components + choice.cost + move(left) + move(right);
+        if (node.algorithm != JoinAlgorithm::IndexNestedLoop) {
+            node.components += right.components;
+        }
+        node.cost = model.total(node.components);
+    }
+    if (plan.nodes.empty()) {
+        return;
+    }
+    PlanNode& root = plan.nodes.back();
+    if (root.enforcer == Enforcer::Sort) {
+        setEnforcer(model, root, Enforcer::Sort, root.enforcerKey, model.sort(root.rows, limitRows(query)));
+    }
+    if (root.exchange == Exchange::Gather) {
+        setExchange(model, root, Exchange::Gather, std::string(), gatherCost(query, model, root.rows));
+    }
+    plan.cost = root.cost + root.enforcerCost + root.exchangeCost;
+}
+
+class BudgetExceeded : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class PlanningClock {
+public:
+    explicit PlanningClock(const PlanningBudget& budget)
+        : budget_(budget), start_(std::chrono::steady_clock::now()) {}
+
+    double elapsed() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+    bool expired() const {
+        return budget_.seconds > 0 && elapsed() >= budget_.seconds;
+    }
+
+    bool fitsMemo(size_t bytes) const {
+        return budget_.memoBytes == 0 || bytes <= budget_.memoBytes;
+    }
+
+    // Cheap enough for the enumerators' inner loops: the clock is only read every kCheckInterval calls
+    void check(size_t memoBytes = 0) {
+        OPTIMIZER_RECORD_MEMO(memoBytes);
+        if (!fitsMemo(memoBytes)) {
+            throw BudgetExceeded("memo budget exceeded");
+        }
+        if (--countdown_ == 0) {
+            countdown_ = kCheckInterval;
+            if (expired()) {
+                throw BudgetExceeded("time budget exceeded");
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t kCheckInterval = 256;
+
+    PlanningBudget budget_;
+    std::chrono::steady_clock::time_point start_;
+    uint32_t countdown_ = kCheckInterval;
+};
+
+// Find the best split of set among those JoinGraph::joinable allows; every proper subset must
+// already be final in the memo
+template <typename Memo>
+void optimizeSubset(const JoinGraph& graph, const CostModel& model, Memo& memo, RelSet set, bool bushy) {
+    if (bushy) {
+        for (RelSet left = (set - 1) & set; left != 0; left = (left - 1) & set) {
+            if (graph.joinable(left, set ^ left, bushy)) {
+                considerJoin(graph, model, memo, left, set ^ left);
+            }
+        }
+    } else {
+        for (RelSet rest = set; rest != 0; rest &= rest - 1) {
+            RelSet right = rest & (~rest + 1);
+            if (graph.joinable(set ^ right, right, bushy)) {
+                considerJoin(graph, model, memo, set ^ right, right);
+            }
+        }
+    }
+}
+
+Plan optimizeQueryBitmask(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy,
+                          PlanningClock* clock = nullptr) {
+    size_t n = query.fromTables.size();
+    if (n == 0) {
+        return { {}, {}, 0, {} };
+    }
+    if (n > kMaxDenseMemoTables) {
+        throw std::length_error("bitmask enumerator supports at most " + std::to_string(kMaxDenseMemoTables) + " tables");
+    }
+    if (clock && !clock->fitsMemo((size_t(1) << n) * sizeof(MemoEntry))) {
+        throw BudgetExceeded("memo budget exceeded");
+    }
+
+    ArenaFrame frame(threadArena());
+    std::pmr::vector<MemoEntry> memo(size_t(1) << n, &frame.arena());
+    seedBaseTables(query, graph, model, memo);
+
+    // Every proper subset of a set is numerically smaller, so ascending order is a valid DP order
+    RelSet full = (RelSet(1) << n) - 1;
+    for (RelSet set = 1; set <= full; ++set) {
+        if (!isSingleRel(set)) {
+            if (clock) {
+                clock->check();
+            }
+            optimizeSubset(graph, model, memo, set, bushy);
+        }
+    }
+
+    return planFromMemo(query, graph, model, memo, full);
+}
+
+// Work-stealing thread pool
+// Each worker owns a deque: it pops its own tasks from the back and, once that is empty, steals
+// from the front of the other workers' deques. The thread calling run() works as worker 0 and
+// returns when every task of the batch has finished.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads) : queues_(std::max<size_t>(threads, 1)) {
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            workers_.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return queues_.size(); }
+
+    void run(std::vector<std::function<void()>>& tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+        pending_ = tasks.size();
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            Queue& queue = queues_[i % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(tasks[i]));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        drain(0);
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool tryPop(size_t self, std::function<void()>& task) {
+        {
+            Queue& own = queues_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues_.size(); ++k) {
+            Queue& victim = queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void drain(size_t self) {
+        std::function<void()> task;
+        while (tryPop(self, task)) {
+            task();
+            if (--pending_ == 0) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_.notify_all();
+            }
+        }
+    }
+
+    void workerLoop(size_t self) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+                if (stopping_) {
+                    return;
+                }
+                seen = generation_;
+            }
+            drain(self);
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::atomic<size_t> pending_{0};
+    uint64_t generation_ = 0;
+    bool stopping_ = false;
+};
+
+// Parallel bitmask enumeration
+// Sets are processed one size level at a time; within a level every set depends only on smaller,
+// already final sets, so each memo slot is written by exactly the task that owns it and no lock
+// is taken on the memo. Each set is optimized by the same loop as the serial enumerator, so the
+// chosen plan is identical to it regardless of thread count or scheduling.
+Plan optimizeQueryBitmaskParallel(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy, size_t threads,
+                                  PlanningClock* clock = nullptr) {
+    size_t n = query.fromTables.size();
+    if (n == 0) {
+        return { {}, {}, 0, {} };
+    }
+    if (n > kMaxDenseMemoTables) {
+        throw std::length_error("bitmask enumerator supports at most " + std::to_string(kMaxDenseMemoTables) + " tables");
+    }
+    if (clock && !clock->fitsMemo((size_t(1) << n) * sizeof(MemoEntry))) {
+        throw BudgetExceeded("memo budget exceeded");
+    }
+
+    // The arena is not thread-safe, and the workers allocate plan alternatives as they go
+    ArenaFrame frame(threadArena());
+    std::pmr::synchronized_pool_resource shared(&frame.arena());
+    std::pmr::vector<MemoEntry> memo(size_t(1) << n, &shared);
+    seedBaseTables(query, graph, model, memo);
+
+    WorkStealingPool pool(threads);
+    [[maybe_unused]] OptimizerMetrics* metrics = currentMetrics();
+    RelSet full = (RelSet(1) << n) - 1;
+    std::vector<RelSet> level;
+    for (size_t size = 2; size <= n; ++size) {
+        // The budget is only checked between levels, never from inside the pool's tasks
+        if (clock && clock->expired()) {
+            throw BudgetExceeded("time budget exceeded");
+        }
+
+        // All sets with exactly size members, in ascending order (Gosper's hack)
+        level.clear();
+        for (RelSet set = (RelSet(1) << size) - 1; set <= full;) {
+            level.push_back(set);
+            RelSet lowest = set & (~set + 1);
+            RelSet ripple = set + lowest;
+            set = ripple | (((set ^ ripple) >> 2) / lowest);
+        }
+
+        // Several chunks per worker so that stealing can even out uneven split counts
+        size_t chunk = std::max<size_t>(1, level.size() / (pool.size() * 8));
+        std::vector<std::function<void()>> tasks;
+        for (size_t begin = 0; begin < level.size(); begin += chunk) {
+            size_t end = std::min(level.size(), begin + chunk);
+            tasks.push_back([&, begin, end] {
+                OPTIMIZER_METRICS_SCOPE(metrics); // Workers record into the caller's metrics
+                for (size_t i = begin; i < end; ++i) {
+                    optimizeSubset(graph, model, memo, level[i], bushy);
+                }
+            });
+        }
+        pool.run(tasks);
+    }
+
+    return planFromMemo(query, graph, model, memo, full);
+}
+
+// DPccp enumeration (Moerkotte & Neumann)
+// Enumerates every connected subgraph S1 and every connected complement S2 adjacent to it exactly
+// once, in an order where both inputs are already optimal when their union is costed. For
+// left-deep plans only pairs where one side is a single relation produce a candidate. A
+// disconnected graph is enumerated component by component, and the components' plans are then
+// joined by cross products (see joinComponents).
+class ConnectedSubgraphEnumerator {
+public:
+    ConnectedSubgraphEnumerator(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy,
+                                PlanningClock* clock = nullptr, std::pmr::memory_resource* arena = std::pmr::get_default_resource())
+        : query_(query), graph_(graph), model_(model), bushy_(bushy), clock_(clock), memo_(graph.size, arena) {}
+
+    Plan run() {
+        size_t n = graph_.size;
+        if (n == 0) {
+            return { {}, {}, 0, {} };
+        }
+        seedBaseTables(query_, graph_, model_, memo_);
+
+        for (size_t i = n; i-- > 0;) {
+            RelSet start = relBit(i);
+            emitCsg(start);
+            enumerateCsgRec(start, prefixUpTo(i));
+        }
+        if (graph_.components.size() > 1) {
+            joinComponents();
+        }
+
+        RelSet full = n == 64 ? ~RelSet(0) : (RelSet(1) << n) - 1;
+        return planFromMemo(query_, graph_, model_, memo_, full);
+    }
+
+    // Offer a result computed elsewhere, of rows rows that cost read to read back, as a plan of
+    // set; it competes with the plans run() finds for set like any of them. Call before run().
+    void share(RelSet set, int shared, double rows, const Cost& read) {
+        MemoPlan plan;
+        plan.cost = model_.total(read);
+        plan.components = read;
+        plan.index = static_cast<int16_t>(shared);
+        offerPlan(model_, memo_[set], plan, rows, memo_.resource());
+    }
+
+    // The best plan of a connected set after run(), as a join tree of its own
+    Plan subplan(RelSet set) const {
+        Plan plan = { {}, {}, memo_.at(set).cost, {} };
+        appendPlanFromMemo(query_, graph_, model_, memo_, set, 0, plan);
+        return plan;
+    }
+
+private:
+    static constexpr size_t kMaxOrderedComponents = 10; // Components a DP orders; more are joined by ascending rows
+
+    // All relations with an index <= i
+    static RelSet prefixUpTo(size_t i) {
+        return i == 63 ? ~RelSet(0) : (RelSet(1) << (i + 1)) - 1;
+    }
+
+    void enumerateCsgRec(RelSet set, RelSet excluded) {
+        RelSet neighborhood = graph_.neighborhood(set, excluded);
+        if (neighborhood == 0) {
+            return;
+        }
+        for (RelSet sub = neighborhood & (~neighborhood + 1); sub != 0; sub = (sub - neighborhood) & neighborhood) {
+            emitCsg(set | sub);
+        }
+        for (RelSet sub = neighborhood & (~neighborhood + 1); sub != 0; sub = (sub - neighborhood) & neighborhood) {
+            enumerateCsgRec(set | sub, excluded | neighborhood);
+        }
+    }
+
+    void emitCsg(RelSet set) {
+        RelSet excluded = set | prefixUpTo(lowestRel(set));
+        RelSet neighborhood = graph_.neighborhood(set, excluded);
+        for (size_t v = graph_.size; v-- > 0;) {
+            if (!(neighborhood & relBit(v))) {
+                continue;
+            }
+            emitCsgCmp(set, relBit(v));
+            enumerateCmpRec(set, relBit(v), excluded | (prefixUpTo(v) & neighborhood));
+        }
+    }
+
+    void enumerateCmpRec(RelSet set, RelSet complement, RelSet excluded) {
+        RelSet neighborhood = graph_.neighborhood(complement, excluded);
+        if (neighborhood == 0) {
+            return;
+        }
+        for (RelSet sub = neighborhood & (~neighborhood + 1); sub != 0; sub = (sub - neighborhood) & neighborhood) {
+            emitCsgCmp(set, complement | sub);
+        }
+        for (RelSet sub = neighborhood & (~neighborhood + 1); sub != 0; sub = (sub - neighborhood) & neighborhood) {
+            enumerateCmpRec(set, complement | sub, excluded | neighborhood);
+        }
+    }
+
+    void emitCsgCmp(RelSet first, RelSet second) {
+        checkClock();
+        considerJoinPair(graph_, model_, memo_, first, second, bushy_ || isSingleRel(second), bushy_ || isSingleRel(first));
+    }
+
+    // Join the plans of the components: up to kMaxOrderedComponents by a DP over the sets of them,
+    // where every proper subset of a set is numerically smaller, and beyond in ascending order of
+    // rows, which keeps the intermediate cross products smallest
+    void joinComponents() {
+        const std::vector<RelSet>& components = graph_.components;
+        size_t count = components.size();
+        std::vector<std::vector<RelSet>> subsets; // Connected subsets of each component, for left-deep plans
+        if (!bushy_) {
+            for (RelSet component : components) {
+                subsets.push_back(connectedSubsets(component));
+            }
+        }
+        if (count > kMaxOrderedComponents) {
+            std::vector<size_t> order;
+            for (size_t c = 0; c < count; ++c) {
+                order.push_back(c);
+            }
+            std::stable_sort(order.begin(), order.end(),
+                             [&](size_t a, size_t b) { return memo_.at(components[a]).rows < memo_.at(components[b]).rows; });
+            RelSet joined = components[order[0]];
+            for (size_t c = 1; c < count; ++c) {
+                crossJoin(joined, order[c], subsets);
+                joined |= components[order[c]];
+            }
+            return;
+        }
+        std::vector<RelSet> unions(size_t(1) << count, 0); // Relations of each set of components
+        for (size_t set = 1; set < unions.size(); ++set) {
+            unions[set] = unions[set & (set - 1)] | components[lowestRel(set)];
+            if (isSingleRel(set)) {
+                continue;
+            }
+            if (bushy_) {
+                for (size_t left = (set - 1) & set; left != 0; left = (left - 1) & set) {
+                    checkClock();
+                    considerJoin(graph_, model_, memo_, unions[left], unions[set ^ left]);
+                }
+                continue;
+            }
+            for (size_t rest = set; rest != 0; rest &= rest - 1) {
+                size_t component = lowestRel(rest);
+                crossJoin(unions[set ^ (size_t(1) << component)], component, subsets);
+            }
+        }
+    }
+
+    // Join the relations of whole components joined with those of a component. A left-deep plan
+    // cannot take a composite right input, so it adds the component's relations one at a time: the
+    // first by a cross product, then each adjacent to those before it. Every connected subset of
+    // the component is extended in turn, smaller before larger, so each prefix is final before it
+    // is extended, as in the bitmask enumerator's search.
+    void crossJoin(RelSet joined, size_t component, const std::vector<std::vector<RelSet>>& subsets) {
+        RelSet relations = graph_.components[component];
+        if (bushy_) {
+            checkClock();
+            considerJoin(graph_, model_, memo_, joined, relations);
+            considerJoin(graph_, model_, memo_, relations, joined);
+            return;
+        }
+        for (RelSet set : subsets[component]) {
+            checkClock();
+            if (isSingleRel(set)) {
+                considerJoin(graph_, model_, memo_, joined, set);
+                if (isSingleRel(joined) && set == relations) {
+                    considerJoin(graph_, model_, memo_, set, joined);
+                }
+            }
+            RelSet neighborhood = graph_.neighborhood(set, set);
+            for (RelSet rest = neighborhood; rest != 0; rest &= rest - 1) {
+                considerJoin(graph_, model_, memo_, joined | set, rest & (~rest + 1));
+            }
+        }
+    }
+
+    // The connected subsets of component, in ascending order of size
+    std::vector<RelSet> connectedSubsets(RelSet component) const {
+        std::vector<RelSet> subsets;
+        for (RelSet rest = component; rest != 0; rest &= rest - 1) {
+            subsets.push_back(rest & (~rest + 1));
+        }
+        std::unordered_set<RelSet> seen(subsets.begin(), subsets.end());
+        for (size_t begin = 0; begin < subsets.size();) {
+            size_t end = subsets.size();
+            for (size_t i = begin; i < end; ++i) {
+                RelSet set = subsets[i];
+                RelSet neighborhood = graph_.neighborhood(set, set);
+                for (RelSet rest = neighborhood; rest != 0; rest &= rest - 1) {
+                    if (seen.insert(set | (rest & (~rest + 1))).second) {
+                        subsets.push_back(set | (rest & (~rest + 1)));
+                    }
+                }
+            }
+            begin = end;
+        }
+        return subsets;
+    }
+
+    void checkClock() {
+        if (clock_) {
+            clock_->check(memo_.bytes());
+        }
+    }
+
+    const Query& query_;
+    const JoinGraph& graph_;
+    const CostModel& model_;
+    bool bushy_;
+    PlanningClock* clock_;
+    SubsetMemo memo_; // Only connected sets ever get an entry
+};
+
+Plan optimizeQueryConnectedSubgraph(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy,
+                                    PlanningClock* clock = nullptr) {
+    ArenaFrame frame(threadArena());
+    return ConnectedSubgraphEnumerator(query, graph, model, bushy, clock, &frame.arena()).run();
+}
+
+// Greedy operator ordering (Fegaras)
+// Starts from one plan per table and repeatedly joins the two plans whose join has the fewest
+// estimated rows, preferring pairs connected by a join condition over cross products. Runs in
+// O(n^3) whatever the join graph. For left-deep plans only one composite plan is ever grown.
+Plan optimizeQueryGreedy(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy) {
+    size_t n = query.fromTables.size();
+    if (n == 0) {
+        return { {}, {}, 0, {} };
+    }
+
+    ArenaFrame frame(threadArena());
+    std::pmr::unordered_map<RelSet, MemoEntry> memo(&frame.arena());
+    seedBaseTables(query, graph, model, memo);
+    std::vector<RelSet> plans;
+    for (size_t i = 0; i < n; ++i) {
+        plans.push_back(relBit(i));
+    }
+
+    bool composite = false;
+    while (plans.size() > 1) {
+        size_t bestFirst = 0;
+        size_t bestSecond = 0;
+        bool bestConnected = false;
+        double bestRows = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < plans.size(); ++i) {
+            for (size_t j = i + 1; j < plans.size(); ++j) {
+                if (!bushy && composite && isSingleRel(plans[i]) && isSingleRel(plans[j])) {
+                    continue;
+                }
+                bool connected = graph.hasCondition(plans[i], plans[j]);
+                double rows = correctedJoinRows(graph, plans[i], plans[j], memo.at(plans[i]).rows, memo.at(plans[j]).rows);
+                if (connected != bestConnected ? connected : rows < bestRows) {
+                    bestFirst = i;
+                    bestSecond = j;
+                    bestConnected = connected;
+                    bestRows = rows;
+                }
+            }
+        }
+
+        RelSet first = plans[bestFirst];
+        RelSet second = plans[bestSecond];
+        considerJoinPair(graph, model, memo, first, second, bushy || isSingleRel(second), bushy || isSingleRel(first));
+        plans[bestFirst] = first | second;
+        plans.erase(plans.begin() + bestSecond);
+        composite = true;
+    }
+
+    return planFromMemo(query, graph, model, memo, plans[0]);
+}
+
+// Simulated annealing over join trees
+// Refines a complete plan by random local moves on its tree: swapping two leaves, or (bushy
+// only) swapping a join's inputs or rotating it, and exchanging ((X Y) Z) into ((X Z) Y), which
+// keeps left-deep trees left-deep. Worse trees are accepted with probability exp(-d / T) where d
+// is the log of the cost ratio, so the schedule does not depend on the magnitude of costs. The
+// seed is fixed, so the same query always anneals to the same plan.
+class JoinTreeAnnealer {
+public:
+    JoinTreeAnnealer(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy, PlanningClock& clock)
+        : query_(query), graph_(graph), model_(model), bushy_(bushy), clock_(clock), random_(0x5eed) {}
+
+    Plan run(const Plan& start) {
+        if (start.nodes.size() < 3) {
+            return start;
+        }
+        std::vector<PlanNode> tree = start.nodes;
+        int root = static_cast<int>(tree.size()) - 1;
+        std::vector<PlanNode> best = tree;
+        double cost = evaluate(tree, root);
+        double bestCost = cost;
+
+        size_t movesPerStage = 8 * query_.fromTables.size();
+        for (double temperature = kInitialTemperature; temperature > kFinalTemperature; temperature *= kCooling) {
+            if (clock_.expired()) {
+                break;
+            }
+            for (size_t move = 0; move < movesPerStage; ++move) {
+                std::vector<PlanNode> candidate = tree;
+                if (!mutate(candidate)) {
+                    continue;
+                }
+                double candidateCost = evaluate(candidate, root);
+                double delta = std::log(candidateCost / cost);
+                if (delta <= 0 || std::uniform_real_distribution<double>(0, 1)(random_) < std::exp(-delta / temperature)) {
+                    tree.swap(candidate);
+                    cost = candidateCost;
+                    if (cost < bestCost) {
+                        best = tree;
+                        bestCost = cost;
+                    }
+                }
+            }
+        }
+
+        ArenaFrame frame(threadArena());
+        std::pmr::unordered_map<RelSet, MemoEntry> memo(&frame.arena());
+        RelSet full = evaluateSet(best, root, memo);
+        return planFromMemo(query_, graph_, model_, memo, full);
+    }
+
+private:
+    static constexpr double kInitialTemperature = 1.0;
+    static constexpr double kFinalTemperature = 1e-3;
+    static constexpr double kCooling = 0.9;
+
+    bool mutate(std::vector<PlanNode>& tree) {
+        size_t pick = std::uniform_int_distribution<size_t>(0, tree.size() - 1)(random_);
+        switch (std::uniform_int_distribution<int>(0, bushy_ ? 4 : 1)(random_)) {
+        case 0: { // Swap two leaves
+            size_t other = std::uniform_int_distribution<size_t>(0, tree.size() - 1)(random_);
+            if (tree[pick].table < 0 || tree[other].table < 0 || pick == other) {
+                return false;
+            }
+            std::swap(tree[pick].table, tree[other].table);
+            return true;
+        }
+        case 1: { // ((X Y) Z) -> ((X Z) Y)
+            if (tree[pick].table >= 0 || tree[tree[pick].left].table >= 0) {
+                return false;
+            }
+            PlanNode& inner = tree[tree[pick].left];
+            std::swap(inner.right, tree[pick].right);
+            return true;
+        }
+        case 2: // (X Y) -> (Y X)
+            if (tree[pick].table >= 0) {
+                return false;
+            }
+            std::swap(tree[pick].left, tree[pick].right);
+            return true;
+        case 3: { // ((X Y) Z) -> (X (Y Z))
+            if (tree[pick].table >= 0 || tree[tree[pick].left].table >= 0) {
+                return false;
+            }
+            int innerIndex = tree[pick].left;
+            PlanNode& inner = tree[innerIndex];
+            int x = inner.left;
+            inner.left = inner.right;
+            inner.right = tree[pick].right;
+            tree[pick].left = x;
+            tree[pick].right = innerIndex;
+            return true;
+        }
+        default: { // (X (Y Z)) -> ((X Y) Z)
+            if (tree[pick].table >= 0 || tree[tree[pick].right].table >= 0) {
+                return false;
+            }
+            int innerIndex = tree[pick].right;
+            PlanNode& inner = tree[innerIndex];
+            int z = inner.right;
+            inner.right = inner.left;
+            inner.left = tree[pick].left;
+            tree[pick].left = innerIndex;
+            tree[pick].right = z;
+            return true;
+        }
+        }
+    }
+
+    double evaluate(const std::vector<PlanNode>& tree, int root) {
+        ArenaFrame frame(threadArena());
+        std::pmr::unordered_map<RelSet, MemoEntry> memo(&frame.arena());
+        return memo.at(evaluateSet(tree, root, memo)).cost;
+    }
+
+    // Cost the tree into a fresh memo, one entry per subtree; returns the root's relation set
+    RelSet evaluateSet(const std::vector<PlanNode>& tree, int root, std::pmr::unordered_map<RelSet, MemoEntry>& memo) {
+        seedBaseTables(query_, graph_, model_, memo);
+        return joinSubtree(tree, root, memo);
+    }
+
+    RelSet joinSubtree(const std::vector<PlanNode>& tree, int node, std::pmr::unordered_map<RelSet, MemoEntry>& memo) {
+        if (tree[node].table >= 0) {
+            return relBit(tree[node].table);
+        }
+        RelSet left = joinSubtree(tree, tree[node].left, memo);
+        RelSet right = joinSubtree(tree, tree[node].right, memo);
+        considerJoin(graph_, model_, memo, left, right);
+        return left | right;
+    }
+
+    const Query& query_;
+    const JoinGraph& graph_;
+    const CostModel& model_;
+    bool bushy_;
+    PlanningClock& clock_;
+    std::mt19937_64 random_;
+};
+
+// Top-down optimization (Cascades / Columbia)
+// The memo holds one group per relation set, and each group the logical join expressions that
+// produce it, stored as their left input's relation set. The search starts from the greedy plan's
+// tree. Exploring a group applies the transformation rules to its expressions until nothing new
+// comes out:
+// - commutativity: L R -> R L
+// - associativity: (A B) C -> A (B C), when B and C are joinable (see JoinGraph::joinable)
+// For left-deep plans the rules keep every right input a base table instead: commutativity only
+// swaps two base tables, and the left join exchange (A b) c -> (A c) b replaces associativity.
+// The rules only create expressions whose inputs are connected, or are whole components of a
+// disconnected graph, so the groups end up with exactly the splits DPccp enumerates and crosses
+// its component plans over. Implementation is left to the physical step, considerJoin,
+// so both searches cost plans the same way and find the same best cost.
+//
+// Groups are optimized on demand under a cost limit, starting from the greedy plan's cost. An
+// expression is skipped when the lower bounds of its inputs already reach the limit. The right
+// input's bound is not counted when it is a base table, because an index nested loop probes
+// it instead of scanning it. Each plan found lowers the limit for the expressions after it, to
+// its cost plus the enforcers for the group's interesting properties, so that costlier plans
+// with those properties can still enter the group's Pareto set. Alternatives are only searched
+// for under the limits a group is optimized with, so its Pareto set can be less complete than
+// the bottom-up enumerators' while its best plan is the same. A
+// group with no plan under its limit keeps that limit as its lower bound. It is optimized again
+// only if it is later asked for with a higher limit, and then the expressions it already costed
+// are not costed again. Groups that are never reached under a limit are never optimized.
+class TopDownOptimizer {
+public:
+    TopDownOptimizer(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy, PlanningClock* clock = nullptr,
+                     std::pmr::memory_resource* arena = std::pmr::get_default_resource())
+        : query_(query), graph_(graph), model_(model), bushy_(bushy), clock_(clock), arena_(arena), groups_(arena), winners_(arena) {}
+
+    Plan run() {
+        size_t n = graph_.size;
+        if (n == 0) {
+            return { {}, {}, 0, {} };
+        }
+        Plan start = optimizeQueryGreedy(query_, graph_, model_, bushy_);
+        seedBaseTables(query_, graph_, model_, winners_);
+        RelSet full = n == 64 ? ~RelSet(0) : (RelSet(1) << n) - 1;
+        if (n == 1) {
+            return planFromMemo(query_, graph_, model_, winners_, full);
+        }
+
+        // The greedy tree is the initial logical expression of each of its subtrees' groups
+        std::vector<RelSet> sets(start.nodes.size());
+        for (size_t i = 0; i < start.nodes.size(); ++i) {
+            const PlanNode& node = start.nodes[i];
+            sets[i] = node.table >= 0 ? relBit(node.table) : sets[node.left] | sets[node.right];
+            Group& group = groupFor(sets[i]);
+            if (node.table < 0) {
+                addExpression(group, sets[node.left]);
+            }
+        }
+
+        // Any plan of full must beat the greedy plan; the slack lets an optimum of exactly its cost through
+        if (std::isinf(optimizeGroup(full, start.cost * (1 + kBoundSlack)))) {
+            return start;
+        }
+        return planFromMemo(query_, graph_, model_, winners_, full);
+    }
+
+private:
+    static constexpr double kBoundSlack = 1e-9;
+
+    struct Group {
+        explicit Group(std::pmr::memory_resource* arena) : expressions(arena), costs(arena), known(arena) {}
+
+        std::pmr::vector<RelSet> expressions; // Left input of each join expression; the right is the rest of the set
+        std::pmr::vector<double> costs;       // Cost of each expression once costed with optimal inputs, NaN before
+        std::pmr::unordered_set<RelSet> known;
+        size_t explored = 0;   // Expressions the rules have been applied to
+        bool optimal = false;  // winners_ holds the group's best plan
+        double lowerBound = 0; // No plan of the group costs less
+    };
+
+    Group& groupFor(RelSet set) {
+        return groups_.try_emplace(set, arena_).first->second;
+    }
+
+    void addExpression(Group& group, RelSet left) {
+        if (group.known.insert(left).second) {
+            group.expressions.push_back(left);
+            group.costs.push_back(std::numeric_limits<double>::quiet_NaN());
+            ++expressions_;
+        }
+    }
+
+    bool adjacent(RelSet a, RelSet b) const {
+        return graph_.joinable(a, b, bushy_);
+    }
+
+    void explore(RelSet set) {
+        Group& group = groups_.at(set);
+        for (; group.explored < group.expressions.size(); ++group.explored) {
+            RelSet left = group.expressions[group.explored];
+            RelSet right = set ^ left;
+            if (bushy_ || isSingleRel(left)) {
+                addExpression(group, right);
+            }
+            if (isSingleRel(left)) {
+                continue;
+            }
+            explore(left);
+            const Group& child = groups_.at(left);
+            for (size_t i = 0; i < child.expressions.size(); ++i) {
+                RelSet a = child.expressions[i];
+                RelSet b = left ^ a;
+                if (bushy_) {
+                    // (A B) C -> A (B C); A (B C) is already known when some other split produced it
+                    if (!group.known.count(a) && adjacent(b, right)) {
+                        addExpression(groupFor(b | right), b);
+                        addExpression(group, a);
+                    }
+                } else if (!group.known.count(a | right) && adjacent(a, right)) {
+                    // (A b) c -> (A c) b
+                    addExpression(groupFor(a | right), a);
+                    addExpression(group, a | right);
+                }
+            }
+        }
+    }
+
+    double lowerBound(RelSet set) const {
+        if (isSingleRel(set)) {
+            return winners_.at(set).cost;
+        }
+        const Group& group = groups_.at(set);
+        return group.optimal ? winners_.at(set).cost : group.lowerBound;
+    }
+
+    // Cost of the best plan of set if it is below limit, infinity if no plan of set is
+    double optimizeGroup(RelSet set, double limit) {
+        if (isSingleRel(set)) {
+            double cost = winners_.at(set).cost;
+            return cost < limit ? cost : std::numeric_limits<double>::infinity();
+        }
+        Group& group = groups_.at(set);
+        if (group.optimal) {
+            double cost = winners_.at(set).cost;
+            return cost < limit ? cost : std::numeric_limits<double>::infinity();
+        }
+        if (limit <= group.lowerBound) {
+            OPTIMIZER_COUNT(pruned);
+            return std::numeric_limits<double>::infinity();
+        }
+        explore(set);
+
+        MemoEntry& winner = winners_[set];
+        double bound = limit;
+        for (size_t i = 0; i < group.expressions.size(); ++i) {
+            if (clock_) {
+                clock_->check(bytes());
+            }
+            RelSet left = group.expressions[i];
+            RelSet right = set ^ left;
+            if (!bushy_ && !isSingleRel(right)) {
+                continue;
+            }
+            if (!std::isnan(group.costs[i])) {
+                // Costed by an earlier attempt under a lower limit; its inputs have not changed since
+                if (group.costs[i] < bound) {
+                    considerJoin(graph_, model_, winners_, left, right);
+                    bound = std::min(bound, winner.cost + slack(set, winner.rows));
+                }
+                continue;
+            }
+            double rightBound = isSingleRel(right) ? 0 : lowerBound(right);
+            if (lowerBound(left) + rightBound >= bound) {
+                OPTIMIZER_COUNT(pruned);
+                continue;
+            }
+            double leftCost = optimizeGroup(left, bound - rightBound);
+            if (std::isinf(leftCost)) {
+                continue;
+            }
+            if (std::isinf(optimizeGroup(right, bound - leftCost)) && !isSingleRel(right)) {
+                continue;
+            }
+            group.costs[i] = considerJoin(graph_, model_, winners_, left, right);
+            bound = std::min(bound, winner.cost + slack(set, winner.rows));
+        }
+
+        if (winner.cost < limit) {
+            group.optimal = true;
+            return winner.cost;
+        }
+        winners_.erase(set);
+        group.lowerBound = std::max(group.lowerBound, limit);
+        return std::numeric_limits<double>::infinity();
+    }
+
+    // How much costlier than the best plan of set a plan with interesting properties can be. On a
+    // cluster any set can be replicated, which no exchange costs more than.
+    double slack(RelSet set, double rows) const {
+        if (std::isinf(rows)) {
+            return 0;
+        }
+        double slack = model_.total(model_.broadcast(rows));
+        if (graph_.hasInterestingProperties(set)) {
+            slack += model_.total(model_.sort(rows)) + model_.total(model_.repartition(rows));
+        }
+        return slack;
+    }
+
+    size_t bytes() const {
+        return expressions_ * (3 * sizeof(RelSet) + sizeof(double)) + groups_.size() * (sizeof(Group) + sizeof(MemoEntry));
+    }
+
+    const Query& query_;
+    const JoinGraph& graph_;
+    const CostModel& model_;
+    bool bushy_;
+    PlanningClock* clock_;
+    std::pmr::memory_resource* arena_;
+    std::pmr::unordered_map<RelSet, Group> groups_;
+    std::pmr::unordered_map<RelSet, MemoEntry> winners_; // Best plan of each optimal group (and of each base table)
+    size_t expressions_ = 0;
+};
+
+Plan optimizeQueryTopDown(const Query& query, const JoinGraph& graph, const CostModel& model, bool bushy, PlanningClock* clock = nullptr) {
+    ArenaFrame frame(threadArena());
+    return TopDownOptimizer(query, graph, model, bushy, clock, &frame.arena()).run();
+}
+
+Plan optimizeQueryExact(const Query& query, const JoinGraph& graph, const CostModel& model, const OptimizerOptions& options,
+                        PlanningClock* clock = nullptr) {
+    switch (options.enumerator) {
+    case EnumeratorMode::StringKeyed: {
+        Plan plan = optimizeQueryStringKeyed(query);
+        buildLeftDeepTree(query, graph, model, plan);
+        return plan;
+    }
+    case EnumeratorMode::Bitmask:
+        if (options.threads > 1) {
+            return optimizeQueryBitmaskParallel(query, graph, model, options.bushy, options.threads, clock);
+        }
+        return optimizeQueryBitmask(query, graph, model, options.bushy, clock);
+    case EnumeratorMode::TopDown:
+        return optimizeQueryTopDown(query, graph, model, options.bushy, clock);
+    case EnumeratorMode::ConnectedSubgraph:
+        break;
+    }
+    return optimizeQueryConnectedSubgraph(query, graph, model, options.bushy, clock);
+}
+
+// Anytime optimization
+// The greedy plan comes first, so a complete plan exists after O(n^3) work. Queries within
+// budget.exactTables then try exact enumeration, whose plan is returned if it finishes within the
+// budget. Otherwise the greedy plan is annealed until the deadline or the end of the schedule.
+Plan optimizeQueryWithinBudget(const Query& query, const JoinGraph& graph, const CostModel& model, const OptimizerOptions& options) {
+    PlanningClock clock(options.budget);
+    Plan best = optimizeQueryGreedy(query, graph, model, options.bushy);
+    if (query.fromTables.size() <= options.budget.exactTables) {
+        try {
+            Plan exact = optimizeQueryExact(query, graph, model, options, &clock);
+            return exact.cost <= best.cost ? exact : best;
+        } catch (const BudgetExceeded&) {
+        } catch (const std::length_error&) {
+            // Too many tables for the chosen enumerator: treat like a blown budget
+        }
+    }
+    Plan annealed = JoinTreeAnnealer(query, graph, model, options.bushy, clock).run(best);
+    return annealed.cost < best.cost ? annealed : best;
+}
+
+JoinGraph planningGraph(const Query& query, const OptimizerOptions& options) {
+    JoinGraph graph = buildJoinGraph(query, options.statistics);
+    if (options.feedback != nullptr) {
+        std::shared_ptr<const FeedbackCorrections> corrections = options.feedback->corrections();
+        if (!corrections->empty()) {
+            attachFeedback(graph, query, std::move(corrections));
+        }
+    }
+    return graph;
+}
+
+Plan optimizeQuery(const Query& query, const OptimizerOptions& options) {
+    OPTIMIZER_METRICS_SCOPE(options.metrics);
+    OPTIMIZER_PHASE(Enumeration);
+    JoinGraph graph = planningGraph(query, options);
+    CostModel model(options.costWeights);
+    if (options.budget.limited(query.fromTables.size())) {
+        return optimizeQueryWithinBudget(query, graph, model, options);
+    }
+    return optimizeQueryExact(query, graph, model, options);
+}
+
+// Re-lex a select item or filter with every literal replaced by '?' and keywords upper-cased
+void appendParameterized(std::string& key, std::string_view text) {
+    std::string normalized;
+    try {
+        Lexer lexer(text);
+        for (Token token = lexer.next(); token.kind != TokenKind::End; token = lexer.next()) {
+            if (token.kind == TokenKind::Number || token.kind == TokenKind::String) {
+                normalized += '?';
+            } else if (token.keyword != Keyword::None) {
+                normalized += kKeywordNames[static_cast<int>(token.keyword)];
+            } else {
+                normalized.append(text.substr(token.offset, token.length));
+            }
+            normalized += ' ';
+        }
+    } catch (const ParseError&) {
+        normalized.assign(text); // Not lexable: only an identical text can share the fingerprint
+    }
+    key += normalized;
+}
+
+QueryFingerprint fingerprintQuery(const Query& query) {
+    QueryFingerprint fingerprint;
+    fingerprint.key.reserve(256);
+
+    fingerprint.key += "S ";
+    for (const auto& column : query.selectColumns) {
+        appendParameterized(fingerprint.key, column);
+        fingerprint.key += ',';
+    }
+
+    // Tables sort by name, then alias; join conditions are rewritten against the canonical
+    // positions, each with its two sides ordered, and sorted as text
+    size_t tableCount = query.fromTables.size();
+    fingerprint.tables.resize(tableCount);
+    for (size_t i = 0; i < tableCount; ++i) {
+        fingerprint.tables[i] = static_cast<int>(i);
+    }
+    std::sort(fingerprint.tables.begin(), fingerprint.tables.end(), [&](int a, int b) {
+        const Table& x = query.fromTables[a];
+        const Table& y = query.fromTables[b];
+        return x.name != y.name ? x.name < y.name : x.alias < y.alias;
+    });
+    std::vector<int> position(tableCount);
+    fingerprint.key += "|T ";
+    for (size_t i = 0; i < tableCount; ++i) {
+        const Table& table = query.fromTables[fingerprint.tables[i]];
+        position[fingerprint.tables[i]] = static_cast<int>(i);
+        fingerprint.key += table.name + ' ' + table.alias + ',';
+    }
+
+    auto canonicalSide = [&](const std::string& columnRef) {
+        int table = tableIndexOf(query, columnRef);
+        return table < 0 ? columnRef : std::to_string(position[table]) + '.' + columnNameOf(columnRef);
+    };
+    std::vector<std::string> conditions;
+    conditions.reserve(query.joinConditions.size());
+    for (const auto& join : query.joinConditions) {
+        std::string first = canonicalSide(join.first);
+        std::string second = canonicalSide(join.second);
+        conditions.push_back(first < second ? first + '=' + second : second + '=' + first);
+    }
+    fingerprint.conditions.resize(conditions.size());
+    for (size_t i = 0; i < conditions.size(); ++i) {
+        fingerprint.conditions[i] = static_cast<int>(i);
+    }
+    std::stable_sort(fingerprint.conditions.begin(), fingerprint.conditions.end(),
+                     [&](int a, int b) { return conditions[a] < conditions[b]; });
+    fingerprint.key += "|J ";
+    for (int condition : fingerprint.conditions) {
+        fingerprint.key += conditions[condition] + ',';
+    }
+
+    std::vector<std::string> filters;
+    filters.reserve(query.filterConditions.size());
+    for (const auto& filter : query.filterConditions) {
+        filters.emplace_back();
+        appendParameterized(filters.back(), filter);
+    }
+    std::sort(filters.begin(), filters.end());
+    fingerprint.key += "|F ";
+    for (const auto& filter : filters) {
+        fingerprint.key += filter + ',';
+    }
+
+    fingerprint.key += "|G ";
+    for (const auto& key : query.groupBy) {
+        appendParameterized(fingerprint.key, key);
+        fingerprint.key += ',';
+    }
+
+    // The LIMIT is kept verbatim: it decides whether a sorted plan beats sorting the result
+    fingerprint.key += "|O ";
+    for (const auto& key : query.orderBy) {
+        appendParameterized(fingerprint.key, key.expression);
+        fingerprint.key += key.descending ? "DESC," : ",";
+    }
+    fingerprint.key += "|L " + std::to_string(query.limit);
+
+    fingerprint.hash = hashValue(fingerprint.key);
+    return fingerprint;
+}
+
+PlanCache::PlanCache(size_t capacity, double rowDriftThreshold, size_t shardCount)
+    : rowDriftThreshold_(rowDriftThreshold), shards_(std::max<size_t>(1, shardCount)) {
+    shardCapacity_ = (capacity + shards_.size() - 1) / shards_.size(); // 0 disables caching
+}
+
+bool PlanCache::lookup(const Query& query, const QueryFingerprint& fingerprint, Plan& plan) {
+    Shard& shard = shardFor(fingerprint);
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto found = shard.index.find(fingerprint.key);
+        if (found != shard.index.end()) {
+            const Entry& entry = *shard.slots[found->second];
+            if (!drifted(query, fingerprint, entry)) {
+                entry.referenced.store(true, std::memory_order_relaxed);
+                plan = fromCanonical(query, fingerprint, entry.plan);
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        } else {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto found = shard.index.find(fingerprint.key);
+    if (found != shard.index.end() && drifted(query, fingerprint, *shard.slots[found->second])) {
+        erase(shard, found->second);
+        invalidations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void PlanCache::insert(const Query& query, const QueryFingerprint& fingerprint, const Plan& plan) {
+    if (shardCapacity_ == 0) {
+        return;
+    }
+    auto entry = std::make_unique<Entry>();
+    entry->key = fingerprint.key;
+    entry->plan = toCanonical(fingerprint, plan);
+    for (int table : fingerprint.tables) {
+        entry->tables.push_back(query.fromTables[table].name);
+        entry->rows.push_back(filteredRows(query, table));
+    }
+
+    Shard& shard = shardFor(fingerprint);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto found = shard.index.find(fingerprint.key);
+    if (found != shard.index.end()) {
+        shard.slots[found->second] = std::move(entry);
+        return;
+    }
+    if (shard.slots.size() < shardCapacity_) {
+        shard.index.emplace(fingerprint.key, shard.slots.size());
+        shard.slots.push_back(std::move(entry));
+        return;
+    }
+    // CLOCK sweep: clear reference bits until an entry not used since the last pass turns up
+    while (shard.slots[shard.hand]->referenced.exchange(false, std::memory_order_relaxed)) {
+        shard.hand = (shard.hand + 1) % shard.slots.size();
+    }
+    shard.index.erase(shard.slots[shard.hand]->key);
+    shard.index.emplace(fingerprint.key, shard.hand);
+    shard.slots[shard.hand] = std::move(entry);
+    shard.hand = (shard.hand + 1) % shard.slots.size();
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PlanCache::invalidateTable(const std::string& table) {
+    for (Shard& shard : shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        for (size_t slot = shard.slots.size(); slot-- > 0;) {
+            const auto& tables = shard.slots[slot]->tables;
+            if (std::find(tables.begin(), tables.end(), table) != tables.end()) {
+                erase(shard, slot);
+                invalidations_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void PlanCache::clear() {
+    for (Shard& shard : shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.index.clear();
+        shard.slots.clear();
+        shard.hand = 0;
+    }
+}
+
+PlanCache::Counters PlanCache::counters() const {
+    Counters counters;
+    counters.hits = hits_.load(std::memory_order_relaxed);
+    counters.misses = misses_.load(std::memory_order_relaxed);
+    counters.invalidations = invalidations_.load(std::memory_order_relaxed);
+    counters.evictions = evictions_.load(std::memory_order_relaxed);
+    for (const Shard& shard : shards_) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        counters.entries += shard.slots.size();
+    }
+    return counters;
+}
+
+PlanCache::Shard& PlanCache::shardFor(const QueryFingerprint& fingerprint) {
+    return shards_[fingerprint.hash % shards_.size()];
+}
+
+bool PlanCache::drifted(const Query& query, const QueryFingerprint& fingerprint, const Entry& entry) const {
+    for (size_t i = 0; i < entry.rows.size(); ++i) {
+        double rows = filteredRows(query, fingerprint.tables[i]);
+        if (std::fabs(rows - entry.rows[i]) > rowDriftThreshold_ * std::max(1.0, entry.rows[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PlanCache::erase(Shard& shard, size_t slot) {
+    shard.index.erase(shard.slots[slot]->key);
+    if (slot + 1 != shard.slots.size()) {
+        shard.slots[slot] = std::move(shard.slots.back());
+        shard.index[shard.slots[slot]->key] = slot;
+    }
+    shard.slots.pop_back();
+    if (shard.hand >= shard.slots.size()) {
+        shard.hand = 0;
+    }
+}
+
+Plan PlanCache::toCanonical(const QueryFingerprint& fingerprint, const Plan& plan) {
+    std::vector<int> tablePosition(fingerprint.tables.size());
+    for (size_t i = 0; i < fingerprint.tables.size(); ++i) {
+        tablePosition[fingerprint.tables[i]] = static_cast<int>(i);
+    }
+    std::vector<int> conditionPosition(fingerprint.conditions.size());
+    for (size_t i = 0; i < fingerprint.conditions.size(); ++i) {
+        conditionPosition[fingerprint.conditions[i]] = static_cast<int>(i);
+    }
+    Plan canonical = { {}, {}, plan.cost, plan.nodes };
+    canonical.memoEntries = plan.memoEntries;
+    for (PlanNode& node : canonical.nodes) {
+        if (node.table >= 0) {
+            node.table = tablePosition[node.table];
+        }
+        for (int& condition : node.conditions) {
+            condition = conditionPosition[condition];
+        }
+    }
+    return canonical;
+}
+
+Plan PlanCache::fromCanonical(const Query& query, const QueryFingerprint& fingerprint, const Plan& canonical) {
+    Plan plan = { {}, {}, canonical.cost, canonical.nodes };
+    plan.memoEntries = canonical.memoEntries;
+    for (PlanNode& node : plan.nodes) {
+        if (node.table >= 0) {
+            node.table = fingerprint.tables[node.table];
+            plan.tables.push_back(query.fromTables[node.table]);
+        }
+        for (int& condition : node.conditions) {
+            condition = fingerprint.conditions[condition];
+            plan.joins.push_back(query.joinConditions[condition]);
+        }
+    }
+    return plan;
+}
+
+Plan optimizeQueryCached(const Query& query, const OptimizerOptions& options, PlanCache& cache) {
+    QueryFingerprint fingerprint = fingerprintQuery(query);
+    Plan plan;
+    if (cache.lookup(query, fingerprint, plan)) {
+        return plan;
+    }
+    plan = optimizeQuery(query, options);
+    cache.insert(query, fingerprint, plan);
+    return plan;
+}
+
+// Generate the Optimized Query
+// The FROM clause mirrors the join tree: every composite input is parenthesized, and each join
+// carries the conditions between its two inputs in its ON clause, preceded by a /*+ ... */ hint
+// naming the chosen operator (and the build side of a hash join) for the executor, and which of
+// its inputs it shuffles or broadcasts to other nodes and sorts or repartitions first. A table
+// read through an index is followed by a hint naming the index and how it is read.
+const char* accessMethodName(AccessMethod access) {
+    switch (access) {
+    case AccessMethod::FullScan:
+        return "FULL_SCAN";
+    case AccessMethod::IndexScan:
+        return "INDEX_SCAN";
+    case AccessMethod::IndexOnlyScan:
+        return "INDEX_ONLY_SCAN";
+    case AccessMethod::IndexLookup:
+        return "INDEX_LOOKUP";
+    }
+    return "";
+}
+
+std::string generateJoinTree(const Query& query, const Plan& plan, int nodeIndex, bool nested) {
+    const PlanNode& node = plan.nodes[nodeIndex];
+    if (node.table >= 0) {
+        const Table& table = query.fromTables[node.table];
+        std::string sql = table.alias.empty() ? table.name : table.name + " " + table.alias;
+        if (node.index >= 0) {
+            sql += std::string(" /*+ ") + accessMethodName(node.access) + (node.backward ? "_DESC(" : "(") + table.indexes[node.index].name + ") */";
+        } else if (node.backward) {
+            sql += " /*+ FULL_SCAN_DESC */";
+        }
+        return sql;
+    }
+
+    std::string sql = generateJoinTree(query, plan, node.left, true);
+    if (node.conditions.empty()) {
+        sql += " CROSS JOIN " + generateJoinTree(query, plan, node.right, true);
+    } else {
+        std::string hint = joinAlgorithmName(node.algorithm);
+        if (node.algorithm == JoinAlgorithm::Hash) {
+            hint += node.buildLeft ? " BUILD_LEFT" : " BUILD_RIGHT";
+        }
+        for (const char* side : {"LEFT", "RIGHT"}) {
+            const PlanNode& input = plan.nodes[side[0] == 'L' ? node.left : node.right];
+            if (input.exchange != Exchange::None) {
+                hint += std::string(input.exchange == Exchange::Shuffle ? " SHUFFLE_" : " BROADCAST_") + side;
+            }
+            if (input.enforcer != Enforcer::None) {
+                hint += std::string(input.enforcer == Enforcer::Sort ? " SORT_" : " PARTITION_") + side;
+            }
+        }
+        sql += " JOIN /*+ " + hint + " */ " + generateJoinTree(query, plan, node.right, true) + " ON ";
+        for (int condition : node.conditions) {
+            sql += query.joinConditions[condition].first + " = " + query.joinConditions[condition].second + " AND ";
+        }
+        sql.erase(sql.size() - 5); // Remove the last " AND "
+    }
+    return nested ? "(" + sql + ")" : sql;
+}
+
+std::string generateOptimizedQuery(const Query& query, const Plan& plan) {
+    OPTIMIZER_PHASE(Emission);
+    std::string optimizedQuery = "SELECT ";
+    for (const auto& column : query.selectColumns) {
+        optimizedQuery += column + ", ";
+    }
+    optimizedQuery.pop_back();
+    optimizedQuery.pop_back();
+
+    if (!plan.nodes.empty()) {
+        optimizedQuery += " FROM " + generateJoinTree(query, plan, static_cast<int>(plan.nodes.size()) - 1, false);
+    }
+
+    if (!query.filterConditions.empty()) {
+        optimizedQuery += " WHERE ";
+        for (const auto& filter : query.filterConditions) {
+            optimizedQuery += filter + " AND ";
+        }
+        optimizedQuery.erase(optimizedQuery.size() - 5); // Remove the last " AND "
+    }
+
+    for (size_t i = 0; i < query.groupBy.size(); ++i) {
+        optimizedQuery += (i == 0 ? " GROUP BY " : ", ") + query.groupBy[i];
+    }
+    for (size_t i = 0; i < query.orderBy.size(); ++i) {
+        optimizedQuery += (i == 0 ? " ORDER BY " : ", ") + query.orderBy[i].expression + (query.orderBy[i].descending ? " DESC" : "");
+    }
+    if (query.limit >= 0) {
+        optimizedQuery += " LIMIT " + std::to_string(query.limit);
+    }
+
+    return optimizedQuery;
+}
+
+void appendEstimates(double rows, double cost, const Cost& components, std::string& out) {
+    std::ostringstream estimates;
+    estimates << "  (rows=" << rows << " cost=" << cost << " cpu=" << components.cpu << " memory=" << components.memory
+              << " io=" << components.io;
+    if (components.network > 0) {
+        estimates << " network=" << components.network;
+    }
+    estimates << ")";
+    out += estimates.str();
+}
+
+void appendActuals(const NodeActuals& actuals, std::string& out) {
+    std::ostringstream measured;
+    measured << " (actual rows=" << actuals.rows << " time=" << actuals.seconds * 1000 << " ms)";
+    out += measured.str();
+}
+
+void explainNode(const Query& query, const Plan& plan, int nodeIndex, size_t depth, std::string& out,
+                 const std::vector<NodeActuals>* actuals = nullptr) {
+    const PlanNode& node = plan.nodes[nodeIndex];
+    auto exchangeLine = [&]() {
+        static const char* const kExchangeLabels[] = {"", "SHUFFLE ", "BROADCAST", "GATHER"};
+        out.append(depth * 2, ' ');
+        out += std::string(depth > 0 ? "-> " : "") + kExchangeLabels[static_cast<int>(node.exchange)] + node.exchangeKey;
+        Cost components = node.components + node.exchangeComponents;
+        double cost = node.cost + node.exchangeCost;
+        if (node.exchange == Exchange::Gather) {
+            components += node.enforcerComponents;
+            cost += node.enforcerCost;
+        }
+        appendEstimates(node.rows, cost, components, out);
+        out += '\n';
+        ++depth;
+    };
+    if (node.exchange == Exchange::Gather) {
+        exchangeLine();
+    }
+    if (node.enforcer != Enforcer::None) {
+        out.append(depth * 2, ' ');
+        out += std::string(depth > 0 ? "-> " : "") + (node.enforcer == Enforcer::Sort ? "SORT " : "REPARTITION ") + node.enforcerKey;
+        bool moved = node.exchange != Exchange::None && node.exchange != Exchange::Gather;
+        appendEstimates(node.rows, node.cost + node.enforcerCost + (moved ? node.exchangeCost : 0),
+                        node.components + node.enforcerComponents + (moved ? node.exchangeComponents : Cost()), out);
+        out += '\n';
+        ++depth;
+    }
+    if (node.exchange != Exchange::None && node.exchange != Exchange::Gather) {
+        exchangeLine();
+    }
+    out.append(depth * 2, ' ');
+    if (depth > 0) {
+        out += "-> ";
+    }
+    if (node.shared >= 0) {
+        // Its subtree is explained once, with the shared result
+        out += "SHARED RESULT #" + std::to_string(node.shared + 1);
+        appendEstimates(node.rows, node.cost, node.components, out);
+        if (actuals != nullptr) {
+            appendActuals((*actuals)[nodeIndex], out);
+        }
+        out += '\n';
+        return;
+    }
+    if (node.table >= 0) {
+        const Table& table = query.fromTables[node.table];
+        static const char* const kAccessLabels[] = {"SCAN ", "INDEX SCAN ", "INDEX ONLY SCAN ", "INDEX LOOKUP "};
+        out += kAccessLabels[static_cast<int>(node.access)] + (table.alias.empty() ? table.name : table.name + " " + table.alias);
+        if (node.index >= 0) {
+            out += " USING " + table.indexes[node.index].name;
+        }
+        if (node.backward) {
+            out += " BACKWARD";
+        }
+    } else {
+        out += joinAlgorithmName(node.algorithm);
+        if (node.conditions.empty()) {
+            out += " CROSS";
+        } else if (node.algorithm == JoinAlgorithm::Hash) {
+            out += node.buildLeft ? " BUILD_LEFT" : " BUILD_RIGHT";
+        }
+    }
+
+    appendEstimates(node.rows, node.cost, node.components, out);
+    if (actuals != nullptr) {
+        appendActuals((*actuals)[nodeIndex], out);
+    }
+    for (size_t i = 0; i < node.conditions.size(); ++i) {
+        const auto& join = query.joinConditions[node.conditions[i]];
+        out += (i == 0 ? " ON " : " AND ") + join.first + " = " + join.second;
+    }
+    bool first = true;
+    for (const auto& filter : query.tableFilters) {
+        if (filter.table == node.table) {
+            out += (first ? " FILTER " : " AND ") + query.filterConditions[filter.condition];
+            first = false;
+        }
+    }
+    out += '\n';
+
+    if (node.table < 0) {
+        explainNode(query, plan, node.left, depth + 1, out, actuals);
+        explainNode(query, plan, node.right, depth + 1, out, actuals);
+    }
+}
+
+std::string explainPlan(const Query& query, const Plan& plan, const std::vector<NodeActuals>* actuals) {
+    std::string out;
+    if (!plan.nodes.empty()) {
+        const PlanNode& root = plan.nodes.back();
+        size_t depth = 0;
+        if (query.limit >= 0) {
+            out += "LIMIT " + std::to_string(query.limit);
+            appendEstimates(std::min(limitRows(query), root.rows), plan.cost, root.components + root.enforcerComponents + root.exchangeComponents,
+                            out);
+            out += '\n';
+            depth = 1;
+        }
+        explainNode(query, plan, static_cast<int>(plan.nodes.size()) - 1, depth, out, actuals);
+    }
+    std::vector<bool> pushed(query.filterConditions.size(), false);
+    for (const auto& filter : query.tableFilters) {
+        pushed[filter.condition] = true;
+    }
+    bool first = true;
+    for (size_t i = 0; i < query.filterConditions.size(); ++i) {
+        if (!pushed[i]) {
+            out += (first ? "Filter: " : " AND ") + query.filterConditions[i];
+            first = false;
+        }
+    }
+    if (!first) {
+        out += '\n';
+    }
+    return out;
+}
+
+std::string explainRewrite(const RewriteSummary& summary) {
+    std::string out;
+    if (!summary.eliminatedTables.empty()) {
+        out += "Rewrite: eliminated join of";
+        for (const auto& table : summary.eliminatedTables) {
+            out += ' ' + table;
+        }
+        out += '\n';
+    }
+    if (summary.inferredConditions != 0) {
+        out += "Rewrite: inferred " + std::to_string(summary.inferredConditions) + " join conditions\n";
+    }
+    return out;
+}
+
+std::string explainMetrics(const OptimizerMetrics& metrics, const Plan& plan) {
+    std::ostringstream out;
+    out << "Timing (ms):";
+    for (int phase = 0; phase < 4; ++phase) {
+        out << " " << kOptimizerPhaseNames[phase] << " " << metrics.seconds(static_cast<OptimizerPhase>(phase)) * 1000;
+    }
+    out << "\nSearch: enumerated " << metrics.enumerated << ", pruned " << metrics.pruned << ", memoized " << metrics.memoized
+        << ", memo entries " << plan.memoEntries << ", memo peak " << metrics.memoPeakBytes << " bytes\n";
+    return out.str();
+}
+
+std::vector<size_t> parameterMarkers(std::string_view sql) {
+    std::vector<size_t> markers;
+    Lexer lexer(sql);
+    for (Token token = lexer.next(); token.kind != TokenKind::End; token = lexer.next()) {
+        if (token.kind == TokenKind::Symbol && token.text == "?") {
+            markers.push_back(token.offset);
+        }
+    }
+    return markers;
+}
+
+PreparedStatement::PreparedStatement(std::string sql, const OptimizerOptions& options) : sql_(std::move(sql)), options_(options) {
+    options_.metrics = nullptr;
+    markers_ = parameterMarkers(sql_);
+    query_ = parseQuery(sql_, options_.statistics);
+    if (options_.rewrite) {
+        rewrite_ = rewriteQuery(query_, options_.statistics);
+    }
+    for (size_t i = 0; i < query_.tableFilters.size() && dimensions_.size() < kMaxParametricDimensions; ++i) {
+        if (!parameterMarkers(query_.filterConditions[query_.tableFilters[i].condition]).empty()) {
+            dimensions_.push_back(static_cast<int>(i));
+        }
+    }
+    static const size_t kPointsPerDimension[kMaxParametricDimensions + 1] = {1, 9, 5, 4};
+    for (int filter : dimensions_) {
+        double rows = static_cast<double>(std::max(1LL, query_.fromTables[query_.tableFilters[filter].table].rows));
+        size_t points = rows > 1 ? kPointsPerDimension[dimensions_.size()] : 1;
+        std::vector<double> selectivities;
+        for (size_t k = 0; k < points; ++k) {
+            selectivities.push_back(points == 1 ? 1 : std::pow(rows, -static_cast<double>(points - 1 - k) / static_cast<double>(points - 1)));
+        }
+        grid_.push_back(std::move(selectivities));
+    }
+    prepare();
+}
+
+size_t PreparedStatement::gridPoints() const {
+    size_t points = 1;
+    for (const auto& selectivities : grid_) {
+        points *= selectivities.size();
+    }
+    return points;
+}
+
+PreparedStatement::Binding PreparedStatement::bind(const std::vector<std::string>& values) const {
+    if (values.size() != markers_.size()) {
+        throw std::runtime_error("the statement takes " + std::to_string(markers_.size()) + " parameters, not " +
+                                 std::to_string(values.size()));
+    }
+    Binding binding;
+    size_t copied = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (!isLiteralText(values[i])) {
+            throw std::runtime_error("parameter " + std::to_string(i + 1) + " is not a literal: " + values[i]);
+        }
+        binding.sql.append(sql_, copied, markers_[i] - copied);
+        binding.sql += values[i];
+        copied = markers_[i] + 1;
+    }
+    binding.sql.append(sql_, copied, std::string::npos);
+    binding.query = parseQuery(binding.sql, options_.statistics);
+    if (options_.rewrite) {
+        binding.rewrite = rewriteQuery(binding.query, options_.statistics);
+    }
+    if (binding.query.fromTables.size() != query_.fromTables.size() || binding.query.joinConditions.size() != query_.joinConditions.size()) {
+        throw std::runtime_error("the bound statement no longer matches its prepared plans");
+    }
+    JoinGraph graph = planningGraph(binding.query, options_);
+    CostModel model(options_.costWeights);
+    for (size_t i = 0; i < plans_.size(); ++i) {
+        Plan plan = plans_[i].plan;
+        recostPlan(binding.query, graph, model, plan);
+        if (i == 0 || plan.cost < binding.plan.cost) {
+            binding.plan = std::move(plan);
+            binding.choice = i;
+        }
+    }
+    return binding;
+}
+
+bool PreparedStatement::isLiteralText(std::string_view text) {
+    try {
+        Lexer lexer(text);
+        Token token = lexer.next();
+        if (token.kind == TokenKind::Symbol && token.text == "-") {
+            token = lexer.next();
+            if (token.kind != TokenKind::Number) {
+                return false;
+            }
+        }
+        bool literal = token.kind == TokenKind::Number || token.kind == TokenKind::String || token.keyword == Keyword::Null;
+        return literal && lexer.next().kind == TokenKind::End;
+    } catch (const ParseError&) {
+        return false;
+    }
+}
+
+Query PreparedStatement::queryAt(size_t point) const {
+    Query query = query_;
+    for (size_t d = 0; d < dimensions_.size(); ++d) {
+        query.tableFilters[dimensions_[d]].selectivity = grid_[d][point % grid_[d].size()];
+        point /= grid_[d].size();
+    }
+    return query;
+}
+
+void PreparedStatement::prepare() {
+    size_t points = gridPoints();
+    std::vector<Plan> candidates;
+    std::unordered_map<std::string, size_t> seen;
+    for (size_t point = 0; point < points; ++point) {
+        Query query = queryAt(point);
+        Plan plan = optimizeQuery(query, options_);
+        if (seen.emplace(generateOptimizedQuery(query, plan), candidates.size()).second) {
+            candidates.push_back(std::move(plan));
+        }
+    }
+
+    // What every candidate costs at every point
+    CostModel model(options_.costWeights);
+    std::vector<std::vector<double>> costs(candidates.size(), std::vector<double>(points));
+    std::vector<double> optimum(points, std::numeric_limits<double>::infinity());
+    for (size_t point = 0; point < points; ++point) {
+        Query query = queryAt(point);
+        JoinGraph graph = planningGraph(query, options_);
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            Plan plan = candidates[c];
+            recostPlan(query, graph, model, plan);
+            costs[c][point] = plan.cost;
+            optimum[point] = std::min(optimum[point], plan.cost);
+        }
+    }
+
+    // Cheapest kept candidate at a point
+    std::vector<bool> kept(candidates.size(), true);
+    auto bestAt = [&](size_t point) {
+        size_t best = candidates.size();
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            if (kept[c] && (best == candidates.size() || costs[c][point] < costs[best][point])) {
+                best = c;
+            }
+        }
+        return best;
+    };
+    for (size_t left = candidates.size(); left > 1; --left) {
+        size_t drop = candidates.size();
+        double dropRatio = std::numeric_limits<double>::infinity();
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            if (!kept[c]) {
+                continue;
+            }
+            kept[c] = false;
+            double ratio = 1;
+            for (size_t point = 0; point < points; ++point) {
+                ratio = std::max(ratio, costs[bestAt(point)][point] / std::max(optimum[point], 1e-9));
+            }
+            kept[c] = true;
+            if (ratio < dropRatio) {
+                drop = c;
+                dropRatio = ratio;
+            }
+        }
+        if (dropRatio > kParametricCostSlack && left <= kMaxParametricPlans) {
+            break;
+        }
+        kept[drop] = false;
+    }
+
+    std::vector<size_t> slot(candidates.size());
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        if (kept[c]) {
+            slot[c] = plans_.size();
+            plans_.push_back({std::move(candidates[c]), {}});
+        }
+    }
+    for (size_t point = 0; point < points; ++point) {
+        auto& ranges = plans_[slot[bestAt(point)]].ranges;
+        for (size_t d = 0, rest = point; d < dimensions_.size(); rest /= grid_[d].size(), ++d) {
+            double selectivity = grid_[d][rest % grid_[d].size()];
+            if (ranges.size() <= d) {
+                ranges.emplace_back(selectivity, selectivity);
+            }
+            ranges[d] = {std::min(ranges[d].first, selectivity), std::max(ranges[d].second, selectivity)};
+        }
+    }
+}
+
+std::string explainPrepared(const PreparedStatement& statement) {
+    std::ostringstream out;
+    const Query& query = statement.query();
+    for (size_t i = 0; i < statement.plans().size(); ++i) {
+        const ParametricPlan& prepared = statement.plans()[i];
+        out << "Prepared plan " << i + 1 << ":";
+        for (size_t d = 0; d < prepared.ranges.size(); ++d) {
+            out << (d == 0 ? " " : ", ") << query.filterConditions[query.tableFilters[statement.dimensions()[d]].condition]
+                << " selectivity " << prepared.ranges[d].first << ".." << prepared.ranges[d].second;
+        }
+        out << "\n  " << generateOptimizedQuery(query, prepared.plan) << '\n';
+    }
+    return out.str();
+}
+
+// Multi-Query Optimization
+// Plans a batch of queries for the work of the whole batch rather than of each query: a join that
+// several queries compute, over the same tables under the same table filters and join conditions,
+// is computed once, written out as a temporary result and read back by each of them. Candidates
+// are the joins of the queries' own best plans, found in other queries by the descriptors of their
+// relations (see relationDescriptor); a query with two relations of one descriptor can only
+// match candidates that hold neither. Candidates are shared greedily: each round shares the one
+// that lowers the batch's total cost most, replanning the queries it occurs in with every result
+// shared so far offered to DPccp as a plan of its relations, costed as a scan of its rows, so a
+// query still joins the tables itself where that is cheaper. A shared result costs its best plan
+// once plus writing its rows out. Rounds stop once no candidate lowers the total; results fewer
+// than two queries end up reading are then dropped again. Shared results are computed from the
+// base tables, never from one another, and queries beyond the exact enumerator's budget are
+// planned alone by optimizeQuery.
+
+const size_t kMaxSharedCandidates = 64; // Candidates with the largest possible savings a batch considers
+
+// Text naming what set of query's relations computes: the descriptors of its relations and its
+// join conditions, each side as descriptor.column, all sorted
+std::string subexpressionKey(const Query& query, const JoinGraph& graph, const std::vector<std::string>& descriptors, RelSet set) {
+    std::vector<std::string> parts;
+    for (RelSet rest = set; rest != 0; rest &= rest - 1) {
+        parts.push_back(descriptors[lowestRel(rest)]);
+    }
+    for (const auto& edge : graph.edges) {
+        if (!(relBit(edge.first) & set) || !(relBit(edge.second) & set)) {
+            continue;
+        }
+        const auto& join = query.joinConditions[edge.condition];
+        std::string first = descriptors[edge.first] + '.' + columnNameOf(join.first);
+        std::string second = descriptors[edge.second] + '.' + columnNameOf(join.second);
+        parts.push_back("J " + std::min(first, second) + '=' + std::max(first, second));
+    }
+    std::sort(parts.begin(), parts.end());
+    std::string key;
+    for (const auto& part : parts) {
+        key += part + '\n';
+    }
+    return key;
+}
+
+// Append the subtree of from at nodeIndex to plan, with its tables and joins in tree order. A node
+// read from shared result r gets computed[r], the plan of its relations in query, as its subtree,
+// and numbers[r] as its PlanNode::shared.
+int appendSharedTree(const Query& query, const Plan& from, int nodeIndex, const std::vector<const Plan*>& computed,
+                     const std::vector<int>& numbers, Plan& plan) {
+    PlanNode node = from.nodes[nodeIndex];
+    if (node.shared >= 0) {
+        const Plan& subplan = *computed[node.shared];
+        int root = appendSharedTree(query, subplan, static_cast<int>(subplan.nodes.size()) - 1, computed, numbers, plan);
+        PlanNode& read = plan.nodes[root];
+        read.shared = numbers[node.shared];
+        read.cost = node.cost;
+        read.components = node.components;
+        read.enforcer = node.enforcer;
+        read.enforcerKey = std::move(node.enforcerKey);
+        read.enforcerCost = node.enforcerCost;
+        read.enforcerComponents = node.enforcerComponents;
+        read.exchange = node.exchange;
+        read.exchangeKey = std::move(node.exchangeKey);
+        read.exchangeCost = node.exchangeCost;
+        read.exchangeComponents = node.exchangeComponents;
+        return root;
+    }
+    if (node.table >= 0) {
+        plan.tables.push_back(query.fromTables[node.table]);
+    } else {
+        node.left = appendSharedTree(query, from, node.left, computed, numbers, plan);
+        node.right = appendSharedTree(query, from, node.right, computed, numbers, plan);
+        for (int condition : node.conditions) {
+            plan.joins.push_back(query.joinConditions[condition]);
+        }
+    }
+    plan.nodes.push_back(std::move(node));
+    return static_cast<int>(plan.nodes.size()) - 1;
+}
+
+SharedPlan optimizeShared(const std::vector<Query>& queries, const OptimizerOptions& options) {
+    CostModel model(options.costWeights);
+    // Where a candidate occurs: its relations in one query, and their best plan there
+    struct Occurrence {
+        size_t query;
+        RelSet set;
+        Plan plan;
+    };
+    struct Candidate {
+        std::string key;
+        std::vector<Occurrence> occurrences;
+        double rows = 0;
+        Cost components; // Computing it and writing it out
+        double cost = 0;
+        double saving = 0; // What sharing it could save at most
+    };
+    struct BatchQuery {
+        JoinGraph graph;
+        bool exact = false; // Planned by DPccp, so it can read shared results
+        std::vector<std::string> descriptors;
+        std::vector<std::pair<size_t, size_t>> uses; // Candidates occurring in it, and which of their occurrences
+    };
+    std::vector<BatchQuery> batch(queries.size());
+    SharedPlan result;
+    result.plans.resize(queries.size());
+
+    // Plan query i reading the chosen shared results, or with its subplans for its uses when wanted
+    auto planQuery = [&](size_t i, const std::vector<Candidate>& candidates, const std::vector<bool>& chosen,
+                         std::vector<Candidate>* subplans) {
+        ArenaFrame frame(threadArena());
+        ConnectedSubgraphEnumerator enumerator(queries[i], batch[i].graph, model, options.bushy, nullptr, &frame.arena());
+        for (const auto& use : batch[i].uses) {
+            const Candidate& candidate = candidates[use.first];
+            if (chosen[use.first]) {
+                enumerator.share(candidate.occurrences[use.second].set, static_cast<int>(use.first), candidate.rows, model.scan(candidate.rows));
+            }
+        }
+        Plan plan = enumerator.run();
+        for (size_t u = 0; subplans != nullptr && u < batch[i].uses.size(); ++u) {
+            auto use = batch[i].uses[u];
+            Occurrence& occurrence = (*subplans)[use.first].occurrences[use.second];
+            occurrence.plan = enumerator.subplan(occurrence.set);
+        }
+        return plan;
+    };
+
+    // Plan every query alone, and collect the joins of the plans as candidates
+    std::vector<Candidate> candidates;
+    std::unordered_map<std::string, size_t> candidateIndex;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const Query& query = queries[i];
+        BatchQuery& b = batch[i];
+        b.graph = planningGraph(query, options);
+        b.exact = !options.budget.limited(query.fromTables.size());
+        if (!b.exact) {
+            result.plans[i] = optimizeQuery(query, options);
+            continue;
+        }
+        for (size_t t = 0; t < query.fromTables.size(); ++t) {
+            b.descriptors.push_back(relationDescriptor(query, t));
+        }
+        result.plans[i] = planQuery(i, candidates, {}, nullptr);
+        const Plan& plan = result.plans[i];
+        std::vector<RelSet> sets;
+        sets.reserve(plan.nodes.size());
+        for (size_t k = 0; k < plan.nodes.size(); ++k) {
+            const PlanNode& node = plan.nodes[k];
+            sets.push_back(node.table >= 0 ? relBit(node.table) : sets[node.left] | sets[node.right]);
+            if (node.table < 0) {
+                std::string key = subexpressionKey(query, b.graph, b.descriptors, sets[k]);
+                if (candidateIndex.emplace(key, candidates.size()).second) {
+                    candidates.emplace_back();
+                    candidates.back().key = std::move(key);
+                    candidates.back().occurrences.push_back({i, sets[k], {}});
+                }
+            }
+        }
+    }
+    for (const Plan& plan : result.plans) {
+        result.separateCost += plan.cost;
+    }
+
+    // Find each candidate in the other queries, relation by relation
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        Candidate& candidate = candidates[c];
+        const Occurrence first = candidate.occurrences[0];
+        const BatchQuery& origin = batch[first.query];
+        for (size_t j = 0; j < queries.size(); ++j) {
+            if (j == first.query || !batch[j].exact) {
+                continue;
+            }
+            const auto& descriptors = batch[j].descriptors;
+            RelSet set = 0;
+            for (RelSet rest = first.set; rest != 0; rest &= rest - 1) {
+                const std::string& descriptor = origin.descriptors[lowestRel(rest)];
+                auto found = std::find(descriptors.begin(), descriptors.end(), descriptor);
+                if (found == descriptors.end() || std::find(found + 1, descriptors.end(), descriptor) != descriptors.end()) {
+                    set = 0;
+                    break;
+                }
+                set |= relBit(found - descriptors.begin());
+            }
+            if (__builtin_popcountll(set) == __builtin_popcountll(first.set) &&
+                subexpressionKey(queries[j], batch[j].graph, descriptors, set) == candidate.key) {
+                candidate.occurrences.push_back({j, set, {}});
+            }
+        }
+    }
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                                    [](const Candidate& candidate) { return candidate.occurrences.size() < 2; }),
+                     candidates.end());
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        for (size_t o = 0; o < candidates[c].occurrences.size(); ++o) {
+            batch[candidates[c].occurrences[o].query].uses.emplace_back(c, o);
+        }
+    }
+    std::vector<bool> none(candidates.size(), false);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        if (!batch[i].uses.empty()) {
+            planQuery(i, candidates, none, &candidates);
+        }
+    }
+
+    // Keep the candidates that could save the most
+    for (auto& candidate : candidates) {
+        const Plan& plan = candidate.occurrences[0].plan;
+        candidate.rows = plan.nodes.back().rows;
+        candidate.components = plan.nodes.back().components + model.materialize(candidate.rows);
+        candidate.cost = model.total(candidate.components);
+        double read = model.total(model.scan(candidate.rows));
+        candidate.saving = static_cast<double>(candidate.occurrences.size()) * (plan.cost - read) - candidate.cost;
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.saving > b.saving || (a.saving == b.saving && a.key < b.key);
+    });
+    while (!candidates.empty() && (candidates.size() > kMaxSharedCandidates || !(candidates.back().saving > 0))) {
+        candidates.pop_back();
+    }
+    for (auto& b : batch) {
+        b.uses.clear();
+    }
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        for (size_t o = 0; o < candidates[c].occurrences.size(); ++o) {
+            batch[candidates[c].occurrences[o].query].uses.emplace_back(c, o);
+        }
+    }
+
+    // Share candidates greedily while the batch gets cheaper
+    std::vector<bool> chosen(candidates.size(), false);
+    double total = result.separateCost;
+    auto share = [&](size_t c, std::vector<Plan>& plans) {
+        double cost = total + (chosen[c] ? candidates[c].cost : -candidates[c].cost);
+        for (const auto& occurrence : candidates[c].occurrences) {
+            plans.push_back(planQuery(occurrence.query, candidates, chosen, nullptr));
+            cost += plans.back().cost - result.plans[occurrence.query].cost;
+        }
+        return cost;
+    };
+    for (;;) {
+        size_t best = candidates.size();
+        double bestTotal = total;
+        std::vector<Plan> bestPlans;
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            if (chosen[c]) {
+                continue;
+            }
+            std::vector<Plan> plans;
+            chosen[c] = true;
+            double cost = share(c, plans);
+            chosen[c] = false;
+            if (cost < bestTotal) {
+                best = c;
+                bestTotal = cost;
+                bestPlans = std::move(plans);
+            }
+        }
+        if (best == candidates.size()) {
+            break;
+        }
+        chosen[best] = true;
+        total = bestTotal;
+        for (size_t o = 0; o < bestPlans.size(); ++o) {
+            result.plans[candidates[best].occurrences[o].query] = std::move(bestPlans[o]);
+        }
+    }
+
+    // Drop results fewer than two plans read
+    auto readers = [&](size_t c) {
+        std::vector<size_t> queries;
+        for (const auto& occurrence : candidates[c].occurrences) {
+            const auto& nodes = result.plans[occurrence.query].nodes;
+            if (std::any_of(nodes.begin(), nodes.end(), [&](const PlanNode& node) { return node.shared == static_cast<int>(c); })) {
+                queries.push_back(occurrence.query);
+            }
+        }
+        std::sort(queries.begin(), queries.end());
+        return queries;
+    };
+    for (size_t c = 0; c < candidates.size();) {
+        if (chosen[c] && readers(c).size() < 2) {
+            chosen[c] = false;
+            std::vector<Plan> plans;
+            total = share(c, plans);
+            for (size_t o = 0; o < plans.size(); ++o) {
+                result.plans[candidates[c].occurrences[o].query] = std::move(plans[o]);
+            }
+            c = 0; // Plans that changed may read other results less
+        } else {
+            ++c;
+        }
+    }
+    result.cost = total;
+
+    // Number the shared results, and put the plan computing each below the nodes reading it
+    std::vector<int> numbers(candidates.size(), -1);
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        if (!chosen[c]) {
+            continue;
+        }
+        numbers[c] = static_cast<int>(result.shared.size());
+        const Candidate& candidate = candidates[c];
+        result.shared.push_back({candidate.occurrences[0].query, candidate.occurrences[0].plan, candidate.rows, candidate.cost,
+                                 candidate.components, readers(c)});
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+        if (batch[i].uses.empty()) {
+            continue;
+        }
+        std::vector<const Plan*> computed(candidates.size(), nullptr);
+        for (const auto& use : batch[i].uses) {
+            computed[use.first] = &candidates[use.first].occurrences[use.second].plan;
+        }
+        Plan& plan = result.plans[i];
+        Plan spliced = { {}, {}, plan.cost, {}, plan.memoEntries };
+        appendSharedTree(queries[i], plan, static_cast<int>(plan.nodes.size()) - 1, computed, numbers, spliced);
+        plan = std::move(spliced);
+    }
+    return result;
+}
+
+std::string explainShared(const std::vector<Query>& queries, const SharedPlan& plan) {
+    std::string out;
+    for (size_t r = 0; r < plan.shared.size(); ++r) {
+        const SharedResult& shared = plan.shared[r];
+        out += "SHARED RESULT #" + std::to_string(r + 1) + " read by queries";
+        for (size_t i = 0; i < shared.readers.size(); ++i) {
+            out += (i == 0 ? " " : ", ") + std::to_string(shared.readers[i] + 1);
+        }
+        appendEstimates(shared.rows, shared.cost, shared.components, out);
+        out += '\n';
+        explainNode(queries[shared.query], shared.plan, static_cast<int>(shared.plan.nodes.size()) - 1, 1, out);
+    }
+    return out;
+}
+
+// Batch Optimization
+// Optimizes a stream of statements (a query log) on a pool of worker threads. The reader blocks
+// once `window` statements are in flight, i.e. read but not yet written, so memory stays bounded
+// however long the input is. Results are written strictly in input order: a finished statement
+// waits in the reorder buffer until every statement before it has been written.
+
+// Splits a stream into statements, either one per line or separated by ';'. In ';' mode
+// semicolons inside quotes and comments do not split, and pieces holding nothing but comments
+// and whitespace are dropped. The stream is read in fixed-size chunks, never as a whole.
+class StatementReader {
+public:
+    StatementReader(std::istream& in, bool semicolons) : in_(in), semicolons_(semicolons), buffer_(kChunkBytes) {}
+
+    bool next(std::string& statement) {
+        if (!semicolons_) {
+            while (std::getline(in_, statement)) {
+                if (!statement.empty() && statement.back() == '\r') {
+                    statement.pop_back();
+                }
+                statement = trim(statement);
+                if (statement.find_first_not_of(" \t") != std::string::npos) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        statement.clear();
+        bool content = false;
+        for (int next = nextChar(); next != EOF; next = nextChar()) {
+            char c = static_cast<char>(next);
+            statement += c;
+            switch (state_) {
+            case State::Code:
+                // A '-' or '/' only counts as content once we know it does not open a comment
+                if (pending_ != 0) {
+                    char opener = pending_;
+                    pending_ = 0;
+                    if (opener == '-' && c == '-') {
+                        state_ = State::LineComment;
+                        break;
+                    }
+                    if (opener == '/' && c == '*') {
+                        state_ = State::BlockComment;
+                        star_ = false;
+                        break;
+                    }
+                    content = true;
+                }
+                if (c == ';') {
+                    statement.pop_back();
+                    if (content) {
+                        return true;
+                    }
+                    statement.clear();
+                } else if (c == '-' || c == '/') {
+                    pending_ = c;
+                } else if (c == '\'' || c == '"' || c == '`') {
+                    state_ = State::Quoted;
+                    quote_ = c;
+                    content = true;
+                } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+                    content = true;
+                }
+                break;
+            case State::Quoted:
+                if (c == quote_) {
+                    state_ = State::Code; // A doubled quote re-enters Quoted with its second half
+                }
+                break;
+            case State::LineComment:
+                if (c == '\n') {
+                    state_ = State::Code;
+                }
+                break;
+            case State::BlockComment:
+                if (star_ && c == '/') {
+                    state_ = State::Code;
+                }
+                star_ = c == '*';
+                break;
+            }
+        }
+        content = content || pending_ != 0;
+        pending_ = 0;
+        return content;
+    }
+
+private:
+    static constexpr size_t kChunkBytes = 64 * 1024;
+
+    enum class State { Code, Quoted, LineComment, BlockComment };
+
+    int nextChar() {
+        if (pos_ == end_) {
+            in_.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+            end_ = static_cast<size_t>(in_.gcount());
+            pos_ = 0;
+            if (end_ == 0) {
+                return EOF;
+            }
+        }
+        return static_cast<unsigned char>(buffer_[pos_++]);
+    }
+
+    std::istream& in_;
+    bool semicolons_;
+    std::vector<char> buffer_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+    State state_ = State::Code;
+    char quote_ = 0;   // Closing quote of the Quoted state
+    char pending_ = 0; // '-' or '/' that may open a comment
+    bool star_ = false; // Last character of a block comment was '*'
+};
+
+class BatchOptimizer {
+public:
+    BatchOptimizer(std::ostream& out, const OptimizerOptions& options, PlanCache& cache, size_t workers, size_t window, bool explain)
+        : out_(out), options_(options), cache_(cache), window_(std::max<size_t>(window, 1)), explain_(explain),
+          start_(std::chrono::steady_clock::now()) {
+        options_.metrics = nullptr;
+        for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i) {
+            workers_.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~BatchOptimizer() {
+        if (!workers_.empty()) {
+            finish();
+        }
+    }
+
+    // Queue a statement, waiting while the window is full
+    void submit(std::string statement) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        slotFree_.wait(lock, [this] { return submitted_ - written_ < window_; });
+        queue_.emplace_back(submitted_++, std::move(statement));
+        workAvailable_.notify_one();
+    }
+
+    // Wait for every submitted statement to be written, then stop the workers
+    BatchReport finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        workAvailable_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        out_.flush();
+
+        BatchReport report;
+        report.statements = submitted_;
+        report.errors = errors_;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        return report;
+    }
+
+private:
+    struct Result {
+        std::string text;
+        bool error = false;
+    };
+
+    Result process(const std::string& sql) {
+        Result result;
+        try {
+            Query query = parseQuery(sql, options_.statistics);
+            RewriteSummary rewrite;
+            if (options_.rewrite) {
+                rewrite = rewriteQuery(query, options_.statistics);
+            }
+            Plan plan = optimizeQueryCached(query, options_, cache_);
+            result.text = generateOptimizedQuery(query, plan) + ";\n";
+            if (explain_) {
+                std::istringstream lines(explainRewrite(rewrite) + explainPlan(query, plan));
+                for (std::string line; std::getline(lines, line);) {
+                    result.text += "-- " + line + "\n";
+                }
+            }
+        } catch (const std::exception& e) {
+            result.text = "-- error: " + std::string(e.what()) + "\n";
+            result.error = true;
+        }
+        return result;
+    }
+
+    void workerLoop() {
+        for (;;) {
+            std::pair<uint64_t, std::string> work;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                workAvailable_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    return;
+                }
+                work = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            Result result = process(work.second);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            errors_ += result.error ? 1 : 0;
+            finished_.emplace(work.first, std::move(result.text));
+            bool wrote = false;
+            for (auto ready = finished_.begin(); ready != finished_.end() && ready->first == written_; ready = finished_.begin()) {
+                out_ << ready->second;
+                finished_.erase(ready);
+                ++written_;
+                wrote = true;
+            }
+            if (wrote) {
+                slotFree_.notify_one();
+            }
+        }
+    }
+
+    std::ostream& out_;
+    OptimizerOptions options_;
+    PlanCache& cache_;
+    size_t window_;
+    bool explain_;
+    std::chrono::steady_clock::time_point start_;
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::condition_variable slotFree_;
+    std::deque<std::pair<uint64_t, std::string>> queue_;
+    std::map<uint64_t, std::string> finished_; // Reorder buffer, keyed by input position
+    uint64_t submitted_ = 0;
+    uint64_t written_ = 0;
+    size_t errors_ = 0;
+    bool closing_ = false;
+};
+
+BatchReport optimizeStream(std::istream& in, std::ostream& out, const OptimizerOptions& options, PlanCache& cache,
+                           bool semicolons, size_t workers, bool explain) {
+    BatchOptimizer batch(out, options, cache, workers, workers * 16, explain);
+    StatementReader reader(in, semicolons);
+    for (std::string statement; reader.next(statement);) {
+        batch.submit(std::move(statement));
+        statement = std::string();
+    }
+    return batch.finish();
+}
+
+// Execution
+// Runs a plan in-process over tables stored as binary column files, so plan choices can be
+// checked against real running times on one machine. Operators pull batches of up to kBatchRows
+// rows from their children, column by column. Filters narrow a selection vector of row positions
+// with branch-free loops over whole columns, which the compiler vectorizes, and the surviving rows
+// are gathered once. Values keep the column files' types and null markers (INT64_MIN and NaN).
+//
+// Every join runs as the operator the plan names, except that column files have no indexes: an
+// index nested loop join builds a hash table on its inner table instead, index scans read the
+// whole table, and merge joins sort both of their inputs. Hash joins split their build side into
+// cache-sized partitions by the low bits of the key hash, each with its own chained table, and
+// probe each batch one partition at a time. GROUP BY and the aggregates COUNT, SUM, MIN, MAX and
+// AVG run as a hash aggregation over the join result; the ORDER BY then sorts, keeping only the
+// first LIMIT rows, and the select items are picked out of what is left.
+const size_t kBatchRows = 2048;
+const size_t kPartitionRows = 8192; // Build rows per hash join partition, whose table then fits in L2
+const int kMaxPartitionBits = 10;
+
+MappedColumnFile::MappedColumnFile(const std::string& path) : name_(columnNameFromPath(path)) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(ColumnFileHeader)) {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a column file");
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    void* data = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path);
+    }
+    ::madvise(data, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(data);
+
+    ColumnFileHeader header;
+    std::memcpy(&header, data_, sizeof(header));
+    if (std::memcmp(header.magic, kColumnFileMagic, sizeof(kColumnFileMagic)) != 0 ||
+        (header.type != ColumnType::Int64 && header.type != ColumnType::Double)) {
+        unmap();
+        throw std::runtime_error(path + " is not a column file");
+    }
+    if (header.count > (size_ - sizeof(header)) / 8) {
+        unmap();
+        throw std::runtime_error(path + " is truncated");
+    }
+    type_ = header.type;
+    rows_ = static_cast<size_t>(header.count);
+}
+
+void MappedColumnFile::unmap() {
+    if (data_ != nullptr) {
+        ::munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+    }
+}
+
+const MappedColumnFile* StoredTable::column(std::string_view name) const {
+    for (const auto& column : columns) {
+        if (column->name() == name) {
+            return column.get();
+        }
+    }
+    return nullptr;
+}
+
+void ColumnStore::add(const std::string& table, const std::vector<std::string>& paths) {
+    StoredTable stored;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        stored.columns.push_back(std::make_unique<MappedColumnFile>(paths[i]));
+        if (i > 0 && stored.columns.back()->rows() != stored.rows) {
+            throw std::runtime_error(paths[i] + " has a different row count than " + paths[0]);
+        }
+        stored.rows = stored.columns.back()->rows();
+    }
+    if (stored.rows > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("table " + table + " has more rows than execution supports");
+    }
+    tables_[table] = std::move(stored);
+}
+
+const StoredTable* ColumnStore::find(const std::string& table) const {
+    auto it = tables_.find(table);
+    return it == tables_.end() ? nullptr : &it->second;
+}
+
+// One column of a batch or of a materialized input, holding the vector of its type
+struct ColumnVector {
+    ColumnType type = ColumnType::Int64;
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+
+    void resize(size_t rows) {
+        if (type == ColumnType::Int64) {
+            ints.resize(rows);
+        } else {
+            doubles.resize(rows);
+        }
+    }
+};
+
+// Read-only view of a column's values, in a batch or in a mapped file
+struct ColumnSpan {
+    ColumnType type = ColumnType::Int64;
+    const int64_t* ints = nullptr;
+    const double* doubles = nullptr;
+};
+
+struct ColumnBatch {
+    size_t rows = 0;
+    std::vector<ColumnVector> columns;
+};
+
+// Operators
+class Operator {
+public:
+    explicit Operator(std::vector<ColumnType> types) : types_(std::move(types)) {}
+    virtual ~Operator() = default;
+
+    // Fill out with the next batch of at least one row; false once the input is exhausted
+    bool pull(ColumnBatch& out) {
+        auto start = std::chrono::steady_clock::now();
+        bool more = next(out);
+        actuals.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        actuals.rows += more ? static_cast<double>(out.rows) : 0;
+        actuals.complete = !more;
+        return more;
+    }
+
+    const std::vector<ColumnType>& types() const { return types_; }
+
+    NodeActuals actuals;
+
+protected:
+    virtual bool next(ColumnBatch& out) = 0;
+
+    // Empty out's columns, typed as this operator's output, keeping their buffers
+    void reset(ColumnBatch& out) const {
+        out.rows = 0;
+        out.columns.resize(types_.size());
+        for (size_t i = 0; i < types_.size(); ++i) {
+            out.columns[i].type = types_[i];
+            out.columns[i].ints.clear();
+            out.columns[i].doubles.clear();
+        }
+    }
+
+private:
+    std::vector<ColumnType> types_;
+};
+
+// All of an operator's output, held in memory
+struct Materialized {
+    std::vector<ColumnVector> columns;
+    size_t rows = 0;
+};
+
+ColumnSpan spanOf(const ColumnVector& column) {
+    return {column.type, column.ints.data(), column.doubles.data()};
+}
+
+// The column's values from row first on
+ColumnSpan spanOf(const MappedColumnFile& column, size_t first) {
+    ColumnSpan span;
+    span.type = column.type();
+    if (span.type == ColumnType::Int64) {
+        span.ints = column.ints() + first;
+    } else {
+        span.doubles = column.doubles() + first;
+    }
+    return span;
+}
+
+inline bool notNull(int64_t value) { return value != std::numeric_limits<int64_t>::min(); }
+inline bool notNull(double value) { return value == value; }
+
+// Append the rows of src listed in rows[0..count) to dst
+template <typename T>
+void gatherValues(const T* src, const uint32_t* rows, size_t count, std::vector<T>& dst) {
+    size_t at = dst.size();
+    dst.resize(at + count);
+    T* out = dst.data() + at;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = src[rows[i]];
+    }
+}
+
+void gather(const ColumnSpan& src, const uint32_t* rows, size_t count, ColumnVector& dst) {
+    if (src.type == ColumnType::Int64) {
+        gatherValues(src.ints, rows, count, dst.ints);
+    } else {
+        gatherValues(src.doubles, rows, count, dst.doubles);
+    }
+}
+
+// Append src's first count values to dst
+void append(const ColumnSpan& src, size_t count, ColumnVector& dst) {
+    if (src.type == ColumnType::Int64) {
+        dst.ints.insert(dst.ints.end(), src.ints, src.ints + count);
+    } else {
+        dst.doubles.insert(dst.doubles.end(), src.doubles, src.doubles + count);
+    }
+}
+
+// Selection kernels
+// Each keeps the rows of sel[0..count) (rows 0..count when sel is null) a condition holds for,
+// writing their positions to out, which may be sel, and returns how many it kept. The loops store
+// every position and only advance past the kept ones, so they have no branch to mispredict.
+template <typename Keep>
+size_t selectRows(const uint32_t* sel, size_t count, uint32_t* out, Keep keep) {
+    size_t kept = 0;
+    if (sel == nullptr) {
+        for (size_t i = 0; i < count; ++i) {
+            out[kept] = static_cast<uint32_t>(i);
+            kept += keep(i);
+        }
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t row = sel[i];
+            out[kept] = row;
+            kept += keep(row);
+        }
+    }
+    return kept;
+}
+
+enum class CompareOp { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+// Values of type T against a constant of type U, an int64 column converted to double for a
+// fractional constant; nulls never compare
+template <typename T, typename U>
+size_t selectCompare(const T* values, const uint32_t* sel, size_t count, uint32_t* out, CompareOp op, U constant) {
+    switch (op) {
+    case CompareOp::Equal:
+        return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) & (static_cast<U>(values[row]) == constant); });
+    case CompareOp::NotEqual:
+        return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) & (static_cast<U>(values[row]) != constant); });
+    case CompareOp::Less:
+        return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) & (static_cast<U>(values[row]) < constant); });
+    case CompareOp::LessEqual:
+        return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) & (static_cast<U>(values[row]) <= constant); });
+    case CompareOp::Greater:
+        return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) & (static_cast<U>(values[row]) > constant); });
+    case CompareOp::GreaterEqual:
+        return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) & (static_cast<U>(values[row]) >= constant); });
+    }
+    return 0;
+}
+
+// Two columns of a row against each other, compared as U
+template <typename U, typename T1, typename T2>
+size_t selectCompareColumns(const T1* left, const T2* right, const uint32_t* sel, size_t count, uint32_t* out, CompareOp op) {
+    auto both = [=](size_t row) { return notNull(left[row]) & notNull(right[row]); };
+    switch (op) {
+    case CompareOp::Equal:
+        return selectRows(sel, count, out, [=](size_t row) { return both(row) & (static_cast<U>(left[row]) == static_cast<U>(right[row])); });
+    case CompareOp::NotEqual:
+        return selectRows(sel, count, out, [=](size_t row) { return both(row) & (static_cast<U>(left[row]) != static_cast<U>(right[row])); });
+    case CompareOp::Less:
+        return selectRows(sel, count, out, [=](size_t row) { return both(row) & (static_cast<U>(left[row]) < static_cast<U>(right[row])); });
+    case CompareOp::LessEqual:
+        return selectRows(sel, count, out, [=](size_t row) { return both(row) & (static_cast<U>(left[row]) <= static_cast<U>(right[row])); });
+    case CompareOp::Greater:
+        return selectRows(sel, count, out, [=](size_t row) { return both(row) & (static_cast<U>(left[row]) > static_cast<U>(right[row])); });
+    case CompareOp::GreaterEqual:
+        return selectRows(sel, count, out, [=](size_t row) { return both(row) & (static_cast<U>(left[row]) >= static_cast<U>(right[row])); });
+    }
+    return 0;
+}
+
+template <typename T, typename U>
+size_t selectBetween(const T* values, const uint32_t* sel, size_t count, uint32_t* out, U low, U high, bool negated) {
+    return selectRows(sel, count, out, [=](size_t row) {
+        U value = static_cast<U>(values[row]);
+        return notNull(values[row]) & ((low <= value && value <= high) != negated);
+    });
+}
+
+template <typename T, typename U>
+size_t selectIn(const T* values, const uint32_t* sel, size_t count, uint32_t* out, const std::vector<U>& list, bool negated) {
+    return selectRows(sel, count, out, [&](size_t row) {
+        U value = static_cast<U>(values[row]);
+        bool found = false;
+        for (U item : list) {
+            found |= value == item;
+        }
+        return notNull(values[row]) & (found != negated);
+    });
+}
+
+template <typename T>
+size_t selectNull(const T* values, const uint32_t* sel, size_t count, uint32_t* out, bool negated) {
+    return selectRows(sel, count, out, [=](size_t row) { return notNull(values[row]) == negated; });
+}
+
+// A filter condition compiled against the columns of the operator that evaluates it
+struct CompiledCondition {
+    AstPredicate::Kind kind = AstPredicate::Kind::Compare;
+    CompareOp op = CompareOp::Equal;
+    bool negated = false;
+    bool never = false;   // Compares with NULL, so holds for no row
+    int column = -1;      // Column the condition restricts
+    int other = -1;       // Column a comparison compares it with, -1 for a literal
+    bool integral = true; // Every literal is an integer, compared exactly with int64 columns
+    std::vector<int64_t> ints; // The literals: the compared value, the BETWEEN bounds or the IN list
+    std::vector<double> doubles;
+};
+
+size_t applyCondition(const CompiledCondition& condition, const ColumnSpan* columns, const uint32_t* sel, size_t count, uint32_t* out) {
+    if (condition.never) {
+        return 0;
+    }
+    const ColumnSpan& column = columns[condition.column];
+    if (condition.other >= 0) {
+        const ColumnSpan& other = columns[condition.other];
+        if (column.type == ColumnType::Int64 && other.type == ColumnType::Int64) {
+            return selectCompareColumns<int64_t>(column.ints, other.ints, sel, count, out, condition.op);
+        }
+        if (column.type == ColumnType::Int64) {
+            return selectCompareColumns<double>(column.ints, other.doubles, sel, count, out, condition.op);
+        }
+        if (other.type == ColumnType::Int64) {
+            return selectCompareColumns<double>(column.doubles, other.ints, sel, count, out, condition.op);
+        }
+        return selectCompareColumns<double>(column.doubles, other.doubles, sel, count, out, condition.op);
+    }
+
+    // Call select with the column's values and the literals of the type they compare as
+    auto dispatch = [&](auto select) -> size_t {
+        if (column.type == ColumnType::Double) {
+            return select(column.doubles, condition.doubles);
+        }
+        return condition.integral ? select(column.ints, condition.ints) : select(column.ints, condition.doubles);
+    };
+    switch (condition.kind) {
+    case AstPredicate::Kind::Compare:
+        return dispatch([&](auto values, const auto& literals) { return selectCompare(values, sel, count, out, condition.op, literals[0]); });
+    case AstPredicate::Kind::Between:
+        return dispatch([&](auto values, const auto& literals) {
+            return selectBetween(values, sel, count, out, literals[0], literals[1], condition.negated);
+        });
+    case AstPredicate::Kind::In:
+        return dispatch([&](auto values, const auto& literals) { return selectIn(values, sel, count, out, literals, condition.negated); });
+    case AstPredicate::Kind::IsNull:
+        return dispatch([&](auto values, const auto&) { return selectNull(values, sel, count, out, condition.negated); });
+    case AstPredicate::Kind::Like:
+        break;
+    }
+    return 0;
+}
+
+// Keys
+// Join and grouping keys compare as 64-bit patterns: an int64 as is, unless the other side of a
+// join is a double, and otherwise the double's bits with -0 folded into 0 and every NaN into one
+inline uint64_t keyBits(const ColumnSpan& column, size_t row, bool asDouble) {
+    if (column.type == ColumnType::Int64 && !asDouble) {
+        return static_cast<uint64_t>(column.ints[row]);
+    }
+    double value = column.type == ColumnType::Int64 ? static_cast<double>(column.ints[row]) : column.doubles[row];
+    value = value == 0 ? 0.0 : value;
+    if (value != value) {
+        value = std::numeric_limits<double>::quiet_NaN();
+    }
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline bool isNullAt(const ColumnSpan& column, size_t row) {
+    return column.type == ColumnType::Int64 ? !notNull(column.ints[row]) : !notNull(column.doubles[row]);
+}
+
+// Spread key bits over the whole word (the MurmurHash3 finalizer), so partitions can take the
+// low bits and buckets the ones above
+inline uint64_t mixKey(uint64_t hash, uint64_t key) {
+    uint64_t h = hash ^ (key + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Three-way comparison of two values of a column; nulls sort after every value
+template <typename T>
+int compareValues(T a, T b) {
+    bool aNull = !notNull(a), bNull = !notNull(b);
+    if (aNull || bNull) {
+        return static_cast<int>(aNull) - static_cast<int>(bNull);
+    }
+    return a < b ? -1 : (b < a ? 1 : 0);
+}
+
+int compareRows(const ColumnSpan& left, size_t leftRow, const ColumnSpan& right, size_t rightRow, bool asDouble) {
+    if (left.type == ColumnType::Int64 && right.type == ColumnType::Int64 && !asDouble) {
+        return compareValues(left.ints[leftRow], right.ints[rightRow]);
+    }
+    double a = left.type == ColumnType::Int64 ? (notNull(left.ints[leftRow]) ? static_cast<double>(left.ints[leftRow]) : NAN)
+                                              : left.doubles[leftRow];
+    double b = right.type == ColumnType::Int64 ? (notNull(right.ints[rightRow]) ? static_cast<double>(right.ints[rightRow]) : NAN)
+                                               : right.doubles[rightRow];
+    return compareValues(a, b);
+}
+
+struct SortKey {
+    int column;
+    bool descending = false;
+};
+
+// Row order of columns by keys, nulls last ascending and first descending; only the first limit
+// rows of the order are sorted
+std::vector<uint32_t> sortRows(const std::vector<ColumnVector>& columns, size_t rows, const std::vector<SortKey>& keys, size_t limit) {
+    std::vector<uint32_t> order(rows);
+    for (size_t i = 0; i < rows; ++i) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    std::vector<ColumnSpan> spans;
+    for (const auto& key : keys) {
+        spans.push_back(spanOf(columns[key.column]));
+    }
+    auto before = [&](uint32_t a, uint32_t b) {
+        for (size_t k = 0; k < keys.size(); ++k) {
+            int compared = compareRows(spans[k], a, spans[k], b, false);
+            if (compared != 0) {
+                return keys[k].descending ? compared > 0 : compared < 0;
+            }
+        }
+        return false;
+    };
+    if (limit < rows) {
+        std::partial_sort(order.begin(), order.begin() + limit, order.end(), before);
+        order.resize(limit);
+    } else {
+        std::sort(order.begin(), order.end(), before);
+    }
+    return order;
+}
+
+Materialized materialize(Operator& input) {
+    Materialized result;
+    result.columns.resize(input.types().size());
+    for (size_t i = 0; i < result.columns.size(); ++i) {
+        result.columns[i].type = input.types()[i];
+    }
+    ColumnBatch batch;
+    while (input.pull(batch)) {
+        for (size_t i = 0; i < result.columns.size(); ++i) {
+            append(spanOf(batch.columns[i]), batch.rows, result.columns[i]);
+        }
+        result.rows += batch.rows;
+        if (result.rows > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("an intermediate result has more rows than execution supports");
+        }
+    }
+    return result;
+}
+
+// Reads a stored table, applying its table filters
+class ScanOperator : public Operator {
+public:
+    ScanOperator(const StoredTable& table, std::vector<const MappedColumnFile*> columns, std::vector<CompiledCondition> conditions)
+        : Operator(typesOf(columns)), rows_(table.rows), columns_(std::move(columns)), conditions_(std::move(conditions)),
+          spans_(columns_.size()), selection_(kBatchRows) {}
+
+protected:
+    bool next(ColumnBatch& out) override {
+        while (position_ < rows_) {
+            size_t count = std::min(kBatchRows, rows_ - position_);
+            for (size_t i = 0; i < columns_.size(); ++i) {
+                spans_[i] = spanOf(*columns_[i], position_);
+            }
+            position_ += count;
+            const uint32_t* sel = nullptr;
+            size_t kept = count;
+            for (size_t i = 0; i < conditions_.size() && kept > 0; ++i) {
+                kept = applyCondition(conditions_[i], spans_.data(), sel, kept, selection_.data());
+                sel = selection_.data();
+            }
+            if (kept == 0) {
+                continue;
+            }
+            reset(out);
+            for (size_t i = 0; i < columns_.size(); ++i) {
+                if (sel == nullptr) {
+                    append(spans_[i], kept, out.columns[i]);
+                } else {
+                    gather(spans_[i], sel, kept, out.columns[i]);
+                }
+            }
+            out.rows = kept;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    static std::vector<ColumnType> typesOf(const std::vector<const MappedColumnFile*>& columns) {
+        std::vector<ColumnType> types;
+        for (const auto* column : columns) {
+            types.push_back(column->type());
+        }
+        return types;
+    }
+
+    size_t rows_;
+    size_t position_ = 0;
+    std::vector<const MappedColumnFile*> columns_;
+    std::vector<CompiledCondition> conditions_;
+    std::vector<ColumnSpan> spans_;
+    std::vector<uint32_t> selection_;
+};
+
+// Applies the filters no single table's scan could
+class FilterOperator : public Operator {
+public:
+    FilterOperator(std::unique_ptr<Operator> input, std::vector<CompiledCondition> conditions)
+        : Operator(input->types()), input_(std::move(input)), conditions_(std::move(conditions)), selection_(kBatchRows) {}
+
+protected:
+    bool next(ColumnBatch& out) override {
+        while (input_->pull(batch_)) {
+            spans_.clear();
+            for (const auto& column : batch_.columns) {
+                spans_.push_back(spanOf(column));
+            }
+            const uint32_t* sel = nullptr;
+            size_t kept = batch_.rows;
+            for (size_t i = 0; i < conditions_.size() && kept > 0; ++i) {
+                kept = applyCondition(conditions_[i], spans_.data(), sel, kept, selection_.data());
+                sel = selection_.data();
+            }
+            if (kept == batch_.rows) {
+                std::swap(out, batch_);
+                return true;
+            }
+            if (kept == 0) {
+                continue;
+            }
+            reset(out);
+            for (size_t i = 0; i < spans_.size(); ++i) {
+                gather(spans_[i], sel, kept, out.columns[i]);
+            }
+            out.rows = kept;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    std::unique_ptr<Operator> input_;
+    std::vector<CompiledCondition> conditions_;
+    ColumnBatch batch_;
+    std::vector<ColumnSpan> spans_;
+    std::vector<uint32_t> selection_;
+};
+
+// One equality of a join: a column of each input, compared as doubles unless both are int64
+struct JoinKey {
+    int left;
+    int right;
+    bool asDouble = false;
+};
+
+// Joins collect matching (left row, right row) pairs and gather them into output batches of the
+// left input's columns followed by the right's
+class JoinOperator : public Operator {
+public:
+    JoinOperator(std::unique_ptr<Operator> left, std::unique_ptr<Operator> right, std::vector<JoinKey> keys)
+        : Operator(concatenate(left->types(), right->types())), left_(std::move(left)), right_(std::move(right)),
+          keys_(std::move(keys)) {}
+
+protected:
+    bool pending() const { return emitted_ < leftRows_.size(); }
+
+    void clearPairs() {
+        leftRows_.clear();
+        rightRows_.clear();
+        emitted_ = 0;
+    }
+
+    // Gather the next batch of collected pairs from the inputs' columns
+    void emit(ColumnBatch& out, const std::vector<ColumnVector>& left, const std::vector<ColumnVector>& right) {
+        size_t count = std::min(kBatchRows, leftRows_.size() - emitted_);
+        reset(out);
+        for (size_t i = 0; i < left.size(); ++i) {
+            gather(spanOf(left[i]), leftRows_.data() + emitted_, count, out.columns[i]);
+        }
+        for (size_t i = 0; i < right.size(); ++i) {
+            gather(spanOf(right[i]), rightRows_.data() + emitted_, count, out.columns[left.size() + i]);
+        }
+        out.rows = count;
+        emitted_ += count;
+    }
+
+    std::unique_ptr<Operator> left_;
+    std::unique_ptr<Operator> right_;
+    std::vector<JoinKey> keys_;
+    std::vector<uint32_t> leftRows_;
+    std::vector<uint32_t> rightRows_;
+    size_t emitted_ = 0;
+
+private:
+    static std::vector<ColumnType> concatenate(std::vector<ColumnType> left, const std::vector<ColumnType>& right) {
+        left.insert(left.end(), right.begin(), right.end());
+        return left;
+    }
+};
+
+// Builds a hash table on one input and probes it with batches of the other. The build side is
+// split into partitions of about kPartitionRows rows by the low bits of the key hash, each with a
+// chained table of its own, and every probe batch is reordered by partition, so probes touch one
+// partition's table at a time while it is in cache. Null keys never match.
+class HashJoinOperator : public JoinOperator {
+public:
+    HashJoinOperator(std::unique_ptr<Operator> left, std::unique_ptr<Operator> right, std::vector<JoinKey> keys, bool buildLeft)
+        : JoinOperator(std::move(left), std::move(right), std::move(keys)), buildLeft_(buildLeft) {}
+
+protected:
+    bool next(ColumnBatch& out) override {
+        if (!built_) {
+            build();
+            built_ = true;
+        }
+        for (;;) {
+            if (pending()) {
+                if (buildLeft_) {
+                    emit(out, build_.columns, probe_.columns);
+                } else {
+                    emit(out, probe_.columns, build_.columns);
+                }
+                return true;
+            }
+            if (build_.rows == 0 || !(buildLeft_ ? *right_ : *left_).pull(probe_)) {
+                return false;
+            }
+            probeBatch();
+        }
+    }
+
+private:
+    static constexpr uint32_t kNoRow = std::numeric_limits<uint32_t>::max();
+
+    // Hash the key columns of a batch's rows, skipping rows with a null key
+    void hashRows(const std::vector<ColumnVector>& columns, size_t rows, bool buildSide, std::vector<uint32_t>& ids,
+                  std::vector<uint64_t>& hashes, std::vector<uint64_t>& keyValues) const {
+        size_t keyCount = keys_.size();
+        std::vector<ColumnSpan> spans;
+        for (const auto& key : keys_) {
+            spans.push_back(spanOf(columns[buildSide == buildLeft_ ? key.left : key.right]));
+        }
+        ids.clear();
+        hashes.clear();
+        keyValues.clear();
+        for (size_t row = 0; row < rows; ++row) {
+            bool null = false;
+            uint64_t hash = 0;
+            for (size_t k = 0; k < keyCount; ++k) {
+                null |= isNullAt(spans[k], row);
+                uint64_t bits = keyBits(spans[k], row, keys_[k].asDouble);
+                keyValues.push_back(bits);
+                hash = mixKey(hash, bits);
+            }
+            if (null) {
+                keyValues.resize(keyValues.size() - keyCount);
+                continue;
+            }
+            ids.push_back(static_cast<uint32_t>(row));
+            hashes.push_back(hash);
+        }
+    }
+
+    void build() {
+        build_ = materialize(buildLeft_ ? *left_ : *right_);
+        std::vector<uint32_t> ids;
+        std::vector<uint64_t> hashes;
+        std::vector<uint64_t> keyValues;
+        hashRows(build_.columns, build_.rows, true, ids, hashes, keyValues);
+
+        size_t count = ids.size();
+        size_t keyCount = keys_.size();
+        while (bits_ < kMaxPartitionBits && (count >> bits_) > kPartitionRows) {
+            ++bits_;
+        }
+        size_t partitions = size_t(1) << bits_;
+
+        // Scatter the rows into their partitions: a histogram, its prefix sums, then one pass
+        std::vector<size_t> start(partitions + 1, 0);
+        for (uint64_t hash : hashes) {
+            ++start[(hash & (partitions - 1)) + 1];
+        }
+        for (size_t p = 0; p < partitions; ++p) {
+            start[p + 1] += start[p];
+        }
+        std::vector<size_t> cursor(start.begin(), start.end() - 1);
+        rows_.resize(count);
+        hashes_.resize(count);
+        keyValues_.resize(count * keyCount);
+        for (size_t i = 0; i < count; ++i) {
+            size_t at = cursor[hashes[i] & (partitions - 1)]++;
+            rows_[at] = ids[i];
+            hashes_[at] = hashes[i];
+            std::copy(keyValues.begin() + i * keyCount, keyValues.begin() + (i + 1) * keyCount, keyValues_.begin() + at * keyCount);
+        }
+
+        // Chain each partition's rows into a table of its own, sized to the next power of two
+        bucketStart_.resize(partitions);
+        bucketMask_.resize(partitions);
+        size_t buckets = 0;
+        for (size_t p = 0; p < partitions; ++p) {
+            size_t size = 1;
+            while (size < start[p + 1] - start[p]) {
+                size <<= 1;
+            }
+            bucketStart_[p] = buckets;
+            bucketMask_[p] = size - 1;
+            buckets += size;
+        }
+        heads_.assign(buckets, kNoRow);
+        next_.resize(count);
+        for (size_t at = 0; at < count; ++at) {
+            size_t p = hashes_[at] & (partitions - 1);
+            size_t bucket = bucketStart_[p] + ((hashes_[at] >> bits_) & bucketMask_[p]);
+            next_[at] = heads_[bucket];
+            heads_[bucket] = static_cast<uint32_t>(at);
+        }
+    }
+
+    void probeBatch() {
+        clearPairs();
+        hashRows(probe_.columns, probe_.rows, false, probeIds_, probeHashes_, probeKeys_);
+        size_t count = probeIds_.size();
+        size_t keyCount = keys_.size();
+        size_t partitions = size_t(1) << bits_;
+
+        // Visit the rows partition by partition
+        order_.resize(count);
+        if (partitions == 1) {
+            for (size_t i = 0; i < count; ++i) {
+                order_[i] = static_cast<uint32_t>(i);
+            }
+        } else {
+            start_.assign(partitions + 1, 0);
+            for (size_t i = 0; i < count; ++i) {
+                ++start_[(probeHashes_[i] & (partitions - 1)) + 1];
+            }
+            for (size_t p = 0; p < partitions; ++p) {
+                start_[p + 1] += start_[p];
+            }
+            for (size_t i = 0; i < count; ++i) {
+                order_[start_[probeHashes_[i] & (partitions - 1)]++] = static_cast<uint32_t>(i);
+            }
+        }
+
+        std::vector<uint32_t>& buildRows = buildLeft_ ? leftRows_ : rightRows_;
+        std::vector<uint32_t>& probeRows = buildLeft_ ? rightRows_ : leftRows_;
+        for (uint32_t i : order_) {
+            uint64_t hash = probeHashes_[i];
+            size_t p = hash & (partitions - 1);
+            const uint64_t* key = probeKeys_.data() + size_t(i) * keyCount;
+            for (uint32_t at = heads_[bucketStart_[p] + ((hash >> bits_) & bucketMask_[p])]; at != kNoRow; at = next_[at]) {
+                if (hashes_[at] == hash && std::equal(key, key + keyCount, keyValues_.begin() + size_t(at) * keyCount)) {
+                    buildRows.push_back(rows_[at]);
+                    probeRows.push_back(probeIds_[i]);
+                }
+            }
+        }
+    }
+
+    bool buildLeft_;
+    bool built_ = false;
+    Materialized build_;
+    int bits_ = 0;                       // Partition bits, the low bits of the key hash
+    std::vector<uint32_t> rows_;         // Build rows with a non-null key, in partition order
+    std::vector<uint64_t> hashes_;       // Their key hashes
+    std::vector<uint64_t> keyValues_;    // Their key bits, keys_.size() per row
+    std::vector<uint32_t> next_;         // Next row in the same bucket
+    std::vector<uint32_t> heads_;        // First row of each bucket, the partitions' tables one after another
+    std::vector<size_t> bucketStart_;    // Each partition's first bucket
+    std::vector<size_t> bucketMask_;     // Each partition's bucket count, less one
+    ColumnBatch probe_;
+    std::vector<uint32_t> probeIds_;
+    std::vector<uint64_t> probeHashes_;
+    std::vector<uint64_t> probeKeys_;
+    std::vector<uint32_t> order_;
+    std::vector<size_t> start_;
+};
+
+// Sorts both inputs on the join keys and merges them: each run of equal keys on the left is
+// joined with the run of the same keys on the right. Rows with a null key are dropped first.
+class MergeJoinOperator : public JoinOperator {
+public:
+    using JoinOperator::JoinOperator;
+
+protected:
+    bool next(ColumnBatch& out) override {
+        if (!sorted_) {
+            leftData_ = materialize(*left_);
+            rightData_ = materialize(*right_);
+            for (const auto& key : keys_) {
+                leftKeys_.push_back(spanOf(leftData_.columns[key.left]));
+                rightKeys_.push_back(spanOf(rightData_.columns[key.right]));
+            }
+            leftOrder_ = sortedKeys(leftData_, leftKeys_, true);
+            rightOrder_ = sortedKeys(rightData_, rightKeys_, false);
+            sorted_ = true;
+        }
+        for (;;) {
+            if (pending()) {
+                emit(out, leftData_.columns, rightData_.columns);
+                return true;
+            }
+            if (!mergeRuns()) {
+                return false;
+            }
+        }
+    }
+
+private:
+    std::vector<uint32_t> sortedKeys(const Materialized& data, const std::vector<ColumnSpan>& spans, bool left) const {
+        std::vector<SortKey> sortKeys;
+        for (const auto& key : keys_) {
+            sortKeys.push_back({left ? key.left : key.right, false});
+        }
+        std::vector<uint32_t> order = sortRows(data.columns, data.rows, sortKeys, data.rows);
+        order.erase(std::remove_if(order.begin(), order.end(),
+                                   [&](uint32_t row) {
+                                       return std::any_of(spans.begin(), spans.end(), [&](const ColumnSpan& span) { return isNullAt(span, row); });
+                                   }),
+                    order.end());
+        return order;
+    }
+
+    // Compare the keys of a left row with those of a right row, or of another left row
+    int compareKeys(uint32_t leftRow, const std::vector<ColumnSpan>& other, uint32_t otherRow) const {
+        for (size_t k = 0; k < keys_.size(); ++k) {
+            int compared = compareRows(leftKeys_[k], leftRow, other[k], otherRow, keys_[k].asDouble);
+            if (compared != 0) {
+                return compared;
+            }
+        }
+        return 0;
+    }
+
+    // Collect the pairs of the next runs of equal keys, until a batch's worth; false at the end
+    bool mergeRuns() {
+        clearPairs();
+        while (leftNext_ < leftOrder_.size() && rightNext_ < rightOrder_.size() && leftRows_.size() < kBatchRows) {
+            uint32_t leftRow = leftOrder_[leftNext_];
+            int compared = compareKeys(leftRow, rightKeys_, rightOrder_[rightNext_]);
+            if (compared < 0) {
+                ++leftNext_;
+            } else if (compared > 0) {
+                ++rightNext_;
+            } else {
+                size_t leftEnd = leftNext_ + 1;
+                while (leftEnd < leftOrder_.size() && compareKeys(leftRow, leftKeys_, leftOrder_[leftEnd]) == 0) {
+                    ++leftEnd;
+                }
+                size_t rightEnd = rightNext_ + 1;
+                while (rightEnd < rightOrder_.size() && compareKeys(leftRow, rightKeys_, rightOrder_[rightEnd]) == 0) {
+                    ++rightEnd;
+                }
+                for (size_t l = leftNext_; l < leftEnd; ++l) {
+                    for (size_t r = rightNext_; r < rightEnd; ++r) {
+                        leftRows_.push_back(leftOrder_[l]);
+                        rightRows_.push_back(rightOrder_[r]);
+                    }
+                }
+                leftNext_ = leftEnd;
+                rightNext_ = rightEnd;
+            }
+        }
+        return !leftRows_.empty();
+    }
+
+    bool sorted_ = false;
+    Materialized leftData_;
+    Materialized rightData_;
+    std::vector<ColumnSpan> leftKeys_;
+    std::vector<ColumnSpan> rightKeys_;
+    std::vector<uint32_t> leftOrder_;
+    std::vector<uint32_t> rightOrder_;
+    size_t leftNext_ = 0;
+    size_t rightNext_ = 0;
+};
+
+// Holds the right input in memory and passes over it once per left row, selecting the right rows
+// whose join keys (none for a cross join) equal the left row's with the selection kernels. Right
+// rows with a null key are set aside when the input is loaded.
+class NestedLoopJoinOperator : public JoinOperator {
+public:
+    using JoinOperator::JoinOperator;
+
+protected:
+    bool next(ColumnBatch& out) override {
+        if (!loaded_) {
+            rightData_ = materialize(*right_);
+            std::vector<uint8_t> valid;
+            keyBitsOf(rightData_.columns, rightData_.rows, false, rightKeys_, valid);
+            for (size_t row = 0; row < rightData_.rows; ++row) {
+                if (valid[row]) {
+                    size_t at = rightIds_.size();
+                    rightIds_.push_back(static_cast<uint32_t>(row));
+                    for (size_t k = 0; k < keys_.size(); ++k) {
+                        rightKeys_[k * rightData_.rows + at] = rightKeys_[k * rightData_.rows + row];
+                    }
+                }
+            }
+            loaded_ = true;
+        }
+        size_t rightCount = rightIds_.size();
+        for (;;) {
+            if (pending()) {
+                emit(out, batch_.columns, rightData_.columns);
+                return true;
+            }
+            if (leftNext_ >= batch_.rows) {
+                if (rightCount == 0 || !left_->pull(batch_)) {
+                    return false;
+                }
+                keyBitsOf(batch_.columns, batch_.rows, true, leftKeys_, leftValid_);
+                leftNext_ = 0;
+            }
+            clearPairs();
+            for (; leftNext_ < batch_.rows && rightRows_.size() < kBatchRows; ++leftNext_) {
+                if (!leftValid_[leftNext_]) {
+                    continue;
+                }
+                size_t first = rightRows_.size();
+                rightRows_.resize(first + rightCount);
+                uint32_t* matches = rightRows_.data() + first;
+                const uint32_t* sel = nullptr;
+                size_t kept = rightCount;
+                for (size_t k = 0; k < keys_.size() && kept > 0; ++k) {
+                    const uint64_t* keys = rightKeys_.data() + k * rightData_.rows;
+                    uint64_t key = leftKeys_[k * batch_.rows + leftNext_];
+                    kept = selectRows(sel, kept, matches, [=](size_t row) { return keys[row] == key; });
+                    sel = matches;
+                }
+                for (size_t i = 0; i < kept; ++i) {
+                    matches[i] = rightIds_[sel == nullptr ? i : matches[i]];
+                }
+                rightRows_.resize(first + kept);
+                leftRows_.resize(first + kept, static_cast<uint32_t>(leftNext_));
+            }
+        }
+    }
+
+private:
+    // Key bits of every row, one key after another, and whether the row's keys are all non-null
+    void keyBitsOf(const std::vector<ColumnVector>& columns, size_t rows, bool left, std::vector<uint64_t>& bits,
+                   std::vector<uint8_t>& valid) const {
+        bits.resize(keys_.size() * rows);
+        valid.assign(rows, 1);
+        for (size_t k = 0; k < keys_.size(); ++k) {
+            ColumnSpan span = spanOf(columns[left ? keys_[k].left : keys_[k].right]);
+            for (size_t row = 0; row < rows; ++row) {
+                bits[k * rows + row] = keyBits(span, row, keys_[k].asDouble);
+                valid[row] &= !isNullAt(span, row);
+            }
+        }
+    }
+
+    bool loaded_ = false;
+    Materialized rightData_;
+    std::vector<uint32_t> rightIds_;  // Right rows whose keys are all non-null
+    std::vector<uint64_t> rightKeys_; // Their key bits, rightData_.rows apart for each key
+    ColumnBatch batch_;
+    std::vector<uint64_t> leftKeys_;
+    std::vector<uint8_t> leftValid_;
+    size_t leftNext_ = 0;
+};
+
+enum class AggregateFunction { Count, Sum, Min, Max, Avg };
+
+struct AggregateSpec {
+    AggregateFunction function;
+    int column = -1; // Input column, -1 for COUNT(*)
+};
+
+// Finds each input row's group in an open-addressing hash table on the group columns' key bits,
+// then updates each aggregate in a loop over the batch's group numbers. Without group columns the
+// whole input is one group, which exists even when the input is empty. Output is the group
+// columns followed by the aggregates; aggregates over no non-null value are NULL, except COUNT.
+class HashAggregateOperator : public Operator {
+public:
+    HashAggregateOperator(std::unique_ptr<Operator> input, std::vector<int> groupColumns, std::vector<AggregateSpec> aggregates)
+        : Operator(outputTypes(input->types(), groupColumns, aggregates)), input_(std::move(input)),
+          groupColumns_(std::move(groupColumns)), aggregates_(std::move(aggregates)), states_(aggregates_.size()) {
+        keys_.resize(groupColumns_.size());
+        for (size_t k = 0; k < groupColumns_.size(); ++k) {
+            keys_[k].type = input_->types()[groupColumns_[k]];
+        }
+        table_.assign(16, 0);
+        if (groupColumns_.empty()) {
+            addGroup(0, nullptr, {}, 0);
+        }
+    }
+
+protected:
+    bool next(ColumnBatch& out) override {
+        if (!consumed_) {
+            ColumnBatch batch;
+            while (input_->pull(batch)) {
+                update(batch);
+            }
+            consumed_ = true;
+        }
+        if (emitted_ >= groups_) {
+            return false;
+        }
+        size_t count = std::min(kBatchRows, groups_ - emitted_);
+        reset(out);
+        for (size_t k = 0; k < keys_.size(); ++k) {
+            ColumnSpan span = spanOf(keys_[k]);
+            if (span.type == ColumnType::Int64) {
+                span.ints += emitted_;
+            } else {
+                span.doubles += emitted_;
+            }
+            append(span, count, out.columns[k]);
+        }
+        for (size_t a = 0; a < aggregates_.size(); ++a) {
+            finish(a, emitted_, count, out.columns[keys_.size() + a]);
+        }
+        out.rows = count;
+        emitted_ += count;
+        return true;
+    }
+
+private:
+    // Running values of one aggregate, per group
+    struct State {
+        std::vector<int64_t> counts; // Non-null inputs, or every row for COUNT(*)
+        std::vector<int64_t> ints;   // SUM, MIN or MAX of an int64 column
+        std::vector<double> doubles; // SUM, MIN or MAX of a double column, or the sum of an AVG
+    };
+
+    static std::vector<ColumnType> outputTypes(const std::vector<ColumnType>& input, const std::vector<int>& groupColumns,
+                                               const std::vector<AggregateSpec>& aggregates) {
+        std::vector<ColumnType> types;
+        for (int column : groupColumns) {
+            types.push_back(input[column]);
+        }
+        for (const auto& aggregate : aggregates) {
+            bool count = aggregate.function == AggregateFunction::Count;
+            types.push_back(count ? ColumnType::Int64 : aggregate.function == AggregateFunction::Avg ? ColumnType::Double : input[aggregate.column]);
+        }
+        return types;
+    }
+
+    uint32_t addGroup(uint64_t hash, const ColumnSpan* spans, const std::vector<uint64_t>& bits, size_t row) {
+        for (size_t k = 0; k < keys_.size(); ++k) {
+            if (spans[k].type == ColumnType::Int64) {
+                keys_[k].ints.push_back(spans[k].ints[row]);
+            } else {
+                keys_[k].doubles.push_back(spans[k].doubles[row]);
+            }
+        }
+        groupHashes_.push_back(hash);
+        groupBits_.insert(groupBits_.end(), bits.begin(), bits.end());
+        ++groups_;
+        for (size_t a = 0; a < aggregates_.size(); ++a) {
+            State& state = states_[a];
+            state.counts.push_back(0);
+            AggregateFunction function = aggregates_[a].function;
+            state.ints.push_back(function == AggregateFunction::Min ? std::numeric_limits<int64_t>::max()
+                                 : function == AggregateFunction::Max ? std::numeric_limits<int64_t>::min() : 0);
+            state.doubles.push_back(function == AggregateFunction::Min ? std::numeric_limits<double>::infinity()
+                                    : function == AggregateFunction::Max ? -std::numeric_limits<double>::infinity() : 0);
+        }
+        return static_cast<uint32_t>(groups_);
+    }
+
+    // Double the table once it is half full
+    void grow() {
+        table_.assign(table_.size() * 2, 0);
+        size_t mask = table_.size() - 1;
+        for (size_t g = 0; g < groups_; ++g) {
+            size_t slot = groupHashes_[g] & mask;
+            while (table_[slot] != 0) {
+                slot = (slot + 1) & mask;
+            }
+            table_[slot] = static_cast<uint32_t>(g + 1);
+        }
+    }
+
+    void update(const ColumnBatch& batch) {
+        size_t rows = batch.rows;
+        groupIds_.resize(rows);
+        if (keys_.empty()) {
+            std::fill(groupIds_.begin(), groupIds_.end(), 0);
+        } else {
+            size_t keyCount = keys_.size();
+            std::vector<ColumnSpan> spans;
+            for (int column : groupColumns_) {
+                spans.push_back(spanOf(batch.columns[column]));
+            }
+            std::vector<uint64_t> bits(keyCount);
+            for (size_t row = 0; row < rows; ++row) {
+                uint64_t hash = 0;
+                for (size_t k = 0; k < keyCount; ++k) {
+                    bits[k] = keyBits(spans[k], row, false);
+                    hash = mixKey(hash, bits[k]);
+                }
+                size_t mask = table_.size() - 1;
+                size_t slot = hash & mask;
+                uint32_t group;
+                for (;;) {
+                    group = table_[slot];
+                    if (group == 0) {
+                        group = table_[slot] = addGroup(hash, spans.data(), bits, row);
+                        if (groups_ * 2 > table_.size()) {
+                            grow();
+                        }
+                        break;
+                    }
+                    if (groupHashes_[group - 1] == hash &&
+                        std::equal(bits.begin(), bits.end(), groupBits_.begin() + size_t(group - 1) * keyCount)) {
+                        break;
+                    }
+                    slot = (slot + 1) & mask;
+                }
+                groupIds_[row] = group - 1;
+            }
+        }
+
+        const uint32_t* groups = groupIds_.data();
+        for (size_t a = 0; a < aggregates_.size(); ++a) {
+            const AggregateSpec& aggregate = aggregates_[a];
+            State& state = states_[a];
+            int64_t* counts = state.counts.data();
+            if (aggregate.column < 0) {
+                for (size_t row = 0; row < rows; ++row) {
+                    ++counts[groups[row]];
+                }
+                continue;
+            }
+            const ColumnVector& column = batch.columns[aggregate.column];
+            if (column.type == ColumnType::Int64) {
+                const int64_t* values = column.ints.data();
+                int64_t* ints = state.ints.data();
+                double* doubles = state.doubles.data();
+                for (size_t row = 0; row < rows; ++row) {
+                    counts[groups[row]] += notNull(values[row]);
+                }
+                switch (aggregate.function) {
+                case AggregateFunction::Count:
+                    break;
+                case AggregateFunction::Sum:
+                    for (size_t row = 0; row < rows; ++row) {
+                        ints[groups[row]] += notNull(values[row]) ? values[row] : 0;
+                    }
+                    break;
+                case AggregateFunction::Min:
+                    for (size_t row = 0; row < rows; ++row) {
+                        ints[groups[row]] = notNull(values[row]) ? std::min(ints[groups[row]], values[row]) : ints[groups[row]];
+                    }
+                    break;
+                case AggregateFunction::Max:
+                    for (size_t row = 0; row < rows; ++row) {
+                        ints[groups[row]] = std::max(ints[groups[row]], values[row]); // The null marker is the least value
+                    }
+                    break;
+                case AggregateFunction::Avg:
+                    for (size_t row = 0; row < rows; ++row) {
+                        doubles[groups[row]] += notNull(values[row]) ? static_cast<double>(values[row]) : 0;
+                    }
+                    break;
+                }
+            } else {
+                const double* values = column.doubles.data();
+                double* doubles = state.doubles.data();
+                for (size_t row = 0; row < rows; ++row) {
+                    counts[groups[row]] += notNull(values[row]);
+                }
+                switch (aggregate.function) {
+                case AggregateFunction::Count:
+                    break;
+                case AggregateFunction::Sum:
+                case AggregateFunction::Avg:
+                    for (size_t row = 0; row < rows; ++row) {
+                        doubles[groups[row]] += notNull(values[row]) ? values[row] : 0;
+                    }
+                    break;
+                case AggregateFunction::Min: // A NaN never compares less or greater, so nulls are skipped
+                    for (size_t row = 0; row < rows; ++row) {
+                        doubles[groups[row]] = std::min(doubles[groups[row]], values[row]);
+                    }
+                    break;
+                case AggregateFunction::Max:
+                    for (size_t row = 0; row < rows; ++row) {
+                        doubles[groups[row]] = std::max(doubles[groups[row]], values[row]);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    // Append the final values of aggregate a for groups [first, first + count) to out
+    void finish(size_t a, size_t first, size_t count, ColumnVector& out) const {
+        const State& state = states_[a];
+        AggregateFunction function = aggregates_[a].function;
+        for (size_t g = first; g < first + count; ++g) {
+            bool empty = state.counts[g] == 0;
+            if (function == AggregateFunction::Count) {
+                out.ints.push_back(state.counts[g]);
+            } else if (function == AggregateFunction::Avg) {
+                out.doubles.push_back(empty ? std::numeric_limits<double>::quiet_NaN() : state.doubles[g] / state.counts[g]);
+            } else if (out.type == ColumnType::Int64) {
+                out.ints.push_back(empty ? std::numeric_limits<int64_t>::min() : state.ints[g]);
+            } else {
+                out.doubles.push_back(empty ? std::numeric_limits<double>::quiet_NaN() : state.doubles[g]);
+            }
+        }
+    }
+
+    std::unique_ptr<Operator> input_;
+    std::vector<int> groupColumns_;
+    std::vector<AggregateSpec> aggregates_;
+    std::vector<State> states_;
+    std::vector<ColumnVector> keys_;    // Each group's key values
+    std::vector<uint64_t> groupHashes_;
+    std::vector<uint64_t> groupBits_;   // Each group's key bits, one per group column
+    std::vector<uint32_t> table_;       // Group number plus one, 0 for an empty slot
+    std::vector<uint32_t> groupIds_;
+    size_t groups_ = 0;
+    size_t emitted_ = 0;
+    bool consumed_ = false;
+};
+
+// Sorts its whole input, keeping only the first limit rows
+class SortOperator : public Operator {
+public:
+    SortOperator(std::unique_ptr<Operator> input, std::vector<SortKey> keys, size_t limit)
+        : Operator(input->types()), input_(std::move(input)), keys_(std::move(keys)), limit_(limit) {}
+
+protected:
+    bool next(ColumnBatch& out) override {
+        if (!sorted_) {
+            data_ = materialize(*input_);
+            order_ = sortRows(data_.columns, data_.rows, keys_, limit_);
+            sorted_ = true;
+        }
+        if (emitted_ >= order_.size()) {
+            return false;
+        }
+        size_t count = std::min(kBatchRows, order_.size() - emitted_);
+        reset(out);
+        for (size_t i = 0; i < data_.columns.size(); ++i) {
+            gather(spanOf(data_.columns[i]), order_.data() + emitted_, count, out.columns[i]);
+        }
+        out.rows = count;
+        emitted_ += count;
+        return true;
+    }
+
+private:
+    std::unique_ptr<Operator> input_;
+    std::vector<SortKey> keys_;
+    size_t limit_;
+    bool sorted_ = false;
+    Materialized data_;
+    std::vector<uint32_t> order_;
+    size_t emitted_ = 0;
+};
+
+// Stops pulling from its input once it has passed on the LIMIT's rows
+class LimitOperator : public Operator {
+public:
+    LimitOperator(std::unique_ptr<Operator> input, size_t limit)
+        : Operator(input->types()), input_(std::move(input)), remaining_(limit) {}
+
+protected:
+    bool next(ColumnBatch& out) override {
+        if (remaining_ == 0 || !input_->pull(out)) {
+            return false;
+        }
+        if (out.rows > remaining_) {
+            for (auto& column : out.columns) {
+                column.resize(remaining_);
+            }
+            out.rows = remaining_;
+        }
+        remaining_ -= out.rows;
+        return true;
+    }
+
+private:
+    std::unique_ptr<Operator> input_;
+    size_t remaining_;
+};
+
+// Turns a plan into a tree of operators over the stored tables. Expressions are parsed again
+// from the Query's text, and every column is resolved to a stored table's column file: by its
+// qualifier, or for an unqualified name by the one FROM table that has a file for it.
+class PlanExecutor {
+public:
+    PlanExecutor(const Query& query, const Plan& plan, const ColumnStore& store) : query_(query), plan_(plan) {
+        if (plan.nodes.empty()) {
+            throw std::runtime_error("the plan reads no tables");
+        }
+        for (const auto& table : query.fromTables) {
+            const StoredTable* stored = store.find(table.name);
+            if (stored == nullptr) {
+                throw std::runtime_error("no column files for table " + table.name + " (give them with --data=" + table.name + ":COLUMN.bin,...)");
+            }
+            tables_.push_back(stored);
+        }
+        needed_.resize(tables_.size());
+        nodeOperators_.assign(plan.nodes.size(), nullptr);
+
+        std::pmr::memory_resource* arena = &parsed_;
+        std::vector<AstSelectItem> items;
+        for (const auto& column : query.selectColumns) {
+            items.push_back(Parser(column, arena).parseItem());
+            need(items.back().expr);
+        }
+        for (const auto& condition : query.filterConditions) {
+            filters_.push_back(Parser(condition, arena).parseCondition());
+            RelSet tables = 0;
+            need(filters_.back().left, &tables);
+            if (filters_.back().kind == AstPredicate::Kind::Compare || filters_.back().kind == AstPredicate::Kind::Like) {
+                need(filters_.back().right, &tables);
+            }
+            for (const auto& value : filters_.back().values) {
+                need(value, &tables);
+            }
+            filterTables_.push_back(tables);
+        }
+        applied_.assign(filters_.size(), false);
+        for (const auto& join : query.joinConditions) {
+            AstSelectItem left = Parser(join.first, arena).parseItem();
+            AstSelectItem right = Parser(join.second, arena).parseItem();
+            need(left.expr);
+            need(right.expr);
+            joinColumns_.push_back({columnOf(left.expr), columnOf(right.expr)});
+        }
+        std::vector<ColumnRef> groupKeys;
+        for (const auto& key : query.groupBy) {
+            AstSelectItem item = Parser(key, arena).parseItem();
+            if (item.expr.kind != AstExpr::Kind::Column) {
+                throw std::runtime_error("cannot execute GROUP BY " + key + ": only columns can be grouped on");
+            }
+            need(item.expr);
+            groupKeys.push_back(columnOf(item.expr));
+        }
+        std::vector<AstSelectItem> orderKeys;
+        for (const auto& key : query.orderBy) {
+            orderKeys.push_back(Parser(key.expression, arena).parseItem());
+            if (key.column) {
+                need(orderKeys.back().expr);
+            }
+        }
+
+        std::vector<ColumnRef> layout;
+        RelSet tables = 0;
+        root_ = build(static_cast<int>(plan.nodes.size()) - 1, layout, tables);
+        for (size_t i = 0; i < filters_.size(); ++i) {
+            if (!applied_[i]) {
+                throw std::runtime_error("cannot execute " + query.filterConditions[i] + ": its tables are not in the plan");
+            }
+        }
+
+        // The select items (and ORDER BY keys naming them) as columns of the top operator
+        std::vector<int> itemColumns;
+        auto itemFor = [&](const std::string& expression) {
+            for (size_t i = 0; i < items.size(); ++i) {
+                if (items[i].alias == expression || items[i].expr.source == expression) {
+                    return itemColumns[i];
+                }
+            }
+            throw std::runtime_error("cannot execute ORDER BY " + expression + ": it names no select item");
+        };
+        std::vector<SortKey> sortKeys;
+        bool aggregated = !groupKeys.empty() || std::any_of(items.begin(), items.end(), [](const AstSelectItem& item) {
+                              return item.expr.kind == AstExpr::Kind::Function;
+                          });
+        if (aggregated) {
+            std::vector<int> groupColumns;
+            for (const auto& key : groupKeys) {
+                groupColumns.push_back(slotOf(layout, key));
+            }
+            auto groupFor = [&](const AstExpr& expr) {
+                auto found = std::find(groupKeys.begin(), groupKeys.end(), columnOf(expr));
+                if (found == groupKeys.end()) {
+                    throw std::runtime_error("cannot execute " + std::string(expr.source) + ": it is not a GROUP BY column");
+                }
+                return static_cast<int>(found - groupKeys.begin());
+            };
+            std::vector<AggregateSpec> aggregates;
+            for (const auto& item : items) {
+                if (item.expr.kind == AstExpr::Kind::Function) {
+                    aggregates.push_back(aggregateOf(item.expr, layout));
+                    itemColumns.push_back(static_cast<int>(groupKeys.size() + aggregates.size() - 1));
+                } else if (item.expr.kind == AstExpr::Kind::Column) {
+                    itemColumns.push_back(groupFor(item.expr));
+                } else {
+                    throw std::runtime_error("cannot execute select item " + std::string(item.expr.source) + " with GROUP BY");
+                }
+                names_.push_back(item.alias.empty() ? std::string(item.expr.source) : std::string(item.alias));
+            }
+            outputColumns_ = itemColumns;
+            for (size_t i = 0; i < orderKeys.size(); ++i) {
+                int column = query.orderBy[i].column ? groupFor(orderKeys[i].expr) : itemFor(query.orderBy[i].expression);
+                sortKeys.push_back({column, query.orderBy[i].descending});
+            }
+            root_ = std::make_unique<HashAggregateOperator>(std::move(root_), std::move(groupColumns), std::move(aggregates));
+        } else {
+            for (const auto& item : items) {
+                if (item.expr.kind == AstExpr::Kind::Star) {
+                    int only = item.expr.qualifier.empty() ? -1 : tableOf(item.expr);
+                    for (size_t t = 0; t < tables_.size(); ++t) {
+                        if (only >= 0 && only != static_cast<int>(t)) {
+                            continue;
+                        }
+                        const Table& table = query.fromTables[t];
+                        for (const auto& column : tables_[t]->columns) {
+                            outputColumns_.push_back(slotOf(layout, {static_cast<int>(t), column->name()}));
+                            names_.push_back((table.alias.empty() ? table.name : table.alias) + "." + column->name());
+                        }
+                    }
+                    itemColumns.push_back(-1);
+                    continue;
+                }
+                if (item.expr.kind != AstExpr::Kind::Column) {
+                    throw std::runtime_error("cannot execute select item " + std::string(item.expr.source) + ": only columns and aggregates are supported");
+                }
+                itemColumns.push_back(slotOf(layout, columnOf(item.expr)));
+                outputColumns_.push_back(itemColumns.back());
+                names_.push_back(item.alias.empty() ? std::string(item.expr.source) : std::string(item.alias));
+            }
+            for (size_t i = 0; i < orderKeys.size(); ++i) {
+                int column = query.orderBy[i].column ? slotOf(layout, columnOf(orderKeys[i].expr)) : itemFor(query.orderBy[i].expression);
+                if (column < 0) {
+                    throw std::runtime_error("cannot execute ORDER BY " + query.orderBy[i].expression + ": it names a *");
+                }
+                sortKeys.push_back({column, query.orderBy[i].descending});
+            }
+        }
+
+        if (!sortKeys.empty()) {
+            size_t limit = query.limit >= 0 ? static_cast<size_t>(query.limit) : std::numeric_limits<size_t>::max();
+            root_ = std::make_unique<SortOperator>(std::move(root_), std::move(sortKeys), limit);
+        } else if (query.limit >= 0) {
+            root_ = std::make_unique<LimitOperator>(std::move(root_), static_cast<size_t>(query.limit));
+        }
+    }
+
+    // Pull every row through the operators, keeping the first keptRows of them
+    ExecutionResult run(size_t keptRows) {
+        ExecutionResult result;
+        result.columns = names_;
+        auto start = std::chrono::steady_clock::now();
+        ColumnBatch batch;
+        while (root_->pull(batch)) {
+            for (size_t row = 0; row < batch.rows && result.rows.size() < keptRows; ++row) {
+                std::vector<std::string> values;
+                for (int column : outputColumns_) {
+                    values.push_back(formatValue(batch.columns[column], row));
+                }
+                result.rows.push_back(std::move(values));
+            }
+            result.rowCount += batch.rows;
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (const Operator* op : nodeOperators_) {
+            result.nodes.push_back(op == nullptr ? NodeActuals() : op->actuals);
+        }
+        return result;
+    }
+
+private:
+    // A column of a stored table, as it appears in an operator's output
+    struct ColumnRef {
+        int table;
+        std::string name;
+
+        bool operator==(const ColumnRef& other) const { return table == other.table && name == other.name; }
+    };
+
+    static std::string formatValue(const ColumnVector& column, size_t row) {
+        if (column.type == ColumnType::Int64) {
+            return notNull(column.ints[row]) ? std::to_string(column.ints[row]) : "NULL";
+        }
+        if (!notNull(column.doubles[row])) {
+            return "NULL";
+        }
+        std::ostringstream out;
+        out << column.doubles[row];
+        return out.str();
+    }
+
+    int tableOf(const AstExpr& expr) const {
+        if (!expr.qualifier.empty()) {
+            std::string qualifier = sqlName(expr.qualifier);
+            for (size_t t = 0; t < tables_.size(); ++t) {
+                const Table& table = query_.fromTables[t];
+                if ((table.alias.empty() ? table.name : table.alias) == qualifier) {
+                    return static_cast<int>(t);
+                }
+            }
+            throw std::runtime_error("cannot execute " + std::string(expr.source) + ": unknown table");
+        }
+        int found = -1;
+        for (size_t t = 0; t < tables_.size(); ++t) {
+            if (tables_[t]->column(expr.name) != nullptr) {
+                if (found >= 0) {
+                    throw std::runtime_error("cannot execute " + std::string(expr.source) + ": more than one table has the column");
+                }
+                found = static_cast<int>(t);
+            }
+        }
+        if (found < 0) {
+            throw std::runtime_error("cannot execute " + std::string(expr.source) + ": no table has a column file for it");
+        }
+        return found;
+    }
+
+    ColumnRef columnOf(const AstExpr& expr) const {
+        int table = tableOf(expr);
+        if (tables_[table]->column(expr.name) == nullptr) {
+            throw std::runtime_error("cannot execute " + std::string(expr.source) + ": table " + query_.fromTables[table].name +
+                                     " has no column file for it");
+        }
+        return {table, std::string(expr.name)};
+    }
+
+    // Have the scans read the columns expr uses, adding their tables to tables
+    void need(const AstExpr& expr, RelSet* tables = nullptr) {
+        if (expr.kind == AstExpr::Kind::Column) {
+            ColumnRef column = columnOf(expr);
+            auto& needed = needed_[column.table];
+            if (std::find(needed.begin(), needed.end(), column.name) == needed.end()) {
+                needed.push_back(column.name);
+            }
+            if (tables != nullptr) {
+                *tables |= RelSet(1) << column.table;
+            }
+        } else if (expr.kind == AstExpr::Kind::Star) {
+            int only = expr.qualifier.empty() ? -1 : tableOf(expr);
+            for (size_t t = 0; t < tables_.size(); ++t) {
+                if (only < 0 || only == static_cast<int>(t)) {
+                    for (const auto& column : tables_[t]->columns) {
+                        if (std::find(needed_[t].begin(), needed_[t].end(), column->name()) == needed_[t].end()) {
+                            needed_[t].push_back(column->name());
+                        }
+                    }
+                }
+            }
+        }
+        for (const auto& arg : expr.args) {
+            need(arg, tables);
+        }
+    }
+
+    static int slotOf(const std::vector<ColumnRef>& layout, const ColumnRef& column) {
+        auto found = std::find(layout.begin(), layout.end(), column);
+        return found == layout.end() ? -1 : static_cast<int>(found - layout.begin());
+    }
+
+    CompiledCondition compile(const AstPredicate& predicate, const std::vector<ColumnRef>& layout) const {
+        auto unsupported = [&]() {
+            return std::runtime_error("cannot execute " + std::string(predicate.source) + ": only conditions on numeric columns are supported");
+        };
+        CompiledCondition compiled;
+        compiled.kind = predicate.kind;
+        compiled.negated = predicate.negated;
+        const AstExpr& subject = predicateSubject(predicate);
+        if (predicate.kind == AstPredicate::Kind::Like || subject.kind != AstExpr::Kind::Column) {
+            throw unsupported();
+        }
+        compiled.column = slotOf(layout, columnOf(subject));
+
+        std::vector<const AstExpr*> literals;
+        if (predicate.kind == AstPredicate::Kind::Compare) {
+            bool mirrored = &subject == &predicate.right;
+            const AstExpr& value = mirrored ? predicate.left : predicate.right;
+            static const std::pair<std::string_view, CompareOp> kOps[] = {
+                {"=", CompareOp::Equal}, {"<>", CompareOp::NotEqual}, {"!=", CompareOp::NotEqual}, {"<", CompareOp::Less},
+                {"<=", CompareOp::LessEqual}, {">", CompareOp::Greater}, {">=", CompareOp::GreaterEqual}};
+            for (const auto& op : kOps) {
+                if (op.first == predicate.op) {
+                    compiled.op = op.second;
+                }
+            }
+            if (mirrored) {
+                static const CompareOp kMirrored[] = {CompareOp::Equal, CompareOp::NotEqual, CompareOp::Greater,
+                                                      CompareOp::GreaterEqual, CompareOp::Less, CompareOp::LessEqual};
+                compiled.op = kMirrored[static_cast<int>(compiled.op)];
+            }
+            if (value.kind == AstExpr::Kind::Column) {
+                compiled.other = slotOf(layout, columnOf(value));
+            } else {
+                literals.push_back(&value);
+            }
+        }
+        for (const auto& value : predicate.values) {
+            literals.push_back(&value);
+        }
+
+        for (const AstExpr* literal : literals) {
+            if (literal->kind == AstExpr::Kind::Null) {
+                // x IN (..., NULL) is true only for the other values, and false or NULL otherwise
+                compiled.never |= predicate.kind != AstPredicate::Kind::In || predicate.negated;
+                continue;
+            }
+            std::string text;
+            for (char c : literal->name) {
+                if (c != ' ') {
+                    text += c;
+                }
+            }
+            double number = 0;
+            if (literal->kind != AstExpr::Kind::Number || !parseNumber(text, number)) {
+                throw unsupported();
+            }
+            int64_t integer = 0;
+            auto parsed = std::from_chars(text.data(), text.data() + text.size(), integer);
+            compiled.integral &= parsed.ec == std::errc() && parsed.ptr == text.data() + text.size();
+            compiled.ints.push_back(integer);
+            compiled.doubles.push_back(number);
+        }
+        return compiled;
+    }
+
+    AggregateSpec aggregateOf(const AstExpr& expr, const std::vector<ColumnRef>& layout) const {
+        static const std::pair<std::string_view, AggregateFunction> kFunctions[] = {
+            {"COUNT", AggregateFunction::Count}, {"SUM", AggregateFunction::Sum}, {"MIN", AggregateFunction::Min},
+            {"MAX", AggregateFunction::Max}, {"AVG", AggregateFunction::Avg}};
+        for (const auto& function : kFunctions) {
+            bool same = function.first.size() == expr.name.size() &&
+                        std::equal(expr.name.begin(), expr.name.end(), function.first.begin(),
+                                   [](char a, char b) { return std::toupper(static_cast<unsigned char>(a)) == b; });
+            if (!same || expr.args.size() != 1) {
+                continue;
+            }
+            const AstExpr& arg = expr.args[0];
+            if (arg.kind == AstExpr::Kind::Star && arg.qualifier.empty() && function.second == AggregateFunction::Count) {
+                return {function.second, -1};
+            }
+            if (arg.kind == AstExpr::Kind::Column) {
+                return {function.second, slotOf(layout, columnOf(arg))};
+            }
+        }
+        throw std::runtime_error("cannot execute " + std::string(expr.source) + ": only COUNT, SUM, MIN, MAX and AVG of a column are supported");
+    }
+
+    // The operators of the subtree at nodeIndex, whose output columns and tables are returned in
+    // layout and tables. Filters are applied as soon as all of their tables are joined, and count
+    // towards the actual rows of the node they are applied at.
+    std::unique_ptr<Operator> build(int nodeIndex, std::vector<ColumnRef>& layout, RelSet& tables) {
+        const PlanNode& node = plan_.nodes[nodeIndex];
+        std::unique_ptr<Operator> op;
+        if (node.table >= 0) {
+            std::vector<const MappedColumnFile*> columns;
+            for (const auto& name : needed_[node.table]) {
+                layout.push_back({node.table, name});
+                columns.push_back(tables_[node.table]->column(name));
+            }
+            std::vector<CompiledCondition> conditions;
+            for (const auto& filter : query_.tableFilters) {
+                if (filter.table == node.table) {
+                    conditions.push_back(compile(filters_[filter.condition], layout));
+                    applied_[filter.condition] = true;
+                }
+            }
+            op = std::make_unique<ScanOperator>(*tables_[node.table], std::move(columns), std::move(conditions));
+            tables = RelSet(1) << node.table;
+        } else {
+            std::vector<ColumnRef> leftLayout;
+            std::vector<ColumnRef> rightLayout;
+            RelSet leftTables = 0;
+            RelSet rightTables = 0;
+            std::unique_ptr<Operator> left = build(node.left, leftLayout, leftTables);
+            std::unique_ptr<Operator> right = build(node.right, rightLayout, rightTables);
+            std::vector<JoinKey> keys;
+            for (int condition : node.conditions) {
+                const auto& columns = joinColumns_[condition];
+                int leftColumn = slotOf(leftLayout, columns.first);
+                int rightColumn = slotOf(rightLayout, columns.second);
+                if (leftColumn < 0 || rightColumn < 0) {
+                    leftColumn = slotOf(leftLayout, columns.second);
+                    rightColumn = slotOf(rightLayout, columns.first);
+                }
+                if (leftColumn < 0 || rightColumn < 0) {
+                    throw std::runtime_error("join condition " + query_.joinConditions[condition].first + " = " +
+                                             query_.joinConditions[condition].second + " does not join the join's inputs");
+                }
+                bool ints = left->types()[leftColumn] == ColumnType::Int64 && right->types()[rightColumn] == ColumnType::Int64;
+                keys.push_back({leftColumn, rightColumn, !ints});
+            }
+            if (keys.empty() || node.algorithm == JoinAlgorithm::NestedLoop) {
+                op = std::make_unique<NestedLoopJoinOperator>(std::move(left), std::move(right), std::move(keys));
+            } else if (node.algorithm == JoinAlgorithm::SortMerge) {
+                op = std::make_unique<MergeJoinOperator>(std::move(left), std::move(right), std::move(keys));
+            } else {
+                bool buildLeft = node.algorithm == JoinAlgorithm::Hash && node.buildLeft;
+                op = std::make_unique<HashJoinOperator>(std::move(left), std::move(right), std::move(keys), buildLeft);
+            }
+            layout = std::move(leftLayout);
+            layout.insert(layout.end(), rightLayout.begin(), rightLayout.end());
+            tables = leftTables | rightTables;
+        }
+        std::vector<CompiledCondition> residual;
+        for (size_t i = 0; i < filters_.size(); ++i) {
+            if (!applied_[i] && (filterTables_[i] & ~tables) == 0) {
+                residual.push_back(compile(filters_[i], layout));
+                applied_[i] = true;
+            }
+        }
+        if (!residual.empty()) {
+            op = std::make_unique<FilterOperator>(std::move(op), std::move(residual));
+        }
+        nodeOperators_[nodeIndex] = op.get();
+        return op;
+    }
+
+    const Query& query_;
+    const Plan& plan_;
+    std::pmr::monotonic_buffer_resource parsed_; // The ASTs' lists, which must outlive filters_
+    std::vector<const StoredTable*> tables_;        // Indexed like query.fromTables
+    std::vector<std::vector<std::string>> needed_;  // Columns each table's scan reads
+    std::vector<AstPredicate> filters_;             // Parsed filterConditions
+    std::vector<RelSet> filterTables_;              // Tables each filter references
+    std::vector<bool> applied_;
+    std::vector<std::pair<ColumnRef, ColumnRef>> joinColumns_; // Parsed joinConditions
+    std::unique_ptr<Operator> root_;
+    std::vector<Operator*> nodeOperators_;          // The operator of each plan node
+    std::vector<int> outputColumns_;                // The top operator's columns the select items are
+    std::vector<std::string> names_;
+};
+
+ExecutionResult executePlan(const Query& query, const Plan& plan, const ColumnStore& store, size_t keptRows) {
+    PlanExecutor executor(query, plan, store);
+    return executor.run(keptRows);
+}
+
+FeedbackStore::FeedbackStore(size_t capacity, double halfLife)
+    : capacity_(std::max<size_t>(1, capacity)), halfLife_(halfLife), published_(std::make_shared<FeedbackCorrections>()) {}
+
+void FeedbackStore::record(const std::vector<std::pair<uint64_t, double>>& observations) {
+    if (observations.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++epoch_;
+    for (const auto& observation : observations) {
+        double observed = std::log(std::min(kMaxCorrection, std::max(1 / kMaxCorrection, observation.second)));
+        Entry& entry = entries_[observation.first];
+        double weight = confidence(entry);
+        entry.logFactor = (entry.logFactor * weight + observed) / (weight + 1);
+        entry.weight = std::min(kMaxWeight, weight + 1);
+        entry.epoch = epoch_;
+    }
+    publish();
+}
+
+std::shared_ptr<const FeedbackCorrections> FeedbackStore::corrections() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return published_;
+}
+
+size_t FeedbackStore::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+uint64_t FeedbackStore::epoch() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return epoch_;
+}
+
+void FeedbackStore::load(const std::string& path) {
+    std::ifstream in(path);
+    std::unordered_map<uint64_t, Entry> entries;
+    uint64_t epoch = 0;
+    if (in) {
+        std::string magic;
+        if (!(in >> magic >> epoch) || magic != kFileMagic) {
+            throw std::runtime_error(path + " is not a feedback file");
+        }
+        std::string signature;
+        Entry entry;
+        while (in >> signature >> entry.logFactor >> entry.weight >> entry.epoch) {
+            uint64_t key = 0;
+            auto parsed = std::from_chars(signature.data(), signature.data() + signature.size(), key, 16);
+            if (parsed.ec != std::errc() || parsed.ptr != signature.data() + signature.size() || entry.epoch > epoch) {
+                throw std::runtime_error(path + " has a malformed feedback entry");
+            }
+            entries[key] = entry;
+        }
+        if (!in.eof()) {
+            throw std::runtime_error(path + " has a malformed feedback entry");
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_ = std::move(entries);
+    epoch_ = epoch;
+    publish();
+}
+
+void FeedbackStore::save(const std::string& path) const {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::trunc);
+        out.precision(17);
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << kFileMagic << ' ' << epoch_ << '\n';
+        for (const auto& [signature, entry] : entries_) {
+            char hex[17];
+            auto written = std::to_chars(hex, hex + sizeof(hex) - 1, signature, 16);
+            out << std::string_view(hex, static_cast<size_t>(written.ptr - hex)) << ' ' << entry.logFactor << ' ' << entry.weight
+                << ' ' << entry.epoch << '\n';
+        }
+        if (!out.flush()) {
+            throw std::runtime_error("cannot write " + temporary);
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("cannot replace " + path);
+    }
+}
+
+double FeedbackStore::confidence(const Entry& entry) const {
+    return entry.weight * std::exp2(-static_cast<double>(epoch_ - entry.epoch) / halfLife_);
+}
+
+void FeedbackStore::publish() {
+    std::vector<std::pair<double, uint64_t>> kept;
+    kept.reserve(entries_.size());
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        double weight = confidence(it->second);
+        if (weight < kMinConfidence) {
+            it = entries_.erase(it);
+        } else {
+            kept.emplace_back(weight, it->first);
+            ++it;
+        }
+    }
+    if (kept.size() > capacity_) {
+        std::nth_element(kept.begin(), kept.begin() + (kept.size() - capacity_), kept.end());
+        for (size_t i = 0; i < kept.size() - capacity_; ++i) {
+            entries_.erase(kept[i].second);
+        }
+    }
+    auto corrections = std::make_shared<FeedbackCorrections>();
+    corrections->reserve(entries_.size());
+    for (const auto& [signature, entry] : entries_) {
+        (*corrections)[signature] = std::exp(entry.logFactor * std::min(1.0, confidence(entry)));
+    }
+    published_ = std::move(corrections);
+}
+
+// Cardinality feedback from executions
+// Every plan node whose output was read to the end is an observation for its relation set: its
+// actual rows over the rows estimated from its inputs' rows, taking an input's actual rows when it
+// too was read to the end and its estimate otherwise. Measured against the inputs, a correction
+// does not depend on the corrections below it. A node whose inputs came back empty says nothing
+// about its join and is skipped, as are nodes a LIMIT stopped early.
+RelSet collectRelations(const Plan& plan, int nodeIndex, std::vector<RelSet>& sets) {
+    const PlanNode& node = plan.nodes[nodeIndex];
+    RelSet set = node.table >= 0 ? relBit(node.table)
+                                 : collectRelations(plan, node.left, sets) | collectRelations(plan, node.right, sets);
+    sets[nodeIndex] = set;
+    return set;
+}
+
+std::vector<std::pair<uint64_t, double>> feedbackObservations(const Query& query, const Plan& plan, const std::vector<NodeActuals>& actuals,
+                                                              const StatisticsCatalog* statistics) {
+    std::vector<std::pair<uint64_t, double>> observations;
+    if (plan.nodes.empty() || actuals.size() != plan.nodes.size()) {
+        return observations;
+    }
+    JoinGraph graph = buildJoinGraph(query, statistics);
+    attachFeedback(graph, query, nullptr);
+    std::vector<RelSet> sets(plan.nodes.size());
+    collectRelations(plan, static_cast<int>(plan.nodes.size()) - 1, sets);
+    auto inputRows = [&](int nodeIndex) { return actuals[nodeIndex].complete ? actuals[nodeIndex].rows : plan.nodes[nodeIndex].rows; };
+    for (size_t i = 0; i < plan.nodes.size(); ++i) {
+        const PlanNode& node = plan.nodes[i];
+        if (!actuals[i].complete || sets[i] == 0) {
+            continue;
+        }
+        double estimated = 0;
+        if (node.table >= 0) {
+            estimated = filteredRows(query, node.table);
+        } else if (inputRows(node.left) > 0 && inputRows(node.right) > 0) {
+            estimated = estimateJoinRows(inputRows(node.left), inputRows(node.right), graph.selectivityBetween(sets[node.left], sets[node.right]));
+        }
+        if (estimated > 0) {
+            observations.emplace_back(graph.feedbackSignature(sets[i]), std::max(1.0, actuals[i].rows) / estimated);
+        }
+    }
+    return observations;
+}
+
+size_t recordFeedback(FeedbackStore& store, const Query& query, const Plan& plan, const std::vector<NodeActuals>& actuals,
+                      const StatisticsCatalog* statistics) {
+    std::vector<std::pair<uint64_t, double>> observations = feedbackObservations(query, plan, actuals, statistics);
+    store.record(observations);
+    return observations.size();
+}
+
+size_t ingestObservedRows(FeedbackStore& store, std::istream& in, const OptimizerOptions& options) {
+    std::vector<std::pair<uint64_t, double>> observations;
+    size_t lineNumber = 0;
+    for (std::string line; std::getline(in, line);) {
+        ++lineNumber;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#') {
+            continue;
+        }
+        size_t end = line.find_first_of(" \t", start);
+        double rows = 0;
+        if (end == std::string::npos || !parseNumber(std::string_view(line).substr(start, end - start), rows) || rows < 0) {
+            throw std::runtime_error("line " + std::to_string(lineNumber) + ": expected ROWS SQL");
+        }
+        try {
+            Query query = parseQuery(std::string_view(line).substr(end), options.statistics);
+            if (options.rewrite) {
+                rewriteQuery(query, options.statistics);
+            }
+            OptimizerOptions planning = options;
+            planning.metrics = nullptr;
+            Plan plan = optimizeQuery(query, planning);
+            std::vector<NodeActuals> actuals(plan.nodes.size());
+            if (!actuals.empty()) {
+                actuals.back().rows = rows;
+                actuals.back().complete = true;
+            }
+            std::vector<std::pair<uint64_t, double>> observed = feedbackObservations(query, plan, actuals, options.statistics);
+            observations.insert(observations.end(), observed.begin(), observed.end());
+        } catch (const std::exception& e) {
+            throw std::runtime_error("line " + std::to_string(lineNumber) + ": " + e.what());
+        }
+    }
+    store.record(observations);
+    return observations.size();
+}
@@ -0,0 +1,1290 @@
+/*
+Query Optimizer
+The optimizer's types and entry points, shared by the query_optimizer program
+(complex_main_w_parser.cpp), optimizer_benchmark.cpp, catalog_builder.cpp and optimizer_test.cpp.
+The functions and members declared here are implemented in optimizer.cpp, which each of them is
+linked with; the lexer, the parser, the memo and the executor's operators are internal to it.
+*/
+
+#ifndef QUERY_OPTIMIZER_OPTIMIZER_H
+#define QUERY_OPTIMIZER_OPTIMIZER_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <limits>
+#include <string_view>
+#include <sstream>
+#include <cstdint>
+#include <stdexcept>
+#include <fstream>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <charconv>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <shared_mutex>
+#include <memory>
+#include <chrono>
+#include <memory_resource>
+#include <unordered_set>
+#include <map>
+#include <type_traits>
+
+// Define the Query Structure
+// A B-tree index over key columns of a table
+struct IndexDefinition {
+    std::string name;
+    std::vector<std::string> columns; // Key columns, leading column first
+    bool unique = false;
+    bool clustered = false; // The table's rows are stored in key order
+    double pages = 0;       // Leaf pages, 0 if unknown
+};
+
+// How a table's rows are placed on the nodes of a cluster
+enum class PartitionScheme {
+    Spread,    // Not declared: spread over the nodes by no key the optimizer can use
+    Hash,      // By a hash of the key column
+    Range,     // By ranges of the key column, split at bounds
+    Replicated // A full copy on every node
+};
+
+struct TablePartitioning {
+    PartitionScheme scheme = PartitionScheme::Spread;
+    std::string column;              // Key column of a hash or range partitioning
+    std::vector<std::string> bounds; // Range: the values the key ranges of consecutive nodes are split at
+    size_t nodes = 0;                // Nodes the table is partitioned over, 0 for every node of the cluster
+};
+
+struct Table {
+    std::string name;
+    long long rows; // Number of rows in the table
+    std::string alias; // Name the query refers to the table by, empty if none
+    std::vector<IndexDefinition> indexes; // Indexes the catalog knows for the table
+    std::vector<std::string> columns;     // Columns of the table the query references
+    bool allColumns = true;               // The query may reference columns not in columns, through a *
+    TablePartitioning partitioning;       // Placement the catalog declares for the table
+};
+
+// A filter that references a single table: it is evaluated by that table's scan, below every
+// join, and shrinks the table's input to join ordering
+struct TableFilter {
+    int table;          // Index into Query::fromTables
+    int condition;      // Index into Query::filterConditions
+    double selectivity; // Estimated fraction of the table's rows that pass
+    std::string column; // Column the filter compares with literals so an index on it can apply it, empty if none
+    bool equality = false; // column = literal, IN (literals) or IS NULL; otherwise a range
+};
+
+// One key of the ORDER BY clause
+struct OrderKey {
+    std::string expression; // table.column for a column of a FROM table, otherwise the key as written
+    bool column = false;    // expression names a column of a FROM table
+    bool descending = false;
+};
+
+struct Query {
+    std::vector<std::string> selectColumns;
+    std::vector<Table> fromTables;
+    std::vector<std::pair<std::string, std::string>> joinConditions; // (table1.column, table2.column)
+    std::vector<std::string> filterConditions; // Other WHERE/ON conditions, emitted unchanged
+    std::vector<TableFilter> tableFilters;     // The filter conditions local to one table
+    std::vector<std::string> groupBy;          // GROUP BY keys, qualified like ORDER BY keys
+    std::vector<OrderKey> orderBy;
+    long long limit = -1; // LIMIT row count, -1 for none
+};
+
+// Helper function to trim whitespace
+std::string trim(const std::string& str);
+
+// Instrumentation
+// Per-phase timings and search-space counters for one optimization. All recording goes through
+// the OPTIMIZER_* macros, which compile to nothing unless the program is built with
+// -DQUERY_OPTIMIZER_INSTRUMENTATION=1. Metrics are recorded into the current thread's sink,
+// installed by OPTIMIZER_METRICS_SCOPE; optimizeQuery installs OptimizerOptions::metrics, and
+// parseQuery and generateOptimizedQuery record into whatever sink their caller installed.
+#ifndef QUERY_OPTIMIZER_INSTRUMENTATION
+#define QUERY_OPTIMIZER_INSTRUMENTATION 0
+#endif
+
+enum class OptimizerPhase { Parse, Enumeration, Costing, Emission };
+
+struct OptimizerMetrics {
+    // Enumeration includes costing; costing is summed over the threads of a parallel enumerator
+    std::atomic<uint64_t> phaseNanoseconds[4] = {};
+    std::atomic<uint64_t> enumerated{0};  // Candidate joins costed
+    std::atomic<uint64_t> pruned{0};      // Candidates that did not beat the plan already memoized
+    std::atomic<uint64_t> memoized{0};    // Candidates that entered their relation set's Pareto set
+    std::atomic<size_t> memoPeakBytes{0}; // Largest memo seen
+
+    double seconds(OptimizerPhase phase) const {
+        return static_cast<double>(phaseNanoseconds[static_cast<int>(phase)].load(std::memory_order_relaxed)) / 1e9;
+    }
+
+    void recordMemo(size_t bytes) {
+        size_t peak = memoPeakBytes.load(std::memory_order_relaxed);
+        while (bytes > peak && !memoPeakBytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+inline OptimizerMetrics*& currentMetrics() {
+    thread_local OptimizerMetrics* metrics = nullptr;
+    return metrics;
+}
+
+// Make metrics the current thread's sink until the end of the scope; a null sink leaves the
+// current one in place
+class MetricsScope {
+public:
+    explicit MetricsScope(OptimizerMetrics* metrics) : previous_(currentMetrics()) {
+        if (metrics) {
+            currentMetrics() = metrics;
+        }
+    }
+    ~MetricsScope() { currentMetrics() = previous_; }
+    MetricsScope(const MetricsScope&) = delete;
+    MetricsScope& operator=(const MetricsScope&) = delete;
+
+private:
+    OptimizerMetrics* previous_;
+};
+
+class PhaseTimer {
+public:
+    explicit PhaseTimer(OptimizerPhase phase) : metrics_(currentMetrics()), phase_(phase) {
+        if (metrics_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+    ~PhaseTimer() {
+        if (metrics_) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_);
+            metrics_->phaseNanoseconds[static_cast<int>(phase_)].fetch_add(elapsed.count(), std::memory_order_relaxed);
+        }
+    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    OptimizerMetrics* metrics_;
+    OptimizerPhase phase_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#if QUERY_OPTIMIZER_INSTRUMENTATION
+#define OPTIMIZER_METRICS_SCOPE(metrics) MetricsScope optimizerMetricsScope_(metrics)
+#define OPTIMIZER_PHASE(phase) PhaseTimer optimizerPhaseTimer_(OptimizerPhase::phase)
+#define OPTIMIZER_COUNT(counter)                                                  \
+    do {                                                                          \
+        if (OptimizerMetrics* optimizerMetrics_ = currentMetrics()) {            \
+            optimizerMetrics_->counter.fetch_add(1, std::memory_order_relaxed);   \
+        }                                                                         \
+    } while (0)
+#define OPTIMIZER_RECORD_MEMO(bytes)                                              \
+    do {                                                                          \
+        if (OptimizerMetrics* optimizerMetrics_ = currentMetrics()) {            \
+            optimizerMetrics_->recordMemo(bytes);                                 \
+        }                                                                         \
+    } while (0)
+#else
+#define OPTIMIZER_METRICS_SCOPE(metrics) ((void)0)
+#define OPTIMIZER_PHASE(phase) ((void)0)
+#define OPTIMIZER_COUNT(counter) ((void)0)
+#define OPTIMIZER_RECORD_MEMO(bytes) ((void)0)
+#endif
+
+// Thrown for a statement that does not lex, parse or bind, with the offset of the offending token
+class ParseError : public std::runtime_error {
+public:
+    ParseError(const std::string& message, size_t offset)
+        : std::runtime_error(message + " at offset " + std::to_string(offset)), offset(offset) {}
+
+    size_t offset;
+};
+
+// Table Statistics
+// Per-column summaries built by ANALYZE: exact min/max and null fraction, an equi-depth histogram
+// of numeric values, the most common values, and a HyperLogLog estimate of the distinct count.
+struct ColumnStats {
+    std::string name;
+    bool numeric = true;  // Every non-null value parsed as a number
+    double min = 0;
+    double max = 0;
+    double nullFraction = 0;
+    double distinct = 0;  // Estimated number of distinct non-null values
+    std::vector<double> histogram; // Equi-depth bucket bounds; each bucket holds an equal share of non-null rows
+    std::vector<std::pair<std::string, double>> mostCommon; // Value and the fraction of all rows holding it
+
+    // Fraction of non-null rows whose value lies in [low, high]
+    double fractionBetween(double low, double high) const;
+};
+
+struct TableStats {
+    std::string name;
+    long long rows = 0;
+    std::vector<ColumnStats> columns;
+
+    const ColumnStats* column(const std::string& columnName) const;
+};
+
+struct ForeignKey {
+    std::string column;
+    std::string referencedTable;
+    std::string referencedColumn;
+};
+
+// 64-bit hash of a value's text (FNV-1a followed by the MurmurHash3 finalizer)
+inline uint64_t hashValue(std::string_view text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : text) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Binary catalog
+// A read-only file of table, column, constraint, index and statistics metadata that is mmapped
+// and read in place, so opening it costs the same for ten tables as for forty thousand. Lookups
+// hash the table name into an open-addressing index stored in the file. The file starts with a
+// CatalogHeader naming its format version and the offset and element count of each section;
+// every section is 8-byte aligned and holds fixed-size records in native byte order (a
+// byte-order mark rejects files written on a machine of the other order). Names and values live
+// in the string section and are referenced by offset and length.
+const char kCatalogMagic[8] = {'Q', 'O', 'C', 'A', 'T', 'A', 'L', '\0'};
+constexpr uint32_t kCatalogVersion = 3; // 2: index clustering and size; 3: table partitioning
+constexpr uint32_t kCatalogByteOrder = 0x01020304;
+
+enum CatalogSection {
+    kCatalogBuckets,      // uint32_t: table index + 1, 0 for an empty bucket; probed linearly
+    kCatalogTables,       // CatalogTable
+    kCatalogColumns,      // CatalogColumn, each table's columns contiguous
+    kCatalogValues,       // CatalogValue: most common values
+    kCatalogForeignKeys,  // CatalogForeignKey, each table's contiguous
+    kCatalogIndexes,      // CatalogIndex, each table's contiguous
+    kCatalogIndexColumns, // uint32_t: column index within the table
+    kCatalogNumbers,      // double: histogram bounds
+    kCatalogStrings,      // char
+    kCatalogSectionCount
+};
+
+struct CatalogString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct CatalogSectionEntry {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct CatalogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t fileBytes;
+    CatalogSectionEntry sections[kCatalogSectionCount];
+};
+
+struct CatalogTable {
+    uint64_t nameHash; // hashValue of the name
+    CatalogString name;
+    int64_t rows;      // -1 without statistics
+    uint32_t firstColumn;
+    uint32_t columnCount;
+    uint32_t firstForeignKey;
+    uint32_t foreignKeyCount;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    uint32_t partitionScheme; // PartitionScheme
+    uint32_t partitionColumn; // Column index within the table of a hash or range key
+    uint32_t partitionNodes;  // 0 for every node
+    uint32_t padding;
+    CatalogString partitionBounds; // Range bounds, comma-separated
+};
+
+struct CatalogColumn {
+    static constexpr uint32_t kNumeric = 1;
+    static constexpr uint32_t kKey = 2;
+    static constexpr uint32_t kStatistics = 4;
+
+    CatalogString name;
+    uint32_t flags;
+    uint32_t padding;
+    double min;
+    double max;
+    double nullFraction;
+    double distinct;
+    uint32_t firstNumber; // Histogram bounds
+    uint32_t numberCount;
+    uint32_t firstValue;  // Most common values
+    uint32_t valueCount;
+};
+
+struct CatalogValue {
+    CatalogString value;
+    double fraction;
+};
+
+struct CatalogForeignKey {
+    uint32_t column;           // Column index within the referencing table
+    uint32_t referencedTable;  // Table index
+    uint32_t referencedColumn; // Column index within the referenced table
+    uint32_t padding;
+};
+
+struct CatalogIndex {
+    static constexpr uint32_t kUnique = 1;
+    static constexpr uint32_t kClustered = 2;
+
+    CatalogString name;
+    uint32_t firstColumn; // Into the index column section
+    uint32_t columnCount;
+    uint32_t flags;
+    uint32_t padding;
+    double pages;         // Leaf pages, 0 if unknown
+};
+
+class MappedCatalog {
+public:
+    explicit MappedCatalog(const std::string& path);
+
+    ~MappedCatalog() { unmap(); }
+    MappedCatalog(const MappedCatalog&) = delete;
+    MappedCatalog& operator=(const MappedCatalog&) = delete;
+
+    size_t tableCount() const { return count(kCatalogTables); }
+
+    const CatalogTable* findTable(std::string_view name) const;
+
+    const CatalogColumn* findColumn(const CatalogTable& table, std::string_view name) const;
+
+    std::string_view string(CatalogString text) const;
+
+    // Decode a column's statistics into the optimizer's form
+    ColumnStats columnStats(const CatalogColumn& column) const;
+
+    bool isForeignKey(const CatalogTable& table, std::string_view column, std::string_view referencedTable,
+                      std::string_view referencedColumn) const;
+
+    std::vector<IndexDefinition> indexes(const CatalogTable& table) const;
+
+    TablePartitioning partitioning(const CatalogTable& table) const;
+
+private:
+    const CatalogHeader& header() const { return *reinterpret_cast<const CatalogHeader*>(data_); }
+
+    size_t count(CatalogSection section) const { return header().sections[section].count; }
+
+    template <typename T>
+    const T* section(CatalogSection section) const {
+        return reinterpret_cast<const T*>(data_ + header().sections[section].offset);
+    }
+
+    // Records are bounds-checked as they are reached rather than validated up front, which would
+    // touch every page of the file
+    template <typename T>
+    const T& record(CatalogSection section, uint64_t index) const {
+        if (index >= count(section)) {
+            throw std::runtime_error(path_ + " is corrupt");
+        }
+        return this->section<T>(section)[index];
+    }
+
+    const CatalogColumn& columnAt(const CatalogTable& table, uint32_t column) const;
+
+    void unmap();
+
+    std::string path_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Statistics and constraints of the tables the optimizer knows. Entries added in memory (by
+// ANALYZE or declarations) take precedence over an attached binary catalog; a column's
+// statistics are decoded from the catalog the first time they are asked for, and kept.
+class StatisticsCatalog {
+public:
+    struct Constraints {
+        std::unordered_set<std::string> keys;
+        std::vector<ForeignKey> foreignKeys;
+        std::vector<IndexDefinition> indexes;
+        TablePartitioning partitioning;
+    };
+
+    StatisticsCatalog() = default;
+    StatisticsCatalog(const StatisticsCatalog&) = delete;
+    StatisticsCatalog& operator=(const StatisticsCatalog&) = delete;
+
+    void add(TableStats stats);
+
+    void attach(std::shared_ptr<const MappedCatalog> mapped);
+
+    const TableStats* find(const std::string& table) const;
+
+    bool hasStatistics(const std::string& table) const;
+
+    // Row count of table, or fallback when no statistics know it
+    long long rowCount(const std::string& table, long long fallback) const;
+
+    bool hasColumn(const std::string& table, const std::string& column) const;
+
+    const ColumnStats* findColumn(const std::string& table, const std::string& column) const;
+
+    // Declared constraints, which the rewrite pass relies on rather than checks. A key column is
+    // unique and NOT NULL; a foreign key column, which may be NULL, references a key column, which
+    // declaring it makes a key.
+    void addKey(const std::string& table, const std::string& column);
+
+    void addForeignKey(const std::string& table, const std::string& column, const std::string& referencedTable,
+                       const std::string& referencedColumn);
+
+    void addIndex(const std::string& table, IndexDefinition index);
+
+    void setPartitioning(const std::string& table, TablePartitioning partitioning);
+
+    bool isKey(const std::string& table, const std::string& column) const;
+
+    bool isForeignKey(const std::string& table, const std::string& column, const std::string& referencedTable,
+                      const std::string& referencedColumn) const;
+
+    std::vector<IndexDefinition> indexes(const std::string& table) const;
+
+    TablePartitioning partitioning(const std::string& table) const;
+
+    // In-memory entries, which writeCatalog serializes
+    const std::unordered_map<std::string, TableStats>& tables() const { return tables_; }
+    const std::unordered_map<std::string, Constraints>& constraints() const { return constraints_; }
+
+private:
+    std::unordered_map<std::string, TableStats> tables_;
+    std::unordered_map<std::string, Constraints> constraints_;
+    std::shared_ptr<const MappedCatalog> mapped_;
+    mutable std::shared_mutex decodedMutex_;
+    mutable std::unordered_map<std::string, std::unique_ptr<ColumnStats>> decoded_; // "table\0column"; null if unknown
+};
+
+// Binary column files
+// One file per column: the 8-byte magic "QOCOLv1", a uint32 value type (0 = int64, 1 = double),
+// a uint32 of padding, a uint64 value count, then the values in native byte order. Nulls are
+// INT64_MIN or NaN. The column is named after the file, without directory or extension.
+const char kColumnFileMagic[8] = {'Q', 'O', 'C', 'O', 'L', 'v', '1', '\0'};
+
+enum class ColumnType : uint32_t { Int64 = 0, Double = 1 };
+
+struct ColumnFileHeader {
+    char magic[8];
+    ColumnType type;
+    uint32_t padding;
+    uint64_t count;
+};
+
+std::string columnNameFromPath(const std::string& path);
+
+// Serialize the catalog's in-memory tables and constraints as a binary catalog file. The file
+// is written next to path and renamed over it, so a planner mapping the old file keeps a
+// consistent view.
+void writeCatalog(const StatisticsCatalog& catalog, const std::string& path);
+
+// Catalog declarations shared by the optimizer and the catalog builder:
+//   --analyze=TABLE:FILE.csv | --analyze=TABLE:COLUMN.bin[,COLUMN.bin...]
+//   --primary-key=TABLE.COLUMN
+//   --foreign-key=TABLE.COLUMN:REFERENCED_TABLE.COLUMN
+//   --index=TABLE:COLUMN[,COLUMN...][:clustered][:pages=N] and --unique-index=... alike
+//   --partition=TABLE:hash:COLUMN[:nodes=N] | TABLE:range:COLUMN:BOUND[,BOUND...] | TABLE:replicated
+// Returns false for any other argument, and throws std::runtime_error for a malformed one.
+bool applyCatalogOption(const std::string& arg, StatisticsCatalog& catalog);
+
+// The numeric value of a command-line flag: false unless text is one number, in range for T
+template <typename T>
+bool parseFlagValue(std::string_view text, T& value) {
+    auto parsed = std::from_chars(text.data(), text.data() + text.size(), value);
+    return !text.empty() && parsed.ec == std::errc() && parsed.ptr == text.data() + text.size();
+}
+
+// Parse the Query
+// The AST lives in the thread's arena only until it has been bound
+Query parseQuery(std::string_view queryStr, const StatisticsCatalog* statistics = nullptr);
+
+// Cost model
+// Every subplan carries its estimated output cardinality and a cost split into CPU, memory, I/O
+// and network components. Components are doubles, so products of large row counts cannot
+// overflow. CostWeights fold them into the single number plans are compared by, and are meant to
+// be calibrated to the hardware the plans run on. Costs are the total work of a plan: on a
+// cluster of several nodes, operators are costed for all of their input as on one node, plus the
+// network transfer of the exchanges that bring their inputs to the nodes that join them.
+struct Cost {
+    double cpu = 0;     // Tuples processed
+    double memory = 0;  // Tuples held in memory
+    double io = 0;      // Pages read or written
+    double network = 0; // Pages sent between nodes
+
+    Cost& operator+=(const Cost& other) {
+        cpu += other.cpu;
+        memory += other.memory;
+        io += other.io;
+        network += other.network;
+        return *this;
+    }
+};
+
+inline Cost operator+(Cost a, const Cost& b) {
+    return a += b;
+}
+
+struct CostWeights {
+    double cpu = 1.0;
+    double memory = 0.5;
+    double io = 25.0;
+    double rowsPerPage = 100.0;
+    double indexEntriesPerPage = 400.0; // Keys per index page; sizes indexes the catalog gives none for
+    double workMemoryRows = 1e6; // Rows one operator may hold before it has to spill
+    double network = 40.0; // Per page sent from one node to another
+    size_t nodes = 1;      // Nodes of the cluster plans run on; 1 plans for a single machine
+};
+
+// What the cost model needs to know about an index a plan may read its table through
+struct IndexAccess {
+    double tableRows = 0;   // Rows of the indexed table
+    double pages = 0;       // Leaf pages, 0 to estimate them from tableRows
+    bool clustered = false;
+    bool covering = false;  // Holds every column of the table the query references
+    bool narrowed = false;  // Table filters restrict a prefix of its key
+    double selectivity = 1; // Fraction of the index those filters leave a scan to read
+};
+
+// Physical join operators
+enum class JoinAlgorithm {
+    NestedLoop,     // Right input held in memory (or rescanned per block of the left input)
+    Hash,           // Build a hash table on one input and probe it with the other
+    SortMerge,      // Sort both inputs on the join key and merge them
+    IndexNestedLoop // Probe an index of the right input, a base table, once per left row
+};
+
+struct JoinChoice {
+    // Enforcers the join puts on its inputs
+    static constexpr uint8_t kSortLeft = 1;
+    static constexpr uint8_t kSortRight = 2;
+    static constexpr uint8_t kPartitionLeft = 4;
+    static constexpr uint8_t kPartitionRight = 8;
+    // Exchanges moving its inputs between the nodes of a cluster first (see considerPlacements)
+    static constexpr uint8_t kShuffleLeft = 16;
+    static constexpr uint8_t kShuffleRight = 32;
+    static constexpr uint8_t kBroadcastLeft = 64;
+    static constexpr uint8_t kBroadcastRight = 128;
+
+    JoinAlgorithm algorithm = JoinAlgorithm::NestedLoop;
+    bool buildLeft = false; // Hash join: the left input is the build side
+    int index = -1;         // Index nested loop: the index of the right table it probes
+    uint8_t enforcers = 0;
+    int key = -1;           // Merge join or partitioned hash join: the key class it sorts or partitions on, -1 if unset
+    double memory = 0;      // Rows of working memory the operator holds at its peak
+    Cost cost;              // Cost of the operator and its enforcers, excluding its inputs
+    double total = std::numeric_limits<double>::infinity();
+};
+
+class CostModel {
+public:
+    explicit CostModel(const CostWeights& weights = CostWeights()) : weights_(weights) {}
+
+    double total(const Cost& cost) const;
+
+    double pages(double rows) const;
+
+    // Full scan of a base table
+    Cost scan(double rows) const;
+
+    // Index scan of a base table: descend the B-tree, read the leaf entries of the key range,
+    // and fetch the matching rows from the table unless the index covers the query. Through a
+    // clustered index the fetched rows are adjacent; through any other each costs a page of its
+    // own, up to the size of the table.
+    Cost indexScan(const IndexAccess& index, double matchedRows) const;
+
+    // Writing rows out as a temporary result, which plans then read back with scan()
+    Cost materialize(double rows) const;
+
+    // Enforcers
+    // Operators that add a property to their input rather than compute anything: a sort gives it
+    // an order, a repartition hash-partitions it on a key. A sort under a LIMIT only keeps the
+    // first limit rows, in a heap.
+    Cost sort(double rows, double limit = std::numeric_limits<double>::infinity()) const;
+
+    // Every page is written out to its partition and read back once
+    Cost repartition(double rows) const;
+
+    bool fitsInMemory(double rows) const;
+
+    // Exchanges
+    // Operators that move rows spread over the cluster's nodes between them, each row sent costing
+    // CPU at both ends. A shuffle sends every row to the node its key hashes (or ranges) to, which
+    // is another node for all but 1/N of them; a broadcast copies every row to the N - 1 nodes
+    // that lack it; a gather collects a result at one node, merging the nodes' sorted streams so
+    // that an order survives it. On a single node they cost nothing.
+    bool distributed() const;
+
+    Cost shuffle(double rows) const;
+
+    Cost broadcast(double rows) const;
+
+    Cost gather(double rows) const;
+
+    // Every join operator produces each output row once. An operator whose footprint exceeds
+    // the work-memory budget is capped at the budget and pays the I/O of spilling instead.
+    JoinChoice nestedLoopJoin(double leftRows, double rightRows, double outputRows) const;
+
+    // A build side too large for memory makes it a grace hash join: both inputs are repartitioned
+    // on the key, unless they already are, and joined one partition at a time
+    JoinChoice hashJoin(double buildRows, double probeRows, double outputRows, bool buildLeft, bool buildPartitioned = false,
+                        bool probePartitioned = false) const;
+
+    // Merges two inputs sorted on the join key, sorting those that are not
+    JoinChoice sortMergeJoin(double leftRows, double rightRows, double outputRows, bool leftSorted = false, bool rightSorted = false) const;
+
+    // Index nested loop: every left row descends the index of the right table and reads the
+    // entries and rows it matches. The inner levels of the index are read once and stay cached
+    // across probes. The right input is read by the probes instead of a scan, and nothing is held
+    // in memory.
+    JoinChoice indexNestedLoopJoin(double leftRows, const IndexAccess& index, double matchesPerProbe, double outputRows) const;
+
+    // Cheapest operator for joining left and right; without a join condition only the nested
+    // loop applies
+    JoinChoice chooseJoin(double leftRows, double rightRows, double outputRows, bool hasCondition) const;
+
+    const CostWeights& weights() const { return weights_; }
+
+private:
+    double indexPages(const IndexAccess& index) const;
+
+    // Levels above the leaves
+    double indexHeight(const IndexAccess& index) const;
+
+    // Leaf entries and table rows of matchedRows keys, without the descent
+    Cost indexRange(const IndexAccess& index, double matchedRows) const;
+
+    Cost transfer(double sentRows) const;
+
+    JoinChoice finish(JoinChoice& choice, const Cost& enforcers = Cost()) const;
+
+    CostWeights weights_;
+};
+
+// Cost-based optimization using dynamic programming
+// A plan is a binary join tree stored bottom-up in a vector: children always come before their
+// parent and the last node is the root. tables and joins list the leaves and join conditions in
+// tree order for callers that only need the flat form.
+
+// How a leaf reads its table
+enum class AccessMethod {
+    FullScan,
+    IndexScan,     // Key range of an index, then the matching rows from the table
+    IndexOnlyScan, // Key range of an index that holds every column the query uses
+    IndexLookup    // Probed by the index nested loop join above it, once per outer row
+};
+
+// Operator a plan puts on top of a node's output to give it a property its parent needs
+enum class Enforcer {
+    None,
+    Sort,       // For a merge join above, or the ORDER BY at the root
+    Repartition // Hash-partitioned on the join key for a grace hash join above
+};
+
+// Operator a plan on a cluster puts on a node's output to move its rows between nodes, beneath
+// its enforcer: an enforcer's order or partitioning would not survive the move. Gather is the
+// root's alone, and merges the nodes' streams above the ORDER BY's sort instead.
+enum class Exchange {
+    None,
+    Shuffle,   // To the node its key hashes or ranges to, to join it in place
+    Broadcast, // To every node
+    Gather     // To the node the result is returned from
+};
+
+struct PlanNode {
+    int table = -1;              // Index into query.fromTables for a leaf, -1 for a join
+    AccessMethod access = AccessMethod::FullScan;
+    int index = -1;              // Index into the leaf table's indexes it reads through, -1 for a full scan
+    bool backward = false;       // The leaf reads its index, or its clustered table, from the last key down
+    int left = -1;               // Child node indexes of a join
+    int right = -1;
+    std::vector<int> conditions; // Indexes into query.joinConditions applied at this join
+    JoinAlgorithm algorithm = JoinAlgorithm::NestedLoop;
+    bool buildLeft = false;      // Hash join builds on the left input
+    double memory = 0;           // Working memory of this operator alone, in rows
+    double rows = 0;             // Estimated output rows
+    double cost = 0;             // Weighted cost of the subtree rooted here, without its exchange and enforcer
+    Cost components;             // The same cost before weighting
+    Enforcer enforcer = Enforcer::None; // Applied to this node's output before its parent reads it
+    std::string enforcerKey;     // Columns the enforcer sorts or partitions on
+    double enforcerCost = 0;     // Weighted cost of the enforcer alone
+    Cost enforcerComponents;
+    Exchange exchange = Exchange::None; // Applied to this node's output before its enforcer
+    std::string exchangeKey;     // Columns a shuffle hashes or ranges on, and how
+    double exchangeCost = 0;     // Weighted cost of the exchange alone
+    Cost exchangeComponents;
+    int shared = -1;             // Shared result of a batch (see optimizeShared) the node's rows are read from, -1 if computed here
+};
+
+struct Plan {
+    std::vector<Table> tables;
+    std::vector<std::pair<std::string, std::string>> joins;
+    double cost;
+    std::vector<PlanNode> nodes;
+    size_t memoEntries = 0; // Relation sets the enumerator kept a best plan for
+};
+
+// Rows a table's scan passes up to the joins once its table filters are applied, treating the
+// filters as independent. This, not the table's size, is what join ordering works from.
+double filteredRows(const Query& query, size_t table);
+
+// Bitmask-based join enumeration
+// Relation sets are 64-bit masks over the indexes of query.fromTables, so the memo is a dense
+// array indexed by subset and each entry only remembers how its best plan was split.
+typedef uint64_t RelSet;
+
+enum class EnumeratorMode {
+    StringKeyed,      // Original DP keyed by comma-concatenated table names
+    Bitmask,          // Subset DP over a dense bitmask-indexed memo
+    ConnectedSubgraph, // DPccp over the join graph, no cross products between joined tables
+    TopDown            // Cascades-style memoized search from the full query down, with branch-and-bound
+};
+
+// What a plan guarantees about its output beyond its rows: the interesting order it is sorted in,
+// the key class it is hash-partitioned on and, on a cluster, how its rows are distributed over
+// the nodes. An order lets a merge join or the ORDER BY above skip a sort; partitioning lets a
+// grace hash join skip repartitioning an input; a distribution lets a join skip an exchange.
+struct PhysicalProperties {
+    int16_t order = -1;        // Index into JoinGraph::orders, -1 if unsorted
+    int16_t partition = -1;    // Key class, -1 if not partitioned
+    int16_t distribution = -1; // Index into JoinGraph::distributions, kReplicated, or -1 if spread over the nodes by no key
+
+    bool any() const {
+        return order >= 0 || partition >= 0 || distribution != -1;
+    }
+
+    // Whether a plan with these properties can stand in for one required to have required's
+    bool satisfies(PhysicalProperties required) const {
+        return (required.order < 0 || required.order == order) && (required.partition < 0 || required.partition == partition) &&
+               (required.distribution == -1 || required.distribution == distribution);
+    }
+};
+
+inline RelSet relBit(size_t index) {
+    return RelSet(1) << index;
+}
+
+inline int lowestRel(RelSet set) {
+    return __builtin_ctzll(set);
+}
+
+inline bool isSingleRel(RelSet set) {
+    return (set & (set - 1)) == 0;
+}
+
+// Cardinality feedback
+// What executions observed about row counts, kept as corrections to the estimates: one per
+// relation set, keyed by a signature that depends only on the set's tables, their filters and the
+// join conditions among them (see attachFeedback), so it carries over between queries, aliases
+// and FROM orders. A correction is the ratio of observed to estimated rows, averaged in log space
+// with a bounded weight so later observations keep moving it. Every recorded execution starts a
+// new epoch; a correction's confidence halves every halfLife epochs it goes unobserved, and fades
+// it towards 1 until it is dropped. Beyond capacity, the least confident corrections are dropped.
+// Optimizations read an immutable snapshot, republished by every record() and load().
+typedef std::unordered_map<uint64_t, double> FeedbackCorrections; // Row multiplier by relation set signature
+
+class FeedbackStore {
+public:
+    static constexpr double kMaxCorrection = 1e6;  // Corrections are clamped to [1/kMax, kMax]
+    static constexpr double kMaxWeight = 4;        // An observation moves a correction by at least 1/(kMaxWeight + 1)
+    static constexpr double kMinConfidence = 1.0 / 64; // Corrections below it are dropped
+
+    explicit FeedbackStore(size_t capacity = 4096, double halfLife = 64);
+
+    // Fold one execution's observations, (signature, observed / estimated rows), into the store
+    void record(const std::vector<std::pair<uint64_t, double>>& observations);
+
+    // The current corrections, each already faded by its confidence
+    std::shared_ptr<const FeedbackCorrections> corrections() const;
+
+    size_t size() const;
+
+    uint64_t epoch() const;
+
+    // Replace the store's contents with a file written by save(); a missing file leaves it empty
+    void load(const std::string& path);
+
+    void save(const std::string& path) const;
+
+private:
+    struct Entry {
+        double logFactor = 0; // Log of observed / estimated rows
+        double weight = 0;    // Observations behind it, as of epoch
+        uint64_t epoch = 0;   // Epoch it was last observed in
+    };
+
+    static constexpr const char* kFileMagic = "QOFEEDBACK1";
+
+    // An entry's weight as of the current epoch
+    double confidence(const Entry& entry) const;
+
+    // Drop what has faded, and the least confident entries beyond capacity, then snapshot the rest
+    void publish();
+
+    size_t capacity_;
+    double halfLife_;
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    uint64_t epoch_ = 0;
+    std::shared_ptr<const FeedbackCorrections> published_;
+};
+
+// Join graph
+// One vertex per table in query.fromTables and one edge per join condition. When the conditions
+// leave the graph disconnected, its components are planned on their own and only whole components
+// are joined by cross products (see wholeComponents). Each edge carries the selectivity estimated
+// from the statistics catalog. Conditions over one equivalence class are not independent: joining
+// a.x = c.x to a.x = b.x AND b.x = c.x filters nothing more, so only the most selective condition
+// of each class counts towards a join's selectivity. Relations also carry what their indexes offer
+// a scan, and edges the indexes an index nested loop can probe.
+// Every equivalence class, and the ORDER BY column, is a key class: the orders a plan can usefully
+// be sorted in and the keys it can be partitioned on are numbered by key class, and so are the
+// first of the ways a plan's rows can be distributed over the nodes of a cluster.
+struct JoinEdge {
+    int first;
+    int second;
+    int condition;      // Index into query.joinConditions
+    double selectivity; // Fraction of the cross product the condition keeps
+    int equivalence;    // Equivalence class shared with other conditions, -1 if it has none
+    int firstIndex = -1;  // Index of the first table led by its column of the condition, -1 if none
+    int secondIndex = -1; // Same for the second table
+    int keyClass = -1;    // Key class of the condition's columns
+};
+
+// A sort order some operator can use: ascending on a key class for a merge join, or the ORDER BY's
+struct InterestingOrder {
+    int keyClass;
+    bool descending;
+};
+
+// How rows are spread over the nodes of a cluster by a key: hashed over every node, which is what
+// a shuffle on the key produces, or as a table's partitioning declares (see TablePartitioning).
+// Rows distributed alike on a key class meet their matches on the same node.
+struct Distribution {
+    int keyClass;
+    PartitionScheme scheme;          // Hash or Range
+    size_t nodes;                    // Nodes the rows are spread over, 0 for every node of the cluster
+    std::vector<std::string> bounds; // Range: the values the key ranges of consecutive nodes are split at
+};
+
+struct JoinGraph {
+    size_t size = 0;
+    std::vector<RelSet> conditionNeighbors; // Adjacency mask of each relation
+    std::vector<std::vector<int>> conditionEdges; // Indexes into edges of each relation's condition edges
+    std::vector<JoinEdge> edges;
+    std::vector<std::vector<IndexAccess>> indexes; // Each relation's Table::indexes, in the same order
+    std::vector<std::vector<int>> indexKeyClasses; // Key class of each of those indexes' leading column, -1 if none
+    std::vector<RelSet> components;         // Relations of each connected component, by lowest relation
+    std::vector<RelSet> keyClasses;         // Relations with a column in each key class
+    std::vector<InterestingOrder> orders;   // Ascending on key class k is order k; then the ORDER BY's, if descending
+    int requiredOrder = -1;                 // Order the ORDER BY asks for, -1 if none or not a single column
+    std::vector<uint64_t> pairKeyClasses;   // Key classes below 64 of the conditions between each pair of relations, size * size
+    RelSet keyedRelations = 0;              // Relations of the key classes a join's order or partitioning can matter past it for
+    std::shared_ptr<const FeedbackCorrections> feedback; // Corrections to the row estimates, null without any
+    std::vector<uint64_t> relationSignatures; // Feedback signature of each relation, set along with feedback
+    std::vector<uint64_t> edgeSignatures;     // Same for each edge
+    std::vector<Distribution> distributions;  // Hashed on key class k over every node is distribution k; then the tables' own
+    std::vector<int16_t> relationDistributions; // Distribution of each relation's table as stored, kReplicated, or -1 if none
+
+    // The descending order of keyClass if the ORDER BY asks for it, otherwise -1
+    int descendingOrder(int keyClass) const;
+
+    // properties without what no operator above a plan of set can use: an order is kept for the
+    // ORDER BY, or, ascending, for a merge join with a relation outside set; a partitioning for a
+    // hash join with one, and a distribution by key for a join with one in place. Replicated rows
+    // join anything in place, and need no gathering at the root.
+    PhysicalProperties interesting(RelSet set, PhysicalProperties properties) const;
+
+    // Whether some plan of set can have an interesting property
+    bool hasInterestingProperties(RelSet set) const;
+
+    void addEdge(int first, int second, int condition, double selectivity, int equivalence);
+
+    // Relations adjacent to set, excluding set itself and everything in excluded
+    RelSet neighborhood(RelSet set, RelSet excluded) const;
+
+    // Whether set is a union of whole components
+    bool wholeComponents(RelSet set) const;
+
+    // Whether the exact enumerators plan a join of left and right: one with a condition between
+    // them, or a cross product of whole components. A left-deep plan cannot take a composite
+    // right input, so it crosses the relations of whole components with one relation of the next
+    // component instead, and joins the rest of that component to it by its conditions.
+    bool joinable(RelSet left, RelSet right, bool bushy) const;
+
+    bool hasCondition(RelSet left, RelSet right) const;
+
+    // Combined selectivity of the join conditions between left and right; 1 for a cross product
+    double selectivityBetween(RelSet left, RelSet right) const;
+
+    // Distinct key classes of the join conditions between left and right, at most max of them;
+    // returns how many were written to keys
+    size_t keyClassesBetween(RelSet left, RelSet right, int* keys, size_t max) const;
+
+    // Feedback signature of set: the sum of its relations' and inner condition edges' signatures
+    uint64_t feedbackSignature(RelSet set) const;
+
+    // Multiplier cardinality feedback has for the rows of set, 1 when nothing was observed for it
+    double feedbackCorrection(RelSet set) const;
+
+    // Join conditions with one side in left and the other in right
+    std::vector<int> conditionsBetween(RelSet left, RelSet right) const;
+};
+
+struct RewriteSummary {
+    size_t inferredConditions = 0;
+    std::vector<std::string> eliminatedTables; // Name, or alias, of each table removed
+};
+
+// Add the join conditions implied by equivalence classes, and remove the joins that the
+// catalog's key/foreign-key constraints prove redundant
+RewriteSummary rewriteQuery(Query& query, const StatisticsCatalog* catalog);
+
+// The LIMIT as a row count, infinite without one
+double limitRows(const Query& query);
+
+// Recost a plan's join tree for the query's current estimates, keeping its shape, operators and
+// access paths: what a plan chosen for other row counts costs at these. Inputs a merge join did
+// not sort came sorted, and still do; a hash join's inputs are repartitioned once its build side
+// outgrows memory, unless they came partitioned. An index nested loop probes whichever index of
+// its inner table is now cheapest. Exchanges move the inputs they moved before.
+void recostPlan(const Query& query, const JoinGraph& graph, const CostModel& model, Plan& plan);
+
+// Planning Budget
+// Limits for one optimizeQuery call. Exact enumeration gives up with BudgetExceeded once the
+// deadline passes or its memo outgrows memoBytes; the anytime driver then keeps the best plan
+// it already has and improves it until the deadline instead.
+struct PlanningBudget {
+    double seconds = 0;      // Wall-clock limit, 0 for none
+    size_t memoBytes = 0;    // Memo size limit for exact enumeration, 0 for none
+    size_t exactTables = 64; // Queries with more tables skip exact enumeration
+
+    bool limited(size_t tables) const {
+        return seconds > 0 || memoBytes > 0 || tables > exactTables;
+    }
+};
+
+struct OptimizerOptions {
+    EnumeratorMode enumerator = EnumeratorMode::ConnectedSubgraph;
+    bool bushy = true; // Allow composite x composite joins; false restricts plans to left-deep trees
+    const StatisticsCatalog* statistics = nullptr; // Join selectivities fall back to key/foreign-key without it
+    CostWeights costWeights;
+    size_t threads = 1; // Above 1, the bitmask enumerator splits each subset-size level across a thread pool
+    PlanningBudget budget; // Unlimited by default, which always runs the exact enumerator
+    OptimizerMetrics* metrics = nullptr; // Receives timings and counters in instrumented builds
+    bool rewrite = true; // Drivers run rewriteQuery between binding and optimization
+    const FeedbackStore* feedback = nullptr; // Corrects row estimates by what executions observed
+};
+
+// The join graph query is planned over, with the feedback of options attached
+JoinGraph planningGraph(const Query& query, const OptimizerOptions& options);
+
+// Choose the plan of a bound (and usually rewritten) query: its join tree, join operators and
+// access paths, by the enumerator and within the budget of options
+Plan optimizeQuery(const Query& query, const OptimizerOptions& options = OptimizerOptions());
+
+// The parser and the enumerators allocate from an arena per thread, which keeps up to 16 MB of
+// blocks between optimizations so that later ones need not call the heap. Return the calling
+// thread's blocks to the heap, e.g. to measure an optimization's memory from a cold start.
+void releaseThreadArena();
+
+// Query Fingerprints
+// Queries that differ only in literal values, in the order of their FROM tables or in the order
+// of their join conditions share a fingerprint. The key is canonical text rather than a bare hash,
+// so a hash collision can never hand back the plan of a different query; the hash picks a shard.
+struct QueryFingerprint {
+    std::string key;
+    uint64_t hash = 0;
+    std::vector<int> tables;     // Query table index at each canonical position
+    std::vector<int> conditions; // Query join condition index at each canonical position
+};
+
+QueryFingerprint fingerprintQuery(const Query& query);
+
+// Plan Cache
+// Maps fingerprints to plans whose table and condition indexes refer to canonical positions, so
+// one entry serves every permutation of the query. The cache is split into shards by hash; a
+// lookup only takes its shard's lock shared, and recency is tracked with a CLOCK reference bit
+// rather than by relinking an LRU list. A hit is rejected, and the entry dropped, once the
+// filtered row count of any of its tables has drifted by more than the threshold since it was
+// planned: through new statistics, or through literals whose filters are far more or less
+// selective than the ones it was planned with.
+// One cache serves one set of OptimizerOptions: clear() it when the options, or the feedback they
+// read, change.
+class PlanCache {
+public:
+    struct Counters {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t invalidations = 0; // Entries dropped for row-count drift or by invalidateTable
+        uint64_t evictions = 0;     // Entries dropped to stay within capacity
+        size_t entries = 0;
+    };
+
+    explicit PlanCache(size_t capacity = 4096, double rowDriftThreshold = 0.2, size_t shardCount = 16);
+
+    // On a hit, plan is set to the cached plan rewritten to the query's own table and condition indexes
+    bool lookup(const Query& query, const QueryFingerprint& fingerprint, Plan& plan);
+
+    void insert(const Query& query, const QueryFingerprint& fingerprint, const Plan& plan);
+
+    // Drop every plan that joins the table, e.g. after it has been re-analyzed
+    void invalidateTable(const std::string& table);
+
+    void clear();
+
+    Counters counters() const;
+
+private:
+    struct Entry {
+        std::string key;
+        Plan plan;                        // Indexes refer to canonical positions
+        std::vector<std::string> tables;  // Table names by canonical position
+        std::vector<double> rows;         // Their filtered row counts when the plan was made
+        mutable std::atomic<bool> referenced{false};
+    };
+
+    struct Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, size_t> index; // Key -> slot
+        std::vector<std::unique_ptr<Entry>> slots;
+        size_t hand = 0;                               // CLOCK hand
+    };
+
+    Shard& shardFor(const QueryFingerprint& fingerprint);
+
+    bool drifted(const Query& query, const QueryFingerprint& fingerprint, const Entry& entry) const;
+
+    // Remove a slot by moving the last slot into its place
+    static void erase(Shard& shard, size_t slot);
+
+    static Plan toCanonical(const QueryFingerprint& fingerprint, const Plan& plan);
+
+    static Plan fromCanonical(const Query& query, const QueryFingerprint& fingerprint, const Plan& canonical);
+
+    double rowDriftThreshold_;
+    size_t shardCapacity_;
+    std::vector<Shard> shards_;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> invalidations_{0};
+    std::atomic<uint64_t> evictions_{0};
+};
+
+Plan optimizeQueryCached(const Query& query, const OptimizerOptions& options, PlanCache& cache);
+
+std::string generateOptimizedQuery(const Query& query, const Plan& plan);
+
+// EXPLAIN
+// The chosen join tree, one operator per line with children indented below their parent, each
+// with its estimated output rows and the cost of its subtree. Table filters are shown on the
+// scans that apply them; the Filter line holds the conditions left above the joins. A table read
+// by an index nested loop join costs nothing of its own: its probes are costed by the join. A
+// sort or repartition a node's output goes through is a line of its own above the node, costed
+// with the node's subtree, and so is an exchange moving it between the nodes of a cluster. A node
+// read from a shared result of a batch is a line of its own, costed for reading the result back.
+// When the plan has been executed, each operator line also shows the rows it actually produced
+// and the time spent in its subtree.
+struct NodeActuals {
+    double rows = 0;
+    double seconds = 0; // Including the node's children
+    bool complete = false; // Its output was read to the end, so rows is all it produces
+};
+
+std::string explainPlan(const Query& query, const Plan& plan, const std::vector<NodeActuals>* actuals = nullptr);
+
+std::string explainRewrite(const RewriteSummary& summary);
+
+std::string explainMetrics(const OptimizerMetrics& metrics, const Plan& plan);
+
+// Prepared Statements
+// A statement with ? parameter markers is optimized once for the whole range of values its
+// parameters may be bound to, rather than for one guess at them. Each table filter with a marker
+// (up to kMaxParametricDimensions of them; further ones keep their default estimate) is a
+// dimension of a grid of selectivities, log-spaced from one row of its table to all of them. The
+// statement is optimized at every grid point, and every distinct plan (told apart by its generated
+// SQL, whose hints name each operator) is recosted at every point. Plans are then dropped, the
+// one whose loss hurts least first, while each point keeps a plan within kParametricCostSlack of
+// its optimum, and until at most kMaxParametricPlans are left. Binding values estimates the
+// filters for them from the statistics and recosts the kept plans, without enumerating anything,
+// to run the cheapest.
+constexpr size_t kMaxParametricDimensions = 3;
+constexpr size_t kMaxParametricPlans = 4;
+constexpr double kParametricCostSlack = 1.1;
+
+// Offsets of the ? markers in a statement, skipping any in literals and comments
+std::vector<size_t> parameterMarkers(std::string_view sql);
+
+struct ParametricPlan {
+    Plan plan;
+    std::vector<std::pair<double, double>> ranges; // Selectivities of each dimension the plan was kept for
+};
+
+class PreparedStatement {
+public:
+    // What binding values produced: the statement's query for them and the plan to run it with
+    struct Binding {
+        std::string sql; // The statement with the values in place of its markers
+        Query query;
+        RewriteSummary rewrite;
+        Plan plan;
+        size_t choice = 0; // Index of the plan into plans()
+    };
+
+    PreparedStatement(std::string sql, const OptimizerOptions& options);
+
+    size_t parameterCount() const { return markers_.size(); }
+    const Query& query() const { return query_; }
+    const RewriteSummary& rewrite() const { return rewrite_; }
+    const std::vector<ParametricPlan>& plans() const { return plans_; }
+    const std::vector<int>& dimensions() const { return dimensions_; } // Indexes into query().tableFilters
+
+    size_t gridPoints() const;
+
+    // Bind values, each the text of a literal (a number, a quoted string or NULL), to the markers
+    // in order
+    Binding bind(const std::vector<std::string>& values) const;
+
+private:
+    // A value a marker can be replaced by: one number (possibly negated), string or NULL
+    static bool isLiteralText(std::string_view text);
+
+    // The prepared query with each dimension's filter at the selectivities of grid point point
+    Query queryAt(size_t point) const;
+
+    void prepare();
+
+    std::string sql_;
+    OptimizerOptions options_;
+    std::vector<size_t> markers_;
+    Query query_;
+    RewriteSummary rewrite_;
+    std::vector<int> dimensions_;
+    std::vector<std::vector<double>> grid_; // Selectivities of each dimension's grid points, ascending
+    std::vector<ParametricPlan> plans_;
+};
+
+// The prepared plans and the selectivities of the parameterized filters each was kept for
+std::string explainPrepared(const PreparedStatement& statement);
+
+// A join several queries of a batch read instead of computing it
+struct SharedResult {
+    size_t query = 0;             // Query of the batch whose relations plan refers to
+    Plan plan;                    // How the result is computed
+    double rows = 0;
+    double cost = 0;              // Weighted cost of computing the result and writing it out
+    Cost components;
+    std::vector<size_t> readers;  // Queries whose plans read it, in batch order
+};
+
+struct SharedPlan {
+    std::vector<SharedResult> shared;
+    std::vector<Plan> plans;  // One per query, in batch order. A node read from a shared result keeps
+                              // the subtree computing it, and PlanNode::shared says which result it is.
+    double cost = 0;          // Shared results plus every plan
+    double separateCost = 0;  // Every query planned on its own
+};
+
+SharedPlan optimizeShared(const std::vector<Query>& queries, const OptimizerOptions& options = OptimizerOptions());
+
+// The shared results of a batch, each with the plan computing it and the queries reading it
+std::string explainShared(const std::vector<Query>& queries, const SharedPlan& plan);
+
+struct BatchReport {
+    size_t statements = 0;
+    size_t errors = 0;
+    double seconds = 0;
+};
+
+BatchReport optimizeStream(std::istream& in, std::ostream& out, const OptimizerOptions& options, PlanCache& cache,
+                           bool semicolons, size_t workers, bool explain = false);
+
+// A binary column file mapped read-only
+class MappedColumnFile {
+public:
+    explicit MappedColumnFile(const std::string& path);
+
+    ~MappedColumnFile() { unmap(); }
+    MappedColumnFile(const MappedColumnFile&) = delete;
+    MappedColumnFile& operator=(const MappedColumnFile&) = delete;
+
+    const std::string& name() const { return name_; }
+    ColumnType type() const { return type_; }
+    size_t rows() const { return rows_; }
+
+    // The values follow the header, 8-byte aligned since the mapping is page-aligned
+    const int64_t* ints() const { return reinterpret_cast<const int64_t*>(data_ + sizeof(ColumnFileHeader)); }
+    const double* doubles() const { return reinterpret_cast<const double*>(data_ + sizeof(ColumnFileHeader)); }
+
+private:
+    void unmap();
+
+    std::string name_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    ColumnType type_ = ColumnType::Int64;
+    size_t rows_ = 0;
+};
+
+// A table execution reads, one column file per column
+struct StoredTable {
+    size_t rows = 0;
+    std::vector<std::unique_ptr<MappedColumnFile>> columns;
+
+    const MappedColumnFile* column(std::string_view name) const;
+};
+
+// The stored tables, by table name
+class ColumnStore {
+public:
+    void add(const std::string& table, const std::vector<std::string>& paths);
+
+    const StoredTable* find(const std::string& table) const;
+
+private:
+    std::unordered_map<std::string, StoredTable> tables_;
+};
+
+// What running a plan returned and measured
+struct ExecutionResult {
+    std::vector<std::string> columns;           // Names of the output columns
+    std::vector<std::vector<std::string>> rows; // The first output rows, formatted
+    size_t rowCount = 0;
+    double seconds = 0;
+    std::vector<NodeActuals> nodes; // Indexed like the plan's nodes
+};
+
+// Run a plan over the stored tables its query reads
+ExecutionResult executePlan(const Query& query, const Plan& plan, const ColumnStore& store, size_t keptRows = 20);
+
+// Record what one execution of plan observed; returns the number of observations
+size_t recordFeedback(FeedbackStore& store, const Query& query, const Plan& plan, const std::vector<NodeActuals>& actuals,
+                      const StatisticsCatalog* statistics = nullptr);
+
+// Record row counts observed outside this program, one per line as "ROWS SQL": ROWS is how many
+// rows the joins and filters of the statement produced (before any GROUP BY or LIMIT). The
+// statement is planned with options, and the count is an observation for its plan's root. Blank
+// lines and lines starting with # are skipped. All lines are recorded as one epoch; returns the
+// number of observations.
+size_t ingestObservedRows(FeedbackStore& store, std::istream& in, const OptimizerOptions& options);
+
+#endif // QUERY_OPTIMIZER_OPTIMIZER_H
@@ -0,0 +1,442 @@
+/*
+Optimizer Benchmark
+Generates synthetic queries over chain, star, snowflake, cycle and clique join graphs and measures
+parseQuery, optimizeQuery and generateOptimizedQuery latency percentiles, the optimizer's memo size
+and peak heap usage for each shape and table count, plus search-space counters when built with
+-DQUERY_OPTIMIZER_INSTRUMENTATION=1. Results are written as JSON so that runs can be compared
+between releases.
+
+    g++ -std=c++17 -O2 -pthread -o optimizer_benchmark optimizer_benchmark.cpp optimizer.cpp
+    ./optimizer_benchmark --shapes=chain,star --tables=4,8,16 --rows=skewed --output=bench.json
+
+--max-optimize-ms=MS makes it exit non-zero when some configuration's median optimize time exceeds
+MS, after writing the results, so that a run can guard against regressions.
+*/
+
+#include "optimizer.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+// Heap Tracking
+// Global operator new/delete are replaced to keep the live and peak number of heap bytes; each
+// block carries its size in a header. The other allocation functions forward to these.
+namespace {
+
+constexpr size_t kAllocationHeader = alignof(std::max_align_t);
+std::atomic<size_t> liveHeapBytes{0};
+std::atomic<size_t> peakHeapBytes{0};
+
+void resetHeapPeak() {
+    peakHeapBytes.store(liveHeapBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    void* block = std::malloc(size + kAllocationHeader);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(block) = size;
+    size_t live = liveHeapBytes.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = peakHeapBytes.load(std::memory_order_relaxed);
+    while (live > peak && !peakHeapBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return static_cast<char*>(block) + kAllocationHeader;
+}
+
+void operator delete(void* pointer) noexcept {
+    if (!pointer) {
+        return;
+    }
+    // Stepped back through an integer: once this is inlined into a deallocation, GCC takes the
+    // header for an access before the start of the caller's array
+    void* block = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(pointer) - kAllocationHeader);
+    liveHeapBytes.fetch_sub(*static_cast<size_t*>(block), std::memory_order_relaxed);
+    std::free(block);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    operator delete(pointer);
+}
+
+// Query Generators
+// Tables are named t0..t(n-1) and every join edge (i, j) becomes the condition ti.cj = tj.ci.
+// Row counts live in a statistics catalog, which parseQuery reads them from.
+enum class Shape { Chain, Star, Snowflake, Cycle, Clique };
+enum class RowDistribution { Constant, Uniform, Skewed };
+
+const char* shapeName(Shape shape) {
+    switch (shape) {
+    case Shape::Chain: return "chain";
+    case Shape::Star: return "star";
+    case Shape::Snowflake: return "snowflake";
+    case Shape::Cycle: return "cycle";
+    case Shape::Clique: return "clique";
+    }
+    return "";
+}
+
+const char* rowDistributionName(RowDistribution distribution) {
+    switch (distribution) {
+    case RowDistribution::Constant: return "constant";
+    case RowDistribution::Uniform: return "uniform";
+    case RowDistribution::Skewed: return "skewed";
+    }
+    return "";
+}
+
+std::vector<std::pair<size_t, size_t>> joinEdges(Shape shape, size_t tables) {
+    std::vector<std::pair<size_t, size_t>> edges;
+    switch (shape) {
+    case Shape::Chain:
+        for (size_t i = 1; i < tables; ++i) {
+            edges.emplace_back(i - 1, i);
+        }
+        break;
+    case Shape::Cycle:
+        for (size_t i = 1; i < tables; ++i) {
+            edges.emplace_back(i - 1, i);
+        }
+        if (tables > 2) {
+            edges.emplace_back(0, tables - 1);
+        }
+        break;
+    case Shape::Star:
+        for (size_t i = 1; i < tables; ++i) {
+            edges.emplace_back(0, i);
+        }
+        break;
+    case Shape::Snowflake: {
+        // A third of the tables are dimensions of the fact table t0, the rest hang off them in turn
+        size_t dimensions = std::min(tables - 1, std::max<size_t>(2, tables / 3));
+        for (size_t i = 1; i < tables; ++i) {
+            edges.emplace_back(i <= dimensions ? 0 : 1 + (i - dimensions - 1) % dimensions, i);
+        }
+        break;
+    }
+    case Shape::Clique:
+        for (size_t i = 0; i < tables; ++i) {
+            for (size_t j = i + 1; j < tables; ++j) {
+                edges.emplace_back(i, j);
+            }
+        }
+        break;
+    }
+    return edges;
+}
+
+// Skewed gives t0 (the hub of stars and snowflakes) 10^7 rows and lets the others fall off
+// quadratically; uniform draws log-uniformly between 10^3 and 10^7
+long long tableRows(RowDistribution distribution, size_t table, std::mt19937_64& random) {
+    switch (distribution) {
+    case RowDistribution::Constant:
+        return 100000;
+    case RowDistribution::Uniform:
+        return static_cast<long long>(std::pow(10.0, std::uniform_real_distribution<double>(3, 7)(random)));
+    case RowDistribution::Skewed:
+        return std::max(10LL, static_cast<long long>(1e7 / static_cast<double>((table + 1) * (table + 1))));
+    }
+    return 1000;
+}
+
+std::string generateQuery(Shape shape, size_t tables, RowDistribution distribution, std::mt19937_64& random,
+                          StatisticsCatalog& statistics) {
+    std::string sql = "SELECT t0.c0 FROM ";
+    for (size_t i = 0; i < tables; ++i) {
+        std::string name = "t" + std::to_string(i);
+        TableStats stats;
+        stats.name = name;
+        stats.rows = tableRows(distribution, i, random);
+        statistics.add(stats);
+        sql += (i == 0 ? "" : ", ") + name;
+    }
+    const char* separator = " WHERE ";
+    for (const auto& edge : joinEdges(shape, tables)) {
+        sql += separator;
+        sql += "t" + std::to_string(edge.first) + ".c" + std::to_string(edge.second) + " = t" + std::to_string(edge.second) + ".c" + std::to_string(edge.first);
+        separator = " AND ";
+    }
+    return sql;
+}
+
+// Measurements
+struct LatencySummary {
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
+    double mean = 0;
+};
+
+// Nearest-rank percentiles over the samples, in microseconds
+LatencySummary summarize(std::vector<double> samples) {
+    LatencySummary summary;
+    if (samples.empty()) {
+        return summary;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+        size_t rank = static_cast<size_t>(std::ceil(p * static_cast<double>(samples.size())));
+        return samples[std::min(samples.size(), std::max<size_t>(rank, 1)) - 1];
+    };
+    summary.p50 = percentile(0.50);
+    summary.p90 = percentile(0.90);
+    summary.p99 = percentile(0.99);
+    summary.max = samples.back();
+    for (double sample : samples) {
+        summary.mean += sample;
+    }
+    summary.mean /= static_cast<double>(samples.size());
+    return summary;
+}
+
+struct BenchmarkResult {
+    Shape shape;
+    size_t tables;
+    size_t joins;
+    size_t memoEntries;
+    double planCost;
+    size_t peakHeapBytes; // Above the heap in use before the run, from an empty arena, highest over all repetitions
+    LatencySummary parse;
+    LatencySummary optimize;
+    LatencySummary generate;
+    uint64_t enumerated;  // Search-space counters of the last run, in instrumented builds only
+    uint64_t pruned;
+    uint64_t memoized;
+    size_t memoPeakBytes;
+};
+
+double microsecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+BenchmarkResult runBenchmark(Shape shape, size_t tables, RowDistribution distribution, const OptimizerOptions& baseOptions,
+                             size_t warmup, size_t repetitions, std::mt19937_64& random) {
+    StatisticsCatalog statistics;
+    std::string sql = generateQuery(shape, tables, distribution, random, statistics);
+    OptimizerOptions options = baseOptions;
+    options.statistics = &statistics;
+
+    BenchmarkResult result = {};
+    result.shape = shape;
+    result.tables = tables;
+    std::vector<double> parseSamples, optimizeSamples, generateSamples;
+    for (size_t run = 0; run < warmup + repetitions; ++run) {
+        OptimizerMetrics metrics;
+        OPTIMIZER_METRICS_SCOPE(&metrics);
+        // Blocks the arena kept from earlier runs would hide the memo's memory from the peak
+        releaseThreadArena();
+        size_t baseline = liveHeapBytes.load(std::memory_order_relaxed);
+        resetHeapPeak();
+
+        auto start = std::chrono::steady_clock::now();
+        Query query = parseQuery(sql, &statistics);
+        double parseTime = microsecondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        Plan plan = optimizeQuery(query, options);
+        double optimizeTime = microsecondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        std::string optimized = generateOptimizedQuery(query, plan);
+        double generateTime = microsecondsSince(start);
+
+        if (run < warmup) {
+            continue;
+        }
+        parseSamples.push_back(parseTime);
+        optimizeSamples.push_back(optimizeTime);
+        generateSamples.push_back(generateTime);
+        result.joins = query.joinConditions.size();
+        result.memoEntries = plan.memoEntries;
+        result.planCost = plan.cost;
+        result.peakHeapBytes = std::max(result.peakHeapBytes, peakHeapBytes.load(std::memory_order_relaxed) - baseline);
+        result.enumerated = metrics.enumerated;
+        result.pruned = metrics.pruned;
+        result.memoized = metrics.memoized;
+        result.memoPeakBytes = metrics.memoPeakBytes;
+    }
+    result.parse = summarize(parseSamples);
+    result.optimize = summarize(optimizeSamples);
+    result.generate = summarize(generateSamples);
+    return result;
+}
+
+// JSON Output
+void writeLatency(std::ostream& out, const char* name, const LatencySummary& latency) {
+    out << "\"" << name << "\": {\"p50\": " << latency.p50 << ", \"p90\": " << latency.p90 << ", \"p99\": " << latency.p99
+        << ", \"max\": " << latency.max << ", \"mean\": " << latency.mean << "}";
+}
+
+void writeJson(std::ostream& out, const OptimizerOptions& options, RowDistribution distribution, size_t repetitions,
+               uint64_t seed, const std::vector<BenchmarkResult>& results) {
+    const char* enumerators[] = {"string", "bitmask", "dpccp", "cascades"};
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    out << "{\n";
+    out << "  \"config\": {\"enumerator\": \"" << enumerators[static_cast<int>(options.enumerator)] << "\", \"bushy\": "
+        << (options.bushy ? "true" : "false") << ", \"threads\": " << options.threads << ", \"budget_ms\": "
+        << options.budget.seconds * 1000 << ", \"rows\": \"" << rowDistributionName(distribution) << "\", \"repetitions\": "
+        << repetitions << ", \"seed\": " << seed << "},\n";
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\"shape\": \"" << shapeName(result.shape) << "\", \"tables\": " << result.tables << ", \"joins\": " << result.joins
+            << ", \"memo_entries\": " << result.memoEntries << ", \"plan_cost\": " << result.planCost
+            << ", \"peak_heap_bytes\": " << result.peakHeapBytes << ",\n     ";
+#if QUERY_OPTIMIZER_INSTRUMENTATION
+        out << "\"enumerated\": " << result.enumerated << ", \"pruned\": " << result.pruned << ", \"memoized\": " << result.memoized
+            << ", \"memo_peak_bytes\": " << result.memoPeakBytes << ",\n     ";
+#endif
+        writeLatency(out, "parse_us", result.parse);
+        out << ",\n     ";
+        writeLatency(out, "optimize_us", result.optimize);
+        out << ",\n     ";
+        writeLatency(out, "generate_us", result.generate);
+        out << "}";
+    }
+    out << "\n  ],\n";
+    out << "  \"peak_rss_kb\": " << usage.ru_maxrss << "\n";
+    out << "}\n";
+}
+
+std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+int main(int argc, char* argv[]) {
+    OptimizerOptions options;
+    std::vector<Shape> shapes = {Shape::Chain, Shape::Star, Shape::Snowflake, Shape::Cycle, Shape::Clique};
+    std::vector<size_t> tableCounts = {4, 8, 12};
+    RowDistribution distribution = RowDistribution::Uniform;
+    size_t warmup = 2;
+    size_t repetitions = 20;
+    uint64_t seed = 1;
+    std::string outputPath;
+    double maxOptimizeMs = 0; // Fail when some configuration's median optimize time exceeds it; 0 to never fail
+    auto number = [](const std::string& arg, auto& value) {
+        if (!parseFlagValue(std::string_view(arg).substr(arg.find('=') + 1), value)) {
+            std::cerr << "Invalid option: " << arg << " expects a number" << std::endl;
+            return false;
+        }
+        return true;
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--shapes=", 0) == 0) {
+            shapes.clear();
+            for (const auto& name : splitList(arg.substr(9))) {
+                Shape all[] = {Shape::Chain, Shape::Star, Shape::Snowflake, Shape::Cycle, Shape::Clique};
+                auto found = std::find_if(std::begin(all), std::end(all), [&](Shape shape) { return name == shapeName(shape); });
+                if (found == std::end(all)) {
+                    std::cerr << "Unknown shape: " << name << std::endl;
+                    return 1;
+                }
+                shapes.push_back(*found);
+            }
+        } else if (arg.rfind("--tables=", 0) == 0) {
+            tableCounts.clear();
+            for (const auto& count : splitList(arg.substr(9))) {
+                tableCounts.push_back(0);
+                if (!parseFlagValue(count, tableCounts.back())) {
+                    std::cerr << "Invalid option: " << arg << " expects numbers separated by commas" << std::endl;
+                    return 1;
+                }
+            }
+        } else if (arg == "--rows=constant") {
+            distribution = RowDistribution::Constant;
+        } else if (arg == "--rows=uniform") {
+            distribution = RowDistribution::Uniform;
+        } else if (arg == "--rows=skewed") {
+            distribution = RowDistribution::Skewed;
+        } else if (arg.rfind("--repetitions=", 0) == 0) {
+            if (!number(arg, repetitions)) {
+                return 1;
+            }
+        } else if (arg.rfind("--warmup=", 0) == 0) {
+            if (!number(arg, warmup)) {
+                return 1;
+            }
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            if (!number(arg, seed)) {
+                return 1;
+            }
+        } else if (arg.rfind("--output=", 0) == 0) {
+            outputPath = arg.substr(9);
+        } else if (arg == "--enumerator=string") {
+            options.enumerator = EnumeratorMode::StringKeyed;
+        } else if (arg == "--enumerator=bitmask") {
+            options.enumerator = EnumeratorMode::Bitmask;
+        } else if (arg == "--enumerator=dpccp") {
+            options.enumerator = EnumeratorMode::ConnectedSubgraph;
+        } else if (arg == "--enumerator=cascades") {
+            options.enumerator = EnumeratorMode::TopDown;
+        } else if (arg == "--left-deep") {
+            options.bushy = false;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            if (!number(arg, options.threads)) {
+                return 1;
+            }
+        } else if (arg.rfind("--budget-ms=", 0) == 0) {
+            double milliseconds = 0;
+            if (!number(arg, milliseconds)) {
+                return 1;
+            }
+            options.budget.seconds = milliseconds / 1000;
+        } else if (arg.rfind("--max-optimize-ms=", 0) == 0) {
+            if (!number(arg, maxOptimizeMs)) {
+                return 1;
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--shapes=chain,star,snowflake,cycle,clique] [--tables=N,...]"
+                      << " [--rows=constant|uniform|skewed] [--repetitions=N] [--warmup=N] [--seed=N] [--output=FILE.json]"
+                      << " [--enumerator=string|bitmask|dpccp|cascades] [--left-deep] [--threads=N] [--budget-ms=MS]"
+                      << " [--max-optimize-ms=MS]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::mt19937_64 random(seed);
+    std::vector<BenchmarkResult> results;
+    for (Shape shape : shapes) {
+        for (size_t tables : tableCounts) {
+            try {
+                results.push_back(runBenchmark(shape, tables, distribution, options, warmup, repetitions, random));
+            } catch (const std::exception& e) {
+                std::cerr << shapeName(shape) << " with " << tables << " tables: " << e.what() << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    if (outputPath.empty()) {
+        writeJson(std::cout, options, distribution, repetitions, seed, results);
+    } else {
+        std::ofstream out(outputPath);
+        writeJson(out, options, distribution, repetitions, seed, results);
+        if (!out) {
+            std::cerr << "Cannot write " << outputPath << std::endl;
+            return 1;
+        }
+    }
+    for (const BenchmarkResult& result : results) {
+        if (maxOptimizeMs > 0 && result.optimize.p50 > maxOptimizeMs * 1000) {
+            std::cerr << shapeName(result.shape) << " with " << result.tables << " tables: median optimize time "
+                      << result.optimize.p50 / 1000 << " ms exceeds " << maxOptimizeMs << " ms" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
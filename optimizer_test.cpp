@@ -0,0 +1,1056 @@
+/*
+Optimizer Tests
+Checks the optimizer against results it must agree with: enumerators that search the same plan
+space find plans of the same cost, the parallel bitmask enumerator finds the serial one's plan,
+the parser binds what it should and rejects what it should, the plan cache hits, evicts and
+invalidates plans as it should, cardinality feedback fades, evicts and corrects later plans, a
+prepared statement re-bound picks the plan for its values, a batch shares a join its statements
+compute alike, tables partitioned alike on a join key join in place, a binary catalog maps back
+to what was written and rejects damaged files, executing any enumerator's plan, with any join
+algorithm, returns the rows computed here independently, and ANALYZE's distinct counts, most
+common values and histograms are as accurate as their sketches promise. Every failed check is
+printed with the query it failed on, and the program exits non-zero if any failed. Catalog and
+column files are written under /tmp.
+
+    g++ -std=c++17 -O2 -pthread -o optimizer_test optimizer_test.cpp optimizer.cpp
+    ./optimizer_test --seed=1
+*/
+
+#include "optimizer.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+size_t checks = 0;
+size_t failures = 0;
+
+void check(bool passed, const std::string& what) {
+    ++checks;
+    if (!passed) {
+        ++failures;
+        std::cerr << "FAILED: " << what << std::endl;
+    }
+}
+
+bool sameCost(double a, double b) {
+    return std::abs(a - b) <= 1e-9 * std::max(std::abs(a), std::abs(b));
+}
+
+// Random Join Graphs
+// Tables t0..t(n-1) with log-uniform row counts between 10 and 10^6. Each table joins an earlier
+// one, except that a disconnected graph drops about a third of those edges; a few conditions on
+// a column d shared by any two tables then close cycles and equivalence classes.
+std::string randomQuery(size_t tables, bool connected, std::mt19937_64& random, StatisticsCatalog& statistics) {
+    std::string sql = "SELECT t0.c0 FROM ";
+    for (size_t i = 0; i < tables; ++i) {
+        TableStats stats;
+        stats.name = "t" + std::to_string(i);
+        stats.rows = static_cast<long long>(std::pow(10.0, std::uniform_real_distribution<double>(1, 6)(random)));
+        statistics.add(stats);
+        sql += (i == 0 ? "" : ", ") + stats.name;
+    }
+    std::vector<std::string> conditions;
+    for (size_t i = 1; i < tables; ++i) {
+        if (connected || random() % 3 != 0) {
+            size_t j = random() % i;
+            conditions.push_back("t" + std::to_string(j) + ".c" + std::to_string(i) + " = t" + std::to_string(i) + ".c" + std::to_string(j));
+        }
+    }
+    for (size_t extra = random() % 3; extra > 0; --extra) {
+        size_t a = random() % tables;
+        size_t b = random() % tables;
+        if (a != b) {
+            conditions.push_back("t" + std::to_string(a) + ".d = t" + std::to_string(b) + ".d");
+        }
+    }
+    for (size_t i = 0; i < conditions.size(); ++i) {
+        sql += (i == 0 ? " WHERE " : " AND ") + conditions[i];
+    }
+    return sql;
+}
+
+// DPccp against the bitmask enumerator
+// Both are exact over the same space: the joins of connected sets, and cross products only
+// between whole components of a disconnected graph. Their plans must cost the same, bushy or
+// left-deep.
+void testConnectedSubgraphMatchesBitmask(std::mt19937_64& random) {
+    size_t disconnected = 0;
+    for (size_t i = 0; i < 300; ++i) {
+        StatisticsCatalog statistics;
+        std::string sql = randomQuery(2 + random() % 9, i % 2 == 0, random, statistics);
+        Query query = parseQuery(sql, &statistics);
+        for (bool bushy : {true, false}) {
+            OptimizerOptions options;
+            options.statistics = &statistics;
+            options.bushy = bushy;
+            disconnected += bushy && planningGraph(query, options).components.size() > 1;
+            options.enumerator = EnumeratorMode::ConnectedSubgraph;
+            double dpccp = optimizeQuery(query, options).cost;
+            options.enumerator = EnumeratorMode::Bitmask;
+            double bitmask = optimizeQuery(query, options).cost;
+            check(sameCost(dpccp, bitmask), std::string(bushy ? "bushy" : "left-deep") + " DPccp cost " + std::to_string(dpccp) +
+                                                " differs from bitmask cost " + std::to_string(bitmask) + ": " + sql);
+        }
+    }
+    check(disconnected > 0, "no disconnected join graph was generated");
+}
+
+// Parallel bitmask enumeration against the serial one
+// Each set is optimized by the serial loop once its subsets are final, so the plan must be the
+// same for any thread count and any scheduling. Each query is planned several times per thread
+// count for the scheduling to vary.
+void testParallelMatchesSerial(std::mt19937_64& random) {
+    for (size_t i = 0; i < 40; ++i) {
+        StatisticsCatalog statistics;
+        std::string sql = randomQuery(4 + random() % 9, i % 4 != 0, random, statistics);
+        Query query = parseQuery(sql, &statistics);
+        for (bool bushy : {true, false}) {
+            OptimizerOptions options;
+            options.statistics = &statistics;
+            options.bushy = bushy;
+            options.enumerator = EnumeratorMode::Bitmask;
+            Plan serial = optimizeQuery(query, options);
+            std::string expected = explainPlan(query, serial);
+            for (size_t threads = 2; threads <= 8; ++threads) {
+                options.threads = threads;
+                for (size_t repetition = 0; repetition < 3; ++repetition) {
+                    Plan parallel = optimizeQuery(query, options);
+                    check(parallel.cost == serial.cost && explainPlan(query, parallel) == expected,
+                          std::to_string(threads) + " threads " + (bushy ? "bushy" : "left-deep") + " plan differs from the serial plan: " + sql);
+                }
+            }
+        }
+    }
+}
+
+// Parser and Binder
+// The AND of a BETWEEN belongs to it, not to the WHERE clause; parenthesized join chains bind
+// every table and condition whichever side they nest on; a number has one decimal point at most;
+// a LIMIT too large for a row count and an unknown table are errors at their offset; and an
+// unqualified column two tables could hold is not taken for a filter of either.
+size_t parseErrorOffset(const std::string& sql, const StatisticsCatalog& statistics) {
+    try {
+        parseQuery(sql, &statistics);
+    } catch (const ParseError& e) {
+        return e.offset;
+    }
+    return std::string::npos; // Parsed
+}
+
+void testParser() {
+    StatisticsCatalog statistics;
+    for (const char* name : {"a", "b", "c"}) {
+        TableStats stats;
+        stats.name = name;
+        stats.rows = 100;
+        ColumnStats shared;
+        shared.name = "x";
+        ColumnStats own;
+        own.name = std::string("only_") + name;
+        stats.columns = {shared, own};
+        statistics.add(stats);
+    }
+
+    Query query = parseQuery("select * from a, b where a.x between 1 and 5 AND a.x = b.x", &statistics);
+    check(query.filterConditions == std::vector<std::string>{"a.x between 1 and 5"} && query.joinConditions.size() == 1 &&
+              query.tableFilters.size() == 1 && query.tableFilters[0].table == 0,
+          "the AND of a BETWEEN is not bound to it");
+    query = parseQuery("SELECT * FROM a, b WHERE a.x NOT BETWEEN 1 AND 5 AND b.x = a.x", &statistics);
+    check(query.filterConditions.size() == 1 && query.joinConditions.size() == 1, "the AND of a NOT BETWEEN is not bound to it");
+
+    for (const char* sql : {"SELECT * FROM (a JOIN b ON a.x = b.x) JOIN c ON b.x = c.x",
+                            "SELECT * FROM a JOIN (b JOIN c ON b.x = c.x) ON a.x = b.x",
+                            "SELECT * FROM ((a JOIN b ON a.x = b.x) JOIN c ON b.x = c.x)"}) {
+        query = parseQuery(sql, &statistics);
+        check(query.fromTables.size() == 3 && query.fromTables[0].name == "a" && query.fromTables[2].name == "c" &&
+                  query.joinConditions.size() == 2,
+              std::string("a parenthesized join chain lost a table or condition: ") + sql);
+    }
+
+    query = parseQuery("SELECT * FROM a WHERE a.x > 1.5e3 AND a.x < .5", &statistics);
+    check(query.filterConditions.size() == 2, "a number with an exponent or without an integer part does not lex");
+    const std::string dotted = "SELECT * FROM a WHERE a.x = 1.2.3";
+    check(parseErrorOffset(dotted, statistics) == dotted.find(".3"), "a number with two decimal points lexes as one");
+    const std::string doubled = "SELECT * FROM a WHERE a.x = 1..2";
+    check(parseErrorOffset(doubled, statistics) == doubled.find(".2"), "a number with two adjacent decimal points lexes as one");
+
+    const std::string huge = "SELECT * FROM a LIMIT 99999999999999999999";
+    check(parseErrorOffset(huge, statistics) == huge.find("999"), "a LIMIT out of range is not an error at its row count");
+    check(parseQuery("SELECT * FROM a LIMIT 10", &statistics).limit == 10, "a LIMIT is not bound");
+    const std::string unknown = "SELECT * FROM a, b WHERE a.x = z.x";
+    check(parseErrorOffset(unknown, statistics) == unknown.find("z.x"), "an unknown table is not an error at its qualifier");
+
+    query = parseQuery("SELECT * FROM a, b WHERE x > 5 AND a.x = b.x", &statistics);
+    check(query.filterConditions.size() == 1 && query.tableFilters.empty(), "a column both tables hold is taken for one table's");
+    query = parseQuery("SELECT * FROM a, b WHERE only_b > 5 AND a.x = b.x", &statistics);
+    check(query.tableFilters.size() == 1 && query.tableFilters[0].table == 1, "a column only one table holds is not taken for its");
+}
+
+// Plan Cache
+// Queries differing only in literals, or in the order of their tables and conditions, share a
+// fingerprint and so a cached plan, rewritten to each query's own tables. Entries referenced since
+// the CLOCK hand last passed survive eviction, and a plan is dropped once a table's rows drift.
+void addCacheTables(StatisticsCatalog& statistics, long long ordersRows) {
+    for (const auto& table : std::vector<std::pair<std::string, long long>>{{"customers", 1000}, {"orders", ordersRows}, {"items", 50000}}) {
+        TableStats stats;
+        stats.name = table.first;
+        stats.rows = table.second;
+        statistics.add(stats);
+    }
+}
+
+void testPlanCache() {
+    StatisticsCatalog statistics;
+    addCacheTables(statistics, 10000);
+    OptimizerOptions options;
+    options.statistics = &statistics;
+    const std::string sql = "SELECT * FROM customers c, orders o, items i WHERE c.id = o.cid AND o.id = i.oid AND o.amount > 100";
+    const std::string otherLiteral = "SELECT * FROM customers c, orders o, items i WHERE c.id = o.cid AND o.id = i.oid AND o.amount > 250";
+    const std::string permuted = "SELECT * FROM items i, orders o, customers c WHERE o.amount > 100 AND o.id = i.oid AND c.id = o.cid";
+    const std::string otherColumn = "SELECT * FROM customers c, orders o, items i WHERE c.id = o.cid AND o.id = i.oid AND o.qty > 100";
+
+    Query query = parseQuery(sql, &statistics);
+    check(fingerprintQuery(query).key == fingerprintQuery(parseQuery(otherLiteral, &statistics)).key,
+          "queries differing only in a literal have different fingerprints");
+    check(fingerprintQuery(query).key == fingerprintQuery(parseQuery(permuted, &statistics)).key,
+          "queries differing only in the order of tables and conditions have different fingerprints");
+    check(fingerprintQuery(query).key != fingerprintQuery(parseQuery(otherColumn, &statistics)).key,
+          "queries filtering different columns share a fingerprint");
+
+    PlanCache cache;
+    Plan planned = optimizeQueryCached(query, options, cache);
+    check(cache.counters().misses == 1 && cache.counters().hits == 0 && cache.counters().entries == 1,
+          "the first lookup of a query is not a miss that caches its plan");
+    Plan cached = optimizeQueryCached(query, options, cache);
+    check(cache.counters().hits == 1 && sameCost(cached.cost, planned.cost), "a repeated query does not hit its cached plan");
+    Query permutedQuery = parseQuery(permuted, &statistics);
+    Plan rewritten = optimizeQueryCached(permutedQuery, options, cache);
+    check(cache.counters().hits == 2 && sameCost(rewritten.cost, optimizeQuery(permutedQuery, options).cost),
+          "a permuted query does not hit the cached plan, or gets it wrongly rewritten");
+    optimizeQueryCached(parseQuery(otherColumn, &statistics), options, cache);
+    check(cache.counters().misses == 2, "a query with another fingerprint hits");
+
+    // Row drift: orders grows fivefold, past the 20% the plan tolerates
+    StatisticsCatalog grown;
+    addCacheTables(grown, 50000);
+    Query drifted = parseQuery(sql, &grown);
+    Plan plan;
+    check(!cache.lookup(drifted, fingerprintQuery(drifted), plan) && cache.counters().invalidations == 1,
+          "a plan whose table rows drifted is not invalidated");
+    StatisticsCatalog slightly;
+    addCacheTables(slightly, 11000);
+    Query close = parseQuery(otherColumn, &slightly);
+    check(cache.lookup(close, fingerprintQuery(close), plan), "a plan whose table rows moved within the threshold is invalidated");
+
+    // CLOCK: with room for two plans, the one looked up since it was cached outlives the other
+    PlanCache small(2, 0.2, 1);
+    Query first = parseQuery(sql, &statistics);
+    Query second = parseQuery(otherColumn, &statistics);
+    Query third = parseQuery("SELECT * FROM customers c, orders o WHERE c.id = o.cid", &statistics);
+    for (const Query* each : {&first, &second}) {
+        small.insert(*each, fingerprintQuery(*each), optimizeQuery(*each, options));
+    }
+    small.lookup(first, fingerprintQuery(first), plan);
+    small.insert(third, fingerprintQuery(third), optimizeQuery(third, options));
+    check(small.counters().evictions == 1 && small.counters().entries == 2, "a full cache does not evict exactly one plan");
+    check(small.lookup(first, fingerprintQuery(first), plan), "the plan referenced since the last sweep was evicted");
+    check(!small.lookup(second, fingerprintQuery(second), plan), "the plan not referenced since the last sweep was kept");
+    check(small.lookup(third, fingerprintQuery(third), plan), "the newly inserted plan is missing");
+}
+
+// Cardinality Feedback
+// A correction is taken whole from a first observation, fades towards 1 as its confidence halves
+// every halfLife epochs without one, and is dropped once faded; beyond capacity the least
+// confident goes first. Planned again with the store, a query estimates the rows it observed, and
+// a join observed to blow up is no longer joined first.
+bool nearly(double a, double b) {
+    return std::abs(a - b) <= 1e-6 * std::max(std::abs(a), std::abs(b));
+}
+
+double correctionOf(const FeedbackStore& store, uint64_t signature) {
+    auto corrections = store.corrections();
+    auto found = corrections->find(signature);
+    return found == corrections->end() ? 1 : found->second;
+}
+
+// The FROM tables of the plan's first join of two base tables
+RelSet firstJoin(const Plan& plan) {
+    for (const PlanNode& node : plan.nodes) {
+        if (node.table < 0 && plan.nodes[node.left].table >= 0 && plan.nodes[node.right].table >= 0) {
+            return relBit(plan.nodes[node.left].table) | relBit(plan.nodes[node.right].table);
+        }
+    }
+    return 0;
+}
+
+void testFeedback() {
+    FeedbackStore fading(16, 2);
+    fading.record({{1, 8}});
+    check(nearly(correctionOf(fading, 1), 8), "a first observation is not taken whole");
+    fading.record({{2, 1}});
+    fading.record({{2, 1}});
+    check(nearly(correctionOf(fading, 1), std::sqrt(8.0)), "a correction unobserved for one half-life has not faded halfway");
+    fading.record({{1, 8}});
+    check(correctionOf(fading, 1) > std::sqrt(8.0) && correctionOf(fading, 1) < 8, "a repeated observation does not restore confidence");
+    for (int epoch = 0; epoch < 16; ++epoch) {
+        fading.record({{2, 1}});
+    }
+    check(fading.corrections()->count(1) == 0 && fading.size() == 1, "a correction unobserved for eight half-lives is kept");
+
+    FeedbackStore small(2, 64);
+    small.record({{1, 2}});
+    small.record({{2, 3}});
+    small.record({{3, 4}});
+    check(small.size() == 2 && small.corrections()->count(1) == 0 && nearly(correctionOf(small, 3), 4),
+          "beyond capacity, the least confident correction is not the one dropped");
+
+    StatisticsCatalog statistics;
+    for (const char* name : {"a", "b", "c"}) {
+        TableStats stats;
+        stats.name = name;
+        stats.rows = 1000;
+        statistics.add(stats);
+    }
+    const std::string sql = "SELECT * FROM a, b, c WHERE a.x = b.x AND b.y = c.y";
+    for (const char* observed : {"SELECT * FROM a, b WHERE a.x = b.x", "SELECT * FROM b, c WHERE b.y = c.y"}) {
+        FeedbackStore store;
+        OptimizerOptions options;
+        options.statistics = &statistics;
+        std::istringstream lines(std::string("100000000 ") + observed);
+        ingestObservedRows(store, lines, options);
+        options.feedback = &store;
+        Query pair = parseQuery(observed, &statistics);
+        Plan replanned = optimizeQuery(pair, options);
+        check(!replanned.nodes.empty() && nearly(replanned.nodes.back().rows, 1e8),
+              std::string("planned again, a join does not estimate the rows observed: ") + observed);
+        Plan plan = optimizeQuery(parseQuery(sql, &statistics), options);
+        RelSet blownUp = pair.fromTables[0].name == "a" ? relBit(0) | relBit(1) : relBit(1) | relBit(2);
+        check(firstJoin(plan) != 0 && firstJoin(plan) != blownUp, std::string("the join observed to blow up is still joined first: ") + observed);
+    }
+}
+
+// Prepared Statements
+// A filter on a parameter that passes almost no orders makes the orders the build side, and one
+// that passes them all makes the customers it; binding either value picks the prepared plan for
+// it, within the slack of what optimizing the bound statement from scratch finds.
+void testPreparedStatement() {
+    StatisticsCatalog statistics;
+    TableStats customers;
+    customers.name = "customers";
+    customers.rows = 100000;
+    ColumnStats id;
+    id.name = "id";
+    id.max = 100000;
+    id.distinct = 100000;
+    customers.columns = {id};
+    statistics.add(customers);
+    TableStats orders;
+    orders.name = "orders";
+    orders.rows = 1000000;
+    ColumnStats cid = id;
+    cid.name = "cid";
+    ColumnStats amount;
+    amount.name = "amount";
+    amount.max = 10000;
+    amount.distinct = 10000;
+    for (int i = 0; i <= 100; ++i) {
+        amount.histogram.push_back(i * 100.0);
+    }
+    orders.columns = {cid, amount};
+    statistics.add(orders);
+    OptimizerOptions options;
+    options.statistics = &statistics;
+
+    PreparedStatement prepared("SELECT * FROM customers c, orders o WHERE c.id = o.cid AND o.amount > ?", options);
+    check(prepared.parameterCount() == 1 && prepared.plans().size() >= 2, "a parameter that changes the build side is prepared into one plan");
+    PreparedStatement::Binding selective = prepared.bind({"9999.9"});
+    PreparedStatement::Binding unselective = prepared.bind({"0"});
+    check(selective.choice != unselective.choice, "binding a selective and an unselective value runs the same prepared plan");
+    for (const auto* binding : {&selective, &unselective}) {
+        double optimal = optimizeQuery(binding->query, options).cost;
+        check(binding->plan.cost <= kParametricCostSlack * optimal * (1 + 1e-9),
+              "the plan bound for " + binding->sql + " costs more than the slack over its optimum");
+    }
+}
+
+// Multi-Query Optimization
+// Three statements that all join items to the same filtered orders compute that join once: each
+// plan reads the one shared result instead, and the batch costs less than planning each alone. A
+// statement filtering orders otherwise computes its own join.
+bool readsShared(const Plan& plan, int result) {
+    return std::any_of(plan.nodes.begin(), plan.nodes.end(), [&](const PlanNode& node) { return node.shared == result; });
+}
+
+void testSharedSubexpressions() {
+    StatisticsCatalog statistics;
+    for (const auto& table : std::vector<std::pair<std::string, long long>>{{"customers", 10000}, {"orders", 1000000}, {"items", 5000000},
+                                                                             {"regions", 10}}) {
+        TableStats stats;
+        stats.name = table.first;
+        stats.rows = table.second;
+        statistics.add(stats);
+    }
+    OptimizerOptions options;
+    options.statistics = &statistics;
+    std::vector<Query> batch = {
+        parseQuery("SELECT * FROM orders o, items i, customers c WHERE o.id = i.oid AND o.amount > 100 AND c.id = o.cid", &statistics),
+        parseQuery("SELECT * FROM orders o, items i, regions r WHERE o.id = i.oid AND o.amount > 100 AND r.id = o.rid", &statistics),
+        parseQuery("SELECT * FROM items i, orders o WHERE o.amount > 100 AND i.oid = o.id", &statistics),
+        parseQuery("SELECT * FROM orders o, items i WHERE o.id = i.oid AND o.qty > 100", &statistics)};
+    SharedPlan plan = optimizeShared(batch, options);
+    check(plan.shared.size() == 1 && plan.shared[0].readers == std::vector<size_t>{0, 1, 2},
+          "the join of items to the orders three statements filter alike is not shared by exactly those three");
+    check(plan.plans.size() == 4 && readsShared(plan.plans[0], 0) && readsShared(plan.plans[1], 0) && readsShared(plan.plans[2], 0) &&
+              !readsShared(plan.plans[3], 0),
+          "a statement's plan does not read the shared result it is listed as reading");
+    check(plan.cost < plan.separateCost, "sharing the join does not lower the cost of the batch");
+}
+
+// Distributed Plans
+// On eight nodes, two large tables hashed on the two sides of their join key join where they
+// are; with one of them hashed on another column, the join shuffles or broadcasts an input.
+size_t movedInputs(const Plan& plan) {
+    return static_cast<size_t>(std::count_if(plan.nodes.begin(), plan.nodes.end(), [](const PlanNode& node) {
+        return node.exchange == Exchange::Shuffle || node.exchange == Exchange::Broadcast;
+    }));
+}
+
+void testColocatedJoin() {
+    const std::string sql = "SELECT * FROM customers c, orders o WHERE c.id = o.cid";
+    for (const char* customersKey : {"id", "region"}) {
+        StatisticsCatalog statistics;
+        for (const char* name : {"customers", "orders"}) {
+            TableStats stats;
+            stats.name = name;
+            stats.rows = 1000000;
+            statistics.add(stats);
+        }
+        applyCatalogOption("--partition=orders:hash:cid", statistics);
+        applyCatalogOption(std::string("--partition=customers:hash:") + customersKey, statistics);
+        OptimizerOptions options;
+        options.statistics = &statistics;
+        options.costWeights.nodes = 8;
+        Plan plan = optimizeQuery(parseQuery(sql, &statistics), options);
+        bool colocated = customersKey == std::string("id");
+        check(colocated ? movedInputs(plan) == 0 : movedInputs(plan) > 0,
+              colocated ? "a join of tables hashed on its key moves an input instead of joining in place"
+                        : "a join of tables hashed on different columns joins in place");
+    }
+}
+
+// Binary Catalog
+// A written catalog maps back to the statistics and constraints it was written from. A file cut
+// short, of another format version, or whose hash index points past its tables is rejected with
+// an error rather than read out of bounds.
+bool sameColumnStats(const ColumnStats& a, const ColumnStats& b) {
+    return a.name == b.name && a.numeric == b.numeric && a.min == b.min && a.max == b.max && a.nullFraction == b.nullFraction &&
+           a.distinct == b.distinct && a.histogram == b.histogram && a.mostCommon == b.mostCommon;
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& bytes) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    if (!out) {
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+// Whether mapping path, and looking table up in it, fails with an error naming the problem
+bool rejected(const std::string& path, const std::string& table, const std::string& problem) {
+    try {
+        MappedCatalog mapped(path);
+        mapped.findTable(table);
+    } catch (const std::runtime_error& e) {
+        return std::string(e.what()).find(problem) != std::string::npos;
+    }
+    return false;
+}
+
+void testBinaryCatalog() {
+    StatisticsCatalog statistics;
+    TableStats customers;
+    customers.name = "customers";
+    customers.rows = 1000;
+    ColumnStats id;
+    id.name = "id";
+    id.min = 1;
+    id.max = 1000;
+    id.distinct = 1000;
+    id.histogram = {1, 250.5, 500, 750.25, 1000};
+    ColumnStats region;
+    region.name = "region";
+    region.numeric = false;
+    region.nullFraction = 0.125;
+    region.distinct = 4;
+    region.mostCommon = {{"north", 0.5}, {"south", 0.25}};
+    customers.columns = {id, region};
+    statistics.add(customers);
+    TableStats orders;
+    orders.name = "orders";
+    orders.rows = 20000;
+    ColumnStats cid;
+    cid.name = "cid";
+    cid.min = 1;
+    cid.max = 1000;
+    cid.distinct = 990;
+    orders.columns = {cid};
+    statistics.add(orders);
+    statistics.addForeignKey("orders", "cid", "customers", "id");
+    statistics.addIndex("orders", {"orders_cid", {"cid"}, false, true, 40});
+    TablePartitioning partitioning;
+    partitioning.scheme = PartitionScheme::Hash;
+    partitioning.column = "cid";
+    statistics.setPartitioning("orders", partitioning);
+
+    char pattern[] = "/tmp/optimizer_test.XXXXXX";
+    if (::mkdtemp(pattern) == nullptr) {
+        throw std::runtime_error("cannot create a directory under /tmp");
+    }
+    std::string directory = pattern;
+    std::string path = directory + "/catalog.qocat";
+    std::string damaged = directory + "/damaged.qocat";
+    try {
+        writeCatalog(statistics, path);
+        {
+            MappedCatalog mapped(path);
+            const CatalogTable* table = mapped.findTable("customers");
+            check(mapped.tableCount() == 2 && table != nullptr && table->rows == 1000 && mapped.findTable("items") == nullptr,
+                  "the mapped catalog does not hold the tables written");
+            for (const ColumnStats& column : customers.columns) {
+                const CatalogColumn* mappedColumn = table ? mapped.findColumn(*table, column.name) : nullptr;
+                check(mappedColumn != nullptr && sameColumnStats(mapped.columnStats(*mappedColumn), column),
+                      "column customers." + column.name + " maps back to other statistics than were written");
+            }
+            const CatalogTable* ordersTable = mapped.findTable("orders");
+            check(ordersTable != nullptr && mapped.isForeignKey(*ordersTable, "cid", "customers", "id"),
+                  "the mapped catalog lost the foreign key");
+            std::vector<IndexDefinition> indexes = ordersTable ? mapped.indexes(*ordersTable) : std::vector<IndexDefinition>();
+            check(indexes.size() == 1 && indexes[0].name == "orders_cid" && indexes[0].columns == std::vector<std::string>{"cid"} &&
+                      indexes[0].clustered && !indexes[0].unique && indexes[0].pages == 40,
+                  "the mapped catalog lost the index");
+            check(ordersTable != nullptr && mapped.partitioning(*ordersTable).scheme == PartitionScheme::Hash &&
+                      mapped.partitioning(*ordersTable).column == "cid",
+                  "the mapped catalog lost the partitioning");
+        }
+        StatisticsCatalog attached;
+        attached.attach(std::make_shared<const MappedCatalog>(path));
+        const ColumnStats* decoded = attached.findColumn("customers", "region");
+        check(attached.rowCount("orders", 0) == 20000 && attached.isKey("customers", "id") && decoded != nullptr &&
+                  sameColumnStats(*decoded, region),
+              "a statistics catalog attached to the file answers otherwise than the one it was written from");
+
+        std::string bytes = readFile(path);
+        writeFile(damaged, bytes.substr(0, bytes.size() - 8));
+        check(rejected(damaged, "customers", "truncated"), "a truncated catalog is not rejected as truncated");
+        writeFile(damaged, bytes.substr(0, sizeof(CatalogHeader) / 2));
+        check(rejected(damaged, "customers", "not a catalog file"), "a catalog cut inside its header is not rejected");
+
+        std::string wrongVersion = bytes;
+        uint32_t version = kCatalogVersion + 1;
+        std::memcpy(&wrongVersion[offsetof(CatalogHeader, version)], &version, sizeof(version));
+        writeFile(damaged, wrongVersion);
+        check(rejected(damaged, "customers", "catalog version " + std::to_string(version)), "a catalog of another version is not rejected");
+
+        // Point every bucket of the hash index past the last table
+        CatalogHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        std::string badIndex = bytes;
+        uint32_t pastTables = static_cast<uint32_t>(header.sections[kCatalogTables].count) + 5;
+        for (uint64_t i = 0; i < header.sections[kCatalogBuckets].count; ++i) {
+            std::memcpy(&badIndex[header.sections[kCatalogBuckets].offset + i * sizeof(uint32_t)], &pastTables, sizeof(pastTables));
+        }
+        writeFile(damaged, badIndex);
+        check(rejected(damaged, "customers", "corrupt"), "a catalog whose hash index points past its tables is not rejected");
+    } catch (...) {
+        ::unlink(path.c_str());
+        ::unlink(damaged.c_str());
+        ::rmdir(directory.c_str());
+        throw;
+    }
+    ::unlink(path.c_str());
+    ::unlink(damaged.c_str());
+    ::rmdir(directory.c_str());
+}
+
+// Execution
+// Small tables are written as column files, with NULLs in most columns and an int64 key joined to
+// a double one, and every query's rows are computed here independently. Each query is planned by
+// every enumerator, and its plan executed as chosen and again with every join forced to each
+// join algorithm in turn; the rows must be the expected ones every time. orders.cid is declared
+// a foreign key, so the rewrite may remove the join to customers but not the rows whose cid is NULL.
+const int64_t kNullInt = std::numeric_limits<int64_t>::min();
+const double kNullDouble = std::numeric_limits<double>::quiet_NaN();
+
+struct TestTables {
+    std::vector<int64_t> customerId, customerRegion;
+    std::vector<double> customerBalance;
+    std::vector<int64_t> orderId, orderCustomer, orderQuantity;
+    std::vector<double> orderAmount;
+    std::vector<int64_t> itemId;
+    std::vector<double> itemOrder, itemPrice;
+};
+
+std::string formatInt(int64_t value) {
+    return value == kNullInt ? "NULL" : std::to_string(value);
+}
+
+// As the executor prints a double
+std::string formatDouble(double value) {
+    if (value != value) {
+        return "NULL";
+    }
+    std::ostringstream out;
+    out << value;
+    return out.str();
+}
+
+// Prices, amounts and balances are multiples of 0.25, so their sums are exact in any order
+TestTables generateTables(std::mt19937_64& random) {
+    TestTables t;
+    auto rarely = [&](size_t percent) { return random() % 100 < percent; };
+    for (int64_t id = 1; id <= 200; ++id) {
+        t.customerId.push_back(id);
+        t.customerRegion.push_back(rarely(10) ? kNullInt : static_cast<int64_t>(random() % 5));
+        t.customerBalance.push_back(rarely(10) ? kNullDouble : static_cast<double>(random() % 401) / 4 - 50);
+    }
+    for (int64_t id = 1; id <= 1000; ++id) {
+        t.orderId.push_back(id);
+        t.orderCustomer.push_back(rarely(10) ? kNullInt : static_cast<int64_t>(1 + random() % 200));
+        t.orderQuantity.push_back(rarely(10) ? kNullInt : static_cast<int64_t>(1 + random() % 5));
+        t.orderAmount.push_back(rarely(10) ? kNullDouble : static_cast<double>(random() % 2001) / 4 - 100);
+    }
+    std::shuffle(t.orderId.begin(), t.orderId.end(), random);
+    for (int64_t id = 1; id <= 3000; ++id) {
+        t.itemId.push_back(id);
+        t.itemOrder.push_back(rarely(10) ? kNullDouble : static_cast<double>(1 + random() % 1100)); // Some match no order
+        t.itemPrice.push_back(rarely(5) ? kNullDouble : static_cast<double>(random() % 161) / 4);
+    }
+    std::shuffle(t.itemId.begin(), t.itemId.end(), random);
+    return t;
+}
+
+template <typename T>
+std::string writeColumn(const std::string& path, ColumnType type, const std::vector<T>& values) {
+    ColumnFileHeader header;
+    std::memcpy(header.magic, kColumnFileMagic, sizeof(header.magic));
+    header.type = type;
+    header.padding = 0;
+    header.count = values.size();
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(T)));
+    if (!out) {
+        throw std::runtime_error("cannot write " + path);
+    }
+    return path;
+}
+
+// Column files of the tables in a new directory under /tmp; returns each table's files
+std::map<std::string, std::vector<std::string>> writeTables(const TestTables& t, std::string& directory) {
+    char pattern[] = "/tmp/optimizer_test.XXXXXX";
+    if (::mkdtemp(pattern) == nullptr) {
+        throw std::runtime_error("cannot create a directory under /tmp");
+    }
+    directory = pattern;
+    std::map<std::string, std::vector<std::string>> files;
+    for (const char* table : {"customers", "orders", "items"}) {
+        ::mkdir((directory + "/" + table).c_str(), 0700);
+    }
+    files["customers"] = {writeColumn(directory + "/customers/id.bin", ColumnType::Int64, t.customerId),
+                          writeColumn(directory + "/customers/region.bin", ColumnType::Int64, t.customerRegion),
+                          writeColumn(directory + "/customers/balance.bin", ColumnType::Double, t.customerBalance)};
+    files["orders"] = {writeColumn(directory + "/orders/id.bin", ColumnType::Int64, t.orderId),
+                       writeColumn(directory + "/orders/cid.bin", ColumnType::Int64, t.orderCustomer),
+                       writeColumn(directory + "/orders/qty.bin", ColumnType::Int64, t.orderQuantity),
+                       writeColumn(directory + "/orders/amount.bin", ColumnType::Double, t.orderAmount)};
+    files["items"] = {writeColumn(directory + "/items/id.bin", ColumnType::Int64, t.itemId),
+                      writeColumn(directory + "/items/order_id.bin", ColumnType::Double, t.itemOrder),
+                      writeColumn(directory + "/items/price.bin", ColumnType::Double, t.itemPrice)};
+    return files;
+}
+
+void removeTables(const std::string& directory, const std::map<std::string, std::vector<std::string>>& files) {
+    for (const auto& table : files) {
+        for (const auto& path : table.second) {
+            std::remove(path.c_str());
+        }
+        ::rmdir((directory + "/" + table.first).c_str());
+    }
+    ::rmdir(directory.c_str());
+}
+
+enum class RowOrder {
+    Exact,     // ORDER BY: the rows in this order
+    Any,       // The rows in any order
+    AnyLimited // LIMIT without ORDER BY: this many of the rows, in any order
+};
+
+struct ExpectedResult {
+    std::string sql;
+    std::vector<std::vector<std::string>> rows;
+    RowOrder order = RowOrder::Exact;
+    size_t limit = 0;
+};
+
+// The (customer, order, item) index triples that join, customers and items optional
+struct JoinedRow {
+    size_t customer;
+    size_t order;
+    size_t item;
+};
+
+std::vector<ExpectedResult> expectedResults(const TestTables& t) {
+    std::map<int64_t, size_t> customers; // By id
+    for (size_t c = 0; c < t.customerId.size(); ++c) {
+        customers[t.customerId[c]] = c;
+    }
+    std::multimap<double, size_t> items; // By order_id, NULLs left out
+    for (size_t i = 0; i < t.itemId.size(); ++i) {
+        if (t.itemOrder[i] == t.itemOrder[i]) {
+            items.emplace(t.itemOrder[i], i);
+        }
+    }
+    std::vector<JoinedRow> orderItems;    // orders joined to items
+    std::vector<JoinedRow> customerOrders; // customers joined to orders
+    std::vector<JoinedRow> all;           // all three
+    for (size_t o = 0; o < t.orderId.size(); ++o) {
+        auto customer = customers.find(t.orderCustomer[o]);
+        if (customer != customers.end()) {
+            customerOrders.push_back({customer->second, o, 0});
+        }
+        auto range = items.equal_range(static_cast<double>(t.orderId[o]));
+        for (auto item = range.first; item != range.second; ++item) {
+            orderItems.push_back({0, o, item->second});
+            if (customer != customers.end()) {
+                all.push_back({customer->second, o, item->second});
+            }
+        }
+    }
+    auto sortRows = [](std::vector<std::vector<std::string>>& rows, auto before) { std::stable_sort(rows.begin(), rows.end(), before); };
+    std::vector<ExpectedResult> results;
+
+    ExpectedResult count;
+    count.sql = "SELECT COUNT(*) FROM orders o, items i WHERE o.id = i.order_id AND i.price BETWEEN 10 AND 20 AND o.qty IS NOT NULL";
+    int64_t matches = 0;
+    for (const auto& row : orderItems) {
+        matches += t.itemPrice[row.item] >= 10 && t.itemPrice[row.item] <= 20 && t.orderQuantity[row.order] != kNullInt;
+    }
+    count.rows = {{std::to_string(matches)}};
+    results.push_back(count);
+
+    ExpectedResult top;
+    top.sql = "SELECT c.id, o.id FROM customers c JOIN orders o ON c.id = o.cid WHERE c.balance < 0 AND o.qty IN (1, 2, NULL) "
+              "ORDER BY o.id DESC LIMIT 7";
+    std::vector<std::pair<int64_t, int64_t>> pairs;
+    for (const auto& row : customerOrders) {
+        int64_t quantity = t.orderQuantity[row.order];
+        if (t.customerBalance[row.customer] < 0 && (quantity == 1 || quantity == 2)) {
+            pairs.emplace_back(t.orderId[row.order], t.customerId[row.customer]);
+        }
+    }
+    std::sort(pairs.rbegin(), pairs.rend());
+    for (size_t i = 0; i < pairs.size() && i < 7; ++i) {
+        top.rows.push_back({std::to_string(pairs[i].second), std::to_string(pairs[i].first)});
+    }
+    results.push_back(top);
+
+    ExpectedResult regions;
+    regions.sql = "SELECT c.region, COUNT(*), SUM(o.qty), MIN(i.price), MAX(o.amount) FROM customers c, orders o, items i "
+                  "WHERE c.id = o.cid AND o.id = i.order_id GROUP BY c.region ORDER BY c.region";
+    struct RegionGroup {
+        int64_t count = 0;
+        int64_t quantity = kNullInt;
+        double price = kNullDouble;
+        double amount = kNullDouble;
+    };
+    std::map<int64_t, RegionGroup> groups; // kNullInt sorts first here, last in the ORDER BY
+    for (const auto& row : all) {
+        RegionGroup& group = groups[t.customerRegion[row.customer]];
+        ++group.count;
+        if (t.orderQuantity[row.order] != kNullInt) {
+            group.quantity = (group.quantity == kNullInt ? 0 : group.quantity) + t.orderQuantity[row.order];
+        }
+        if (t.itemPrice[row.item] == t.itemPrice[row.item] && !(group.price <= t.itemPrice[row.item])) {
+            group.price = t.itemPrice[row.item];
+        }
+        if (t.orderAmount[row.order] == t.orderAmount[row.order] && !(group.amount >= t.orderAmount[row.order])) {
+            group.amount = t.orderAmount[row.order];
+        }
+    }
+    for (const auto& group : groups) {
+        regions.rows.push_back({formatInt(group.first), std::to_string(group.second.count), formatInt(group.second.quantity),
+                                formatDouble(group.second.price), formatDouble(group.second.amount)});
+    }
+    if (!groups.empty() && groups.begin()->first == kNullInt) {
+        std::rotate(regions.rows.begin(), regions.rows.begin() + 1, regions.rows.end());
+    }
+    results.push_back(regions);
+
+    ExpectedResult amounts;
+    amounts.sql = "SELECT o.id, o.amount FROM customers c, orders o WHERE c.id = o.cid AND c.region IS NULL "
+                  "AND o.amount BETWEEN -100 AND 0 ORDER BY o.amount DESC, o.id";
+    std::vector<std::pair<double, int64_t>> byAmount;
+    for (const auto& row : customerOrders) {
+        double amount = t.orderAmount[row.order];
+        if (t.customerRegion[row.customer] == kNullInt && amount >= -100 && amount <= 0) {
+            byAmount.emplace_back(amount, t.orderId[row.order]);
+        }
+    }
+    std::sort(byAmount.begin(), byAmount.end(),
+              [](const auto& a, const auto& b) { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+    for (const auto& row : byAmount) {
+        amounts.rows.push_back({std::to_string(row.second), formatDouble(row.first)});
+    }
+    results.push_back(amounts);
+
+    ExpectedResult quantities;
+    quantities.sql = "SELECT o.qty, COUNT(*), AVG(i.price) FROM orders o, items i WHERE o.id = i.order_id AND o.qty NOT IN (2, 4) "
+                     "GROUP BY o.qty";
+    quantities.order = RowOrder::Any;
+    std::map<int64_t, std::pair<int64_t, std::pair<double, int64_t>>> byQuantity; // Rows, and the sum and count of prices
+    for (const auto& row : orderItems) {
+        int64_t quantity = t.orderQuantity[row.order];
+        if (quantity != kNullInt && quantity != 2 && quantity != 4) {
+            auto& group = byQuantity[quantity];
+            ++group.first;
+            if (t.itemPrice[row.item] == t.itemPrice[row.item]) {
+                group.second.first += t.itemPrice[row.item];
+                ++group.second.second;
+            }
+        }
+    }
+    for (const auto& group : byQuantity) {
+        double average = group.second.second.second == 0 ? kNullDouble
+                                                         : group.second.second.first / static_cast<double>(group.second.second.second);
+        quantities.rows.push_back({std::to_string(group.first), std::to_string(group.second.first), formatDouble(average)});
+    }
+    results.push_back(quantities);
+
+    ExpectedResult ordered;
+    ordered.sql = "SELECT c.id, i.id FROM customers c, orders o, items i WHERE c.id = o.cid AND o.id = i.order_id AND c.region IN (1, 3) "
+                  "ORDER BY c.id, i.id DESC LIMIT 15";
+    std::vector<std::pair<int64_t, int64_t>> customerItems;
+    for (const auto& row : all) {
+        if (t.customerRegion[row.customer] == 1 || t.customerRegion[row.customer] == 3) {
+            customerItems.emplace_back(t.customerId[row.customer], t.itemId[row.item]);
+        }
+    }
+    std::sort(customerItems.begin(), customerItems.end(),
+              [](const auto& a, const auto& b) { return a.first != b.first ? a.first < b.first : a.second > b.second; });
+    for (size_t i = 0; i < customerItems.size() && i < 15; ++i) {
+        ordered.rows.push_back({std::to_string(customerItems[i].first), std::to_string(customerItems[i].second)});
+    }
+    results.push_back(ordered);
+
+    ExpectedResult eliminated;
+    eliminated.sql = "SELECT COUNT(*) FROM customers c, orders o WHERE c.id = o.cid";
+    eliminated.rows = {{std::to_string(customerOrders.size())}};
+    results.push_back(eliminated);
+
+    ExpectedResult limited;
+    limited.sql = "SELECT o.id, i.id FROM orders o, items i WHERE o.id = i.order_id LIMIT 25";
+    limited.order = RowOrder::AnyLimited;
+    limited.limit = 25;
+    for (const auto& row : orderItems) {
+        limited.rows.push_back({std::to_string(t.orderId[row.order]), std::to_string(t.itemId[row.item])});
+    }
+    results.push_back(limited);
+
+    for (auto& result : results) {
+        if (result.order != RowOrder::Exact) {
+            sortRows(result.rows, std::less<std::vector<std::string>>());
+        }
+    }
+    return results;
+}
+
+bool matchesExpected(const ExpectedResult& expected, ExecutionResult& result) {
+    if (expected.order == RowOrder::Exact) {
+        return result.rowCount == expected.rows.size() && result.rows == expected.rows;
+    }
+    std::sort(result.rows.begin(), result.rows.end());
+    if (expected.order == RowOrder::Any) {
+        return result.rowCount == expected.rows.size() && result.rows == expected.rows;
+    }
+    return result.rowCount == std::min(expected.limit, expected.rows.size()) && result.rows.size() == result.rowCount &&
+           std::includes(expected.rows.begin(), expected.rows.end(), result.rows.begin(), result.rows.end());
+}
+
+struct PlannerConfiguration {
+    const char* name;
+    EnumeratorMode enumerator;
+    bool bushy;
+    size_t threads;
+    size_t exactTables; // Above, the budgeted driver plans greedily and by simulated annealing
+};
+
+struct ForcedJoin {
+    const char* name; // nullptr keeps the optimizer's choice
+    JoinAlgorithm algorithm;
+    bool buildLeft;
+};
+
+void testExecution(std::mt19937_64& random) {
+    TestTables tables = generateTables(random);
+    std::string directory;
+    std::map<std::string, std::vector<std::string>> files = writeTables(tables, directory);
+    try {
+        StatisticsCatalog statistics;
+        ColumnStore store;
+        for (const auto& table : files) {
+            std::string analyze = "--analyze=" + table.first + ":";
+            for (size_t i = 0; i < table.second.size(); ++i) {
+                analyze += (i == 0 ? "" : ",") + table.second[i];
+            }
+            applyCatalogOption(analyze, statistics);
+            store.add(table.first, table.second);
+        }
+        applyCatalogOption("--primary-key=customers.id", statistics);
+        applyCatalogOption("--foreign-key=orders.cid:customers.id", statistics);
+
+        const PlannerConfiguration configurations[] = {
+            {"string-keyed", EnumeratorMode::StringKeyed, true, 1, 64},
+            {"bitmask", EnumeratorMode::Bitmask, true, 1, 64},
+            {"bitmask with 4 threads", EnumeratorMode::Bitmask, true, 4, 64},
+            {"dpccp", EnumeratorMode::ConnectedSubgraph, true, 1, 64},
+            {"left-deep dpccp", EnumeratorMode::ConnectedSubgraph, false, 1, 64},
+            {"cascades", EnumeratorMode::TopDown, true, 1, 64},
+            {"greedy and annealing", EnumeratorMode::ConnectedSubgraph, true, 1, 1},
+        };
+        const ForcedJoin joins[] = {
+            {nullptr, JoinAlgorithm::Hash, false},
+            {"nested loop", JoinAlgorithm::NestedLoop, false},
+            {"hash building right", JoinAlgorithm::Hash, false},
+            {"hash building left", JoinAlgorithm::Hash, true},
+            {"sort-merge", JoinAlgorithm::SortMerge, false},
+        };
+        for (const auto& expected : expectedResults(tables)) {
+            for (const auto& configuration : configurations) {
+                OptimizerOptions options;
+                options.statistics = &statistics;
+                options.enumerator = configuration.enumerator;
+                options.bushy = configuration.bushy;
+                options.threads = configuration.threads;
+                options.budget.exactTables = configuration.exactTables;
+                Query query = parseQuery(expected.sql, &statistics);
+                rewriteQuery(query, &statistics);
+                Plan plan = optimizeQuery(query, options);
+                for (const auto& join : joins) {
+                    Plan forced = plan;
+                    for (auto& node : forced.nodes) {
+                        if (join.name != nullptr && node.table < 0) {
+                            node.algorithm = join.algorithm;
+                            node.buildLeft = join.buildLeft;
+                        }
+                    }
+                    ExecutionResult result = executePlan(query, forced, store, std::numeric_limits<size_t>::max());
+                    check(matchesExpected(expected, result), std::string(configuration.name) + " plan" +
+                                                                 (join.name ? std::string(" with ") + join.name + " joins" : std::string()) +
+                                                                 " returned other rows than expected (" + std::to_string(result.rowCount) +
+                                                                 " rows, " + std::to_string(expected.rows.size()) + " expected): " + expected.sql);
+                }
+            }
+        }
+    } catch (...) {
+        removeTables(directory, files);
+        throw;
+    }
+    removeTables(directory, files);
+}
+
+// Column Statistics
+// ANALYZE of generated column files: the HyperLogLog distinct count of a column with more values
+// than the heavy-hitter counter tracks is within four standard errors (1.6% each) of the truth, a
+// value in 30% of the rows is the most common one at about that share, and each equi-depth
+// histogram bucket of a skewed column, built from the reservoir sample, holds about 1% of its rows.
+void testColumnStatistics(std::mt19937_64& random) {
+    const size_t kHistogramBuckets = 100; // ANALYZE's
+    const size_t rows = 200000;
+    const size_t distinct = 50000;
+    std::vector<int64_t> spread(rows);
+    std::vector<int64_t> skewed(rows);
+    std::vector<double> exponential(rows);
+    std::exponential_distribution<double> draw(0.01);
+    for (size_t i = 0; i < rows; ++i) {
+        spread[i] = static_cast<int64_t>((i * 7919) % distinct);
+        skewed[i] = random() % 10 < 3 ? 7 : static_cast<int64_t>(1000 + random() % 1000000);
+        exponential[i] = draw(random);
+    }
+
+    char pattern[] = "/tmp/optimizer_test.XXXXXX";
+    if (::mkdtemp(pattern) == nullptr) {
+        throw std::runtime_error("cannot create a directory under /tmp");
+    }
+    std::string directory = pattern;
+    ::mkdir((directory + "/samples").c_str(), 0700);
+    std::vector<std::string> files;
+    StatisticsCatalog statistics;
+    try {
+        files = {writeColumn(directory + "/samples/spread.bin", ColumnType::Int64, spread),
+                 writeColumn(directory + "/samples/skewed.bin", ColumnType::Int64, skewed),
+                 writeColumn(directory + "/samples/exponential.bin", ColumnType::Double, exponential)};
+        applyCatalogOption("--analyze=samples:" + files[0] + "," + files[1] + "," + files[2], statistics);
+    } catch (...) {
+        removeTables(directory, {{"samples", files}});
+        throw;
+    }
+    removeTables(directory, {{"samples", files}});
+
+    const ColumnStats* column = statistics.findColumn("samples", "spread");
+    check(column != nullptr && std::abs(column->distinct - distinct) <= 4 * 0.016 * distinct,
+          "HyperLogLog estimated " + std::to_string(column ? column->distinct : 0) + " distinct values of " + std::to_string(distinct));
+
+    column = statistics.findColumn("samples", "skewed");
+    size_t heavy = static_cast<size_t>(std::count(skewed.begin(), skewed.end(), 7));
+    check(column != nullptr && !column->mostCommon.empty() && column->mostCommon[0].first == "7" &&
+              std::abs(column->mostCommon[0].second - static_cast<double>(heavy) / rows) <= 1.0 / 64,
+          "the value in 30% of the rows is not the most common value at its share");
+
+    column = statistics.findColumn("samples", "exponential");
+    std::vector<double> sorted = exponential;
+    std::sort(sorted.begin(), sorted.end());
+    bool bucketsEven = column != nullptr && column->histogram.size() == kHistogramBuckets + 1;
+    for (size_t i = 0; bucketsEven && i + 1 < column->histogram.size(); ++i) {
+        auto low = std::lower_bound(sorted.begin(), sorted.end(), column->histogram[i]);
+        auto high = i + 2 == column->histogram.size() ? sorted.end() : std::lower_bound(sorted.begin(), sorted.end(), column->histogram[i + 1]);
+        double share = static_cast<double>(high - low) / rows;
+        bucketsEven = std::abs(share - 1.0 / kHistogramBuckets) <= 0.004;
+    }
+    check(bucketsEven, "an equi-depth histogram bucket holds far from 1% of the rows");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--seed=", 0) != 0 || !parseFlagValue(std::string_view(arg).substr(7), seed)) {
+            std::cerr << "Usage: " << argv[0] << " [--seed=N]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::mt19937_64 random(seed);
+    testConnectedSubgraphMatchesBitmask(random);
+    testParallelMatchesSerial(random);
+    testParser();
+    testPlanCache();
+    testFeedback();
+    testPreparedStatement();
+    testSharedSubexpressions();
+    testColocatedJoin();
+    testBinaryCatalog();
+    testExecution(random);
+    testColumnStatistics(random);
+
+    std::cout << checks << " checks, " << failures << " failed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}